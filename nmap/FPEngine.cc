@@ -416,7 +416,7 @@ void FPNetworkControl::probe_transmission_handler(nsock_pool nsp, nsock_event ns
 
       /* Send the packet*/
       for (int decoy = 0; decoy < o.numdecoys; decoy++) {
-        result = myprobe->changeSourceAddress(&((struct sockaddr_in6 *)&o.decoys[decoy])->sin6_addr);
+        result = myprobe->changeSourceAddress(&((const struct sockaddr_in6 *) myprobe->host->getDecoyAddress(decoy))->sin6_addr);
         assert(result == OP_SUCCESS);
         assert(myprobe->host != NULL);
         buf = myprobe->getPacketBuffer(&len);
@@ -435,7 +435,7 @@ void FPNetworkControl::probe_transmission_handler(nsock_pool nsp, nsock_event ns
       }
       /* Reset the address to the original one if decoys were present and original Address wasn't last one */
       if ( o.numdecoys != o.decoyturn+1 ) {
-        result = myprobe->changeSourceAddress(&((struct sockaddr_in6 *)&o.decoys[o.decoyturn])->sin6_addr);
+        result = myprobe->changeSourceAddress(&((const struct sockaddr_in6 *) myprobe->host->getDecoyAddress(o.decoyturn))->sin6_addr);
         assert(result == OP_SUCCESS);
       }
 
@@ -1290,6 +1290,12 @@ const struct sockaddr_storage *FPHost::getTargetAddress() {
   return this->target_host->TargetSockAddr();
 }
 
+/* Returns the address to send as decoy number decoy; see
+ * Target::DecoySockAddr. */
+const struct sockaddr_storage *FPHost::getDecoyAddress(int decoy) {
+  return this->target_host->DecoySockAddr(decoy);
+}
+
 /* Marks one probe as unanswerable, making the fingerprint incomplete and
  * ineligible for submission */
 void FPHost::fail_one_probe() {
@@ -2693,7 +2699,7 @@ int FPProbe::setTimed() {
 }
 
 /* Changes source address for packet element associated with current FPProbe. */
-int FPProbe::changeSourceAddress(struct in6_addr *addr) {
+int FPProbe::changeSourceAddress(const struct in6_addr *addr) {
   if (!is_set())
     return OP_FAILURE;
   else{
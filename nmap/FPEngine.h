@@ -292,7 +292,7 @@ class FPProbe : public FPPacket {
   int setFailed();
   bool isTimed() const;
   int setTimed();
-  int changeSourceAddress(struct in6_addr *addr);
+  int changeSourceAddress(const struct in6_addr *addr);
 
 };
 
@@ -365,6 +365,7 @@ class FPHost {
   virtual int schedule() = 0;
   virtual int callback(const u8 *pkt, size_t pkt_len, const struct timeval *tv) = 0;
   const struct sockaddr_storage *getTargetAddress();
+  const struct sockaddr_storage *getDecoyAddress(int decoy);
   void fail_one_probe();
 
 };
@@ -64,6 +64,20 @@
 #include "NmapOps.h"
 #include "output.h"
 #include "nmap_error.h"
+#include "scan_pipeline.h"
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+
+/* In a pipelined scan, scripts add targets from one thread while the port
+   scan stage reads them from another. */
+static pthread_mutex_t new_targets_lock = PTHREAD_MUTEX_INITIALIZER;
+#define NEW_TARGETS_LOCK() pthread_mutex_lock(&new_targets_lock)
+#define NEW_TARGETS_UNLOCK() pthread_mutex_unlock(&new_targets_lock)
+#else
+#define NEW_TARGETS_LOCK()
+#define NEW_TARGETS_UNLOCK()
+#endif
 
 extern NmapOps o;  /* option structure */
 NewTargets *NewTargets::new_targets;
@@ -121,29 +135,51 @@ unsigned long NewTargets::push (const char *target) {
 std::string NewTargets::read (void) {
   std::string str;
 
+  NEW_TARGETS_LOCK();
   /* check to see it there are targets in the queue */
   if (!new_targets->queue.empty()) {
     str = new_targets->queue.front();
     new_targets->queue.pop();
   }
+  NEW_TARGETS_UNLOCK();
 
   return str;
 }
 
 void NewTargets::clear (void) {
+  NEW_TARGETS_LOCK();
   new_targets->history.clear();
+  NEW_TARGETS_UNLOCK();
 }
 
 unsigned long NewTargets::get_number (void) {
-  return new_targets->history.size();
+  unsigned long n;
+
+  NEW_TARGETS_LOCK();
+  n = new_targets->history.size();
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
 
 unsigned long NewTargets::get_scanned (void) {
-  return new_targets->history.size() - new_targets->queue.size();
+  unsigned long n;
+
+  NEW_TARGETS_LOCK();
+  n = new_targets->history.size() - new_targets->queue.size();
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
 
 unsigned long NewTargets::get_queued (void) {
-  return new_targets->queue.size();
+  unsigned long n;
+
+  NEW_TARGETS_LOCK();
+  n = new_targets->queue.size();
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
 
 /* This is the function that is used by nse_nmaplib.cc to add
@@ -151,12 +187,15 @@ unsigned long NewTargets::get_queued (void) {
  * Returns the number of targets in the queue on success, or 0 on
  * failures or when the queue is empty. */
 unsigned long NewTargets::insert (const char *target) {
+  unsigned long n;
+
   if (*target) {
     if (new_targets == NULL) {
       error("ERROR: to add targets run with -sC or --script options.");
       return 0;
     }
-    if (o.current_scantype == SCRIPT_POST_SCAN) {
+    /* Post-scan scripts never run in a pipeline stage. */
+    if (!in_pipeline_stage() && o.current_scantype == SCRIPT_POST_SCAN) {
       error("ERROR: adding targets is disabled in the Post-scanning phase.");
       return 0;
     }
@@ -166,5 +205,9 @@ unsigned long NewTargets::insert (const char *target) {
     }
   }
 
-  return new_targets->push(target);
+  NEW_TARGETS_LOCK();
+  n = new_targets->push(target);
+  NEW_TARGETS_UNLOCK();
+
+  return n;
 }
@@ -121,6 +121,10 @@ NmapOps::~NmapOps() {
     free(idleProxy);
     idleProxy = NULL;
   }
+  if (checkpoint_file) {
+    free(checkpoint_file);
+    checkpoint_file = NULL;
+  }
   if (datadir) {
     free(datadir);
     datadir = NULL;
@@ -230,6 +234,10 @@ void NmapOps::Initialize() {
   max_packet_send_rate = 0.0; /* Unset. */
   stats_interval = 0.0; /* Unset. */
   randomize_hosts = false;
+  randomize_seed = 0;
+  randomize_seed_set = false;
+  shard = 0;
+  nshards = 1;
   randomize_ports = true;
   sendpref = PACKET_SEND_NOPREF;
   spoofsource = false;
@@ -244,6 +252,11 @@ void NmapOps::Initialize() {
   timing_level = 3;
   max_parallelism = 0;
   min_parallelism = 0;
+  scan_threads = 1;
+  rolling_hostgroup = false;
+  stateless_sweep = false;
+  memset(pipeline_groups, 0, sizeof(pipeline_groups));
+  memset(pipeline_sockets, 0, sizeof(pipeline_sockets));
   max_os_tries = 5;
   max_rtt_timeout = MAX_RTT_TIMEOUT;
   min_rtt_timeout = MIN_RTT_TIMEOUT;
@@ -263,6 +276,8 @@ void NmapOps::Initialize() {
   defeat_rst_ratelimit = false;
   defeat_icmp_ratelimit = false;
   resume_ip.ss_family = AF_UNSPEC;
+  checkpoint_file = NULL;
+  checkpoint_interval = 60000;
   osscan_limit = false;
   osscan_guess = false;
   numdecoys = 0;
@@ -271,6 +286,7 @@ void NmapOps::Initialize() {
   servicescan = false;
   override_excludeports = false;
   version_intensity = 7;
+  version_threads = 1;
   pingtype = PINGTYPE_UNKNOWN;
   listscan = ackscan = bouncescan = connectscan = 0;
   nullscan = xmasscan = fragscan = synscan = windowscan = 0;
@@ -498,9 +514,44 @@ administrator privileges.";
     fatal("Option --defeat-icmp-ratelimit works only with a UDP scan (-sU)");
   }
 
+  if (stateless_sweep) {
+    if (!synscan || UDPScan() || SCTPScan() || ipprotscan)
+      fatal("--stateless works only with a SYN scan (-sS) by itself");
+    if (af() != AF_INET)
+      fatal("--stateless is only supported for IPv4");
+    if (numdecoys > 1 || fragscan || ipoptionslen || sendpref == PACKET_SEND_ETH_STRONG)
+      fatal("--stateless sends through a raw IP socket and cannot be combined with decoys (-D), fragmentation (-f), IP options, or --send-eth");
+    if (generate_random_ips || resume_ip.ss_family != AF_UNSPEC)
+      fatal("--stateless cannot be combined with -iR or --resume");
+  }
+
   if (resume_ip.ss_family != AF_UNSPEC && generate_random_ips)
     resume_ip.ss_family = AF_UNSPEC;
 
+  if (checkpoint_file != NULL) {
+    if (generate_random_ips)
+      fatal("--checkpoint cannot be used with -iR");
+    if (stateless_sweep || rolling_hostgroup || scan_threads > 1 || pipeline_groups[0] > 0)
+      fatal("--checkpoint cannot be combined with --stateless, --rolling-hostgroup, --scan-threads, or --pipeline-groups");
+  }
+
+  if (nshards > 1) {
+    if (generate_random_ips)
+      fatal("--shard cannot be used with -iR");
+    /* The shards split one permutation of the targets, so they must all
+       use the same seed. */
+    randomize_hosts = true;
+    if (!randomize_seed_set) {
+      randomize_seed = 0;
+      randomize_seed_set = true;
+    }
+  }
+
+  if (randomize_seed_set && !randomize_hosts)
+    fatal("--randomize-seed only makes sense with --randomize-hosts");
+  if (randomize_hosts && !randomize_seed_set)
+    randomize_seed = get_random_u64();
+
   if (magic_port_set && connectscan) {
     error("WARNING: -g is incompatible with the default connect() scan (-sT).  Use a raw scan such as -sS if you want to set the source port.");
   }
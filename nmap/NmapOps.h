@@ -68,6 +68,7 @@
 #include "nmap.h" /* MAX_DECOYS */
 #include "scan_lists.h"
 #include "output.h" /* LOG_NUM_FILES */
+#include "scan_pipeline.h" /* PIPELINE_NUM_STAGES */
 #include <nbase.h>
 #include <nsock.h>
 #include <string>
@@ -162,6 +163,13 @@ class NmapOps {
   /* The requested auto stats printing interval, or 0.0 if unset. */
   float stats_interval;
   bool randomize_hosts;
+  /* The seed of the --randomize-hosts order, chosen at random unless given
+     with --randomize-seed. */
+  u64 randomize_seed;
+  bool randomize_seed_set;
+  /* --shard: this process scans slice shard (counting from 0) of nshards. */
+  unsigned int shard;
+  unsigned int nshards;
   bool randomize_ports;
   bool spoofsource; /* -S used */
   bool fastscan;
@@ -178,6 +186,16 @@ class NmapOps {
   int timing_level; // 0-5, corresponding to Paranoid, Sneaky, Polite, Normal, Aggressive, Insane
   int max_parallelism; // 0 means it has not been set
   int min_parallelism; // 0 means it has not been set
+  int scan_threads; // --scan-threads; 1 runs port scans in the main thread
+  bool rolling_hostgroup; // --rolling-hostgroup
+  bool stateless_sweep; // --stateless
+  /* --pipeline-groups: how many host groups may wait for the version/OS and
+     the script stages of a pipelined scan. 0 runs each group through every
+     phase before starting the next. */
+  int pipeline_groups[PIPELINE_NUM_STAGES - 1];
+  /* --pipeline-sockets: a cap on the sockets of each stage; 0 for the
+     stage's usual limit. */
+  int pipeline_sockets[PIPELINE_NUM_STAGES];
   double topportlevel; // -1 means it has not been set
 
   /* The maximum number of OS detection (gen2) tries we will make
@@ -255,11 +273,16 @@ class NmapOps {
                                resume_ip.ss_family == AF_UNSPEC.  Also
                                Target::next_target will eventually set it
                                to AF_UNSPEC. */
+  char *checkpoint_file; /* --checkpoint, or NULL */
+  long checkpoint_interval; /* --checkpoint-interval, in milliseconds */
 
   // Version Detection Options
   bool override_excludeports;
   int version_intensity;
+  int version_threads; // --version-threads; 1 matches responses in the nsock loop
 
+  /* Fixed once the options are parsed. decoys[decoyturn] is unused: each
+     Target sends as itself there (see Target::DecoySockAddr). */
   struct sockaddr_storage decoys[MAX_DECOYS];
   bool osscan_limit; /* Skip OS Scan if no open or no closed TCP ports */
   bool osscan_guess;   /* Be more aggressive in guessing OS type */
@@ -72,6 +72,7 @@
 #include <dnet.h>
 #include "nbase.h"
 #include "NmapOps.h"
+#include "checkpoint.h"
 #include "nmap.h"
 #include "nmap_error.h"
 
@@ -114,6 +115,7 @@ void Target::Initialize() {
   state_reason_init(&reason);
   memset(&pingprobe, 0, sizeof(pingprobe));
   pingprobe_state = PORT_UNKNOWN;
+  checkpoint = NULL;
 }
 
 
@@ -154,6 +156,9 @@ void Target::FreeInternal() {
   }
 
   if (FPR) delete FPR;
+
+  if (checkpoint)
+    checkpoint_release(this);
 }
 
 /*  Creates a "presentation" formatted string out of the IPv4/IPv6 address.
@@ -295,6 +300,12 @@ struct sockaddr_storage Target::source() const {
   return sourcesock;
 }
 
+const struct sockaddr_storage *Target::DecoySockAddr(int decoy) const {
+  if (decoy == o.decoyturn)
+    return &sourcesock;
+  return &o.decoys[decoy];
+}
+
 // Returns IPv4 host address or NULL if unavailable.
 const struct in_addr *Target::v4sourceip() const {
   struct sockaddr_in *sin = (struct sockaddr_in *) &sourcesock;
@@ -80,6 +80,7 @@
 #include "osscan.h"
 #include "osscan2.h"
 class FingerPrintResults;
+class HostCheckpoint;
 
 #include <list>
 #include <string>
@@ -146,6 +147,9 @@ class Target {
      to sockaddr_storage */
   void setSourceSockAddr(const struct sockaddr_storage *ss, size_t ss_len);
   struct sockaddr_storage source() const;
+  /* The address to send as decoy number decoy (see NmapOps::decoys). For
+     o.decoyturn, the real one, that is this target's own source address. */
+  const struct sockaddr_storage *DecoySockAddr(int decoy) const;
   const struct in_addr *v4sourceip() const;
   const struct in6_addr *v6sourceip() const;
   /* The IPv4 or IPv6 literal string for the target host */
@@ -278,6 +282,9 @@ class Target {
      received. */
   int pingprobe_state;
 
+  /* The state kept for --checkpoint, or NULL. */
+  HostCheckpoint *checkpoint;
+
   private:
   void Initialize();
   void FreeInternal(); // Free memory allocated inside this object
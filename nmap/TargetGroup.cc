@@ -75,6 +75,7 @@
 #include <sstream>
 #include <errno.h>
 #include <limits.h> // CHAR_BIT
+#include <algorithm>
 
 /* We use bit vectors to represent what values are allowed in an IPv4 octet.
    Each vector is built up of an array of bitvector_t (any convenient integer
@@ -87,6 +88,28 @@ typedef bitvector_t octet_bitvector[(256 - 1) / (sizeof(unsigned long) * CHAR_BI
 #define BIT_SET(v, n) ((v)[(n) / BITVECTOR_BITS] |= 1UL << ((n) % BITVECTOR_BITS))
 #define BIT_IS_SET(v, n) (((v)[(n) / BITVECTOR_BITS] & 1UL << ((n) % BITVECTOR_BITS)) != 0)
 
+/* The smallest value allowed in one octet that is at least n, or 256 if there
+   is none. This looks at a whole bitvector_t at a time, which matters for long
+   lists of single addresses, where most of each octet is empty. */
+static unsigned int octet_next(const octet_bitvector v, unsigned int n) {
+  unsigned int i, b;
+  bitvector_t w;
+
+  if (n >= 256)
+    return 256;
+  i = n / BITVECTOR_BITS;
+  w = v[i] & (~(bitvector_t) 0 << (n % BITVECTOR_BITS));
+  while (w == 0) {
+    if (++i >= sizeof(octet_bitvector) / sizeof(bitvector_t))
+      return 256;
+    w = v[i];
+  }
+  for (b = 0; !(w & 1); b++)
+    w >>= 1;
+
+  return i * BITVECTOR_BITS + b;
+}
+
 extern NmapOps o;
 
 class NetBlock {
@@ -115,6 +138,13 @@ public:
   virtual bool next(struct sockaddr_storage *ss, size_t *sslen) = 0;
   virtual void apply_netmask(int bits) = 0;
   virtual std::string str() const = 0;
+  /* Random access to the addresses, in the same order next() returns them.
+     size() returns false if they can't be counted in 64 bits. */
+  virtual bool size(u64 *n) const { return false; }
+  virtual void nth(u64 index, struct sockaddr_storage *ss, size_t *sslen) const { assert(false); }
+  /* Makes next() skip the addresses up to and including last. Subclasses
+     that can't do it cheaply keep this default, which skips nothing. */
+  virtual void skip_past(const struct sockaddr_storage *last) {}
 };
 
 class NetBlockIPv4Ranges : public NetBlock {
@@ -126,6 +156,9 @@ public:
   bool next(struct sockaddr_storage *ss, size_t *sslen);
   void apply_netmask(int bits);
   std::string str() const;
+  bool size(u64 *n) const;
+  void nth(u64 index, struct sockaddr_storage *ss, size_t *sslen) const;
+  void skip_past(const struct sockaddr_storage *last);
   void set_addr(const struct sockaddr_in *addr);
 
 private:
@@ -139,6 +172,9 @@ public:
   bool next(struct sockaddr_storage *ss, size_t *sslen);
   void apply_netmask(int bits);
   std::string str() const;
+  bool size(u64 *n) const;
+  void nth(u64 index, struct sockaddr_storage *ss, size_t *sslen) const;
+  void skip_past(const struct sockaddr_storage *last);
 
 private:
   bool exhausted;
@@ -345,8 +381,7 @@ bool NetBlockIPv4Ranges::next(struct sockaddr_storage *ss, size_t *sslen) {
      not bit set for one of the octets and therefore there are not addresses
      overall. */
   for (i = 0; i < 4; i++) {
-    while (this->counter[i] < 256 && !BIT_IS_SET(this->octets[i], this->counter[i]))
-      this->counter[i]++;
+    this->counter[i] = octet_next(this->octets[i], this->counter[i]);
     if (this->counter[i] >= 256)
       return false;
   }
@@ -363,16 +398,15 @@ bool NetBlockIPv4Ranges::next(struct sockaddr_storage *ss, size_t *sslen) {
   *sslen = sizeof(*sin);
 
   for (i = 0; i < 4; i++) {
-    bool carry;
-
-    carry = false;
-    do {
-      this->counter[3 - i] = (this->counter[3 - i] + 1) % 256;
-      if (this->counter[3 - i] == 0)
-        carry = true;
-    } while (!BIT_IS_SET(this->octets[3 - i], this->counter[3 - i]));
-    if (!carry)
+    unsigned int c;
+
+    c = octet_next(this->octets[3 - i], this->counter[3 - i] + 1);
+    if (c < 256) {
+      this->counter[3 - i] = c;
       break;
+    }
+    /* Carry into the next octet. */
+    this->counter[3 - i] = octet_next(this->octets[3 - i], 0);
   }
   if (i >= 4) {
     if (o.resolve_all && !this->resolvedaddrs.empty() && current_addr != this->resolvedaddrs.end() && ++current_addr != this->resolvedaddrs.end()) {
@@ -390,6 +424,57 @@ bool NetBlockIPv4Ranges::next(struct sockaddr_storage *ss, size_t *sslen) {
   return true;
 }
 
+void NetBlockIPv4Ranges::skip_past(const struct sockaddr_storage *last) {
+  unsigned int x[4];
+  u32 ip;
+  int i, k;
+
+  if (last->ss_family != AF_INET || this->counter[0] >= 256)
+    return;
+  /* Stepping into the next resolved address is up to next(). */
+  if (o.resolve_all && this->resolvedaddrs.size() > 1)
+    return;
+
+  ip = ntohl(((const struct sockaddr_in *) last)->sin_addr.s_addr);
+  if (ip == 0xFFFFFFFF) {
+    for (i = 0; i < 4; i++)
+      this->counter[i] = 256;
+    return;
+  }
+  ip++;
+  x[0] = (ip >> 24) & 0xFF;
+  x[1] = (ip >> 16) & 0xFF;
+  x[2] = (ip >> 8) & 0xFF;
+  x[3] = ip & 0xFF;
+
+  /* Find the smallest address of the block that is at least ip. It keeps the
+     octets of ip that are in the block, then at some octet k takes the next
+     greater value the block has, and the smallest values after that. */
+  for (k = 0; k < 4 && BIT_IS_SET(this->octets[k], x[k]); k++)
+    ;
+  if (k == 4) {
+    for (i = 0; i < 4; i++)
+      this->counter[i] = x[i];
+    return;
+  }
+  for (; k >= 0; k--) {
+    unsigned int b;
+
+    b = octet_next(this->octets[k], x[k] + 1);
+    if (b < 256) {
+      for (i = 0; i < k; i++)
+        this->counter[i] = x[i];
+      this->counter[k] = b;
+      /* next() moves these up to the first value in each octet. */
+      for (i = k + 1; i < 4; i++)
+        this->counter[i] = 0;
+      return;
+    }
+  }
+  for (i = 0; i < 4; i++)
+    this->counter[i] = 256;
+}
+
 /* Expand a single-octet bit vector to include any additional addresses that
    result when mask is applied. */
 static void apply_ipv4_netmask_octet(octet_bitvector bits, uint8_t mask) {
@@ -488,6 +573,83 @@ std::string NetBlockIPv4Ranges::str() const {
   return result.str();
 }
 
+/* Number of set bits in one bitvector_t. */
+static unsigned int bitvector_t_count(bitvector_t w) {
+  unsigned int n;
+
+  for (n = 0; w != 0; n++)
+    w &= w - 1;
+
+  return n;
+}
+
+/* Number of values allowed in one octet. */
+static unsigned int octet_count(const octet_bitvector v) {
+  unsigned int i, n;
+
+  n = 0;
+  for (i = 0; i < sizeof(octet_bitvector) / sizeof(bitvector_t); i++)
+    n += bitvector_t_count(v[i]);
+
+  return n;
+}
+
+/* The k-th (from 0) value allowed in one octet. */
+static unsigned int octet_select(const octet_bitvector v, unsigned int k) {
+  unsigned int i, n;
+  bitvector_t w;
+
+  for (i = 0; i < sizeof(octet_bitvector) / sizeof(bitvector_t); i++) {
+    n = bitvector_t_count(v[i]);
+    if (k < n)
+      break;
+    k -= n;
+  }
+  assert(i < sizeof(octet_bitvector) / sizeof(bitvector_t));
+  /* Clear the k lowest set bits; the answer is then the lowest one left. */
+  for (w = v[i]; k > 0; k--)
+    w &= w - 1;
+  for (n = 0; !(w & 1); n++)
+    w >>= 1;
+
+  return i * BITVECTOR_BITS + n;
+}
+
+bool NetBlockIPv4Ranges::size(u64 *n) const {
+  unsigned int i;
+
+  if (o.resolve_all && this->resolvedaddrs.size() > 1)
+    return false;
+  *n = 1;
+  for (i = 0; i < 4; i++)
+    *n *= octet_count(this->octets[i]);
+
+  return true;
+}
+
+void NetBlockIPv4Ranges::nth(u64 index, struct sockaddr_storage *ss, size_t *sslen) const {
+  struct sockaddr_in *sin;
+  unsigned int count, i;
+  u32 ip;
+
+  /* The last octet varies fastest, as it does for next(). */
+  ip = 0;
+  for (i = 4; i-- > 0; ) {
+    count = octet_count(this->octets[i]);
+    ip |= octet_select(this->octets[i], (unsigned int) (index % count)) << (8 * (3 - i));
+    index /= count;
+  }
+
+  memset(ss, 0, sizeof(*ss));
+  sin = (struct sockaddr_in *) ss;
+  sin->sin_family = AF_INET;
+#if HAVE_SOCKADDR_SA_LEN
+  sin->sin_len = sizeof(*sin);
+#endif
+  sin->sin_addr.s_addr = htonl(ip);
+  *sslen = sizeof(*sin);
+}
+
 void NetBlockIPv4Ranges::set_addr(const struct sockaddr_in *addr) {
   uint32_t ip;
 
@@ -572,6 +734,83 @@ bool NetBlockIPv6Netmask::next(struct sockaddr_storage *ss, size_t *sslen) {
   return true;
 }
 
+void NetBlockIPv6Netmask::skip_past(const struct sockaddr_storage *last) {
+  struct in6_addr next;
+  int i;
+
+  if (last->ss_family != AF_INET6 || this->exhausted)
+    return;
+  if (o.resolve_all && this->resolvedaddrs.size() > 1)
+    return;
+
+  next = ((const struct sockaddr_in6 *) last)->sin6_addr;
+  for (i = 15; i >= 0; i--) {
+    next.s6_addr[i]++;
+    if (next.s6_addr[i] > 0)
+      break;
+  }
+  /* Wrapping around means last was the very last address. */
+  if (i < 0 || memcmp(next.s6_addr, this->end.s6_addr, 16) > 0)
+    this->exhausted = true;
+  else if (memcmp(next.s6_addr, this->cur.s6_addr, 16) > 0)
+    this->cur = next;
+}
+
+bool NetBlockIPv6Netmask::size(u64 *n) const {
+  int i, borrow;
+  u8 diff[16];
+
+  if (o.resolve_all && this->resolvedaddrs.size() > 1)
+    return false;
+  /* end - start must fit in 64 bits, and so must one more than that. */
+  borrow = 0;
+  for (i = 15; i >= 0; i--) {
+    int d = this->end.s6_addr[i] - this->start.s6_addr[i] - borrow;
+    borrow = d < 0;
+    diff[i] = (u8) d;
+  }
+  *n = 0;
+  for (i = 0; i < 16; i++) {
+    if (i < 8 && diff[i] != 0)
+      return false;
+    if (i >= 8)
+      *n = (*n << 8) | diff[i];
+  }
+  if (*n == (u64) -1)
+    return false;
+  (*n)++;
+
+  return true;
+}
+
+void NetBlockIPv6Netmask::nth(u64 index, struct sockaddr_storage *ss, size_t *sslen) const {
+  struct sockaddr_in6 *sin6;
+  unsigned int carry;
+  int i;
+
+  memset(ss, 0, sizeof(*ss));
+  sin6 = (struct sockaddr_in6 *) ss;
+  sin6->sin6_family = AF_INET6;
+#ifdef SIN_LEN
+  sin6->sin6_len = sizeof(*sin6);
+#endif
+  *sslen = sizeof(*sin6);
+
+  if (this->addr.sin6_scope_id != 0)
+    sin6->sin6_scope_id = this->addr.sin6_scope_id;
+  else
+    sin6->sin6_scope_id = get_scope_id(o.device);
+
+  /* start + index */
+  carry = 0;
+  for (i = 15; i >= 0; i--) {
+    carry += this->start.s6_addr[i] + (unsigned int) (index & 0xFF);
+    sin6->sin6_addr.s6_addr[i] = (u8) carry;
+    carry >>= 8;
+    index >>= 8;
+  }
+}
+
 /* Fill in an in6_addr with a CIDR-style netmask with the given number of bits. */
 static void make_ipv6_netmask(struct in6_addr *mask, int bits) {
   unsigned int i;
@@ -783,8 +1022,36 @@ int TargetGroup::parse_expr(const char *target_expr, int af) {
    fills in ss if successful.  ss must point to a pre-allocated
    sockaddr_storage structure */
 int TargetGroup::get_next_host(struct sockaddr_storage *ss, size_t *sslen) {
-  if (this->netblock == NULL)
+  if (!this->resolve())
+    return -1;
+
+  if (this->netblock->next(ss, sslen))
+    return 0;
+  else
     return -1;
+}
+
+bool TargetGroup::get_size(u64 *n) {
+  if (!this->resolve())
+    return false;
+
+  return this->netblock->size(n);
+}
+
+void TargetGroup::get_host(u64 index, struct sockaddr_storage *ss, size_t *sslen) const {
+  this->netblock->nth(index, ss, sslen);
+}
+
+void TargetGroup::skip_past(const struct sockaddr_storage *last) {
+  if (this->netblock != NULL)
+    this->netblock->skip_past(last);
+}
+
+/* Replaces a hostname netblock with the addresses it resolves to. Returns
+   false if there is no netblock or it does not resolve. */
+bool TargetGroup::resolve() {
+  if (this->netblock == NULL)
+    return false;
 
   /* If all we have at this point is a hostname and netmask, resolve into
      something where we know the address. If we ever have to use strictly the
@@ -802,13 +1069,10 @@ int TargetGroup::get_next_host(struct sockaddr_storage *ss, size_t *sslen) {
   }
   else {
     error("Failed to resolve \"%s\".", this->netblock->hostname.c_str());
-    return -1;
+    return false;
   }
 
-  if (this->netblock->next(ss, sslen))
-    return 0;
-  else
-    return -1;
+  return true;
 }
 
 /* Returns true iff the given address is the one that was resolved to create
@@ -836,3 +1100,41 @@ const std::list<struct sockaddr_storage> &TargetGroup::get_unscanned_addrs(void)
 int TargetGroup::get_namedhost() const {
   return this->get_resolved_name() != NULL;
 }
+
+TargetSpace::~TargetSpace() {
+  this->clear();
+}
+
+void TargetSpace::add(TargetGroup *tg, u64 n) {
+  Range r;
+
+  this->total += n;
+  r.group = tg;
+  r.end = this->total;
+  this->ranges.push_back(r);
+}
+
+void TargetSpace::clear() {
+  std::vector<Range>::iterator it;
+
+  for (it = this->ranges.begin(); it != this->ranges.end(); it++)
+    delete it->group;
+  this->ranges.clear();
+  this->total = 0;
+}
+
+bool TargetSpace::end_less(u64 index, const Range &r) {
+  return index < r.end;
+}
+
+const TargetGroup *TargetSpace::get_host(u64 index, struct sockaddr_storage *ss, size_t *sslen) const {
+  std::vector<Range>::const_iterator r;
+
+  r = std::upper_bound(this->ranges.begin(), this->ranges.end(), index, end_less);
+  assert(r != this->ranges.end());
+  if (r != this->ranges.begin())
+    index -= (r - 1)->end;
+  r->group->get_host(index, ss, sslen);
+
+  return r->group;
+}
@@ -67,7 +67,10 @@
 #ifndef TARGETGROUP_H
 #define TARGETGROUP_H
 
+#include "nbase.h"
+
 #include <list>
+#include <vector>
 #include <cstddef>
 
 class NetBlock;
@@ -91,6 +94,19 @@ public:
      fills in ss if successful.  ss must point to a pre-allocated
      sockaddr_storage structure */
   int get_next_host(struct sockaddr_storage *ss, std::size_t *sslen);
+  /* For visiting the addresses in another order than get_next_host's:
+     stores the number of addresses in this expression in *n, resolving it
+     first if necessary. Returns false if they can't be indexed, which is the
+     case for IPv6 netmasks of more than 64 host bits and for names that
+     resolved to several addresses with --resolve-all. */
+  bool get_size(u64 *n);
+  /* Fills in the address with the given index, which must be less than the
+     size from get_size. This does not affect get_next_host. */
+  void get_host(u64 index, struct sockaddr_storage *ss, std::size_t *sslen) const;
+  /* Moves get_next_host past the addresses up to and including last, which
+     must come after the address it returned most recently. Used to skip a
+     whole excluded range at once. */
+  void skip_past(const struct sockaddr_storage *last);
   /* Returns true iff the given address is the one that was resolved to create
      this target group; i.e., not one of the addresses derived from it with a
      netmask. */
@@ -102,6 +118,45 @@ public:
   const std::list<struct sockaddr_storage> &get_unscanned_addrs(void) const;
   /* is the current expression a named host */
   int get_namedhost() const;
+  /* Replaces a host name with the addresses it resolves to. Returns false if
+     there is no expression or the name doesn't resolve. Calling it again
+     after it succeeded does nothing. */
+  bool resolve();
+};
+
+/* A run of target expressions whose addresses are numbered consecutively
+   across all of them, so that they can be visited in any order. */
+class TargetSpace {
+public:
+  TargetSpace() {
+    this->total = 0;
+  }
+
+  ~TargetSpace();
+
+  /* Takes ownership of tg and appends its n addresses, where n is what
+     tg->get_size gave. */
+  void add(TargetGroup *tg, u64 n);
+  /* Deletes all the expressions. */
+  void clear();
+  /* The total number of addresses. */
+  u64 size() const {
+    return this->total;
+  }
+  /* Fills in the address with the given index, which must be less than
+     size(), and returns the expression it came from. */
+  const TargetGroup *get_host(u64 index, struct sockaddr_storage *ss, std::size_t *sslen) const;
+
+private:
+  /* One expression and the index just past its last address. */
+  struct Range {
+    TargetGroup *group;
+    u64 end;
+  };
+  std::vector<Range> ranges;
+  u64 total;
+
+  static bool end_less(u64 index, const Range &r);
 };
 
 #endif /* TARGETGROUP_H */
@@ -0,0 +1,536 @@
+
+/***************************************************************************
+ * checkpoint.cc -- saving the progress of a scan to a file with           *
+ * --checkpoint, and reading it back for --resume.                         *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "checkpoint.h"
+#include "nmap.h"
+#include "NmapOps.h"
+#include "Target.h"
+#include "nmap_error.h"
+#include "output.h"
+#include "portlist.h"
+#include "portreasons.h"
+#include "timing.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <map>
+#include <string>
+
+extern NmapOps o;
+
+/* A checkpoint file starts with CHECKPOINT_MAGIC and a version number. The
+   rest is the arguments of the scan, the number of addresses taken from its
+   target specifications, and the hosts among those that weren't finished.
+   Numbers are big-endian. */
+#define CHECKPOINT_MAGIC "NMAPCKPT"
+#define CHECKPOINT_VERSION 1
+
+/* Enough bytes for a bit for every port number. */
+#define DONE_BYTES (65536 / 8)
+
+/* A port of a host read from a checkpoint. */
+struct SavedPort {
+  u8 proto;
+  u16 portno;
+  u8 state;
+  reason_t reason_id;
+  u8 ttl;
+  struct sockaddr_storage reason_addr;
+};
+
+/* A host read from a checkpoint, kept until the resumed scan gets to it. */
+struct SavedHost {
+  struct sockaddr_storage ss;
+  int flags;
+  reason_t reason_id;
+  unsigned short reason_ttl;
+  struct timeout_info to;
+  std::vector<SavedPort> ports;
+  HostCheckpoint *hc;
+};
+
+/* The hosts being scanned, by sequence number. */
+static std::map<u64, Target *> tracked;
+/* The sequence number of the next address taken. */
+static u64 next_seq = 0;
+/* With --resume, the addresses the checkpoint had taken and the hosts among
+   them that were not finished. */
+static u64 resume_taken = 0;
+static std::map<u64, SavedHost> resumed;
+static std::string checkpoint_args;
+static struct timeval last_write;
+
+HostCheckpoint::HostCheckpoint(u64 seq) {
+  this->seq = seq;
+  scans_done = 0;
+  cur_scan = STYPE_UNKNOWN;
+  cwnd = 0;
+  ssthresh = 0;
+  restored = false;
+}
+
+bool HostCheckpoint::scanDone(stype scantype) const {
+  return (scans_done & (1U << scantype)) != 0;
+}
+
+void HostCheckpoint::setScanDone(stype scantype) {
+  scans_done |= 1U << scantype;
+  if (cur_scan == scantype) {
+    cur_scan = STYPE_UNKNOWN;
+    done.clear();
+    cwnd = 0;
+    ssthresh = 0;
+  }
+}
+
+void HostCheckpoint::startScan(stype scantype) {
+  if (cur_scan == scantype)
+    return;
+  cur_scan = scantype;
+  done.clear();
+  cwnd = 0;
+  ssthresh = 0;
+}
+
+bool HostCheckpoint::portDone(u16 portno) const {
+  if (done.empty())
+    return false;
+  return (done[portno / 8] & (1 << (portno % 8))) != 0;
+}
+
+void HostCheckpoint::setPortDone(u16 portno, bool isdone) {
+  if (done.empty()) {
+    if (!isdone)
+      return;
+    done.resize(DONE_BYTES, 0);
+  }
+  if (isdone)
+    done[portno / 8] |= 1 << (portno % 8);
+  else
+    done[portno / 8] &= ~(1 << (portno % 8));
+}
+
+bool HostCheckpoint::hasProgress() const {
+  return scans_done != 0 || !done.empty();
+}
+
+static void put_u8(std::string &buf, u8 v) {
+  buf.push_back((char) v);
+}
+
+static void put_u16(std::string &buf, u16 v) {
+  put_u8(buf, v >> 8);
+  put_u8(buf, v & 0xff);
+}
+
+static void put_u32(std::string &buf, u32 v) {
+  put_u16(buf, v >> 16);
+  put_u16(buf, v & 0xffff);
+}
+
+static void put_u64(std::string &buf, u64 v) {
+  put_u32(buf, (u32) (v >> 32));
+  put_u32(buf, (u32) v);
+}
+
+/* Addresses are a family byte (4, 6, or 0 for none) and the address. */
+static void put_addr(std::string &buf, const struct sockaddr_storage *ss) {
+  if (ss->ss_family == AF_INET) {
+    put_u8(buf, 4);
+    buf.append((const char *) &((const struct sockaddr_in *) ss)->sin_addr, 4);
+  } else if (ss->ss_family == AF_INET6) {
+    put_u8(buf, 6);
+    buf.append((const char *) &((const struct sockaddr_in6 *) ss)->sin6_addr, 16);
+  } else {
+    put_u8(buf, 0);
+  }
+}
+
+static void put_host(std::string &buf, Target *t) {
+  const HostCheckpoint *hc = t->checkpoint;
+  struct sockaddr_storage reason_addr;
+  Port *p, port;
+  std::string ports;
+  u32 nports;
+  int proto;
+
+  put_u64(buf, hc->seq);
+  put_addr(buf, t->TargetSockAddr());
+  put_u32(buf, (u32) t->flags);
+  put_u16(buf, t->reason.reason_id);
+  put_u16(buf, t->reason.ttl);
+  put_u32(buf, (u32) t->to.srtt);
+  put_u32(buf, (u32) t->to.rttvar);
+  put_u32(buf, (u32) t->to.timeout);
+  put_u32(buf, hc->scans_done);
+  put_u32(buf, hc->cur_scan);
+  put_u32(buf, (u32) (hc->cwnd * 1000));
+  put_u32(buf, (u32) hc->ssthresh);
+  put_u32(buf, hc->done.size());
+  if (!hc->done.empty())
+    buf.append((const char *) &hc->done[0], hc->done.size());
+
+  /* Only the ports that aren't in the default state of their protocol. */
+  nports = 0;
+  for (proto = 0; proto < 2; proto++) {
+    p = NULL;
+    while ((p = t->ports.nextPort(p, &port, proto == 0 ? TCPANDUDPANDSCTP : IPPROTO_IP, 0)) != NULL) {
+      if (t->ports.portIsDefault(p->portno, p->proto))
+        continue;
+      put_u8(ports, p->proto);
+      put_u16(ports, p->portno);
+      put_u8(ports, p->state);
+      put_u16(ports, p->reason.reason_id);
+      put_u8(ports, p->reason.ttl);
+      memset(&reason_addr, 0, sizeof(reason_addr));
+      if (p->reason.ip_addr.sockaddr.sa_family == AF_INET)
+        memcpy(&reason_addr, &p->reason.ip_addr.in, sizeof(p->reason.ip_addr.in));
+      else if (p->reason.ip_addr.sockaddr.sa_family == AF_INET6)
+        memcpy(&reason_addr, &p->reason.ip_addr.in6, sizeof(p->reason.ip_addr.in6));
+      put_addr(ports, &reason_addr);
+      nports++;
+    }
+  }
+  put_u32(buf, nports);
+  buf.append(ports);
+}
+
+/* Reads the fields of a checkpoint, failing if it ends too soon. */
+class CheckpointReader {
+public:
+  CheckpointReader(const char *fname, const std::string &data)
+    : fname(fname), data(data), pos(0) {}
+
+  bool atEnd() const {
+    return pos == data.size();
+  }
+
+  const char *bytes(size_t n) {
+    const char *p;
+    if (data.size() - pos < n)
+      fatal("Checkpoint file %s is truncated or corrupt", fname);
+    p = data.data() + pos;
+    pos += n;
+    return p;
+  }
+
+  u8 get_u8() {
+    return (u8) *bytes(1);
+  }
+
+  u16 get_u16() {
+    u16 v = get_u8();
+    return (v << 8) | get_u8();
+  }
+
+  u32 get_u32() {
+    u32 v = get_u16();
+    return (v << 16) | get_u16();
+  }
+
+  u64 get_u64() {
+    u64 v = get_u32();
+    return (v << 32) | get_u32();
+  }
+
+  void get_addr(struct sockaddr_storage *ss) {
+    u8 family = get_u8();
+
+    memset(ss, 0, sizeof(*ss));
+    if (family == 4) {
+      struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+      sin->sin_family = AF_INET;
+      memcpy(&sin->sin_addr, bytes(4), 4);
+    } else if (family == 6) {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+      sin6->sin6_family = AF_INET6;
+      memcpy(&sin6->sin6_addr, bytes(16), 16);
+    } else if (family != 0) {
+      fatal("Checkpoint file %s is truncated or corrupt", fname);
+    }
+#if HAVE_SOCKADDR_SA_LEN
+    if (family == 4)
+      ((struct sockaddr *) ss)->sa_len = sizeof(struct sockaddr_in);
+    else if (family == 6)
+      ((struct sockaddr *) ss)->sa_len = sizeof(struct sockaddr_in6);
+#endif
+  }
+
+private:
+  const char *fname;
+  const std::string &data;
+  size_t pos;
+};
+
+static void get_host(CheckpointReader &r, SavedHost *h) {
+  SavedPort port;
+  u32 n, i;
+
+  h->hc = new HostCheckpoint(r.get_u64());
+  h->hc->restored = true;
+  r.get_addr(&h->ss);
+  h->flags = (int) r.get_u32();
+  h->reason_id = r.get_u16();
+  h->reason_ttl = r.get_u16();
+  h->to.srtt = (int) r.get_u32();
+  h->to.rttvar = (int) r.get_u32();
+  h->to.timeout = (int) r.get_u32();
+  h->hc->scans_done = r.get_u32();
+  h->hc->cur_scan = (stype) r.get_u32();
+  h->hc->cwnd = r.get_u32() / 1000.0;
+  h->hc->ssthresh = (int) r.get_u32();
+  n = r.get_u32();
+  if (n != 0) {
+    const u8 *done = (const u8 *) r.bytes(n);
+    h->hc->done.assign(done, done + n);
+  }
+
+  n = r.get_u32();
+  for (i = 0; i < n; i++) {
+    port.proto = r.get_u8();
+    port.portno = r.get_u16();
+    port.state = r.get_u8();
+    port.reason_id = r.get_u16();
+    port.ttl = r.get_u8();
+    r.get_addr(&port.reason_addr);
+    h->ports.push_back(port);
+  }
+}
+
+bool checkpoint_load(const char *fname, int *myargc, char ***myargv) {
+  std::string data, command;
+  CheckpointReader r(fname, data);
+  char buf[4096];
+  size_t n;
+  FILE *fp;
+  u32 len, nhosts, i;
+
+  fp = fopen(fname, "rb");
+  if (fp == NULL)
+    pfatal("Could not open %s", fname);
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    data.append(buf, n);
+  if (ferror(fp))
+    pfatal("Could not read %s", fname);
+  fclose(fp);
+
+  if (data.compare(0, strlen(CHECKPOINT_MAGIC), CHECKPOINT_MAGIC) != 0)
+    return false;
+  r.bytes(strlen(CHECKPOINT_MAGIC));
+  if (r.get_u32() != CHECKPOINT_VERSION)
+    fatal("Checkpoint file %s was written by an incompatible version of Nmap", fname);
+
+  len = r.get_u32();
+  checkpoint_args.assign(r.bytes(len), len);
+  resume_taken = r.get_u64();
+  nhosts = r.get_u32();
+  for (i = 0; i < nhosts; i++) {
+    SavedHost h;
+    get_host(r, &h);
+    resumed[h.hc->seq] = h;
+  }
+  if (!r.atEnd())
+    fatal("Checkpoint file %s is truncated or corrupt", fname);
+
+  command = "nmap --append-output " + checkpoint_args;
+  *myargc = arg_parse(command.c_str(), myargv);
+  if (*myargc == -1)
+    fatal("Unable to parse the arguments in checkpoint file %s", fname);
+
+  return true;
+}
+
+void checkpoint_init(int argc, const char * const argv[]) {
+  gettimeofday(&last_write, NULL);
+  if (o.checkpoint_file == NULL || !checkpoint_args.empty())
+    return;
+  checkpoint_args = join_quoted(argv + 1, argc - 1);
+  /* A resumed scan must give the hosts in the same order. */
+  if (o.randomize_hosts && checkpoint_args.find("--randomize-seed") == std::string::npos) {
+    char seedbuf[64];
+    Snprintf(seedbuf, sizeof(seedbuf), " --randomize-seed %llu",
+             (unsigned long long) o.randomize_seed);
+    checkpoint_args += seedbuf;
+  }
+}
+
+bool checkpoint_next_host(const struct sockaddr_storage *ss,
+                          HostCheckpoint **hc) {
+  std::map<u64, SavedHost>::iterator it;
+  u64 seq;
+
+  seq = next_seq++;
+  *hc = NULL;
+  if (seq < resume_taken) {
+    it = resumed.find(seq);
+    if (it == resumed.end())
+      return false;
+    if (sockaddr_storage_cmp(&it->second.ss, ss) == 0) {
+      *hc = it->second.hc;
+      return true;
+    }
+    error("Warning: the checkpoint has %s where the targets now give %s; scanning it from the start",
+          inet_ntop_ez(&it->second.ss, sizeof(it->second.ss)),
+          inet_ntop_ez(ss, sizeof(*ss)));
+    delete it->second.hc;
+    resumed.erase(it);
+  }
+  if (o.checkpoint_file != NULL)
+    *hc = new HostCheckpoint(seq);
+
+  return true;
+}
+
+void checkpoint_attach(Target *t, HostCheckpoint *hc) {
+  std::map<u64, SavedHost>::iterator it;
+  std::vector<SavedPort>::iterator port;
+
+  t->checkpoint = hc;
+  tracked[hc->seq] = t;
+  if (!hc->restored)
+    return;
+
+  it = resumed.find(hc->seq);
+  assert(it != resumed.end());
+  for (port = it->second.ports.begin(); port != it->second.ports.end(); port++) {
+    t->ports.setPortState(port->portno, port->proto, port->state);
+    t->ports.setStateReason(port->portno, port->proto, port->reason_id, port->ttl,
+                            port->reason_addr.ss_family == AF_UNSPEC ? NULL : &port->reason_addr);
+  }
+  it->second.ports.clear();
+}
+
+void checkpoint_release(Target *t) {
+  tracked.erase(t->checkpoint->seq);
+  delete t->checkpoint;
+  t->checkpoint = NULL;
+}
+
+void checkpoint_restore_status(Target *t) {
+  std::map<u64, SavedHost>::iterator it;
+
+  if (t->checkpoint == NULL || !t->checkpoint->restored)
+    return;
+  it = resumed.find(t->checkpoint->seq);
+  if (it == resumed.end())
+    return;
+  if (t->checkpoint->hasProgress() && (it->second.flags & HOST_UP)) {
+    t->flags = it->second.flags;
+    t->reason.reason_id = it->second.reason_id;
+    t->reason.ttl = it->second.reason_ttl;
+    t->to = it->second.to;
+  }
+  resumed.erase(it);
+}
+
+bool checkpoint_due(const struct timeval *now) {
+  return o.checkpoint_file != NULL
+    && TIMEVAL_MSEC_SUBTRACT(*now, last_write) >= o.checkpoint_interval;
+}
+
+void checkpoint_write() {
+  std::map<u64, Target *>::iterator it;
+  std::string buf, tmpname;
+  FILE *fp;
+  bool ok;
+
+  if (o.checkpoint_file == NULL)
+    return;
+  gettimeofday(&last_write, NULL);
+
+  buf.append(CHECKPOINT_MAGIC);
+  put_u32(buf, CHECKPOINT_VERSION);
+  put_u32(buf, checkpoint_args.size());
+  buf.append(checkpoint_args);
+  put_u64(buf, next_seq);
+  put_u32(buf, tracked.size());
+  for (it = tracked.begin(); it != tracked.end(); it++)
+    put_host(buf, it->second);
+
+  /* The hosts left out of the checkpoint count as finished, so their output
+     must be out first. */
+  log_flush_all();
+
+  /* Write a new file and rename it over the old one, so an interruption
+     can't leave a half-written checkpoint. */
+  tmpname = std::string(o.checkpoint_file) + ".tmp";
+  fp = fopen(tmpname.c_str(), "wb");
+  if (fp == NULL) {
+    error("Could not open checkpoint file %s: %s", tmpname.c_str(), strerror(errno));
+    return;
+  }
+  ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok) {
+    error("Could not write checkpoint file %s: %s", tmpname.c_str(), strerror(errno));
+    return;
+  }
+#ifdef WIN32
+  /* rename doesn't replace an existing file on Windows. */
+  remove(o.checkpoint_file);
+#endif
+  if (rename(tmpname.c_str(), o.checkpoint_file) != 0)
+    error("Could not rename %s to %s: %s", tmpname.c_str(), o.checkpoint_file, strerror(errno));
+}
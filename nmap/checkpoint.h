@@ -0,0 +1,143 @@
+
+/***************************************************************************
+ * checkpoint.h -- saving the progress of a scan to a file with            *
+ * --checkpoint, and reading it back for --resume.                         *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+
+/* $Id$ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "nbase.h"
+#include "scan_lists.h"
+
+#include <vector>
+
+class Target;
+
+/* What --checkpoint remembers about a target between checkpoints. Every
+   address taken from the target specifications gets the next sequence number,
+   whether or not it is scanned, so a resumed scan can tell which of the
+   addresses it takes again were finished. */
+class HostCheckpoint {
+public:
+  HostCheckpoint(u64 seq);
+
+  u64 seq;
+  /* Bit (1 << stype) is set for each port scan that has finished. */
+  u32 scans_done;
+  /* The port scan in progress, or STYPE_UNKNOWN, and the ports of it that
+     need no more probes: bit n of done is port (or protocol) n. */
+  stype cur_scan;
+  std::vector<u8> done;
+  /* The congestion window of cur_scan; 0 if not known. */
+  double cwnd;
+  int ssthresh;
+  /* Whether this host's state was read back from a checkpoint. */
+  bool restored;
+
+  bool scanDone(stype scantype) const;
+  void setScanDone(stype scantype);
+  /* Sets up done for a new port scan unless it belongs to scantype already. */
+  void startScan(stype scantype);
+  bool portDone(u16 portno) const;
+  void setPortDone(u16 portno, bool isdone);
+  /* Whether any port scan of the host was finished or begun. */
+  bool hasProgress() const;
+};
+
+/* Reads a checkpoint file for --resume. Returns false if fname is not a
+   checkpoint, so it can be read as a log file instead. Otherwise fills in the
+   arguments to resume the scan with and remembers the hosts that were being
+   scanned, to be given to checkpoint_next_host. */
+bool checkpoint_load(const char *fname, int *myargc, char ***myargv);
+
+/* Records the arguments to save with each checkpoint. Call it after the
+   options have been validated. */
+void checkpoint_init(int argc, const char * const argv[]);
+
+/* Called for every address taken from the target specifications, in order.
+   Returns false if a resumed scan finished the address before. Otherwise
+   *hc is set to the state to attach with checkpoint_attach, which is
+   restored from the checkpoint if the host was in progress, or NULL if there
+   is no --checkpoint. */
+bool checkpoint_next_host(const struct sockaddr_storage *ss,
+                          HostCheckpoint **hc);
+
+/* Makes hc the checkpoint state of t, which is tracked until t is deleted.
+   Port states restored with hc are set in t. */
+void checkpoint_attach(Target *t, HostCheckpoint *hc);
+
+/* Stops tracking t; called from the Target destructor. */
+void checkpoint_release(Target *t);
+
+/* Gives a restored host that was found up before the scan was interrupted the
+   status and timeouts it had then, whatever host discovery found now. */
+void checkpoint_restore_status(Target *t);
+
+/* Returns true when --checkpoint-interval has passed since the last
+   checkpoint. */
+bool checkpoint_due(const struct timeval *now);
+
+/* Writes the state of every tracked host to the --checkpoint file. */
+void checkpoint_write();
+
+#endif /* CHECKPOINT_H */
@@ -798,6 +798,7 @@ _intf_get_aliases(intf_t *intf, struct intf_entry *entry)
 				}
 			}
 			fclose(proc_net_if_inet6_fp);
+			proc_net_if_inet6_fp = NULL;
 		}
 	}
 #endif
@@ -3983,7 +3983,8 @@ int DnetName2PcapName(const char *dnetdev, char *pcapdev, int pcapdevlen) {
  * pcap_open_live() that takes care of compatibility issues and error
  * checking. The function attempts to open the device up to three times.
  * If the call does not succeed the third time, NULL is returned. */
-pcap_t *my_pcap_open_live(const char *device, int snaplen, int promisc, int to_ms){
+pcap_t *my_pcap_open_live(const char *device, int snaplen, int promisc, int to_ms,
+                          int bufsize){
   char err0r[PCAP_ERRBUF_SIZE];
   pcap_t *pt;
   char pcapdev[128];
@@ -4033,6 +4034,8 @@ pcap_t *my_pcap_open_live(const char *device, int snaplen, int promisc, int to_m
 #ifdef HAVE_PCAP_SET_IMMEDIATE_MODE
   MY_PCAP_SET(pcap_set_immediate_mode, pt, 1);
 #endif
+  if (bufsize > 0)
+    MY_PCAP_SET(pcap_set_buffer_size, pt, bufsize);
 
   failed = pcap_activate(pt);
   if (failed < 0) {
@@ -4167,6 +4170,19 @@ int datalink_offset(int datalink)
   return offset;
 }
 
+/* Returns true if pd has been put in nonblocking mode and frames are read from
+   a memory-mapped ring, as with Linux PACKET_MMAP. libpcap then hands out all
+   the frames of a TPACKET_V3 block without further system calls, so frames
+   that have already been captured can be read without a select() for each
+   one. For ring-backed handles pcap_getnonblock only checks a flag. */
+static bool pcap_ring_nonblocking(pcap_t *pd) {
+#ifdef __linux__
+  return pcap_getnonblock(pd, NULL) == 1;
+#else
+  return false;
+#endif
+}
+
 /* Common subroutine for reading ARP and NS responses. Input parameters are pd,
    to_usec, and accept_callback. If a received frame passes accept_callback,
    then the output parameters p, head, rcvdtime, datalink, and offset are filled
@@ -4213,7 +4229,10 @@ int read_reply_pcap(pcap_t *pd, long to_usec,
     /* It may be that protecting this with !pcap_selectable_fd_one_to_one is not
        necessary, that it is always safe to do a nonblocking read in this way on
        all platforms. But I have only tested it on Solaris. */
-    if (!pcap_selectable_fd_one_to_one()) {
+    if (pcap_ring_nonblocking(pd)) {
+      /* Drain the ring before waiting on it. */
+      pcap_status = pcap_next_ex(pd, head, p);
+    } else if (!pcap_selectable_fd_one_to_one()) {
       int rc, nonblock;
 
       nonblock = pcap_getnonblock(pd, NULL);
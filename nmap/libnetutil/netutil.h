@@ -459,8 +459,11 @@ int Sendto(const char *functionname, int sd, const unsigned char *packet,
  * packets on the network. It is actually a wrapper for libpcap's
  * pcap_open_live() that takes care of compatibility issues and error
  * checking.  Prints an error and fatal()s if the call fails, so a
- * valid pcap_t will always be returned. */
-pcap_t *my_pcap_open_live(const char *device, int snaplen, int promisc, int to_ms);
+ * valid pcap_t will always be returned. If bufsize is nonzero, it is the
+ * size in bytes of the kernel capture buffer to ask for (on Linux, the
+ * memory-mapped packet ring); otherwise libpcap's default is used. */
+pcap_t *my_pcap_open_live(const char *device, int snaplen, int promisc, int to_ms,
+                          int bufsize = 0);
 
 /* Set a pcap filter */
 void set_pcap_filter(const char *device, pcap_t *pd, const char *bpf, ...);
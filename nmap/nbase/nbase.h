@@ -510,6 +510,7 @@ extern void addrset_print(FILE *fp, const struct addrset *set);
 extern int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns);
 extern int addrset_add_file(struct addrset *set, FILE *fd, int af, int dns);
 extern int addrset_contains(const struct addrset *set, const struct sockaddr *sa);
+extern int addrset_range_end(const struct addrset *set, const struct sockaddr *sa, struct sockaddr_storage *end);
 
 #ifndef STDIN_FILENO
 #define STDIN_FILENO 0
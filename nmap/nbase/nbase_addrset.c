@@ -90,20 +90,6 @@ void nbase_set_log(void (*log_user_func)(const char *, ...),void (*log_debug_fun
         log_debug = log_debug_func;
 }
 
-/* Node for a radix tree (trie) used to match certain addresses.
- * Currently, only individual numeric IP and IPv6 addresses are matched using
- * the trie. */
-struct trie_node {
-  /* The address prefix that this node represents. */
-  u32 addr[4];
-  /* The prefix mask. Bits in addr that are not within this mask are ignored. */
-  u32 mask[4];
-  /* Addresses with the next bit after the mask equal to 1 are on this branch. */
-  struct trie_node *next_bit_one;
-  /* Addresses with the next bit after the mask equal to 0 are on this branch. */
-  struct trie_node *next_bit_zero;
-};
-
 /* We use bit vectors to represent what values are allowed in an IPv4 octet.
    Each vector is built up of an array of bitvector_t (any convenient integer
    type). */
@@ -121,58 +107,43 @@ struct addrset_elem {
   struct addrset_elem *next;
 };
 
+/* A 128-bit address. IPv4 addresses are mapped into ::ffff:0:0/96. */
+struct addr128 {
+    u64 hi;
+    u64 lo;
+};
+
+/* A run of consecutive addresses, first and last included. */
+struct addr_range {
+    struct addr128 first;
+    struct addr128 last;
+};
+
 /* A set of addresses. Used to match against allow/deny lists. */
 struct addrset {
     /* Linked list of struct addset_elem. */
     struct addrset_elem *head;
-    /* Radix tree for faster matching of certain cases */
-    struct trie_node *trie;
+    /* The addresses and netmasks, as ranges. They are appended as they come
+       and only sorted and merged when the set is next searched, so that
+       loading a long list is cheap and a lookup is a binary search over a
+       compact array. */
+    struct addr_range *ranges;
+    size_t nranges;
+    size_t ranges_alloc;
+    /* Whether ranges is sorted and its ranges disjoint and not adjacent. */
+    int ranges_merged;
 };
 
-/* Special node pointer to represent "all possible addresses"
- * This will be used to represent netmask specifications. */
-static struct trie_node *TRIE_NODE_TRUE = NULL;
-
 struct addrset *addrset_new()
 {
     struct addrset *set = (struct addrset *) safe_zalloc(sizeof(struct addrset));
     set->head = NULL;
-    /* We could simply allocate one byte to get a unique address, but this
-     * feels safer and is not too large. */
-    if (TRIE_NODE_TRUE == NULL) {
-      TRIE_NODE_TRUE = (struct trie_node *) safe_zalloc(sizeof(struct trie_node));
-    }
-
-    /* Allocate the first node of the IPv4 trie */
-    set->trie = (struct trie_node *) safe_zalloc(sizeof(struct trie_node));
+    set->ranges = NULL;
+    set->nranges = set->ranges_alloc = 0;
+    set->ranges_merged = 1;
     return set;
 }
 
-static void trie_free(struct trie_node *curr)
-{
-  /* Since we descend only down one side, we at most accumulate one tree's-depth, or 128.
-   * Add 4 for safety to account for special root node and special empty stack position 0.
-   */
-  struct trie_node *stack[128+4];
-  int i = 1;
-
-  while (i > 0 && curr != NULL && curr != TRIE_NODE_TRUE) {
-    /* stash next_bit_one */
-    if (curr->next_bit_one != NULL && curr->next_bit_one != TRIE_NODE_TRUE) {
-      stack[i++] = curr->next_bit_one;
-    }
-    /* if next_bit_zero is valid, descend */
-    if (curr->next_bit_zero != NULL && curr->next_bit_zero != TRIE_NODE_TRUE) {
-      curr = curr->next_bit_zero;
-    }
-    else {
-      /* next_bit_one was stashed, next_bit_zero is invalid. Free it and move back up the stack. */
-      free(curr);
-      curr = stack[--i];
-    }
-  }
-}
-
 void addrset_free(struct addrset *set)
 {
     struct addrset_elem *elem, *next;
@@ -182,336 +153,143 @@ void addrset_free(struct addrset *set)
         free(elem);
     }
 
-    trie_free(set->trie);
+    free(set->ranges);
     free(set);
 }
 
-
-/* Public domain log2 function. https://graphics.stanford.edu/~seander/bithacks.html#IntegerLogLookup */
-static const char LogTable256[256] = {
-#define LT(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
-  -1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
-  LT(4), LT(5), LT(5), LT(6), LT(6), LT(6), LT(6),
-  LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7)
-};
-
-/* Returns a mask representing the common prefix between 2 values. */
-static u32 common_mask(u32 a, u32 b)
+static int addr128_cmp(const struct addr128 *a, const struct addr128 *b)
 {
-  u8 r;     // r will be lg(v)
-  u32 t, tt; // temporaries
-  u32 v = a ^ b;
-  if (v == 0) {
-    /* values are equal, all bits are the same */
-    return 0xffffffff;
-  }
-
-  if ((tt = v >> 16))
-  {
-    r = (t = tt >> 8) ? 24 + LogTable256[t] : 16 + LogTable256[tt];
-  }
-  else
-  {
-    r = (t = v >> 8) ? 8 + LogTable256[t] : LogTable256[v];
-  }
-  if (r + 1 >= 32) {
-    /* shifting this many bits would overflow. Just return max mask */
-    return 0;
-  }
-  else {
-    return ~((1 << (r + 1)) - 1);
-  }
-}
-
-/* Given a mask and a value, return the value of the bit immediately following
- * the masked bits. */
-static u32 next_bit_is_one(u32 mask, u32 value) {
-  if (mask == 0) {
-    /* no masked bits, check the first bit. */
-    return (0x80000000 & value);
-  }
-  else if (mask == 0xffffffff) {
-    /* Imaginary bit off the end we will say is 0 */
+    if (a->hi != b->hi)
+        return a->hi < b->hi ? -1 : 1;
+    if (a->lo != b->lo)
+        return a->lo < b->lo ? -1 : 1;
     return 0;
-  }
-  /* isolate the bit by overlapping the mask with its inverse */
-  return ((mask >> 1) & ~mask) & value;
 }
 
-/* Given a mask and an address, return true if the first unmasked bit is one */
-static u32 addr_next_bit_is_one(const u32 *mask, const u32 *addr) {
-  u32 curr_mask;
-  u8 i;
-  for (i = 0; i < 4; i++) {
-    curr_mask = mask[i];
-    if (curr_mask < 0xffffffff) {
-      /* Only bother checking the first not-completely-masked portion of the address */
-      return next_bit_is_one(curr_mask, addr[i]);
-    }
-  }
-  /* Mask must be all ones, meaning that the next bit is off the end, and clearly not 1. */
-  return 0;
-}
-
-/* Return true if the masked portion of a and b is identical */
-static int mask_matches(u32 mask, u32 a, u32 b)
-{
-  return !(mask & (a ^ b));
-}
-
-/* Apply a mask and check if 2 addresses are equal */
-static int addr_matches(const u32 *mask, const u32 *sa, const u32 *sb)
+/* Helper function to turn a sockaddr into an addr128, used internally */
+static int sockaddr_to_addr128(const struct sockaddr *sa, struct addr128 *addr)
 {
-  u32 curr_mask;
-  u8 i;
-  for (i = 0; i < 4; i++) {
-    curr_mask = mask[i];
-    if (curr_mask == 0) {
-      /* No more applicable bits */
-      break;
+    if (sa->sa_family == AF_INET) {
+        /* IPv4-mapped IPv6 address */
+        addr->hi = 0;
+        addr->lo = ((u64) 0xffff << 32) | ntohl(((struct sockaddr_in *) sa)->sin_addr.s_addr);
     }
-    else if (!mask_matches(curr_mask, sa[i], sb[i])) {
-      /* Doesn't match. */
-      return 0;
+#ifdef HAVE_IPV6
+    else if (sa->sa_family == AF_INET6) {
+        const unsigned char *addr6 = ((struct sockaddr_in6 *) sa)->sin6_addr.s6_addr;
+        int i;
+        addr->hi = addr->lo = 0;
+        for (i = 0; i < 8; i++) {
+            addr->hi = (addr->hi << 8) | addr6[i];
+            addr->lo = (addr->lo << 8) | addr6[i + 8];
+        }
     }
-  }
-  /* All applicable bits match. */
-  return 1;
-}
-
-/* Helper function to allocate and initialize a new node */
-static struct trie_node *new_trie_node(const u32 *addr, const u32 *mask)
-{
-  u8 i;
-  struct trie_node *new_node = (struct trie_node *) safe_zalloc(sizeof(struct trie_node));
-  for (i=0; i < 4; i++) {
-    new_node->addr[i] = addr[i];
-    new_node->mask[i] = mask[i];
-  }
-  /* New nodes default to matching true. Override if not. */
-  new_node->next_bit_one = new_node->next_bit_zero = TRIE_NODE_TRUE;
-  return new_node;
-}
-
-/* Split a node into 2: one that matches the greatest common prefix with addr
- * and one that does not. */
-static void trie_split (struct trie_node *this, const u32 *addr)
-{
-  struct trie_node *new_node;
-  u32 new_mask[4] = {0,0,0,0};
-  u8 i;
-  /* Calculate the mask of the common prefix */
-  for (i=0; i < 4; i++) {
-    new_mask[i] = common_mask(this->addr[i], addr[i]);
-    if (new_mask[i] < 0xffffffff) {
-      break;
+#endif
+    else {
+        return 0;
     }
-  }
-  /* Make a copy of this node to continue matching what it has been */
-  new_node = new_trie_node(this->addr, this->mask);
-  new_node->next_bit_one = this->next_bit_one;
-  new_node->next_bit_zero = this->next_bit_zero;
-  /* Adjust this node to the smaller mask */
-  for (i=0; i < 4; i++) {
-    this->mask[i] = new_mask[i];
-  }
-  /* Put the new node on the appropriate branch */
-  if (addr_next_bit_is_one(this->mask, this->addr)) {
-    this->next_bit_one = new_node;
-    this->next_bit_zero = NULL;
-  }
-  else {
-    this->next_bit_zero = new_node;
-    this->next_bit_one = NULL;
-  }
+    return 1;
 }
 
-/* Helper for address insertion */
-static void _trie_insert (struct trie_node *this, const u32 *addr, const u32 *mask)
+/* Appends the range of addresses that share the first bits bits of the
+   address in sa. A negative bits means the whole address. */
+static int add_prefix_range(struct addrset *set, const struct sockaddr *sa, int bits)
 {
-  u8 i;
-  while (this != NULL && this != TRIE_NODE_TRUE) {
-    if (addr_matches(this->mask, this->addr, addr)) {
-      if (1 & this->mask[3]) {
-        /* 1. end of address: duplicate. return; */
-        return;
-      }
+    struct addr128 addr;
+    struct addr_range *r;
+    u64 himask, lomask;
+
+    if (!sockaddr_to_addr128(sa, &addr)) {
+        log_debug("Unknown address family %u, address not inserted.\n", sa->sa_family);
+        return 0;
     }
-    else {
-      /* Split the netmask to ensure a match */
-      trie_split(this, addr);
+    if (bits < 0)
+        bits = 128;
+    else if (sa->sa_family == AF_INET)
+        bits += 96;
+    if (bits > 128) {
+        log_debug("Bad netmask length %d for address family %u, address not inserted.\n", bits, sa->sa_family);
+        return 0;
     }
 
-    for (i=0; i < 4; i++) {
-      if (this->mask[i] > mask[i]) {
-        /* broader mask, truncate this one */
-        this->mask[i] = mask[i];
-        for (; i < 4; i++) {
-          this->mask[i] = 0;
-        }
-        /* The longer mask is superseded. Delete following nodes. */
-        trie_free(this->next_bit_one);
-        trie_free(this->next_bit_zero);
-        /* Anything below here will always match. */
-        this->next_bit_one = this->next_bit_zero = TRIE_NODE_TRUE;
-        return;
-      }
-    }
+    /* The host bits of each half. */
+    himask = bits >= 64 ? 0 : bits == 0 ? ~(u64) 0 : ~(u64) 0 >> bits;
+    lomask = bits >= 128 ? 0 : bits <= 64 ? ~(u64) 0 : ~(u64) 0 >> (bits - 64);
 
-    if (addr_next_bit_is_one(this->mask, addr)) {
-      /* next bit is one: insert on the one branch */
-      if (this->next_bit_one == NULL) {
-        /* Previously unmatching branch, always the case when splitting */
-        this->next_bit_one = new_trie_node(addr, mask);
-        return;
-      }
-      else {
-        this = this->next_bit_one;
-      }
-    }
-    else {
-      /* next bit is zero: insert on the zero branch */
-      if (this->next_bit_zero == NULL) {
-        /* Previously unmatching branch, always the case when splitting */
-        this->next_bit_zero = new_trie_node(addr, mask);
-        return;
-      }
-      else {
-        this = this->next_bit_zero;
-      }
+    if (set->nranges == set->ranges_alloc) {
+        set->ranges_alloc = set->ranges_alloc == 0 ? 64 : set->ranges_alloc * 2;
+        set->ranges = (struct addr_range *) safe_realloc(set->ranges,
+            set->ranges_alloc * sizeof(*set->ranges));
     }
-  }
-}
+    r = &set->ranges[set->nranges++];
+    r->first.hi = addr.hi & ~himask;
+    r->first.lo = addr.lo & ~lomask;
+    r->last.hi = addr.hi | himask;
+    r->last.lo = addr.lo | lomask;
+    set->ranges_merged = 0;
 
-/* Helper function to turn a sockaddr into an array of u32, used internally */
-static int sockaddr_to_addr(const struct sockaddr *sa, u32 *addr)
-{
-  if (sa->sa_family == AF_INET) {
-    /* IPv4-mapped IPv6 address */
-    addr[0] = addr[1] = 0;
-    addr[2] = 0xffff;
-    addr[3] = ntohl(((struct sockaddr_in *) sa)->sin_addr.s_addr);
-  }
-#ifdef HAVE_IPV6
-  else if (sa->sa_family == AF_INET6) {
-    u8 i;
-    unsigned char *addr6 = ((struct sockaddr_in6 *) sa)->sin6_addr.s6_addr;
-    for (i=0; i < 4; i++) {
-      addr[i] = (addr6[i*4] << 24) + (addr6[i*4+1] << 16) + (addr6[i*4+2] << 8) + addr6[i*4+3];
-    }
-  }
-#endif
-  else {
-    return 0;
-  }
-  return 1;
+    return 1;
 }
 
-static int sockaddr_to_mask (const struct sockaddr *sa, int bits, u32 *mask)
+static int addr_range_cmp(const void *a, const void *b)
 {
-  int i, k;
-  if (bits >= 0) {
-    if (sa->sa_family == AF_INET) {
-      bits += 96;
-    }
-#ifdef HAVE_IPV6
-    else if (sa->sa_family == AF_INET6) {
-      ; /* do nothing */
-    }
-#endif
-    else {
-      return 0;
-    }
-  }
-  else
-    bits = 128;
-  k = bits / 32;
-  for (i=0; i < 4; i++) {
-    if (i < k) {
-      mask[i] = 0xffffffff;
-    }
-    else if (i > k) {
-      mask[i] = 0;
-    }
-    else {
-      mask[i] = 0xfffffffe << (31 - bits % 32);
-    }
-  }
-  return 1;
+    return addr128_cmp(&((const struct addr_range *) a)->first,
+                       &((const struct addr_range *) b)->first);
 }
 
-/* Insert a sockaddr into the trie */
-static void trie_insert (struct trie_node *this, const struct sockaddr *sa, int bits)
+/* Sorts the ranges and combines those that overlap or touch. */
+static void merge_ranges(struct addrset *set)
 {
-  u32 addr[4] = {0};
-  u32 mask[4] = {0};
-  if (!sockaddr_to_addr(sa, addr)) {
-    log_debug("Unknown address family %u, address not inserted.\n", sa->sa_family);
-    return;
-  }
-  if (!sockaddr_to_mask(sa, bits, mask)) {
-    log_debug("Bad netmask length %d for address family %u, address not inserted.\n", bits, sa->sa_family);
-    return;
-  }
-  /* First node doesn't have a mask or address of its own; we have to check the
-   * first bit manually. */
-  if (0x80000000 & addr[0]) {
-    /* First bit is 1, so insert on ones branch */
-    if (this->next_bit_one == NULL) {
-      /* Empty branch, just add it. */
-      this->next_bit_one = new_trie_node(addr, mask);
-      return;
-    }
-    _trie_insert(this->next_bit_one, addr, mask);
-  }
-  else {
-    /* First bit is 0, so insert on zeros branch */
-    if (this->next_bit_zero == NULL) {
-      /* Empty branch, just add it. */
-      this->next_bit_zero = new_trie_node(addr, mask);
-      return;
-    }
-    _trie_insert(this->next_bit_zero, addr, mask);
-  }
-}
+    struct addr_range *prev, *r, *end;
+    struct addr128 next;
 
-/* Helper for matching addresses */
-static int _trie_match (const struct trie_node *this, const u32 *addr)
-{
-  while (this != TRIE_NODE_TRUE && this != NULL
-    && addr_matches(this->mask, this->addr, addr)) {
-    if (1 & this->mask[3]) {
-      /* We've matched all possible bits! Yay! */
-      return 1;
-    }
-    else if (addr_next_bit_is_one(this->mask, addr)) {
-      this = this->next_bit_one;
-    }
-    else {
-      this = this->next_bit_zero;
+    if (set->ranges_merged)
+        return;
+    qsort(set->ranges, set->nranges, sizeof(*set->ranges), addr_range_cmp);
+
+    prev = NULL;
+    end = set->ranges + set->nranges;
+    for (r = set->ranges; r < end; r++) {
+        if (prev != NULL) {
+            /* The address after prev->last, which can't overflow unless prev
+               reaches the end of the address space and covers r anyway. */
+            next.lo = prev->last.lo + 1;
+            next.hi = prev->last.hi + (next.lo == 0);
+            if ((next.hi == 0 && next.lo == 0) || addr128_cmp(&r->first, &next) <= 0) {
+                if (!(next.hi == 0 && next.lo == 0) && addr128_cmp(&r->last, &prev->last) > 0)
+                    prev->last = r->last;
+                continue;
+            }
+        }
+        prev = prev == NULL ? set->ranges : prev + 1;
+        *prev = *r;
     }
-  }
-  if (this == TRIE_NODE_TRUE) {
-    return 1;
-  }
-  return 0;
+    set->nranges = prev == NULL ? 0 : prev - set->ranges + 1;
+    set->ranges_merged = 1;
 }
 
-static int trie_match (const struct trie_node *this, const struct sockaddr *sa)
+/* Returns the range that contains addr, or NULL. */
+static const struct addr_range *find_range(const struct addrset *set,
+                                           const struct addr128 *addr)
 {
-  u32 addr[4] = {0};
-  if (!sockaddr_to_addr(sa, addr)) {
-    log_debug("Unknown address family %u, cannot match.\n", sa->sa_family);
-    return 0;
-  }
-  /* Manually check first bit to decide which branch to match against */
-  if (0x80000000 & addr[0]) {
-    return _trie_match(this->next_bit_one, addr);
-  }
-  else {
-    return _trie_match(this->next_bit_zero, addr);
-  }
-  return 0;
+    size_t lo, hi, mid;
+
+    /* Merging once after the set is loaded doesn't change its contents. */
+    merge_ranges((struct addrset *) set);
+
+    /* Find the last range that starts at or before addr. */
+    lo = 0;
+    hi = set->nranges;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (addr128_cmp(&set->ranges[mid].first, addr) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || addr128_cmp(addr, &set->ranges[lo - 1].last) > 0)
+        return NULL;
+    return &set->ranges[lo - 1];
 }
 
 /* A debugging function to print out the contents of an addrset_elem. For IPv4
@@ -532,10 +310,17 @@ static void addrset_elem_print(FILE *fp, const struct addrset_elem *elem)
 void addrset_print(FILE *fp, const struct addrset *set)
 {
   const struct addrset_elem *elem;
+  size_t i;
   for (elem = set->head; elem != NULL; elem = elem->next) {
     fprintf(fp, "addrset_elem: %p\n", elem);
     addrset_elem_print(fp, elem);
   }
+  merge_ranges((struct addrset *) set);
+  for (i = 0; i < set->nranges; i++) {
+    fprintf(fp, "addr_range: %016llX%016llX-%016llX%016llX\n",
+      (unsigned long long) set->ranges[i].first.hi, (unsigned long long) set->ranges[i].first.lo,
+      (unsigned long long) set->ranges[i].last.hi, (unsigned long long) set->ranges[i].last.lo);
+  }
 }
 
 /* This is a wrapper around getaddrinfo that automatically handles hints for
@@ -630,10 +415,41 @@ int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns)
         }
     }
 
+    /* Plain IP addresses are by far the most common in long lists, so try
+       inet_pton before the more general getaddrinfo. */
+    if (strchr(local_spec, '%') == NULL) {
+      struct sockaddr_storage ss;
+      memset(&ss, 0, sizeof(ss));
+      if (inet_pton(AF_INET, local_spec, &((struct sockaddr_in *) &ss)->sin_addr) == 1) {
+        ss.ss_family = AF_INET;
+        if (netmask_bits > 32) {
+          log_user("Illegal netmask in \"%s\". Must be smaller than address bit length.\n", spec);
+          free(local_spec);
+          return 0;
+        }
+      }
+#ifdef HAVE_IPV6
+      else if (inet_pton(AF_INET6, local_spec, &((struct sockaddr_in6 *) &ss)->sin6_addr) == 1) {
+        ss.ss_family = AF_INET6;
+        if (netmask_bits > 128) {
+          log_user("Illegal netmask in \"%s\". Must be smaller than address bit length.\n", spec);
+          free(local_spec);
+          return 0;
+        }
+      }
+#endif
+      if (ss.ss_family != 0) {
+        add_prefix_range(set, (struct sockaddr *) &ss, netmask_bits);
+        log_debug("Add IP %s/%ld to addrset.\n", local_spec, netmask_bits);
+        free(local_spec);
+        return 1;
+      }
+    }
+
     /* See if it's a plain IP address */
     rc = resolve_name(local_spec, &addrs, af, 0);
     if (rc == 0 && addrs != NULL) {
-      /* Add all addresses to the trie */
+      /* Add all addresses to the set */
       for (addr = addrs; addr != NULL; addr = addr->ai_next) {
         char addr_string[128];
         if ((addr->ai_family == AF_INET && netmask_bits > 32)
@@ -647,8 +463,8 @@ int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns)
           return 0;
         }
         address_to_string(addr->ai_addr, addr->ai_addrlen, addr_string, sizeof(addr_string));
-        trie_insert(set->trie, addr->ai_addr, netmask_bits);
-        log_debug("Add IP %s/%d to addrset (trie).\n", addr_string, netmask_bits);
+        add_prefix_range(set, addr->ai_addr, netmask_bits);
+        log_debug("Add IP %s/%ld to addrset.\n", addr_string, netmask_bits);
       }
       free(local_spec);
       freeaddrinfo(addrs);
@@ -706,7 +522,7 @@ int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns)
                 freeaddrinfo(addrs);
                 return 0;
             }
-            log_debug("Add IPv4 %s/%ld to addrset (trie).\n", addr_string, netmask_bits > 0 ? netmask_bits : 32);
+            log_debug("Add IPv4 %s/%ld to addrset.\n", addr_string, netmask_bits > 0 ? netmask_bits : 32);
 
 #ifdef HAVE_IPV6
         } else if (addr->ai_family == AF_INET6) {
@@ -715,14 +531,14 @@ int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns)
                 freeaddrinfo(addrs);
                 return 0;
             }
-            log_debug("Add IPv6 %s/%ld to addrset (trie).\n", addr_string, netmask_bits > 0 ? netmask_bits : 128);
+            log_debug("Add IPv6 %s/%ld to addrset.\n", addr_string, netmask_bits > 0 ? netmask_bits : 128);
 #endif
         } else {
             log_debug("ignoring address %s for %s. Family %d socktype %d protocol %d.\n", addr_string, spec, addr->ai_family, addr->ai_socktype, addr->ai_protocol);
             continue;
         }
 
-        trie_insert(set->trie, addr->ai_addr, netmask_bits);
+        add_prefix_range(set, addr->ai_addr, netmask_bits);
     }
 
     if (addrs != NULL)
@@ -923,8 +739,10 @@ int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
 {
     struct addrset_elem *elem;
 
-    /* First check the trie. */
-    if (trie_match(set->trie, sa))
+    struct addr128 addr;
+
+    /* First check the ranges. */
+    if (sockaddr_to_addr128(sa, &addr) && find_range(set, &addr) != NULL)
       return 1;
 
     /* If that didn't match, check the rest of the addrset_elem in order */
@@ -937,3 +755,48 @@ int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
 
     return 0;
 }
+
+/* Find the end of the run of addresses in the set, built from addresses and
+   CIDR netmasks, that contains sa. On return of 1, end holds the last address
+   of the run, in the address family of sa. Returns 0 if sa is not in such a
+   run; IPv4 octet ranges like 192.168.1-5.* are not considered. */
+int addrset_range_end(const struct addrset *set, const struct sockaddr *sa,
+    struct sockaddr_storage *end)
+{
+    const struct addr_range *r;
+    struct addr128 addr;
+
+    if (!sockaddr_to_addr128(sa, &addr))
+        return 0;
+    r = find_range(set, &addr);
+    if (r == NULL)
+        return 0;
+
+    memset(end, 0, sizeof(*end));
+    if (sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) end;
+        u32 last;
+
+        /* A run may go on past the IPv4-mapped block. */
+        if (r->last.hi != 0 || (r->last.lo >> 32) != 0xffff)
+            last = 0xffffffff;
+        else
+            last = (u32) r->last.lo;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(last);
+    }
+#ifdef HAVE_IPV6
+    else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) end;
+        int i;
+
+        sin6->sin6_family = AF_INET6;
+        for (i = 0; i < 8; i++) {
+            sin6->sin6_addr.s6_addr[i] = (r->last.hi >> (56 - 8 * i)) & 0xff;
+            sin6->sin6_addr.s6_addr[i + 8] = (r->last.lo >> (56 - 8 * i)) & 0xff;
+        }
+    }
+#endif
+
+    return 1;
+}
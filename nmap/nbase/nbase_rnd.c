@@ -183,6 +183,15 @@ void nrand_init(nrand_h *r) {
 int get_random_bytes(void *buf, int numbytes) {
   static nrand_h state;
   static int state_init = 0;
+#if defined(__GNUC__)
+  /* Nmap's ultra_scan worker threads all draw from this one stream.
+     Unsynchronized swaps would slowly wreck the ARC4 permutation, so take a
+     spinlock; the critical section is only a few byte operations. */
+  static volatile int lock = 0;
+
+  while (__sync_lock_test_and_set(&lock, 1))
+    ;
+#endif
 
   /* Initialize if we need to */
   if (!state_init) {
@@ -193,6 +202,10 @@ int get_random_bytes(void *buf, int numbytes) {
   /* Now fill our buffer */
   nrand_get(&state, buf, numbytes);
 
+#if defined(__GNUC__)
+  __sync_lock_release(&lock);
+#endif
+
   return 0;
 }
 
@@ -246,6 +246,46 @@ test_addrset "1:2::0003/0" "1:2::3 1:2::0 1:2::ff 1:2::1ff 1:3::3 ff::00" <<EOF
 ff::00
 EOF
 
+# Overlapping, nested, and adjacent netmasks.
+test_addrset "10.0.0.0/24 10.0.0.128/25 10.0.0.7 10.0.1.0/24 10.0.3.0/24 10.0.2.255" \
+"10.0.0.0 10.0.0.200 10.0.1.255 10.0.2.255 10.0.3.0" <<EOF
+9.255.255.255
+10.0.0.0
+10.0.0.200
+10.0.1.255
+10.0.2.0
+10.0.2.255
+10.0.3.0
+10.0.4.0
+EOF
+
+# A netmask given after a narrower one within it.
+test_addrset "10.64.5.0/24 10.0.0.0/9" "10.64.0.0 10.64.5.1 10.127.255.255" <<EOF
+10.64.0.0
+10.64.5.1
+10.127.255.255
+10.128.0.0
+EOF
+
+# Netmasks at the ends of the address space.
+test_addrset "255.255.255.255 0.0.0.0/31 ffff::/16" "0.0.0.1 255.255.255.255 ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff" <<EOF
+0.0.0.1
+0.0.0.2
+255.255.255.254
+255.255.255.255
+fffe:ffff:ffff:ffff:ffff:ffff:ffff:ffff
+ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff
+EOF
+
+# Many specifications.
+test_addrset "$(for a in `seq 0 255`; do echo 172.16.$a.$a/31; done)" "172.16.7.6 172.16.7.7 172.16.200.200" <<EOF
+172.16.7.6
+172.16.7.7
+172.16.7.8
+172.16.200.200
+172.16.200.202
+EOF
+
 # Name lookup.
 test_addrset "scanme.nmap.org" "scanme.nmap.org" <<EOF
 1:2::3:4
@@ -304,7 +304,7 @@ class my_uninstall(distutils.cmd.Command):
                     log.error(str(e))
 
 
-distutils.core.setup(name=u"ndiff", scripts=[u"scripts/ndiff"],
+distutils.core.setup(name=u"ndiff", scripts=[u"scripts/ndiff", u"scripts/nmap-merge-shards"],
     py_modules=[u"ndiff"],
     data_files=[(u"share/man/man1", [u"docs/ndiff.1"])],
     cmdclass={
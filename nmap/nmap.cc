@@ -72,6 +72,9 @@
 #include "nmap.h"
 #include "osscan.h"
 #include "scan_engine.h"
+#include "scan_pipeline.h"
+#include "stateless_scan.h"
+#include "checkpoint.h"
 #include "FPEngine.h"
 #include "idle_scan.h"
 #include "droppriv.h"
@@ -138,6 +141,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <set>
 
 /* global options */
 extern char *optarg;
@@ -191,6 +195,32 @@ static int parse_scanflags(char *arg) {
   return flagval;
 }
 
+/* Parses a comma-separated list of up to n non-negative integers into vals.
+   If spread is true, a single number is used for every element. */
+static void parse_int_list(const char *arg, int *vals, int n,
+                           const char *option, bool spread) {
+  const char *p = arg;
+  char *end;
+  long l;
+  int i = 0;
+
+  for (;;) {
+    if (i >= n)
+      fatal("Too many numbers given to %s (at most %d)", option, n);
+    l = strtol(p, &end, 10);
+    if (end == p || l < 0 || l > INT_MAX || (*end != ',' && *end != '\0'))
+      fatal("Bad argument to %s: %s", option, arg);
+    vals[i++] = (int) l;
+    if (*end == '\0')
+      break;
+    p = end + 1;
+  }
+  if (spread && i == 1) {
+    for (; i < n; i++)
+      vals[i] = vals[0];
+  }
+}
+
 static void printusage() {
 
   printf("%s %s ( %s )\n"
@@ -202,6 +232,7 @@ static void printusage() {
          "  -iR <num hosts>: Choose random targets\n"
          "  --exclude <host1[,host2][,host3],...>: Exclude hosts/networks\n"
          "  --excludefile <exclude_file>: Exclude list from file\n"
+         "  --shard <i>/<N>: Scan only slice i of N of the targets\n"
          "HOST DISCOVERY:\n"
          "  -sL: List Scan - simply list targets to scan\n"
          "  -sn: Ping Scan - disable port scan\n"
@@ -222,6 +253,7 @@ static void printusage() {
          "  -sY/sZ: SCTP INIT/COOKIE-ECHO scans\n"
          "  -sO: IP protocol scan\n"
          "  -b <FTP relay host>: FTP bounce scan\n"
+         "  --stateless: Sweep -sS over all targets and ports without per-probe state\n"
          "PORT SPECIFICATION AND SCAN ORDER:\n"
          "  -p <port ranges>: Only scan specified ports\n"
          "    Ex: -p22; -p1-65535; -p U:53,111,137,T:21-25,80,139,8080,S:9\n"
@@ -236,6 +268,7 @@ static void printusage() {
          "  --version-light: Limit to most likely probes (intensity 2)\n"
          "  --version-all: Try every single probe (intensity 9)\n"
          "  --version-trace: Show detailed version scan activity (for debugging)\n"
+         "  --version-threads <number>: Match service responses in <number> threads\n"
 #ifndef NOLUA
          "SCRIPT SCAN:\n"
          "  -sC: equivalent to --script=default\n"
@@ -258,6 +291,7 @@ static void printusage() {
          "  's' (seconds), 'm' (minutes), or 'h' (hours) to the value (e.g. 30m).\n"
          "  -T<0-5>: Set timing template (higher is faster)\n"
          "  --min-hostgroup/max-hostgroup <size>: Parallel host scan group sizes\n"
+         "  --rolling-hostgroup: Admit new hosts to a port scan as others finish\n"
          "  --min-parallelism/max-parallelism <numprobes>: Probe parallelization\n"
          "  --min-rtt-timeout/max-rtt-timeout/initial-rtt-timeout <time>: Specifies\n"
          "      probe round trip time.\n"
@@ -266,6 +300,10 @@ static void printusage() {
          "  --scan-delay/--max-scan-delay <time>: Adjust delay between probes\n"
          "  --min-rate <number>: Send packets no slower than <number> per second\n"
          "  --max-rate <number>: Send packets no faster than <number> per second\n"
+         "  --scan-threads <number>: Split raw port scans of a host group across threads\n"
+         "  --pipeline-groups <n>[,<n>]: Overlap phases of successive host groups,\n"
+         "      queuing up to <n> groups for version/OS detection and for scripts\n"
+         "  --pipeline-sockets <scan>,<version>,<script>: Socket budget of each stage\n"
          "FIREWALL/IDS EVASION AND SPOOFING:\n"
          "  -f; --mtu <val>: fragment packets (optionally w/given MTU)\n"
          "  -D <decoy1,decoy2[,ME],...>: Cloak a scan with decoys\n"
@@ -292,6 +330,8 @@ static void printusage() {
          "  --iflist: Print host interfaces and routes (for debugging)\n"
          "  --append-output: Append to rather than clobber specified output files\n"
          "  --resume <filename>: Resume an aborted scan\n"
+         "  --checkpoint <filename>: Save the progress of the scan for --resume\n"
+         "  --checkpoint-interval <time>: Save it this often (default 60s)\n"
          "  --stylesheet <path/URL>: XSL stylesheet to transform XML output to HTML\n"
          "  --webxml: Reference stylesheet from Nmap.Org for more portable XML\n"
          "  --no-stylesheet: Prevent associating of XSL stylesheet w/XML output\n"
@@ -537,6 +577,8 @@ void parse_options(int argc, char **argv) {
     {"exclude", required_argument, 0, 0},
     {"max-hostgroup", required_argument, 0, 0},
     {"min-hostgroup", required_argument, 0, 0},
+    {"rolling-hostgroup", no_argument, 0, 0},
+    {"stateless", no_argument, 0, 0},
     {"open", no_argument, 0, 0},
     {"scanflags", required_argument, 0, 0},
     {"defeat-rst-ratelimit", no_argument, 0, 0},
@@ -557,6 +599,8 @@ void parse_options(int argc, char **argv) {
     {"sI", required_argument, 0, 0},
     {"source-port", required_argument, 0, 'g'},
     {"randomize-hosts", no_argument, 0, 0},
+    {"randomize-seed", required_argument, 0, 0},
+    {"shard", required_argument, 0, 0},
     {"nsock-engine", required_argument, 0, 0},
     {"proxies", required_argument, 0, 0},
     {"proxy", required_argument, 0, 0},
@@ -592,6 +636,7 @@ void parse_options(int argc, char **argv) {
     {"version-intensity", required_argument, 0, 0},
     {"version-light", no_argument, 0, 0},
     {"version-all", no_argument, 0, 0},
+    {"version-threads", required_argument, 0, 0},
     {"system-dns", no_argument, 0, 0},
     {"resolve-all", no_argument, 0, 0},
     {"log-errors", no_argument, 0, 0},
@@ -613,11 +658,16 @@ void parse_options(int argc, char **argv) {
     {"ip-options", required_argument, 0, 0},
     {"min-rate", required_argument, 0, 0},
     {"max-rate", required_argument, 0, 0},
+    {"scan-threads", required_argument, 0, 0},
+    {"pipeline-groups", required_argument, 0, 0},
+    {"pipeline-sockets", required_argument, 0, 0},
     {"adler32", no_argument, 0, 0},
     {"stats-every", required_argument, 0, 0},
     {"disable-arp-ping", no_argument, 0, 0},
     {"route-dst", required_argument, 0, 0},
     {"resume", required_argument, 0, 0},
+    {"checkpoint", required_argument, 0, 0},
+    {"checkpoint-interval", required_argument, 0, 0},
     {0, 0, 0, 0}
   };
 
@@ -686,6 +736,10 @@ void parse_options(int argc, char **argv) {
           o.setMinHostGroupSz(atoi(optarg));
           if (atoi(optarg) > 100)
             error("Warning: You specified a highly aggressive --min-hostgroup.");
+        } else if (strcmp(long_options[option_index].name, "rolling-hostgroup") == 0) {
+          o.rolling_hostgroup = true;
+        } else if (strcmp(long_options[option_index].name, "stateless") == 0) {
+          o.stateless_sweep = true;
         } else if (strcmp(long_options[option_index].name, "open") == 0) {
           o.setOpenOnly(true);
           // If they only want open, don't spend extra time (potentially) distinguishing closed from filtered.
@@ -748,6 +802,10 @@ void parse_options(int argc, char **argv) {
           o.version_intensity = 2;
         } else if (strcmp(long_options[option_index].name, "version-all") == 0) {
           o.version_intensity = 9;
+        } else if (strcmp(long_options[option_index].name, "version-threads") == 0) {
+          o.version_threads = atoi(optarg);
+          if (o.version_threads < 1)
+            fatal("Argument to --version-threads must be at least 1");
         } else if (strcmp(long_options[option_index].name, "scan-delay") == 0) {
           l = tval2msecs(optarg);
           if (l < 0)
@@ -774,6 +832,19 @@ void parse_options(int argc, char **argv) {
                    || strcmp(long_options[option_index].name, "rH") == 0) {
           o.randomize_hosts = true;
           o.ping_group_sz = PING_GROUP_SZ * 4;
+        } else if (strcmp(long_options[option_index].name, "randomize-seed") == 0) {
+          o.randomize_seed = strtoull(optarg, &endptr, 10);
+          if (*optarg == '\0' || *optarg == '-' || *endptr != '\0')
+            fatal("--randomize-seed argument must be a non-negative integer");
+          o.randomize_seed_set = true;
+        } else if (strcmp(long_options[option_index].name, "shard") == 0) {
+          unsigned int shard, nshards;
+          char c;
+          if (sscanf(optarg, "%u/%u%c", &shard, &nshards, &c) != 2
+              || shard < 1 || shard > nshards)
+            fatal("--shard argument must be <i>/<N> with 1 <= i <= N, for example 2/8");
+          o.shard = shard - 1;
+          o.nshards = nshards;
         } else if (strcmp(long_options[option_index].name, "nsock-engine") == 0) {
           if (nsock_set_default_engine(optarg) < 0)
             fatal("Unknown or non-available engine: %s", optarg);
@@ -961,6 +1032,16 @@ void parse_options(int argc, char **argv) {
         } else if (strcmp(long_options[option_index].name, "max-rate") == 0) {
           if (sscanf(optarg, "%f", &o.max_packet_send_rate) != 1 || o.max_packet_send_rate <= 0.0)
             fatal("Argument to --max-rate must be a positive floating-point number");
+        } else if (strcmp(long_options[option_index].name, "scan-threads") == 0) {
+          o.scan_threads = atoi(optarg);
+          if (o.scan_threads < 1)
+            fatal("Argument to --scan-threads must be at least 1");
+        } else if (strcmp(long_options[option_index].name, "pipeline-groups") == 0) {
+          parse_int_list(optarg, o.pipeline_groups, PIPELINE_NUM_STAGES - 1,
+                         "--pipeline-groups", true);
+        } else if (strcmp(long_options[option_index].name, "pipeline-sockets") == 0) {
+          parse_int_list(optarg, o.pipeline_sockets, PIPELINE_NUM_STAGES,
+                         "--pipeline-sockets", false);
         } else if (strcmp(long_options[option_index].name, "adler32") == 0) {
           o.adler32 = true;
         } else if (strcmp(long_options[option_index].name, "stats-every") == 0) {
@@ -976,6 +1057,14 @@ void parse_options(int argc, char **argv) {
           route_dst_hosts.push_back(optarg);
         } else if (strcmp(long_options[option_index].name, "resume") == 0) {
           fatal("Cannot use --resume with other options. Usage: nmap --resume <filename>");
+        } else if (strcmp(long_options[option_index].name, "checkpoint") == 0) {
+          free(o.checkpoint_file);
+          o.checkpoint_file = strdup(optarg);
+        } else if (strcmp(long_options[option_index].name, "checkpoint-interval") == 0) {
+          l = tval2msecs(optarg);
+          if (l <= 0)
+            fatal("Bogus --checkpoint-interval argument specified");
+          o.checkpoint_interval = l;
         } else {
           fatal("Unknown long option (%s) given@#!$#$", long_options[option_index].name);
         }
@@ -1762,9 +1851,469 @@ void nmap_free_mem() {
   free_services();
   AllProbes::service_scan_free();
   traceroute_hop_cache_clear();
+  route_cache_free();
   nsock_set_default_engine(NULL);
 }
 
+/* Gets the next host that should go into a scan group with the hosts in
+   group, doing host discovery as needed. Hosts that are down, or that need no
+   scanning past discovery, are printed and freed here. pending is the number
+   of hosts already taken out for scanning, for the --max-scan limit. Returns
+   NULL when there are no more targets or when the next one has to go in a new
+   group; in the latter case it is returned to hstate for next time. */
+static Target *next_scan_target(HostGroupState *hstate,
+                                struct addrset *exclude_group,
+                                struct scan_lists *ports,
+                                Target **group, unsigned int group_sz,
+                                unsigned int pending) {
+  static int sourceaddrwarning = 0; /* Have we warned them yet about
+                                       unguessable source addresses? */
+  char myname[FQDN_LEN + 1];
+  struct sockaddr_storage ss;
+  size_t sslen;
+  Target *currenths;
+
+  for (;;) {
+    o.current_scantype = HOST_DISCOVERY;
+    currenths = nexthost(hstate, exclude_group, ports, o.pingtype);
+    if (!currenths)
+      return NULL;
+
+    if (currenths->flags & HOST_UP && !o.listscan)
+      o.numhosts_up++;
+
+    if ((o.noportscan && !o.traceroute
+#ifndef NOLUA
+         && !o.script
+#endif
+        ) || o.listscan) {
+      /* We're done with the hosts */
+      output_lock();
+      if (currenths->flags & HOST_UP || (o.verbose && !o.openOnly())) {
+        xml_start_tag("host");
+        write_host_header(currenths);
+        printmacinfo(currenths);
+        //  if (currenths->flags & HOST_UP)
+        //  log_write(LOG_PLAIN,"\n");
+        printtimes(currenths);
+        xml_end_tag();
+        xml_newline();
+        log_flush_all();
+      }
+      o.numhosts_scanned++;
+      output_unlock();
+      delete currenths;
+      if (!o.max_ips_to_scan || o.max_ips_to_scan > o.numhosts_scanned + pending)
+        continue;
+      else
+        return NULL;
+    }
+
+    if (o.spoofsource) {
+      o.SourceSockAddr(&ss, &sslen);
+      currenths->setSourceSockAddr(&ss, sslen);
+    }
+
+    /* I used to check that !currenths->weird_responses, but in some
+       rare cases, such IPs CAN be port successfully scanned and even
+       connected to */
+    if (!(currenths->flags & HOST_UP)) {
+      output_lock();
+      if (o.verbose && (!o.openOnly() || currenths->ports.hasOpenPorts())) {
+        xml_start_tag("host");
+        write_host_header(currenths);
+        xml_end_tag();
+        xml_newline();
+      }
+      o.numhosts_scanned++;
+      output_unlock();
+      delete currenths;
+      if (!o.max_ips_to_scan || o.max_ips_to_scan > o.numhosts_scanned + pending)
+        continue;
+      else
+        return NULL;
+    }
+
+    if (o.RawScan()) {
+      if (currenths->SourceSockAddr(NULL, NULL) != 0) {
+        if (o.SourceSockAddr(&ss, &sslen) == 0) {
+          currenths->setSourceSockAddr(&ss, sslen);
+        } else {
+          if (gethostname(myname, FQDN_LEN) ||
+              resolve(myname, 0, &ss, &sslen, o.af()) != 0)
+            fatal("Cannot get hostname!  Try using -S <my_IP_address> or -e <interface to scan through>\n");
+
+          o.setSourceSockAddr(&ss, sslen);
+          currenths->setSourceSockAddr(&ss, sslen);
+          if (! sourceaddrwarning) {
+            error("WARNING: We could not determine for sure which interface to use, so we are guessing %s .  If this is wrong, use -S <my_IP_address>.",
+                  inet_socktop(&ss));
+            sourceaddrwarning = 1;
+          }
+        }
+      }
+
+      if (!currenths->deviceName())
+        fatal("Do not have appropriate device name for target");
+
+      /* Hosts in a group need to be somewhat homogeneous. Put this host in
+         the next group if necessary. See target_needs_new_hostgroup for the
+         details of when we need to split. */
+      if (group_sz > 0 && target_needs_new_hostgroup(group, group_sz, currenths)) {
+        returnhost(hstate);
+        o.numhosts_up--;
+        return NULL;
+      }
+    }
+    return currenths;
+  }
+}
+
+/* Prints the results for one host once it is done with all scan phases. */
+static void print_host_results(Target *currenths) {
+  char hostname[FQDN_LEN + 1] = "";
+
+  if (currenths->timedOut(NULL)) {
+    xml_open_start_tag("host");
+    xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+    xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+    xml_close_start_tag();
+    write_host_header(currenths);
+    xml_end_tag(); /* host */
+    xml_newline();
+    log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
+              currenths->NameIP(hostname, sizeof(hostname)));
+    log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
+              currenths->targetipstr(), currenths->HostName());
+  } else {
+    /* --open means don't show any hosts without open ports. */
+    if (o.openOnly() && !currenths->ports.hasOpenPorts())
+      return;
+
+    xml_open_start_tag("host");
+    xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+    xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+    xml_close_start_tag();
+    write_host_header(currenths);
+    printportoutput(currenths, &currenths->ports);
+    printmacinfo(currenths);
+    printosscanoutput(currenths);
+    printserviceinfooutput(currenths);
+#ifndef NOLUA
+    printhostscriptresults(currenths);
+#endif
+    if (o.traceroute)
+      printtraceroute(currenths);
+    printtimes(currenths);
+    log_write(LOG_PLAIN | LOG_MACHINE, "\n");
+    xml_end_tag(); /* host */
+    xml_newline();
+  }
+}
+
+/* Runs the port scans, which are the first stage of a pipelined scan. */
+static void port_scan_phase(std::vector<Target *> &Targets,
+                            struct scan_lists *ports) {
+  unsigned int targetno;
+
+  if (o.noportscan)
+    return;
+
+  // Ultra_scan sets o.scantype for us so we don't have to worry
+  if (o.synscan)
+    ultra_scan(Targets, ports, SYN_SCAN);
+
+  if (o.ackscan)
+    ultra_scan(Targets, ports, ACK_SCAN);
+
+  if (o.windowscan)
+    ultra_scan(Targets, ports, WINDOW_SCAN);
+
+  if (o.finscan)
+    ultra_scan(Targets, ports, FIN_SCAN);
+
+  if (o.xmasscan)
+    ultra_scan(Targets, ports, XMAS_SCAN);
+
+  if (o.nullscan)
+    ultra_scan(Targets, ports, NULL_SCAN);
+
+  if (o.maimonscan)
+    ultra_scan(Targets, ports, MAIMON_SCAN);
+
+  if (o.udpscan)
+    ultra_scan(Targets, ports, UDP_SCAN);
+
+  if (o.connectscan)
+    ultra_scan(Targets, ports, CONNECT_SCAN);
+
+  if (o.sctpinitscan)
+    ultra_scan(Targets, ports, SCTP_INIT_SCAN);
+
+  if (o.sctpcookieechoscan)
+    ultra_scan(Targets, ports, SCTP_COOKIE_ECHO_SCAN);
+
+  if (o.ipprotscan)
+    ultra_scan(Targets, ports, IPPROT_SCAN);
+
+  /* These lame functions can only handle one target at a time */
+  if (o.idlescan) {
+    for (targetno = 0; targetno < Targets.size(); targetno++) {
+      o.current_scantype = IDLE_SCAN;
+      keyWasPressed(); // Check if a status message should be printed
+      idle_scan(Targets[targetno], ports->tcp_ports,
+                ports->tcp_count, o.idleProxy, ports);
+    }
+  }
+  if (o.bouncescan) {
+    for (targetno = 0; targetno < Targets.size(); targetno++) {
+      o.current_scantype = BOUNCE_SCAN;
+      keyWasPressed(); // Check if a status message should be printed
+      if (ftp.sd <= 0)
+        ftp_anon_connect(&ftp);
+      if (ftp.sd > 0)
+        bounce_scan(Targets[targetno], ports->tcp_ports, ports->tcp_count, &ftp);
+    }
+  }
+}
+
+/* Version detection, OS detection and traceroute. */
+static void probe_phase(std::vector<Target *> &Targets) {
+  if (!o.noportscan && o.servicescan) {
+    if (!in_pipeline_stage())
+      o.current_scantype = SERVICE_SCAN;
+    service_scan(Targets);
+  }
+
+  if (o.osscan) {
+    OSScan os_engine;
+    os_engine.os_scan(Targets);
+  }
+
+  if (o.traceroute)
+    traceroute(Targets);
+}
+
+/* Runs the script scan, prints the results, and frees the Targets. */
+static void script_phase(std::vector<Target *> &Targets) {
+  unsigned int targetno;
+  Target *currenths;
+
+#ifndef NOLUA
+  if (o.script || o.scriptversion) {
+    script_scan(Targets, SCRIPT_SCAN);
+  }
+#endif
+
+  output_lock();
+  for (targetno = 0; targetno < Targets.size(); targetno++)
+    print_host_results(Targets[targetno]);
+  log_flush_all();
+
+  o.numhosts_scanned += Targets.size();
+  output_unlock();
+
+  /* Free all of the Targets */
+  while (!Targets.empty()) {
+    currenths = Targets.back();
+    delete currenths;
+    Targets.pop_back();
+  }
+}
+
+/* With --stateless: sweeps all the targets at once, then runs the later
+   phases over the hosts that answered, a host group at a time. */
+static void stateless_sweep_phase(HostGroupState *hstate,
+                                  const struct addrset *exclude_group,
+                                  struct scan_lists *ports) {
+  std::vector<Target *> responders, Targets;
+  unsigned int i, group_sz;
+  u64 nhosts;
+
+  nhosts = stateless_syn_sweep(hstate, exclude_group, ports, responders);
+  o.numhosts_up += responders.size();
+  /* Hosts that did not answer are done now; script_phase counts the rest. */
+  o.numhosts_scanned += (int) (nhosts - responders.size());
+
+  i = 0;
+  while (i < responders.size()) {
+    group_sz = determineScanGroupSize(o.numhosts_scanned, ports);
+    do {
+      Targets.push_back(responders[i++]);
+    } while (i < responders.size() && Targets.size() < group_sz
+             && !target_needs_new_hostgroup(&Targets[0], Targets.size(), responders[i]));
+
+    o.numhosts_scanning = Targets.size();
+    probe_phase(Targets);
+    script_phase(Targets);
+    o.numhosts_scanning = 0;
+  }
+}
+
+#if HAVE_PTHREAD
+/* Whether to run host groups through a ScanPipeline. Options that keep
+   shared state between phases (timing across calls, packet tracing with
+   its static buffers, or the -iR host count) run one group at a time. */
+static bool use_pipeline() {
+  return o.pipeline_groups[0] > 0 && !o.packetTrace() && o.debugging <= 1
+         && !o.scan_delay && !o.max_ips_to_scan;
+}
+
+/* The stages of a pipeline hold sockets at the same time, so unless the
+   port scan stage has a budget of its own it gets what the later stages
+   leave of the descriptor limit. */
+static void set_pipeline_socket_budgets() {
+  int probe, script, sd;
+
+  if (o.pipeline_sockets[PIPELINE_SCAN] > 0)
+    return;
+  sd = max_sd();
+  if (sd <= 0)
+    return;
+  probe = o.pipeline_sockets[PIPELINE_PROBE];
+  if (probe <= 0)
+    probe = o.max_parallelism ? o.max_parallelism : 100;
+  script = o.pipeline_sockets[PIPELINE_SCRIPT];
+  if (script <= 0)
+    script = o.max_parallelism ? o.max_parallelism : 20;
+  o.pipeline_sockets[PIPELINE_SCAN] = MAX(sd - 10 - probe - script, 5);
+}
+
+/* HostGroupState::before_discovery for a pipelined scan: host discovery
+   belongs to the port scan stage, so it must not switch interfaces under the
+   later ones either. */
+static void pipeline_before_discovery(const Target *first, void *arg) {
+  ((ScanPipeline *) arg)->useDevice(first->deviceName());
+}
+#endif
+
+/* With --rolling-hostgroup, returns the scan type to run as a single rolling
+   ultra_scan, or STYPE_UNKNOWN if the requested scans need fixed groups. Hosts
+   are retired as soon as their port scan is done, so only a lone ultra_scan
+   port scan with no later per-host phases qualifies. */
+static stype rolling_hostgroup_scantype() {
+  stype scantype = STYPE_UNKNOWN;
+  int nscans = 0;
+
+  if (!o.rolling_hostgroup || o.noportscan || o.servicescan || o.osscan
+      || o.traceroute || o.idlescan || o.bouncescan
+#ifndef NOLUA
+      || o.script || o.scriptversion
+#endif
+     )
+    return STYPE_UNKNOWN;
+
+  if (o.synscan) { scantype = SYN_SCAN; nscans++; }
+  if (o.ackscan) { scantype = ACK_SCAN; nscans++; }
+  if (o.windowscan) { scantype = WINDOW_SCAN; nscans++; }
+  if (o.finscan) { scantype = FIN_SCAN; nscans++; }
+  if (o.xmasscan) { scantype = XMAS_SCAN; nscans++; }
+  if (o.nullscan) { scantype = NULL_SCAN; nscans++; }
+  if (o.maimonscan) { scantype = MAIMON_SCAN; nscans++; }
+  if (o.udpscan) { scantype = UDP_SCAN; nscans++; }
+  if (o.connectscan) { scantype = CONNECT_SCAN; nscans++; }
+  if (o.sctpinitscan) { scantype = SCTP_INIT_SCAN; nscans++; }
+  if (o.sctpcookieechoscan) { scantype = SCTP_COOKIE_ECHO_SCAN; nscans++; }
+  if (o.ipprotscan) { scantype = IPPROT_SCAN; nscans++; }
+
+  return nscans == 1 ? scantype : STYPE_UNKNOWN;
+}
+
+/* Feeds hosts to a rolling ultra_scan as earlier ones finish. Host discovery
+   is not run from inside the scan, where it would hold up every probe in
+   flight: prefetch() discovers a bounded pool of hosts beforehand, and next()
+   only hands them out. The first host of the initial group is kept until the
+   end so that new hosts can be checked against it with
+   target_needs_new_hostgroup; the set of hosts held keeps ultra_scan from
+   seeing the same address twice at once. */
+class RollingTargetFeed : public TargetFeed {
+public:
+  RollingTargetFeed(HostGroupState *hstate, struct addrset *exclude_group,
+                    struct scan_lists *ports, std::vector<Target *> &group) {
+    this->hstate = hstate;
+    this->exclude_group = exclude_group;
+    this->ports = ports;
+    this->representative = group[0];
+    for (unsigned int i = 0; i < group.size(); i++)
+      held.insert(group[i]);
+  }
+
+  ~RollingTargetFeed() {
+    /* The scan takes the whole pool unless it had nothing to send. */
+    while (!pool.empty()) {
+      Target *target = pool.front();
+      pool.pop_front();
+      done(target);
+    }
+    delete representative;
+  }
+
+  /* Runs host discovery until up to max hosts fit for the scan are waiting
+     in the pool. Call it before the scan starts. */
+  void prefetch(unsigned int max) {
+    stype scantype;
+    Target *target;
+
+    scantype = o.current_scantype;
+    while (pool.size() < max) {
+      if (o.max_ips_to_scan
+          && o.max_ips_to_scan <= o.numhosts_scanned + held.size())
+        break;
+      target = next_scan_target(hstate, exclude_group, ports,
+                                &representative, 1, held.size());
+      if (target == NULL)
+        break;
+      if (held.find(target) != held.end()) {
+        /* Same address as a host already held; it goes in a later group. */
+        returnhost(hstate);
+        o.numhosts_up--;
+        break;
+      }
+      held.insert(target);
+      pool.push_back(target);
+    }
+    o.current_scantype = scantype;
+  }
+
+  Target *next() {
+    Target *target;
+
+    if (pool.empty())
+      return NULL;
+    target = pool.front();
+    pool.pop_front();
+    o.numhosts_scanning = held.size() - pool.size();
+    return target;
+  }
+
+  void done(Target *target) {
+    held.erase(target);
+    o.numhosts_scanning = held.size() - pool.size();
+    output_lock();
+    print_host_results(target);
+    log_flush_all();
+    o.numhosts_scanned++;
+    output_unlock();
+    if (target != representative)
+      delete target;
+  }
+
+private:
+  struct TargetAddrLess {
+    bool operator()(const Target *a, const Target *b) const {
+      return sockaddr_storage_cmp(a->TargetSockAddr(), b->TargetSockAddr()) < 0;
+    }
+  };
+
+  HostGroupState *hstate;
+  struct addrset *exclude_group;
+  struct scan_lists *ports;
+  Target *representative;
+  /* Hosts in the scan or waiting in pool */
+  std::set<Target *, TargetAddrLess> held;
+  std::list<Target *> pool;
+};
+
 int nmap_main(int argc, char *argv[]) {
   int i;
   std::vector<Target *> Targets;
@@ -1781,13 +2330,10 @@ int nmap_main(int argc, char *argv[]) {
 #endif
   unsigned int ideal_scan_group_sz = 0;
   Target *currenths;
-  char myname[FQDN_LEN + 1];
-  int sourceaddrwarning = 0; /* Have we warned them yet about unguessable
-                                source addresses? */
-  unsigned int targetno;
-  char hostname[FQDN_LEN + 1] = "";
-  struct sockaddr_storage ss;
-  size_t sslen;
+  stype rolling_scantype;
+#if HAVE_PTHREAD
+  ScanPipeline *pipeline = NULL;
+#endif
   int err;
 
 #ifdef LINUX
@@ -1910,6 +2456,12 @@ int nmap_main(int argc, char *argv[]) {
     xml_write_escaped(" %s %s scan initiated %s as: %s ", NMAP_NAME, NMAP_VERSION, mytime, join_quoted(argv, argc).c_str());
     xml_end_comment();
     xml_newline();
+    if (o.randomize_hosts) {
+      xml_start_comment();
+      xml_write_raw(" Hosts randomized with seed %llu ", (unsigned long long) o.randomize_seed);
+      xml_end_comment();
+      xml_newline();
+    }
 
     xml_open_start_tag("nmaprun");
     xml_attribute("scanner", "nmap");
@@ -1931,6 +2483,14 @@ int nmap_main(int argc, char *argv[]) {
     xml_attribute("level", "%d", o.debugging);
     xml_close_empty_tag();
     xml_newline();
+    if (o.nshards > 1) {
+      xml_open_start_tag("shard");
+      xml_attribute("index", "%u", o.shard + 1);
+      xml_attribute("count", "%u", o.nshards);
+      xml_attribute("seed", "%llu", (unsigned long long) o.randomize_seed);
+      xml_close_empty_tag();
+      xml_newline();
+    }
   } else {
     xml_start_tag("nmaprun", false);
   }
@@ -1938,6 +2498,10 @@ int nmap_main(int argc, char *argv[]) {
   log_write(LOG_NORMAL | LOG_MACHINE, "# ");
   log_write(LOG_NORMAL | LOG_MACHINE, "%s %s scan initiated %s as: %s", NMAP_NAME, NMAP_VERSION, mytime, join_quoted(argv, argc).c_str());
   log_write(LOG_NORMAL | LOG_MACHINE, "\n");
+  /* --resume reads the seed back from here when it wasn't given. */
+  if (o.randomize_hosts)
+    log_write(LOG_NORMAL | LOG_MACHINE, "# Hosts randomized with seed %llu\n", (unsigned long long) o.randomize_seed);
+  checkpoint_init(argc, argv);
 
   /* Before we randomize the ports scanned, lets output them to machine
      parseable output */
@@ -2034,245 +2598,88 @@ int nmap_main(int argc, char *argv[]) {
     o.ping_group_sz = o.minHostGroupSz();
   HostGroupState hstate(o.ping_group_sz, o.randomize_hosts, argc, (const char **) argv);
 
+  /* This takes every target there is, so the loop below only gets any that
+     scripts add. */
+  if (o.stateless_sweep)
+    stateless_sweep_phase(&hstate, exclude_group, &ports);
+
+#if HAVE_PTHREAD
+  if (use_pipeline()) {
+    set_pipeline_socket_budgets();
+    pipeline = new ScanPipeline(probe_phase, script_phase, o.pipeline_groups);
+    hstate.before_discovery = pipeline_before_discovery;
+    hstate.before_discovery_arg = pipeline;
+  }
+#endif
+
   do {
+    /* The script stage of a pipelined scan counts hosts as it prints them. */
+    output_lock();
     ideal_scan_group_sz = determineScanGroupSize(o.numhosts_scanned, &ports);
+    output_unlock();
 
     while (Targets.size() < ideal_scan_group_sz) {
-      o.current_scantype = HOST_DISCOVERY;
-      currenths = nexthost(&hstate, exclude_group, &ports, o.pingtype);
+      currenths = next_scan_target(&hstate, exclude_group, &ports,
+                                   Targets.empty() ? NULL : &Targets[0],
+                                   Targets.size(), Targets.size());
       if (!currenths)
         break;
-
-      if (currenths->flags & HOST_UP && !o.listscan)
-        o.numhosts_up++;
-
-      if ((o.noportscan && !o.traceroute
-#ifndef NOLUA
-           && !o.script
-#endif
-          ) || o.listscan) {
-        /* We're done with the hosts */
-        if (currenths->flags & HOST_UP || (o.verbose && !o.openOnly())) {
-          xml_start_tag("host");
-          write_host_header(currenths);
-          printmacinfo(currenths);
-          //  if (currenths->flags & HOST_UP)
-          //  log_write(LOG_PLAIN,"\n");
-          printtimes(currenths);
-          xml_end_tag();
-          xml_newline();
-          log_flush_all();
-        }
-        delete currenths;
-        o.numhosts_scanned++;
-        if (!o.max_ips_to_scan || o.max_ips_to_scan > o.numhosts_scanned + Targets.size())
-          continue;
-        else
-          break;
-      }
-
-      if (o.spoofsource) {
-        o.SourceSockAddr(&ss, &sslen);
-        currenths->setSourceSockAddr(&ss, sslen);
-      }
-
-      /* I used to check that !currenths->weird_responses, but in some
-         rare cases, such IPs CAN be port successfully scanned and even
-         connected to */
-      if (!(currenths->flags & HOST_UP)) {
-        if (o.verbose && (!o.openOnly() || currenths->ports.hasOpenPorts())) {
-          xml_start_tag("host");
-          write_host_header(currenths);
-          xml_end_tag();
-          xml_newline();
-        }
-        delete currenths;
-        o.numhosts_scanned++;
-        if (!o.max_ips_to_scan || o.max_ips_to_scan > o.numhosts_scanned + Targets.size())
-          continue;
-        else
-          break;
-      }
-
-      if (o.RawScan()) {
-        if (currenths->SourceSockAddr(NULL, NULL) != 0) {
-          if (o.SourceSockAddr(&ss, &sslen) == 0) {
-            currenths->setSourceSockAddr(&ss, sslen);
-          } else {
-            if (gethostname(myname, FQDN_LEN) ||
-                resolve(myname, 0, &ss, &sslen, o.af()) != 0)
-              fatal("Cannot get hostname!  Try using -S <my_IP_address> or -e <interface to scan through>\n");
-
-            o.setSourceSockAddr(&ss, sslen);
-            currenths->setSourceSockAddr(&ss, sslen);
-            if (! sourceaddrwarning) {
-              error("WARNING: We could not determine for sure which interface to use, so we are guessing %s .  If this is wrong, use -S <my_IP_address>.",
-                    inet_socktop(&ss));
-              sourceaddrwarning = 1;
-            }
-          }
-        }
-
-        if (!currenths->deviceName())
-          fatal("Do not have appropriate device name for target");
-
-        /* Hosts in a group need to be somewhat homogeneous. Put this host in
-           the next group if necessary. See target_needs_new_hostgroup for the
-           details of when we need to split. */
-        if (Targets.size() && target_needs_new_hostgroup(&Targets[0], Targets.size(), currenths)) {
-          returnhost(&hstate);
-          o.numhosts_up--;
-          break;
-        }
-        o.decoys[o.decoyturn] = currenths->source();
-      }
       Targets.push_back(currenths);
     }
 
-    if (Targets.size() == 0)
+    if (Targets.size() == 0) {
+#if HAVE_PTHREAD
+      /* Scripts still in the pipeline may yet add new targets. */
+      if (pipeline != NULL && pipeline->drain())
+        continue;
+#endif
       break; /* Couldn't find any more targets */
+    }
 
     // Set the variable for status printing
     o.numhosts_scanning = Targets.size();
 
-    // Our source must be set in decoy list because nexthost() call can
-    // change it (that issue really should be fixed when possible)
-    if (o.RawScan())
-      o.decoys[o.decoyturn] = Targets[0]->source();
-
     /* I now have the group for scanning in the Targets vector */
 
-    if (!o.noportscan) {
-      // Ultra_scan sets o.scantype for us so we don't have to worry
-      if (o.synscan)
-        ultra_scan(Targets, &ports, SYN_SCAN);
-
-      if (o.ackscan)
-        ultra_scan(Targets, &ports, ACK_SCAN);
-
-      if (o.windowscan)
-        ultra_scan(Targets, &ports, WINDOW_SCAN);
-
-      if (o.finscan)
-        ultra_scan(Targets, &ports, FIN_SCAN);
-
-      if (o.xmasscan)
-        ultra_scan(Targets, &ports, XMAS_SCAN);
-
-      if (o.nullscan)
-        ultra_scan(Targets, &ports, NULL_SCAN);
-
-      if (o.maimonscan)
-        ultra_scan(Targets, &ports, MAIMON_SCAN);
-
-      if (o.udpscan)
-        ultra_scan(Targets, &ports, UDP_SCAN);
-
-      if (o.connectscan)
-        ultra_scan(Targets, &ports, CONNECT_SCAN);
-
-      if (o.sctpinitscan)
-        ultra_scan(Targets, &ports, SCTP_INIT_SCAN);
-
-      if (o.sctpcookieechoscan)
-        ultra_scan(Targets, &ports, SCTP_COOKIE_ECHO_SCAN);
-
-      if (o.ipprotscan)
-        ultra_scan(Targets, &ports, IPPROT_SCAN);
-
-      /* These lame functions can only handle one target at a time */
-      if (o.idlescan) {
-        for (targetno = 0; targetno < Targets.size(); targetno++) {
-          o.current_scantype = IDLE_SCAN;
-          keyWasPressed(); // Check if a status message should be printed
-          idle_scan(Targets[targetno], ports.tcp_ports,
-                    ports.tcp_count, o.idleProxy, &ports);
-        }
-      }
-      if (o.bouncescan) {
-        for (targetno = 0; targetno < Targets.size(); targetno++) {
-          o.current_scantype = BOUNCE_SCAN;
-          keyWasPressed(); // Check if a status message should be printed
-          if (ftp.sd <= 0)
-            ftp_anon_connect(&ftp);
-          if (ftp.sd > 0)
-            bounce_scan(Targets[targetno], ports.tcp_ports, ports.tcp_count, &ftp);
-        }
-      }
-
-      if (o.servicescan) {
-        o.current_scantype = SERVICE_SCAN;
-        service_scan(Targets);
-      }
+    rolling_scantype = rolling_hostgroup_scantype();
+    if (rolling_scantype != STYPE_UNKNOWN) {
+      /* Hosts are admitted, printed, and freed by the feed as the scan goes,
+         so nothing is left in Targets afterwards. */
+      RollingTargetFeed feed(&hstate, exclude_group, &ports, Targets);
+      feed.prefetch(o.ping_group_sz);
+      ultra_scan(Targets, &ports, rolling_scantype, NULL, &feed);
+      Targets.clear();
+      log_flush_all();
+      o.numhosts_scanning = 0;
+      continue;
     }
 
-    if (o.osscan) {
-      OSScan os_engine;
-      os_engine.os_scan(Targets);
-    }
-
-    if (o.traceroute)
-      traceroute(Targets);
-
-#ifndef NOLUA
-    if (o.script || o.scriptversion) {
-      script_scan(Targets, SCRIPT_SCAN);
-    }
+#if HAVE_PTHREAD
+    /* Discovery may have moved on to the next batch's interface already. */
+    if (pipeline != NULL)
+      pipeline->useDevice(Targets[0]->deviceName());
 #endif
 
-    for (targetno = 0; targetno < Targets.size(); targetno++) {
-      currenths = Targets[targetno];
-      /* Now I can do the output and such for each host */
-      if (currenths->timedOut(NULL)) {
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_close_start_tag();
-        write_host_header(currenths);
-        xml_end_tag(); /* host */
-        xml_newline();
-        log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
-                  currenths->NameIP(hostname, sizeof(hostname)));
-        log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
-                  currenths->targetipstr(), currenths->HostName());
-      } else {
-        /* --open means don't show any hosts without open ports. */
-        if (o.openOnly() && !currenths->ports.hasOpenPorts())
-          continue;
-
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_close_start_tag();
-        write_host_header(currenths);
-        printportoutput(currenths, &currenths->ports);
-        printmacinfo(currenths);
-        printosscanoutput(currenths);
-        printserviceinfooutput(currenths);
-#ifndef NOLUA
-        printhostscriptresults(currenths);
-#endif
-        if (o.traceroute)
-          printtraceroute(currenths);
-        printtimes(currenths);
-        log_write(LOG_PLAIN | LOG_MACHINE, "\n");
-        xml_end_tag(); /* host */
-        xml_newline();
-      }
-    }
-    log_flush_all();
-
-    o.numhosts_scanned += Targets.size();
-
-    /* Free all of the Targets */
-    while (!Targets.empty()) {
-      currenths = Targets.back();
-      delete currenths;
-      Targets.pop_back();
+    port_scan_phase(Targets, &ports);
+#if HAVE_PTHREAD
+    if (pipeline != NULL) {
+      pipeline->push(Targets);
+      o.numhosts_scanning = 0;
+      continue;
     }
+#endif
+    probe_phase(Targets);
+    script_phase(Targets);
+    /* The hosts of the group are out of the way now. */
+    checkpoint_write();
     o.numhosts_scanning = 0;
   } while (!o.max_ips_to_scan || o.max_ips_to_scan > o.numhosts_scanned);
 
+#if HAVE_PTHREAD
+  /* Waits for the last groups to get through. */
+  delete pipeline;
+#endif
+
 #ifndef NOLUA
   if (o.script) {
     script_scan(Targets, SCRIPT_POST_SCAN);
@@ -2310,6 +2717,8 @@ int nmap_main(int argc, char *argv[]) {
    it must gather are:
    1) The last host completed
    2) The command arguments
+   A --checkpoint file is read with checkpoint_load instead, which restores
+   the unfinished hosts as well.
 */
 
 int gather_logfile_resumption_state(char *fname, int *myargc, char ***myargv) {
@@ -2320,6 +2729,10 @@ int gather_logfile_resumption_state(char *fname, int *myargc, char ***myargv) {
   int af = AF_INET; // default without -6 is ipv4
   size_t sslen;
   char *p, *q, *found, *lastipstr; /* I love C! */
+
+  if (checkpoint_load(fname, myargc, myargv))
+    return 0;
+
   /* We mmap it read/write since we will change the last char to a newline if it is not already */
   filestr = mmapfile(fname, &filelen, O_RDWR);
   if (!filestr) {
@@ -2389,8 +2802,20 @@ int gather_logfile_resumption_state(char *fname, int *myargc, char ***myargv) {
      free(unescaped);
   }
 
-  if (strstr(nmap_arg_buffer, "--randomize-hosts") != NULL) {
-    error("WARNING: You are attempting to resume a scan which used --randomize-hosts.  Some hosts in the last randomized batch may be missed and others may be repeated once");
+  /* The hosts come in the same order again only with the same seed. */
+  if (strstr(nmap_arg_buffer, "--randomize-hosts") != NULL
+      && strstr(nmap_arg_buffer, "--randomize-seed") == NULL) {
+    q = strstr(filestr, "Hosts randomized with seed ");
+    if (q != NULL) {
+      unsigned long long seed = strtoull(q + 27, NULL, 10);
+      size_t len = strlen(nmap_arg_buffer);
+      int n = Snprintf(nmap_arg_buffer + len, sizeof(nmap_arg_buffer) - len,
+                       " --randomize-seed %llu", seed);
+      if (n < 0 || (size_t) n >= sizeof(nmap_arg_buffer) - len)
+        fatal("0verfl0w");
+    } else {
+      error("WARNING: You are attempting to resume a scan which used --randomize-hosts without recording its seed.  Hosts will be scanned in a different order, so some may be missed and others repeated");
+    }
   }
 
   *myargc = arg_parse(nmap_arg_buffer, myargv);
@@ -134,6 +134,14 @@
 #include <limits.h>
 #include <list>
 #include <vector>
+#if HAVE_PTHREAD
+#include <pthread.h>
+
+/* The resolver state below is shared; in a pipelined scan, host discovery
+   and traceroute (and scripts asking for the server list) may want it at the
+   same time, so they take turns. */
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 extern NmapOps o;
 
@@ -1245,6 +1253,9 @@ void nmap_mass_rdns(Target **targets, int num_targets) {
 
   struct timeval now;
 
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&dns_lock);
+#endif
   gettimeofday(&starttv, NULL);
 
   stat_actual = stat_ok = stat_nx = stat_sf = stat_trans = stat_dropped = stat_cname = 0;
@@ -1277,11 +1288,17 @@ void nmap_mass_rdns(Target **targets, int num_targets) {
   }
 
   firstrun=0;
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&dns_lock);
+#endif
 }
 
 
 // Returns a list of known DNS servers
 std::list<std::string> get_dns_servers() {
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&dns_lock);
+#endif
   init_servs();
 
   // If the user said --system-dns (!o.mass_dns), we should never return a list
@@ -1293,6 +1310,9 @@ std::list<std::string> get_dns_servers() {
   for(servI = servs.begin(); servI != servs.end(); servI++) {
     serverList.push_back(inet_socktop((struct sockaddr_storage *) &servI->addr));
   }
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&dns_lock);
+#endif
   return serverList;
 }
 
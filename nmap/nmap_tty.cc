@@ -94,6 +94,15 @@
 #include "nmap_tty.h"
 #include "NmapOps.h"
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+
+/* Only the thread that called tty_init() reads keypresses and prints
+   status; the other stages of a pipelined scan leave that to it. */
+static pthread_t tty_thread;
+static bool tty_thread_set = false;
+#endif
+
 extern NmapOps o;
 
 #ifdef WIN32
@@ -216,6 +225,11 @@ void tty_init()
 {
         struct termios ti;
 
+#if HAVE_PTHREAD
+        tty_thread = pthread_self();
+        tty_thread_set = true;
+#endif
+
         if(o.noninteractive)
                 return;
 
@@ -257,6 +271,10 @@ bool keyWasPressed()
 
   if (o.noninteractive)
     return false;
+#if HAVE_PTHREAD
+  if (tty_thread_set && !pthread_equal(pthread_self(), tty_thread))
+    return false;
+#endif
 
   if ((c = tty_getchar()) >= 0) {
     tty_flush(); /* flush input queue */
@@ -6,6 +6,7 @@
 #include "NmapOps.h"
 #include "timing.h"
 #include "Target.h"
+#include "scan_pipeline.h"
 #include "nmap_tty.h"
 #include "xml.h"
 
@@ -616,6 +617,7 @@ static int run_main (lua_State *L)
 {
   std::vector<Target *> *targets = (std::vector<Target*> *)
       lua_touserdata(L, 1);
+  stype scantype = (stype) lua_tointeger(L, 2);
 
   /* New host group */
   lua_newtable(L);
@@ -655,8 +657,10 @@ static int run_main (lua_State *L)
   }
   lua_settop(L, targets_table);
 
-  /* Push script scan phase type. Second argument to NSE main function */
-  switch (o.current_scantype)
+  /* Push script scan phase type. Second argument to NSE main function. This
+   * is passed in rather than read from o.current_scantype, which the port
+   * scan stage of a pipelined scan may be changing meanwhile. */
+  switch (scantype)
   {
     case SCRIPT_PRE_SCAN:
       lua_pushliteral(L, NSE_PRE_SCAN);
@@ -821,7 +825,8 @@ void open_nse (void)
 
 void script_scan (std::vector<Target *> &targets, stype scantype)
 {
-  o.current_scantype = scantype;
+  if (!in_pipeline_stage())
+    o.current_scantype = scantype;
 
   assert(L_NSE != NULL);
   lua_settop(L_NSE, 0); /* clear the stack */
@@ -829,7 +834,8 @@ void script_scan (std::vector<Target *> &targets, stype scantype)
   lua_pushcfunction(L_NSE, nseU_traceback);
   lua_pushcfunction(L_NSE, run_main);
   lua_pushlightuserdata(L_NSE, &targets);
-  if (lua_pcall(L_NSE, 1, 0, 1))
+  lua_pushinteger(L_NSE, scantype);
+  if (lua_pcall(L_NSE, 2, 0, 1))
     error("%s: Script Engine Scan Aborted.\nAn error was thrown by the "
           "engine: %s", SCRIPT_ENGINE, lua_tostring(L_NSE, -1));
   lua_settop(L_NSE, 0);
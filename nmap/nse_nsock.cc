@@ -176,6 +176,8 @@ static std::string hexify (const unsigned char *str, size_t len)
 static int socket_lock (lua_State *L, int idx)
 {
   unsigned p = o.max_parallelism == 0 ? MAX_PARALLELISM : o.max_parallelism;
+  if (o.pipeline_sockets[PIPELINE_SCRIPT] > 0)
+    p = MIN(p, (unsigned) o.pipeline_sockets[PIPELINE_SCRIPT]);
   int top = lua_gettop(L);
   nse_base(L);
   lua_rawget(L, THREAD_SOCKETS);
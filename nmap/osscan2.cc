@@ -2105,7 +2105,8 @@ int HostOsScan::send_tcp_probe(HostOsScanStats *hss,
 
   ethptr = hss->fill_eth_nfo(&eth, ethsd);
 
-  return send_tcp_raw_decoys(rawsd, ethptr, hss->target->v4hostip(),
+  return send_tcp_raw_decoys(rawsd, ethptr, hss->target->v4sourceip(),
+                             hss->target->v4hostip(),
                              ttl, df, ipopt, ipoptlen, sport, dport, seq, ack,
                              reserved, flags, window, urp,
                              options, optlen, data, datalen);
@@ -2126,7 +2127,7 @@ int HostOsScan::send_icmp_echo_probe(HostOsScanStats *hss,
   ethptr = hss->fill_eth_nfo(&eth, ethsd);
 
   for (decoy = 0; decoy < o.numdecoys; decoy++) {
-    packet = build_icmp_raw(&((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, hss->target->v4hostip(),
+    packet = build_icmp_raw(&((const struct sockaddr_in *) hss->target->DecoySockAddr(decoy))->sin_addr, hss->target->v4hostip(),
                             o.ttl, get_random_u16(), tos, df, NULL, 0, seq, id,
                             ICMP_ECHO, pcode, NULL, datalen, &packetlen);
     if (!packet)
@@ -2151,7 +2152,7 @@ int HostOsScan::send_closedudp_probe(HostOsScanStats *hss,
   u8 packet[328]; /* 20 IP hdr + 8 UDP hdr + 300 data */
   struct ip *ip = (struct ip *) packet;
   struct udp_hdr *udp = (struct udp_hdr *) (packet + sizeof(struct ip));
-  struct in_addr *source;
+  const struct in_addr *source;
   int datalen = 300;
   unsigned char *data = packet + 28;
   unsigned short realcheck; /* the REAL checksum */
@@ -2179,9 +2180,9 @@ int HostOsScan::send_closedudp_probe(HostOsScanStats *hss,
   }
 
   for (decoy = 0; decoy < o.numdecoys; decoy++) {
-    if (o.decoys[decoy].ss_family == AF_INET6)
+    if (hss->target->DecoySockAddr(decoy)->ss_family == AF_INET6)
       return 1;
-    source = &((struct sockaddr_in *)&o.decoys[decoy])->sin_addr;
+    source = &((const struct sockaddr_in *) hss->target->DecoySockAddr(decoy))->sin_addr;
 
     memset((char *) packet, 0, sizeof(struct ip) + sizeof(struct udp_hdr));
 
@@ -91,6 +91,9 @@
 #include <vector>
 #include <list>
 #include <sstream>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 extern NmapOps o;
 static const char *logtypes[LOG_NUM_FILES] = LOG_NAMES;
@@ -1079,6 +1082,22 @@ void log_flush_all() {
   fflush(stderr);
 }
 
+#if HAVE_PTHREAD
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void output_lock() {
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&output_mutex);
+#endif
+}
+
+void output_unlock() {
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&output_mutex);
+#endif
+}
+
 /* Open a log descriptor of the type given to the filename given.  If
    append is true, the file will be appended instead of clobbered if
    it already exists.  If the file does not exist, it will be created */
@@ -1329,11 +1348,13 @@ static void write_xml_initial_hostinfo(Target *currenths,
 }
 
 void write_xml_hosthint(Target *currenths) {
+  output_lock();
   xml_start_tag("hosthint");
   write_xml_initial_hostinfo(currenths, (currenths->flags & HOST_UP) ? "up" : "down");
   xml_end_tag();
   xml_newline();
   log_flush_all();
+  output_unlock();
 }
 
 static void write_xml_osclass(const OS_Classification *osclass, double accuracy) {
@@ -2525,7 +2546,7 @@ void printfinaloutput() {
   gettimeofday(&tv, NULL);
   timep = time(NULL);
 
-  if (o.numhosts_scanned == 0
+  if (o.numhosts_scanned == 0 && !o.resuming
 #ifndef NOLUA
       && !o.scriptupdatedb
 #endif
@@ -169,6 +169,11 @@ void log_flush(int logt);
    corresponding logs immediately */
 void log_flush_all();
 
+/* Hold these around output that spans several calls (a whole XML element)
+   while the stages of a pipelined scan may be printing from other threads. */
+void output_lock();
+void output_unlock();
+
 /* Open a log descriptor of the type given to the filename given.  If
    append is nonzero, the file will be appended instead of clobbered if
    it already exists.  If the file does not exist, it will be created */
@@ -397,14 +397,182 @@ void PortList::addScriptResult(u16 portno, int protocol, const ScriptResult& sr)
    IPPROTO_IP)
 
 
+SparsePortTable::SparsePortTable() {
+  slots = NULL;
+  dense = NULL;
+  mask = 0;
+  shift = 0;
+  count = 0;
+  bitmap = NULL;
+  nindexes = 0;
+}
+
+SparsePortTable::~SparsePortTable() {
+  free(slots);
+  free(dense);
+  free(bitmap);
+}
+
+void SparsePortTable::init(int n) {
+  assert(count == 0);
+  nindexes = n;
+}
+
+/* Fibonacci hashing: the top bits of the product spread the consecutive
+   indexes a port scan tends to record over the whole table. */
+int SparsePortTable::hash(int index) const {
+  return (int) (((u32) index * 0x9E3779B1U) >> shift);
+}
+
+Port *SparsePortTable::find(int index) const {
+  unsigned int i;
+
+  if (dense)
+    return dense[index];
+  if (count == 0)
+    return NULL;
+  for (i = hash(index); slots[i].port != NULL; i = (i + 1) & mask) {
+    if (slots[i].index == index)
+      return slots[i].port;
+  }
+  return NULL;
+}
+
+/* Double the table (or create it with 8 slots) and rehash every entry.  Once
+   the doubled table would take more memory than an array indexed directly,
+   switch to that array instead. */
+void SparsePortTable::grow() {
+  Slot *old = slots;
+  unsigned int oldcap = capacity(), i, j;
+
+  if (sizeof(Slot) * oldcap * 2 >= sizeof(Port *) * nindexes) {
+    dense = (Port **) safe_zalloc(sizeof(Port *) * nindexes);
+    for (i = 0; i < oldcap; i++) {
+      if (old[i].port != NULL)
+        dense[old[i].index] = old[i].port;
+    }
+    free(old);
+    slots = NULL;
+    free(bitmap);
+    bitmap = NULL;
+    return;
+  }
+
+  if (old == NULL) {
+    mask = 7;
+    shift = 32 - 3;
+  } else {
+    mask = mask * 2 + 1;
+    shift--;
+  }
+  slots = (Slot *) safe_zalloc(sizeof(Slot) * (mask + 1));
+  for (i = 0; i < oldcap; i++) {
+    if (old[i].port == NULL)
+      continue;
+    for (j = hash(old[i].index); slots[j].port != NULL; j = (j + 1) & mask)
+      ;
+    slots[j] = old[i];
+  }
+  free(old);
+}
+
+void SparsePortTable::insert(int index, Port *port) {
+  unsigned int i;
+
+  assert(index >= 0 && index < nindexes);
+  assert(port != NULL && find(index) == NULL);
+  /* Keep the load factor at or below 1/2. */
+  if (!dense && (unsigned int) (count + 1) * 2 > (unsigned int) capacity())
+    grow();
+  count++;
+  if (dense) {
+    dense[index] = port;
+    return;
+  }
+  if (bitmap == NULL)
+    bitmap = (u32 *) safe_zalloc(sizeof(u32) * ((nindexes + 31) / 32));
+
+  for (i = hash(index); slots[i].port != NULL; i = (i + 1) & mask)
+    ;
+  slots[i].index = index;
+  slots[i].port = port;
+  bitmap[index / 32] |= (u32) 1 << (index % 32);
+}
+
+Port *SparsePortTable::remove(int index) {
+  unsigned int i, j, k;
+  Port *port;
+
+  if (dense) {
+    port = dense[index];
+    dense[index] = NULL;
+    if (port != NULL)
+      count--;
+    return port;
+  }
+  if (count == 0)
+    return NULL;
+  for (i = hash(index); slots[i].port != NULL; i = (i + 1) & mask) {
+    if (slots[i].index == index)
+      break;
+  }
+  port = slots[i].port;
+  if (port == NULL)
+    return NULL;
+
+  /* Backward-shift deletion: pull later members of the probe run into the
+     hole so that lookups never need tombstones. */
+  for (j = (i + 1) & mask; slots[j].port != NULL; j = (j + 1) & mask) {
+    k = hash(slots[j].index);
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i].port = NULL;
+  bitmap[index / 32] &= ~((u32) 1 << (index % 32));
+  count--;
+  return port;
+}
+
+bool SparsePortTable::contains(int index) const {
+  if (dense)
+    return dense[index] != NULL;
+  if (bitmap == NULL)
+    return false;
+  return (bitmap[index / 32] >> (index % 32)) & 1;
+}
+
+int SparsePortTable::next(int index) const {
+  int w;
+  u32 bits;
+
+  if (count == 0 || index >= nindexes)
+    return -1;
+  if (dense) {
+    while (index < nindexes && dense[index] == NULL)
+      index++;
+    return index < nindexes ? index : -1;
+  }
+  w = index / 32;
+  bits = bitmap[w] & (~(u32) 0 << (index % 32));
+  while (bits == 0) {
+    if (++w >= (nindexes + 31) / 32)
+      return -1;
+    bits = bitmap[w];
+  }
+  for (index = w * 32; !(bits & 1); bits >>= 1)
+    index++;
+  return index;
+}
+
+
 PortList::PortList() {
   int proto;
   memset(state_counts_proto, 0, sizeof(state_counts_proto));
-  memset(port_list, 0, sizeof(port_list));
 
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) {
-    if(port_list_count[proto] > 0)
-      port_list[proto] = (Port**) safe_zalloc(sizeof(Port*)*port_list_count[proto]);
+    port_table[proto].init(port_list_count[proto]);
     default_port_state[proto].proto = PORTLISTPROTO2INPROTO(proto);
     default_port_state[proto].reason.reason_id = ER_NORESPONSE;
     state_counts_proto[proto][default_port_state[proto].state] = port_list_count[proto];
@@ -423,29 +591,25 @@ PortList::~PortList() {
   }
 
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) { // for every protocol
-    if(port_list[proto]) {
-      for(i=0; i < port_list_count[proto]; i++) { // free every Port
-        if(port_list[proto][i]) {
-          port_list[proto][i]->freeService(true);
-          port_list[proto][i]->freeScriptResults();
-          delete port_list[proto][i];
-        }
+    for(i=0; i < port_table[proto].capacity(); i++) { // free every Port
+      Port *port = port_table[proto].slot(i);
+      if(port) {
+        port->freeService(true);
+        port->freeScriptResults();
+        delete port;
       }
-      free(port_list[proto]);
     }
   }
 }
 
 void PortList::setDefaultPortState(u8 protocol, int state) {
   int proto = INPROTO2PORTLISTPROTO(protocol);
-  int i;
+  int ndefault;
 
-  for (i = 0; i < port_list_count[proto]; i++) {
-    if (port_list[proto][i] == NULL) {
-      state_counts_proto[proto][default_port_state[proto].state]--;
-      state_counts_proto[proto][state]++;
-    }
-  }
+  /* Every port without an entry is in the default state. */
+  ndefault = port_list_count[proto] - port_table[proto].size();
+  state_counts_proto[proto][default_port_state[proto].state] -= ndefault;
+  state_counts_proto[proto][state] += ndefault;
 
   default_port_state[proto].state = state;
 }
@@ -551,7 +715,8 @@ Port *PortList::nextPort(const Port *cur, Port *next,
                          int allowed_protocol, int allowed_state) {
   int proto;
   int mapped_pno;
-  Port *port;
+  const Port *port;
+  bool default_ok;
 
   if (cur) {
     proto = INPROTO2PORTLISTPROTO(cur->proto);
@@ -569,19 +734,26 @@ Port *PortList::nextPort(const Port *cur, Port *next,
     mapped_pno = 0;
   }
 
-  if(port_list[proto] != NULL) {
-    for(;mapped_pno < port_list_count[proto]; mapped_pno++) {
-      port = port_list[proto][mapped_pno];
-      if (port && (allowed_state==0 || port->state==allowed_state)) {
+  default_ok = (allowed_state==0 || default_port_state[proto].state==allowed_state);
+  while (mapped_pno >= 0 && mapped_pno < port_list_count[proto]) {
+    /* If no default port can match, jump straight to the next entry. */
+    if (!default_ok) {
+      mapped_pno = port_table[proto].next(mapped_pno);
+      if (mapped_pno < 0)
+        break;
+    }
+    if (port_table[proto].contains(mapped_pno)) {
+      port = port_table[proto].find(mapped_pno);
+      if (allowed_state==0 || port->state==allowed_state) {
         *next = *port;
         return next;
       }
-      if (!port && (allowed_state==0 || default_port_state[proto].state==allowed_state)) {
-        *next = default_port_state[proto];
-        next->portno = port_map_rev[proto][mapped_pno];
-        return next;
-      }
+    } else {
+      *next = default_port_state[proto];
+      next->portno = port_map_rev[proto][mapped_pno];
+      return next;
     }
+    mapped_pno++;
   }
 
   /* if all protocols, than after TCP search UDP & SCTP */
@@ -598,7 +770,7 @@ Port *PortList::nextPort(const Port *cur, Port *next,
 }
 
 /* Convert portno and protocol into the internal indices used to index
-   port_list. */
+   port_table. */
 void PortList::mapPort(u16 *portno, u8 *protocol) const {
   int mapped_portno, mapped_protocol;
 
@@ -606,7 +778,7 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
 
   if (*protocol == IPPROTO_IP)
     assert(*portno < 256);
-  if(port_map[mapped_protocol]==NULL || port_list[mapped_protocol]==NULL) {
+  if(port_map[mapped_protocol]==NULL || port_list_count[mapped_protocol]==0) {
     fatal("%s(%i,%i): you're trying to access uninitialized protocol", __func__, *portno, *protocol);
   }
   mapped_portno = port_map[mapped_protocol][*portno];
@@ -620,7 +792,7 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
 
 const Port *PortList::lookupPort(u16 portno, u8 protocol) const {
   mapPort(&portno, &protocol);
-  return port_list[protocol][portno];
+  return port_table[protocol].find(portno);
 }
 
 /* Create the port if it doesn't exist; otherwise this is like lookupPort. */
@@ -633,17 +805,17 @@ Port *PortList::createPort(u16 portno, u8 protocol) {
   mapped_protocol = protocol;
   mapPort(&mapped_portno, &mapped_protocol);
 
-  p = port_list[mapped_protocol][mapped_portno];
+  p = port_table[mapped_protocol].find(mapped_portno);
   if (p == NULL) {
     p = new Port();
     p->portno = portno;
     p->proto = protocol;
     p->state = default_port_state[mapped_protocol].state;
     p->reason.reason_id = ER_NORESPONSE;
-    port_list[mapped_protocol][mapped_portno] = p;
+    port_table[mapped_protocol].insert(mapped_portno, p);
   }
 
-  return port_list[mapped_protocol][mapped_portno];
+  return p;
 }
 
 int PortList::forgetPort(u16 portno, u8 protocol) {
@@ -653,15 +825,13 @@ int PortList::forgetPort(u16 portno, u8 protocol) {
 
   mapPort(&portno, &protocol);
 
-  answer = port_list[protocol][portno];
+  answer = port_table[protocol].remove(portno);
   if (answer == NULL)
     return -1;
 
   state_counts_proto[protocol][answer->state]--;
   state_counts_proto[protocol][default_port_state[protocol].state]++;
 
-  port_list[protocol][portno] = NULL;
-
   if (o.verbose) {
     log_write(LOG_STDOUT, "Deleting port %hu/%s, which we thought was %s\n",
               portno, proto2ascii_lowercase(answer->proto),
@@ -720,8 +890,8 @@ void PortList::initializePortMap(int protocol, u16 *ports, int portcount) {
     port_map_rev[proto][i] = ports[i];
   }
   /* So now port_map should have such structure (lets scan 2nd,4th and 6th port):
-   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to port_list structure
-   * 	port_list[port_2,port_4,port_6] */
+   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to port_table structure
+   * 	port_table[port_2,port_4,port_6] */
 }
 
   /* Cycles through the 0 or more "ignored" ports which should be
@@ -172,6 +172,52 @@ enum portlist_proto {	// PortList Protocols
   PORTLIST_PROTO_MAX	= 4
 };
 
+/* Sparse storage for the Port entries of one protocol in a PortList.  Most
+   ports of a large scan stay in the default state and need no entry, so only
+   the others are kept, in a small open-addressing hash table keyed by the
+   port's index in PortList::port_map.  A bitmap over those indexes is
+   allocated with the first entry; it lets nextPort skip runs of default ports
+   in order without probing the table for each one.  Should the table outgrow
+   a plain array of Port pointers (most ports answered), it is replaced by
+   one. */
+class SparsePortTable {
+ public:
+  SparsePortTable();
+  ~SparsePortTable();
+  /* Set the number of port indexes (PortList::port_list_count). */
+  void init(int nindexes);
+  Port *find(int index) const;
+  void insert(int index, Port *port);
+  /* Removes the entry for index and returns it, or NULL if there was none. */
+  Port *remove(int index);
+  bool contains(int index) const;
+  /* Returns the lowest index >= index that has an entry, or -1. */
+  int next(int index) const;
+  int size() const { return count; }
+  /* Returns the Port in slot i, which may be NULL; i < capacity(). */
+  Port *slot(int i) const { return dense ? dense[i] : slots[i].port; }
+  int capacity() const { return dense ? nindexes : slots ? mask + 1 : 0; }
+
+ private:
+  struct Slot {
+    int index;
+    Port *port;
+  };
+  int hash(int index) const;
+  void grow();
+
+  Slot *slots;
+  Port **dense;
+  unsigned int mask;
+  int shift;
+  int count;
+  u32 *bitmap;
+  int nindexes;
+
+  SparsePortTable(const SparsePortTable &);
+  SparsePortTable &operator=(const SparsePortTable &);
+};
+
 class PortList {
  public:
   PortList();
@@ -277,14 +323,15 @@ class PortList {
   char *idstr;
   /* Number of ports in each state per each protocol. */
   int state_counts_proto[PORTLIST_PROTO_MAX][PORT_HIGHEST_STATE];
-  Port **port_list[PORTLIST_PROTO_MAX];
+  /* Ports that are not in the default state, per protocol. */
+  SparsePortTable port_table[PORTLIST_PROTO_MAX];
  protected:
-  /* Maps port_number to index in port_list array.
-   * Only functions: getPortEntry, setPortEntry, initializePortMap and
-   * nextPort should access this structure directly. */
+  /* Maps port_number to index in port_table.
+   * Only functions: mapPort, initializePortMap and nextPort should access
+   * this structure directly. */
   static u16 *port_map[PORTLIST_PROTO_MAX];
   static u16 *port_map_rev[PORTLIST_PROTO_MAX];
-  /* Number of allocated elements in port_list per each protocol. */
+  /* Number of scanned ports (port_map indexes) per each protocol. */
   static int port_list_count[PORTLIST_PROTO_MAX];
   Port default_port_state[PORTLIST_PROTO_MAX];
 };
@@ -69,6 +69,7 @@
 #include "portreasons.h"
 #include <dnet.h>
 #include "scan_engine.h"
+#include "checkpoint.h"
 #include "scan_engine_connect.h"
 #include "scan_engine_raw.h"
 #include "timing.h"
@@ -90,8 +91,13 @@
 
 #include <math.h>
 #include <list>
+#include <new>
 #include <map>
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 extern NmapOps o;
 #ifdef WIN32
 /* from libdnet's intf-win32.c */
@@ -102,12 +108,181 @@ extern "C" int g_has_npcap_loopback;
 #define RLD_TIME_MS 1000
 
 int HssPredicate::operator() (const HostScanStats *lhs, const HostScanStats *rhs) const {
-  const struct sockaddr_storage *lss, *rss;
-  lss = (lhs) ? lhs->target->TargetSockAddr() : ss;
-  rss = (rhs) ? rhs->target->TargetSockAddr() : ss;
-  return 0 > sockaddr_storage_cmp(lss, rss);
+  return 0 > sockaddr_storage_cmp(lhs->target->TargetSockAddr(),
+                                  rhs->target->TargetSockAddr());
+}
+
+/* Marks a slot whose entry was erased. Lookups probe past it; inserts may
+   reuse it. */
+static HostScanStats *const HSS_DELETED = (HostScanStats *) &HSS_DELETED;
+
+HssAddrTable::HssAddrTable(size_t keylen) {
+  this->keylen = keylen;
+  capacity = 0;
+  used = 0;
+  live = 0;
+}
+
+/* Multiplicative (Fibonacci) hashing over the key, 32 bits at a time. */
+unsigned int HssAddrTable::slotFor(const u8 *key) const {
+  u32 h = 0, word;
+  size_t i;
+
+  for (i = 0; i < keylen; i += sizeof(word)) {
+    memcpy(&word, key + i, sizeof(word));
+    h = (h ^ word) * 0x9E3779B1U;
+  }
+  h ^= h >> 16;
+  return h & (capacity - 1);
+}
+
+void HssAddrTable::rehash(unsigned int newcap) {
+  std::vector<u8> oldkeys;
+  std::vector<HostScanStats *> oldvalues;
+  unsigned int i;
+
+  oldkeys.swap(keys);
+  oldvalues.swap(values);
+  capacity = newcap;
+  used = 0;
+  live = 0;
+  keys.resize(capacity * keylen);
+  values.assign(capacity, (HostScanStats *) NULL);
+  for (i = 0; i < oldvalues.size(); i++) {
+    if (oldvalues[i] != NULL && oldvalues[i] != HSS_DELETED)
+      insert(&oldkeys[i * keylen], oldvalues[i]);
+  }
+}
+
+void HssAddrTable::reserve(unsigned int n) {
+  unsigned int newcap = 16;
+
+  /* Keep the load factor at or below 1/2. */
+  while (newcap < 2 * n)
+    newcap *= 2;
+  if (newcap > capacity)
+    rehash(newcap);
+}
+
+void HssAddrTable::insert(const u8 *key, HostScanStats *hss) {
+  unsigned int i, reuse;
+
+  /* Deleted slots count against the load factor. When hosts come and go, as
+     with --rolling-hostgroup, most used slots can be deleted ones; then they
+     are cleared out at the same size instead of growing the table. */
+  if (2 * (used + 1) > capacity) {
+    if (capacity > 0 && 4 * (live + 1) <= capacity)
+      rehash(capacity);
+    else
+      rehash(capacity > 0 ? 2 * capacity : 16);
+  }
+  /* Take the first deleted slot in the probe sequence, unless it comes before
+     an entry with the same key: the first of several duplicate keys must stay
+     first. */
+  reuse = capacity;
+  for (i = slotFor(key); values[i] != NULL; i = (i + 1) & (capacity - 1)) {
+    if (values[i] == HSS_DELETED) {
+      if (reuse == capacity)
+        reuse = i;
+    } else if (memcmp(&keys[i * keylen], key, keylen) == 0) {
+      reuse = capacity;
+    }
+  }
+  if (reuse != capacity)
+    i = reuse;
+  else
+    used++;
+  memcpy(&keys[i * keylen], key, keylen);
+  values[i] = hss;
+  live++;
+}
+
+bool HssAddrTable::erase(const u8 *key, const HostScanStats *hss) {
+  unsigned int i;
+
+  if (capacity == 0)
+    return false;
+  for (i = slotFor(key); values[i] != NULL; i = (i + 1) & (capacity - 1)) {
+    if (values[i] == hss && memcmp(&keys[i * keylen], key, keylen) == 0) {
+      values[i] = HSS_DELETED;
+      live--;
+      return true;
+    }
+  }
+  return false;
+}
+
+HostScanStats *HssAddrTable::find(const u8 *key) const {
+  unsigned int i;
+
+  if (capacity == 0)
+    return NULL;
+  for (i = slotFor(key); values[i] != NULL; i = (i + 1) & (capacity - 1)) {
+    if (values[i] != HSS_DELETED && memcmp(&keys[i * keylen], key, keylen) == 0)
+      return values[i];
+  }
+  return NULL;
+}
+
+void HssAddrTable::clear() {
+  keys.clear();
+  values.clear();
+  capacity = 0;
+  used = 0;
+  live = 0;
+}
+
+/* Returns a pointer to the raw address bytes of ss, or NULL if its address
+   family is not indexed. */
+static const u8 *hss_index_key(const struct sockaddr_storage *ss) {
+  if (ss->ss_family == AF_INET)
+    return (const u8 *) &((const struct sockaddr_in *) ss)->sin_addr;
+  else if (ss->ss_family == AF_INET6)
+    return (const u8 *) &((const struct sockaddr_in6 *) ss)->sin6_addr;
+  return NULL;
+}
+
+void HssIndex::reserve(unsigned int n, int af) {
+  if (af == AF_INET)
+    v4.reserve(n);
+  else if (af == AF_INET6)
+    v6.reserve(n);
+}
+
+void HssIndex::insert(HostScanStats *hss) {
+  const struct sockaddr_storage *ss = hss->target->TargetSockAddr();
+  const u8 *key = hss_index_key(ss);
+
+  assert(key != NULL);
+  if (ss->ss_family == AF_INET)
+    v4.insert(key, hss);
+  else
+    v6.insert(key, hss);
+}
+
+void HssIndex::erase(const HostScanStats *hss) {
+  const struct sockaddr_storage *ss = hss->target->TargetSockAddr();
+  const u8 *key = hss_index_key(ss);
+  bool found;
+
+  assert(key != NULL);
+  if (ss->ss_family == AF_INET)
+    found = v4.erase(key, hss);
+  else
+    found = v6.erase(key, hss);
+  assert(found);
+}
+
+HostScanStats *HssIndex::find(const struct sockaddr_storage *ss) const {
+  const u8 *key = hss_index_key(ss);
+
+  if (key == NULL)
+    return NULL;
+  if (ss->ss_family == AF_INET)
+    return v4.find(key);
+  else
+    return v6.find(key);
 }
-struct sockaddr_storage *HssPredicate::ss = NULL;
 
 void UltraScanInfo::log_overall_rates(int logt) {
   log_write(logt, "Overall sending rates: %.2f packets / s", send_rate_meter.getOverallPacketRate(&now));
@@ -252,6 +427,10 @@ UltraProbe::UltraProbe() {
   mypspec.type = PS_NONE;
   memset(&sent, 0, sizeof(prevSent));
   memset(&prevSent, 0, sizeof(prevSent));
+  timer_next = NULL;
+  timer_pprev = NULL;
+  timer_tick = 0;
+  timer_hss = NULL;
 }
 
 UltraProbe::~UltraProbe() {
@@ -259,7 +438,373 @@ UltraProbe::~UltraProbe() {
     delete probes.CP;
 }
 
-GroupScanStats::GroupScanStats(UltraScanInfo *UltraSI) {
+UltraProbePool::UltraProbePool() {
+  in_use = 0;
+  high_water = 0;
+}
+
+UltraProbePool::~UltraProbePool() {
+  std::vector<void *>::iterator it;
+
+  for (it = slabs.begin(); it != slabs.end(); it++)
+    free(*it);
+}
+
+UltraProbe *UltraProbePool::get() {
+  void *mem;
+  int i;
+
+  if (freelist.empty()) {
+    mem = safe_malloc(PROBE_POOL_SLAB_SIZE * sizeof(UltraProbe));
+    slabs.push_back(mem);
+    freelist.reserve(slabs.size() * PROBE_POOL_SLAB_SIZE);
+    /* Backwards, so that probes are handed out in address order. */
+    for (i = PROBE_POOL_SLAB_SIZE - 1; i >= 0; i--)
+      freelist.push_back((UltraProbe *) mem + i);
+  }
+  mem = freelist.back();
+  freelist.pop_back();
+
+  in_use++;
+  if (in_use > high_water)
+    high_water = in_use;
+
+  return new (mem) UltraProbe();
+}
+
+void UltraProbePool::put(UltraProbe *probe) {
+  assert(in_use > 0);
+  probe->~UltraProbe();
+  freelist.push_back(probe);
+  in_use--;
+}
+
+void UltraProbePool::log_stats(int logt) const {
+  log_write(logt, "Probe pool: %u probes in use at most, %lu slabs of %d.\n",
+            high_water, (unsigned long) slabs.size(), PROBE_POOL_SLAB_SIZE);
+}
+
+#define TIMER_WHEEL_L0_SIZE (1UL << TIMER_WHEEL_L0_BITS)
+#define TIMER_WHEEL_LN_SIZE (1UL << TIMER_WHEEL_LN_BITS)
+/* Number of ticks covered by one slot of the given level, and by the whole
+   level. */
+#define TIMER_WHEEL_SLOT_SPAN(level) (1UL << (TIMER_WHEEL_L0_BITS + ((level) - 1) * TIMER_WHEEL_LN_BITS))
+#define TIMER_WHEEL_SPAN(level) (1UL << (TIMER_WHEEL_L0_BITS + (level) * TIMER_WHEEL_LN_BITS))
+
+ProbeTimerWheel::ProbeTimerWheel() {
+  memset(l0, 0, sizeof(l0));
+  memset(ln, 0, sizeof(ln));
+  gettimeofday(&base, NULL);
+  cur_tick = 0;
+  count = 0;
+  next_tick = 0;
+}
+
+/* Rounds up, so that a probe is never handed out before its time. */
+unsigned long ProbeTimerWheel::tickOf(const struct timeval *tv) const {
+  long long us = TIMEVAL_SUBTRACT(*tv, base);
+
+  if (us <= 0)
+    return 0;
+  return (unsigned long) ((us + 999) / 1000);
+}
+
+/* Puts a probe whose timer_tick is set into the slot for it, relative to
+   cur_tick. timer_tick may not be before cur_tick. */
+void ProbeTimerWheel::link(UltraProbe *probe) {
+  UltraProbe **head;
+  unsigned long delta;
+  int level;
+
+  delta = probe->timer_tick - cur_tick;
+
+  if (delta < TIMER_WHEEL_L0_SIZE) {
+    head = &l0[probe->timer_tick & (TIMER_WHEEL_L0_SIZE - 1)];
+  } else {
+    unsigned long tick = probe->timer_tick;
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if (delta < TIMER_WHEEL_SPAN(level))
+        break;
+    }
+    if (level == TIMER_WHEEL_LEVELS) {
+      /* Past the end of the wheel. Park it in the last slot of the top
+         level; it is put back where it belongs when that is cascaded. */
+      level = TIMER_WHEEL_LEVELS - 1;
+      tick = cur_tick + TIMER_WHEEL_SPAN(level) - 1;
+    }
+    head = &ln[level - 1][(tick / TIMER_WHEEL_SLOT_SPAN(level)) & (TIMER_WHEEL_LN_SIZE - 1)];
+  }
+
+  probe->timer_next = *head;
+  if (*head)
+    (*head)->timer_pprev = &probe->timer_next;
+  probe->timer_pprev = head;
+  *head = probe;
+}
+
+void ProbeTimerWheel::schedule(HostScanStats *hss,
+                               std::list<UltraProbe *>::iterator probeI,
+                               const struct timeval *when) {
+  UltraProbe *probe = *probeI;
+
+  cancel(probe);
+  probe->timer_hss = hss;
+  probe->timer_probeI = probeI;
+  probe->timer_tick = tickOf(when);
+  /* The slot for cur_tick has already been handed out. */
+  if (probe->timer_tick <= cur_tick)
+    probe->timer_tick = cur_tick + 1;
+  link(probe);
+  count++;
+  if (next_tick != 0 && probe->timer_tick < next_tick)
+    next_tick = probe->timer_tick;
+}
+
+void ProbeTimerWheel::cancel(UltraProbe *probe) {
+  if (probe->timer_pprev == NULL)
+    return;
+  *probe->timer_pprev = probe->timer_next;
+  if (probe->timer_next)
+    probe->timer_next->timer_pprev = probe->timer_pprev;
+  probe->timer_next = NULL;
+  probe->timer_pprev = NULL;
+  assert(count > 0);
+  count--;
+  if (probe->timer_tick == next_tick)
+    next_tick = 0;
+}
+
+/* Redistributes the probes of a slot of an upper level over the levels
+   below. */
+void ProbeTimerWheel::cascade(int level, unsigned int slot) {
+  UltraProbe *probe, *next;
+
+  probe = ln[level - 1][slot];
+  ln[level - 1][slot] = NULL;
+  for (; probe != NULL; probe = next) {
+    next = probe->timer_next;
+    link(probe);
+  }
+}
+
+void ProbeTimerWheel::expire(const struct timeval *now,
+                             std::vector<UltraProbe *> &due) {
+  long long us = TIMEVAL_SUBTRACT(*now, base);
+  unsigned long now_tick;
+  UltraProbe *probe, *next;
+  unsigned long slot;
+  int level;
+
+  /* Only whole ticks that have passed count. */
+  now_tick = (us > 0) ? (unsigned long) (us / 1000) : 0;
+
+  while (count > 0 && cur_tick < now_tick) {
+    cur_tick++;
+    slot = cur_tick & (TIMER_WHEEL_L0_SIZE - 1);
+    /* Going into a new slot of a level means its probes are now close
+       enough for the levels below. Higher levels go first, so that their
+       probes can fall all the way down. */
+    if (slot == 0) {
+      for (level = TIMER_WHEEL_LEVELS - 1; level >= 1; level--) {
+        if (cur_tick % TIMER_WHEEL_SLOT_SPAN(level) == 0)
+          cascade(level, (cur_tick / TIMER_WHEEL_SLOT_SPAN(level)) & (TIMER_WHEEL_LN_SIZE - 1));
+      }
+    }
+    probe = l0[slot];
+    l0[slot] = NULL;
+    for (; probe != NULL; probe = next) {
+      next = probe->timer_next;
+      probe->timer_next = NULL;
+      probe->timer_pprev = NULL;
+      count--;
+      due.push_back(probe);
+    }
+  }
+  /* Nothing is scheduled, so skip the idle ticks. */
+  if (count == 0 && cur_tick < now_tick)
+    cur_tick = now_tick;
+  if (next_tick <= cur_tick)
+    next_tick = 0;
+}
+
+UltraProbe *ProbeTimerWheel::minInSlot(UltraProbe *head) const {
+  UltraProbe *best = head;
+
+  for (; head != NULL; head = head->timer_next) {
+    if (head->timer_tick < best->timer_tick)
+      best = head;
+  }
+  return best;
+}
+
+bool ProbeTimerWheel::nextDeadline(struct timeval *when) const {
+  unsigned long best = 0;
+  unsigned long i, slot;
+  UltraProbe *probe;
+  int level;
+
+  if (count == 0)
+    return false;
+  if (next_tick != 0) {
+    TIMEVAL_ADD(*when, base, (long long) next_tick * 1000);
+    return true;
+  }
+
+  /* Within each level, the first nonempty slot after the current one holds
+     that level's earliest probes, but a later level may still hold an
+     earlier probe than the level below it. */
+  for (i = 1; i < TIMER_WHEEL_L0_SIZE; i++) {
+    if (l0[(cur_tick + i) & (TIMER_WHEEL_L0_SIZE - 1)] != NULL) {
+      best = cur_tick + i;
+      break;
+    }
+  }
+  for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    for (i = 1; i <= TIMER_WHEEL_LN_SIZE; i++) {
+      slot = (cur_tick / TIMER_WHEEL_SLOT_SPAN(level) + i) & (TIMER_WHEEL_LN_SIZE - 1);
+      if (ln[level - 1][slot] != NULL) {
+        probe = minInSlot(ln[level - 1][slot]);
+        if (best == 0 || probe->timer_tick < best)
+          best = probe->timer_tick;
+        break;
+      }
+    }
+  }
+  assert(best != 0);
+  next_tick = best;
+
+  TIMEVAL_ADD(*when, base, (long long) best * 1000);
+  return true;
+}
+
+#define PROBE_INDEX_EMPTY 0
+#define PROBE_INDEX_LIVE 1
+#define PROBE_INDEX_DELETED 2
+
+/* Multiplicative (Fibonacci) hashing of the key, folded to 32 bits. */
+static u32 probe_index_hash(u64 key) {
+  u32 h;
+
+  h = ((u32) key ^ (u32) (key >> 32)) * 0x9E3779B1U;
+  return h ^ (h >> 16);
+}
+
+ProbeIndex::ProbeIndex() {
+  capacity = 0;
+  used = 0;
+  live = 0;
+}
+
+/* Returns the slot holding key, or capacity if there is none. */
+unsigned int ProbeIndex::slotOf(u64 key) const {
+  unsigned int i;
+
+  if (capacity == 0)
+    return capacity;
+  for (i = probe_index_hash(key) & (capacity - 1); state[i] != PROBE_INDEX_EMPTY; i = (i + 1) & (capacity - 1)) {
+    if (state[i] == PROBE_INDEX_LIVE && keys[i] == key)
+      return i;
+  }
+  return capacity;
+}
+
+/* Claims a slot for key, which must not be in the table yet, and returns it.
+   The table must have room. */
+unsigned int ProbeIndex::newSlot(u64 key) {
+  unsigned int i;
+
+  for (i = probe_index_hash(key) & (capacity - 1); state[i] == PROBE_INDEX_LIVE; i = (i + 1) & (capacity - 1))
+    ;
+  if (state[i] == PROBE_INDEX_EMPTY)
+    used++;
+  state[i] = PROBE_INDEX_LIVE;
+  keys[i] = key;
+  live++;
+  return i;
+}
+
+void ProbeIndex::rehash(unsigned int newcap) {
+  std::vector<u8> oldstate;
+  std::vector<u64> oldkeys;
+  std::vector<Bucket> oldbuckets;
+  unsigned int i;
+
+  oldstate.swap(state);
+  oldkeys.swap(keys);
+  oldbuckets.swap(buckets);
+  capacity = newcap;
+  used = 0;
+  live = 0;
+  state.assign(capacity, PROBE_INDEX_EMPTY);
+  keys.resize(capacity);
+  buckets.resize(capacity);
+  for (i = 0; i < oldstate.size(); i++) {
+    if (oldstate[i] == PROBE_INDEX_LIVE)
+      buckets[newSlot(oldkeys[i])].swap(oldbuckets[i]);
+  }
+}
+
+void ProbeIndex::insert(u64 key, std::list<UltraProbe *>::iterator probeI) {
+  unsigned int i;
+
+  i = slotOf(key);
+  if (i == capacity) {
+    /* As in HssAddrTable, deleted slots count against the load factor, and
+       are cleared out at the same size when most used slots are deleted. */
+    if (2 * (used + 1) > capacity) {
+      if (capacity > 0 && 4 * (live + 1) <= capacity)
+        rehash(capacity);
+      else
+        rehash(capacity > 0 ? 2 * capacity : 16);
+    }
+    i = newSlot(key);
+  }
+  buckets[i].push_back(probeI);
+}
+
+void ProbeIndex::erase(u64 key, std::list<UltraProbe *>::iterator probeI) {
+  Bucket::iterator it;
+  unsigned int i;
+
+  i = slotOf(key);
+  assert(i != capacity);
+  it = std::find(buckets[i].begin(), buckets[i].end(), probeI);
+  assert(it != buckets[i].end());
+  buckets[i].erase(it);
+  if (buckets[i].empty()) {
+    state[i] = PROBE_INDEX_DELETED;
+    live--;
+  }
+}
+
+const ProbeIndex::Bucket *ProbeIndex::find(u64 key) const {
+  unsigned int i;
+
+  i = slotOf(key);
+  if (i == capacity)
+    return NULL;
+  return &buckets[i];
+}
+
+SharedGroupStats::SharedGroupStats() {
+  initialized = false;
+  num_probes_active = 0;
+  num_incomplete_hosts = 0;
+  memset(&timing, 0, sizeof(timing));
+  memset(&send_no_earlier_than, 0, sizeof(send_no_earlier_than));
+  memset(&send_no_later_than, 0, sizeof(send_no_later_than));
+#if HAVE_PTHREAD
+  pthread_mutex_init(&lock, NULL);
+#endif
+}
+
+SharedGroupStats::~SharedGroupStats() {
+#if HAVE_PTHREAD
+  pthread_mutex_destroy(&lock);
+#endif
+}
+
+GroupScanStats::GroupScanStats(UltraScanInfo *UltraSI, SharedGroupStats *shared) {
   memset(&latestip, 0, sizeof(latestip));
   memset(&timeout, 0, sizeof(timeout));
   USI = UltraSI;
@@ -283,16 +828,74 @@ GroupScanStats::GroupScanStats(UltraScanInfo *UltraSI) {
   pinghost = NULL;
   gettimeofday(&last_wait, NULL);
   num_hosts_timedout = 0;
+
+  this->shared = shared;
+  if (shared != NULL) {
+    /* The first worker sets up the shared values; the others start from
+       them. */
+#if HAVE_PTHREAD
+    pthread_mutex_lock(&shared->lock);
+#endif
+    if (!shared->initialized) {
+      shared->timing = timing;
+      shared->send_no_earlier_than = send_no_earlier_than;
+      shared->send_no_later_than = send_no_later_than;
+      shared->initialized = true;
+    } else {
+      timing = shared->timing;
+    }
+    shared->num_incomplete_hosts += numtargets;
+#if HAVE_PTHREAD
+    pthread_mutex_unlock(&shared->lock);
+#endif
+  }
 }
 
 GroupScanStats::~GroupScanStats() {
   delete CSI;
 }
 
+void GroupScanStats::lock() {
+  if (shared == NULL)
+    return;
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&shared->lock);
+#endif
+  num_probes_active = shared->num_probes_active;
+  timing = shared->timing;
+  send_no_earlier_than = shared->send_no_earlier_than;
+  send_no_later_than = shared->send_no_later_than;
+}
+
+void GroupScanStats::unlock() {
+  if (shared == NULL)
+    return;
+  shared->num_probes_active = num_probes_active;
+  shared->timing = timing;
+  shared->send_no_earlier_than = send_no_earlier_than;
+  shared->send_no_later_than = send_no_later_than;
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&shared->lock);
+#endif
+}
+
+void GroupScanStats::hostCompleted() {
+  if (shared == NULL)
+    return;
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&shared->lock);
+#endif
+  shared->num_incomplete_hosts--;
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&shared->lock);
+#endif
+}
+
 /* Called whenever a probe is sent to any host. Should only be called by
    HostScanStats::probeSent. */
 void GroupScanStats::probeSent(unsigned int nbytes) {
   USI->send_rate_meter.update(nbytes, &USI->now);
+  lock();
 
   /* Find a new scheduling interval for minimum- and maximum-rate sending.
      Recall that these have effect only when --min-rate or --max-rate is
@@ -317,10 +920,21 @@ void GroupScanStats::probeSent(unsigned int nbytes) {
       TIMEVAL_ADD(send_no_later_than, send_no_later_than,
                   (time_t) (1000000.0 / o.min_packet_send_rate));
   }
+  unlock();
 }
 
 /* Returns true if the GLOBAL system says that sending is OK.*/
 bool GroupScanStats::sendOK(struct timeval *when) {
+  bool ok;
+
+  lock();
+  ok = sendOKLocked(when);
+  unlock();
+
+  return ok;
+}
+
+bool GroupScanStats::sendOKLocked(struct timeval *when) {
   int recentsends;
 
   /* In case it's not okay to send, arbitrarily say to check back in one
@@ -392,7 +1006,8 @@ bool GroupScanStats::sendOK(struct timeval *when) {
 
   /* When there is only one target left, let the host congestion
      stuff deal with it. */
-  if (USI->numIncompleteHostsLessThan(2)) {
+  if (shared != NULL ? shared->num_incomplete_hosts < 2
+                     : USI->numIncompleteHostsLessThan(2)) {
     if (when)
       *when = USI->now;
     return true;
@@ -439,6 +1054,26 @@ static bool pingprobe_is_appropriate(const UltraScanInfo *USI,
   return false;
 }
 
+/* Sets *ports to the ports (or protocols) that a port scan probes and returns
+   how many there are. Returns 0 for other scans. */
+static int scan_ports(const UltraScanInfo *USI, const unsigned short **ports) {
+  if (USI->tcp_scan) {
+    *ports = USI->ports->tcp_ports;
+    return USI->ports->tcp_count;
+  } else if (USI->udp_scan) {
+    *ports = USI->ports->udp_ports;
+    return USI->ports->udp_count;
+  } else if (USI->sctp_scan) {
+    *ports = USI->ports->sctp_ports;
+    return USI->ports->sctp_count;
+  } else if (USI->prot_scan) {
+    *ports = USI->ports->prots;
+    return USI->ports->prot_count;
+  }
+  *ports = NULL;
+  return 0;
+}
+
 HostScanStats::HostScanStats(Target *t, UltraScanInfo *UltraSI) {
   target = t;
   USI = UltraSI;
@@ -477,6 +1112,22 @@ HostScanStats::HostScanStats(Target *t, UltraScanInfo *UltraSI) {
     memset(&target->pingprobe, 0, sizeof(target->pingprobe));
     target->pingprobe_state = PORT_UNKNOWN;
   }
+  HostCheckpoint *hc = target->checkpoint;
+  const unsigned short *ports;
+  int nports = scan_ports(USI, &ports);
+  if (hc != NULL && nports > 0) {
+    if (hc->scanDone(USI->scantype)) {
+      /* Finished before the scan was resumed. */
+      next_portidx = nports;
+    } else {
+      if (hc->cur_scan == USI->scantype && hc->cwnd > 0) {
+        timing.cwnd = hc->cwnd;
+        timing.ssthresh = hc->ssthresh;
+      }
+      hc->startScan(USI->scantype);
+      skipCheckpointedPorts();
+    }
+  }
 }
 
 HostScanStats::~HostScanStats() {
@@ -491,6 +1142,18 @@ HostScanStats::~HostScanStats() {
   }
 }
 
+void HostScanStats::skipCheckpointedPorts() {
+  const HostCheckpoint *hc = target->checkpoint;
+  const unsigned short *ports;
+  int nports;
+
+  if (hc == NULL || hc->cur_scan != USI->scantype)
+    return;
+  nports = scan_ports(USI, &ports);
+  while (next_portidx < nports && hc->portDone(ports[next_portidx]))
+    next_portidx++;
+}
+
 /* Called whenever a probe is sent to this host. Takes care of updating scan
    delay and rate limiting variables. */
 void HostScanStats::probeSent(unsigned int nbytes) {
@@ -538,7 +1201,6 @@ unsigned long HostScanStats::probeExpireTime(const UltraProbe *probe) {
    true. */
 bool HostScanStats::sendOK(struct timeval *when) {
   struct ultra_timing_vals tmng;
-  std::list<UltraProbe *>::iterator probeI;
   struct timeval probe_to, earliest_to, sendTime;
   long tdiff;
 
@@ -551,7 +1213,12 @@ bool HostScanStats::sendOK(struct timeval *when) {
   /* If the group stats say we need to send a probe to enforce a minimum
      scanning rate, then we need to step up and send a probe. */
   if (o.min_packet_send_rate != 0.0) {
-    if (TIMEVAL_SUBTRACT(USI->gstats->send_no_later_than, USI->now) <= 0) {
+    bool behind;
+
+    USI->gstats->lock();
+    behind = TIMEVAL_SUBTRACT(USI->gstats->send_no_later_than, USI->now) <= 0;
+    USI->gstats->unlock();
+    if (behind) {
       if (when)
         *when = USI->now;
       return true;
@@ -592,15 +1259,11 @@ bool HostScanStats::sendOK(struct timeval *when) {
 
   TIMEVAL_MSEC_ADD(earliest_to, USI->now, 10000);
 
-  // Any timeouts coming up?
-  for (probeI = probes_outstanding.begin(); probeI != probes_outstanding.end();
-       probeI++) {
-    if (!(*probeI)->timedout) {
-      TIMEVAL_MSEC_ADD(probe_to, (*probeI)->sent, probeTimeout() / 1000);
-      if (TIMEVAL_SUBTRACT(probe_to, earliest_to) < 0) {
-        earliest_to = probe_to;
-      }
-    }
+  // Any timeouts coming up? This is the next one in the whole scan, which
+  // may be early for this host but is never late.
+  if (USI->timers.nextDeadline(&probe_to)
+      && TIMEVAL_SUBTRACT(probe_to, earliest_to) < 0) {
+    earliest_to = probe_to;
   }
 
   // Will any scan delay affect this?
@@ -627,31 +1290,26 @@ bool HostScanStats::sendOK(struct timeval *when) {
   return false;
 }
 
-/* If there are pending probe timeouts, fills in when with the time of
-   the earliest one and returns true.  Otherwise returns false and
-   puts now in when. */
-bool HostScanStats::nextTimeout(struct timeval *when) {
-  struct timeval probe_to, earliest_to;
-  std::list<UltraProbe *>::iterator probeI;
-  bool firstgood = true;
-
-  assert(when);
-  memset(&probe_to, 0, sizeof(probe_to));
-  memset(&earliest_to, 0, sizeof(earliest_to));
+/* Puts the probe at probeI in USI->timers for its timeout if it is active,
+   otherwise for its expiry. Those move with the host's timeout, so the wait
+   is capped: an active probe is looked at again at least every
+   --min-rtt-timeout, and a timed out one every probeTimeout(), in case the
+   timeout has shrunk in the meantime. Too early is harmless, as processData
+   checks again and reschedules. */
+void HostScanStats::scheduleProbeTimer(std::list<UltraProbe *>::iterator probeI) {
+  UltraProbe *probe = *probeI;
+  struct timeval when, limit;
 
-  for (probeI = probes_outstanding.begin(); probeI != probes_outstanding.end();
-       probeI++) {
-    if (!(*probeI)->timedout) {
-      TIMEVAL_ADD(probe_to, (*probeI)->sent, probeTimeout());
-      if (firstgood || TIMEVAL_SUBTRACT(probe_to, earliest_to) < 0) {
-        earliest_to = probe_to;
-        firstgood = false;
-      }
-    }
+  if (!probe->timedout) {
+    TIMEVAL_ADD(when, probe->sent, probeTimeout());
+    TIMEVAL_MSEC_ADD(limit, USI->now, o.minRttTimeout());
+  } else {
+    TIMEVAL_ADD(when, probe->sent, probeExpireTime(probe));
+    TIMEVAL_ADD(limit, USI->now, probeTimeout());
   }
-
-  *when = (firstgood) ? USI->now : earliest_to;
-  return !firstgood;
+  if (TIMEVAL_AFTER(when, limit))
+    when = limit;
+  USI->timers.schedule(this, probeI, &when);
 }
 
 /* gives the maximum try number (try numbers start at zero and
@@ -705,24 +1363,35 @@ unsigned int HostScanStats::allowedTryno(bool *capped, bool *mayincrease) {
 
 
 UltraScanInfo::UltraScanInfo() {
+  feed = NULL;
 }
 
 UltraScanInfo::~UltraScanInfo() {
   std::multiset<HostScanStats *, HssPredicate>::iterator hostI;
+  Target *target;
 
   for (hostI = incompleteHosts.begin(); hostI != incompleteHosts.end(); hostI++) {
+    target = (*hostI)->target;
     delete *hostI;
+    if (feed)
+      feed->done(target);
   }
 
   for (hostI = completedHosts.begin(); hostI != completedHosts.end(); hostI++) {
+    target = (*hostI)->target;
     delete *hostI;
+    if (feed)
+      feed->done(target);
   }
 
   incompleteHosts.clear();
   completedHosts.clear();
+  hostIndex.clear();
 
   delete gstats;
   delete SPM;
+  delete sendq;
+  delete[] probeTemplates;
   if (rawsd >= 0) {
     close(rawsd);
     rawsd = -1;
@@ -832,9 +1501,35 @@ static void set_default_port_state(std::vector<Target *> &targets, stype scantyp
   }
 }
 
+/* Tops a rolling scan back up to its initial group size with new hosts from
+   feed, as completed hosts are retired. */
+void UltraScanInfo::admitHosts() {
+  std::vector<Target *> one(1);
+  HostScanStats *hss;
+  Target *target;
+
+  while (incompleteHosts.size() < numInitialTargets
+         && (target = feed->next()) != NULL) {
+    if (target->timedOut(&now)) {
+      gstats->num_hosts_timedout++;
+      feed->done(target);
+      continue;
+    }
+    one[0] = target;
+    set_default_port_state(one, scantype);
+    hss = new HostScanStats(target, this);
+    incompleteHosts.insert(hss);
+    hostIndex.insert(hss);
+    gstats->numtargets++;
+    if (incompleteHosts.size() == 1)
+      nextI = incompleteHosts.begin();
+  }
+}
+
 /* Order of initializations in this function CAN BE IMPORTANT, so be careful
  mucking with it. */
-void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts, stype scantp) {
+void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts, stype scantp,
+                         SharedGroupStats *shared, TargetFeed *feed) {
   unsigned int targetno = 0;
   HostScanStats *hss;
   int num_timedout = 0;
@@ -844,8 +1539,10 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
   ports = pts;
 
   seqmask = get_random_u32();
+  base_port = get_base_port();
   scantype = scantp;
-  SPM = new ScanProgressMeter(scantype2str(scantype));
+  this->feed = feed;
+  SPM = (shared == NULL) ? new ScanProgressMeter(scantype2str(scantype)) : NULL;
   send_rate_meter.start(&now);
   tcp_scan = udp_scan = sctp_scan = prot_scan = false;
   ping_scan = noresp_open_scan = ping_scan_arp = ping_scan_nd = false;
@@ -917,23 +1614,31 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
   completedHostLifetime = 120000;
   memset(&lastCompletedHostRemoval, 0, sizeof(lastCompletedHostRemoval));
 
+  if (!Targets.empty())
+    hostIndex.reserve(Targets.size(), Targets[0]->af());
   for (targetno = 0; targetno < Targets.size(); targetno++) {
     if (Targets[targetno]->timedOut(&now)) {
       num_timedout++;
+      if (feed)
+        feed->done(Targets[targetno]);
       continue;
     }
 
     hss = new HostScanStats(Targets[targetno], this);
     incompleteHosts.insert(hss);
+    hostIndex.insert(hss);
   }
   numInitialTargets = Targets.size();
   nextI = incompleteHosts.begin();
 
-  gstats = new GroupScanStats(this); /* Peeks at several elements in USI - careful of order */
+  gstats = new GroupScanStats(this, shared); /* Peeks at several elements in USI - careful of order */
   gstats->num_hosts_timedout += num_timedout;
 
   pd = NULL;
+  replies = NULL;
   rawsd = -1;
+  sendq = NULL;
+  probeTemplates = new PacketTemplate[2 * o.numdecoys];
   ethsd = NULL;
 
   /* See if we need an ethernet handle or raw socket. Basically, it's if we
@@ -968,10 +1673,20 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
       we won't be receiving on the socket anyway
       unblock_socket(rawsd);*/
       ethsd = NULL;
+      if (RawSendBatch::supported())
+        sendq = new RawSendBatch(rawsd);
     }
   }
 }
 
+/* Returns the template for building IPPROTO_TCP or IPPROTO_UDP probes from
+   the given decoy. */
+PacketTemplate *UltraScanInfo::probeTemplate(u8 proto, int decoy) {
+  assert(proto == IPPROTO_TCP || proto == IPPROTO_UDP);
+  assert(decoy >= 0 && decoy < o.numdecoys);
+  return &probeTemplates[2 * decoy + (proto == IPPROTO_UDP)];
+}
+
 /* Return the total number of probes that may be sent to each host. This never
    changes after initialization. */
 unsigned int UltraScanInfo::numProbesPerHost() {
@@ -1040,12 +1755,9 @@ bool UltraScanInfo::sendOK(struct timeval *when) {
       lowhtime = *when;
       // Can't do anything until global is OK - means packet receipt
       // or probe timeout.
-      for (host = incompleteHosts.begin(); host != incompleteHosts.end();
-           host++) {
-        if ((*host)->nextTimeout(&tmptv)) {
-          if (TIMEVAL_SUBTRACT(tmptv, lowhtime) < 0)
-            lowhtime = tmptv;
-        }
+      if (timers.nextDeadline(&tmptv)) {
+        if (TIMEVAL_SUBTRACT(tmptv, lowhtime) < 0)
+          lowhtime = tmptv;
       }
       *when = lowhtime;
     }
@@ -1070,8 +1782,10 @@ bool UltraScanInfo::sendOK(struct timeval *when) {
   /* Defer to the group stats if they need a shorter delay to enforce a minimum
      packet sending rate. */
   if (o.min_packet_send_rate != 0.0) {
+    gstats->lock();
     if (TIMEVAL_MSEC_SUBTRACT(gstats->send_no_later_than, lowhtime) < 0)
       lowhtime = gstats->send_no_later_than;
+    gstats->unlock();
   }
 
   if (TIMEVAL_MSEC_SUBTRACT(lowhtime, now) < 0)
@@ -1085,27 +1799,17 @@ bool UltraScanInfo::sendOK(struct timeval *when) {
 
 /* Find a HostScanStats by its IP address in the incomplete and completed lists.
    Returns NULL if none are found. */
-HostScanStats *UltraScanInfo::findHost(struct sockaddr_storage *ss) {
-  std::multiset<HostScanStats *, HssPredicate>::iterator hss;
-
-  HssPredicate::ss = ss;
-  HostScanStats *fakeHss = NULL;
-
-  hss = incompleteHosts.find(fakeHss);
-  if (hss != incompleteHosts.end()) {
-    if (o.debugging > 2)
-      log_write(LOG_STDOUT, "Found %s in incomplete hosts list.\n", (*hss)->target->targetipstr());
-    return *hss;
-  }
+HostScanStats *UltraScanInfo::findHost(const struct sockaddr_storage *ss) {
+  HostScanStats *hss;
 
-  hss = completedHosts.find(fakeHss);
-  if (hss != completedHosts.end()) {
-    if (o.debugging > 2)
-      log_write(LOG_STDOUT, "Found %s in completed hosts list.\n", (*hss)->target->targetipstr());
-    return *hss;
+  hss = hostIndex.find(ss);
+  if (hss != NULL && o.debugging > 2) {
+    /* completiontime is only set once a host moves to completedHosts. */
+    log_write(LOG_STDOUT, "Found %s in %s hosts list.\n", hss->target->targetipstr(),
+              (hss->completiontime.tv_sec == 0 && hss->completiontime.tv_usec == 0) ? "incomplete" : "completed");
   }
 
-  return NULL;
+  return hss;
 }
 
 /* Check if incompleteHosts list contains less than n elements. This function
@@ -1138,8 +1842,10 @@ int UltraScanInfo::removeCompletedHosts() {
   bool timedout = false;
   struct timeval compare;
 
-  /* We don't want to run this all of the time */
-  TIMEVAL_MSEC_ADD(compare, lastCompletedHostRemoval, completedHostLifetime / 2);
+  /* We don't want to run this all of the time. A rolling scan hands hosts
+     back as they go, so it looks more often. */
+  TIMEVAL_MSEC_ADD(compare, lastCompletedHostRemoval,
+                   feed ? 100 : completedHostLifetime / 2);
   if (TIMEVAL_AFTER(now, compare) ) {
     for (hostI = completedHosts.begin(); hostI != completedHosts.end(); hostI = nxt) {
       nxt = hostI;
@@ -1150,10 +1856,21 @@ int UltraScanInfo::removeCompletedHosts() {
       if (hss == gstats->pinghost)
         continue;
 
-      TIMEVAL_MSEC_ADD(compare, hss->completiontime, completedHostLifetime);
+      /* A rolling scan only waits until the last of the host's probes
+         would have expired, so that its results are out soon. */
+      if (feed)
+        TIMEVAL_ADD(compare, hss->completiontime, hss->probeExpireTime(NULL))
+      else
+        TIMEVAL_MSEC_ADD(compare, hss->completiontime, completedHostLifetime);
       if (TIMEVAL_AFTER(now, compare) ) {
+        hostIndex.erase(hss);
         completedHosts.erase(hostI);
         hostsRemoved++;
+        if (feed) {
+          Target *target = hss->target;
+          delete hss;
+          feed->done(target);
+        }
       }
     }
     lastCompletedHostRemoval = now;
@@ -1172,7 +1889,7 @@ int UltraScanInfo::removeCompletedHosts() {
         if (nextI == incompleteHosts.end())
           nextI = incompleteHosts.begin();
       }
-      if (o.verbose && gstats->numprobes > 50) {
+      if (o.verbose && SPM && gstats->numprobes > 50) {
         int remain = incompleteHosts.size() - 1;
         if (remain && !timedout)
           log_write(LOG_STDOUT, "Completed %s against %s in %.2fs (%d %s)\n",
@@ -1198,8 +1915,11 @@ int UltraScanInfo::removeCompletedHosts() {
         }
       }
       hss->completiontime = now;
+      if (hss->target->checkpoint != NULL && (tcp_scan || udp_scan || sctp_scan || prot_scan))
+        hss->target->checkpoint->setScanDone(scantype);
       completedHosts.insert(hss);
       incompleteHosts.erase(hostI);
+      gstats->hostCompleted();
       hostsRemoved++;
       /* Consider making this host the new global ping host during its
          retirement in the completed hosts list. */
@@ -1525,6 +2245,30 @@ int HostScanStats::freshPortsLeft() {
   return 0;
 }
 
+/* Appends a newly sent probe to probes_outstanding (and probes_by_key if
+   it is an IP probe) and schedules its timeout. Does not touch any of the
+   active probe counts. */
+void HostScanStats::addOutstandingProbe(UltraProbe *probe) {
+  std::list<UltraProbe *>::iterator probeI;
+
+  probeI = probes_outstanding.insert(probes_outstanding.end(), probe);
+  if (probe->type == UltraProbe::UP_IP) {
+    probes_by_key.insert(ProbeIndex::key(probe->protocol(), probe->sport(),
+                                         probe->dport()), probeI);
+  }
+  scheduleProbeTimer(probeI);
+}
+
+/* Removes the probes_by_key entry for the given probe, if any. */
+void HostScanStats::unindexProbe(std::list<UltraProbe *>::iterator probeI) {
+  const UltraProbe *probe = *probeI;
+
+  if (probe->type != UltraProbe::UP_IP)
+    return;
+  probes_by_key.erase(ProbeIndex::key(probe->protocol(), probe->sport(),
+                                      probe->dport()), probeI);
+}
+
 /* Removes a probe from probes_outstanding, adjusts HSS and USS
    active probe stats accordingly, then deletes the probe. */
 void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator probeI) {
@@ -1533,8 +2277,10 @@ void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator pr
   if (!probe->timedout) {
     assert(num_probes_active > 0);
     num_probes_active--;
+    USI->gstats->lock();
     assert(USI->gstats->num_probes_active > 0);
     USI->gstats->num_probes_active--;
+    USI->gstats->unlock();
   }
 
   if (!probe->isPing() && probe->timedout && !probe->retransmitted) {
@@ -1546,8 +2292,10 @@ void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator pr
   if (probe->type == UltraProbe::UP_CONNECT && probe->CP()->sd > 0)
     USI->gstats->CSI->clearSD(probe->CP()->sd);
 
+  unindexProbe(probeI);
+  USI->timers.cancel(probe);
   probes_outstanding.erase(probeI);
-  delete probe;
+  USI->probePool.put(probe);
 }
 
 /* Removes all probes from probes_outstanding using
@@ -1587,6 +2335,7 @@ static void ultrascan_adjust_timing(UltraScanInfo *USI, HostScanStats *hss,
                                     struct timeval *rcvdtime) {
   int ping_magnifier = (probe->isPing()) ? USI->perf.ping_magnifier : 1;
 
+  USI->gstats->lock();
   USI->gstats->timing.num_replies_expected++;
   USI->gstats->timing.num_updates++;
 
@@ -1615,6 +2364,7 @@ static void ultrascan_adjust_timing(UltraScanInfo *USI, HostScanStats *hss,
     USI->gstats->timing.ack(&USI->perf, ping_magnifier);
     hss->timing.ack(&USI->perf, ping_magnifier);
   }
+  USI->gstats->unlock();
 
   /* If packet drops are particularly bad, enforce a delay between
      packet sends (useful for cases such as UDP scan where responses
@@ -1654,8 +2404,10 @@ void HostScanStats::markProbeTimedout(std::list<UltraProbe *>::iterator probeI)
   probe->timedout = true;
   assert(num_probes_active > 0);
   num_probes_active--;
+  USI->gstats->lock();
   assert(USI->gstats->num_probes_active > 0);
   USI->gstats->num_probes_active--;
+  USI->gstats->unlock();
   ultrascan_adjust_timing(USI, this, probe, NULL);
   if (!probe->isPing())
     /* I'll leave it in the queue in case some response ever does come */
@@ -1668,6 +2420,7 @@ void HostScanStats::markProbeTimedout(std::list<UltraProbe *>::iterator probeI)
     close(probe->CP()->sd);
     probe->CP()->sd = -1;
   }
+  scheduleProbeTimer(probeI);
 }
 
 bool HostScanStats::completed() {
@@ -1704,10 +2457,13 @@ void HostScanStats::getTiming(struct ultra_timing_vals *tmng) {
   }
 
   /* Otherwise, use the global cwnd stats if it has sufficient responses */
+  USI->gstats->lock();
   if (USI->gstats->timing.num_updates > 1) {
     *tmng = USI->gstats->timing;
+    USI->gstats->unlock();
     return;
   }
+  USI->gstats->unlock();
 
   /* Last resort is to use canned values */
   tmng->cwnd = USI->perf.host_initial_cwnd;
@@ -1933,9 +2689,11 @@ void HostScanStats::moveProbeToBench(std::list<UltraProbe *>::iterator probeI) {
     probe_bench.reserve(128);
   }
   probe_bench.push_back(*probe->pspec());
+  unindexProbe(probeI);
+  USI->timers.cancel(probe);
   probes_outstanding.erase(probeI);
   num_probes_waiting_retransmit--;
-  delete probe;
+  USI->probePool.put(probe);
 }
 
 /* Called when a ping response is discovered. If adjust_timing is false, timing
@@ -2166,6 +2924,8 @@ static void sendNextScanProbe(UltraScanInfo *USI, HostScanStats *hss) {
   if (get_next_target_probe(USI, hss, &pspec) == -1) {
     fatal("%s: No more probes! Error in Nmap.", __func__);
   }
+  /* So that freshPortsLeft() doesn't count finished ports. */
+  hss->skipCheckpointedPorts();
   hss->numprobes_sent++;
   USI->gstats->probes_sent++;
   if (pspec.type == PS_ARP)
@@ -2390,9 +3150,10 @@ static void doAnyOutstandingRetransmits(UltraScanInfo *USI) {
          hostI != USI->incompleteHosts.end() && USI->gstats->sendOK(NULL);
          hostI++) {
       host = *hostI;
-      /* Skip this host if it has nothing to send. */
-      if ((host->num_probes_active == 0
-           && host->num_probes_waiting_retransmit == 0))
+      /* Skip this host if it has nothing to retransmit. Only timed out
+         probes that have not been retransmitted yet are candidates, and
+         those are what num_probes_waiting_retransmit counts. */
+      if (host->num_probes_waiting_retransmit == 0)
         continue;
       if (!host->sendOK(NULL))
         continue;
@@ -2478,7 +3239,7 @@ static void printAnyStats(UltraScanInfo *USI) {
     USI->log_overall_rates(LOG_PLAIN);
   }
 
-  if (USI->SPM->mayBePrinted(&USI->now))
+  if (USI->SPM && USI->SPM->mayBePrinted(&USI->now))
     USI->SPM->printStatsIfNecessary(USI->getCompletionFraction(), &USI->now);
 }
 
@@ -2501,7 +3262,7 @@ static void waitForResponses(UltraScanInfo *USI) {
         gotone = get_ping_pcap_result(USI, &stime);
       if (!gotone && USI->ptech.connecttcpscan)
         gotone = do_one_select_round(USI, &stime);
-    } else if (USI->pd) {
+    } else if (USI->pd || USI->replies) {
       gotone = get_pcap_result(USI, &stime);
     } else if (USI->scantype == CONNECT_SCAN) {
       gotone = do_one_select_round(USI, &stime);
@@ -2521,6 +3282,10 @@ static void processData(UltraScanInfo *USI) {
   UltraProbe *probe = NULL;
   unsigned int maxtries = 0;
   int expire_us = 0;
+  std::vector<UltraProbe *> due;
+  std::map<HostScanStats *, std::pair<unsigned int, bool> > trynos;
+  std::map<HostScanStats *, std::pair<unsigned int, bool> >::iterator trynoI;
+  unsigned int i;
 
   bool tryno_capped = false, tryno_mayincrease = false;
   struct timeval tv_start = {0};
@@ -2535,17 +3300,15 @@ static void processData(UltraScanInfo *USI) {
   if (USI->incompleteHostsEmpty())
     return;
 
-  /* Run through probe lists to:
-     1) Mark timedout entries as such
-     2) Remove long-expired and retransmitted entries
-     3) Detect if we are done (we may just have a bunch of probes
-        sitting around waiting to see if another round of
-        retransmissions will be required).
-  */
+  /* Whether to dump the bench, and whether to give up on timed out probes
+     that can't be retransmitted, depend on the host's tryno limit rather
+     than on time. Only hosts with probes on the bench or waiting for
+     retransmission can be affected. */
   for (hostI = USI->incompleteHosts.begin();
        hostI != USI->incompleteHosts.end(); hostI++) {
     host = *hostI;
-    /* Look for timedout or long expired entries */
+    if (host->probe_bench.empty() && host->num_probes_waiting_retransmit == 0)
+      continue;
     maxtries = host->allowedTryno(&tryno_capped, &tryno_mayincrease);
 
     /* Should we dump everyone off the bench? */
@@ -2560,61 +3323,94 @@ static void processData(UltraScanInfo *USI) {
       }
     }
 
+    if (tryno_mayincrease || host->num_probes_waiting_retransmit == 0)
+      continue;
     for (probeI = host->probes_outstanding.begin();
          probeI != host->probes_outstanding.end(); probeI = nextProbeI) {
       nextProbeI = probeI;
       nextProbeI++;
       probe = *probeI;
 
-      // give up completely after this long
-      expire_us = host->probeExpireTime(probe);
+      if (!probe->isPing() && probe->timedout && !probe->retransmitted
+          && probe->tryno >= maxtries) {
+        if (tryno_capped && !host->retry_capped_warned) {
+          log_write(LOG_PLAIN, "Warning: %s giving up on port because"
+                    " retransmission cap hit (%d).\n", host->target->targetipstr(),
+                    probe->tryno);
+          host->retry_capped_warned = true;
+        }
+        if (USI->ping_scan) {
+          ultrascan_host_probe_update(USI, host, probeI, HOST_DOWN, NULL);
+          if (host->target->reason.reason_id == ER_UNKNOWN)
+            host->target->reason.reason_id = ER_NORESPONSE;
+        } else {
+          /* No ultrascan_port_probe_update because that allocates a Port
+             object; the default port state as set by setDefaultPortState
+             handles these no-response ports. */
+          host->destroyOutstandingProbe(probeI);
+        }
+      }
+    }
+  }
+
+  /* Now the probes whose time has come, to:
+     1) Mark timedout entries as such
+     2) Remove long-expired and retransmitted entries
+     3) Detect if we are done (we may just have a bunch of probes
+        sitting around waiting to see if another round of
+        retransmissions will be required).
+     Probes newly marked timed out are left for the next round, so the
+     other functions have a chance to see that they timed out first. In
+     particular, timing out a probe may mean that the tryno can no longer
+     increase. */
+  USI->timers.expire(&USI->now, due);
+  for (i = 0; i < due.size(); i++) {
+    probe = due[i];
+    host = probe->timer_hss;
+    probeI = probe->timer_probeI;
+
+    /* Probes of hosts in completedHosts are left alone until the host goes. */
+    if (host->completiontime.tv_sec != 0 || host->completiontime.tv_usec != 0)
+      continue;
 
-      if (!probe->timedout && TIMEVAL_SUBTRACT(USI->now, probe->sent) >
-          (long) host->probeTimeout()) {
+    if (!probe->timedout) {
+      if (TIMEVAL_SUBTRACT(USI->now, probe->sent) > (long) host->probeTimeout())
         host->markProbeTimedout(probeI);
-        /* Once we've timed out a probe, skip it for this round of processData.
-           We don't want it to move to the bench or anything until the other
-           functions have had a chance to see that it's timed out. In
-           particular, timing out a probe may mean that the tryno can no longer
-           increase, which would make the logic below incorrect. */
-        continue;
-      }
+      else
+        host->scheduleProbeTimer(probeI);
+      continue;
+    }
 
-      if (!probe->isPing() && probe->timedout && !probe->retransmitted) {
-        if (!tryno_mayincrease && probe->tryno >= maxtries) {
-          if (tryno_capped && !host->retry_capped_warned) {
-            log_write(LOG_PLAIN, "Warning: %s giving up on port because"
-                      " retransmission cap hit (%d).\n", host->target->targetipstr(),
-                      probe->tryno);
-            host->retry_capped_warned = true;
-          }
-          if (USI->ping_scan) {
-            ultrascan_host_probe_update(USI, host, probeI, HOST_DOWN, NULL);
-            if (host->target->reason.reason_id == ER_UNKNOWN)
-              host->target->reason.reason_id = ER_NORESPONSE;
-          } else {
-            /* No ultrascan_port_probe_update because that allocates a Port
-               object; the default port state as set by setDefaultPortState
-               handles these no-response ports. */
-            host->destroyOutstandingProbe(probeI);
-          }
-          continue;
-        } else if (probe->tryno >= maxtries &&
-                   TIMEVAL_SUBTRACT(USI->now, probe->sent) > expire_us) {
-          assert(probe->tryno == maxtries);
-          /* Move it to the bench until it is needed (maxtries
-             increases or is capped */
-          host->moveProbeToBench(probeI);
-          continue;
-        }
-      }
+    // give up completely after this long
+    expire_us = host->probeExpireTime(probe);
+    if (TIMEVAL_SUBTRACT(USI->now, probe->sent) <= expire_us) {
+      host->scheduleProbeTimer(probeI);
+      continue;
+    }
 
-      if ((probe->isPing() || (probe->timedout && probe->retransmitted)) &&
-          TIMEVAL_SUBTRACT(USI->now, probe->sent) > expire_us) {
-        host->destroyOutstandingProbe(probeI);
-        continue;
-      }
+    if (probe->isPing() || probe->retransmitted) {
+      host->destroyOutstandingProbe(probeI);
+      continue;
+    }
+
+    /* Timed out but not retransmitted. */
+    trynoI = trynos.find(host);
+    if (trynoI == trynos.end()) {
+      maxtries = host->allowedTryno(NULL, &tryno_mayincrease);
+      trynoI = trynos.insert(std::make_pair(host, std::make_pair(maxtries, tryno_mayincrease))).first;
     }
+    maxtries = trynoI->second.first;
+    tryno_mayincrease = trynoI->second.second;
+    if (probe->tryno >= maxtries && tryno_mayincrease) {
+      assert(probe->tryno == maxtries);
+      /* Move it to the bench until it is needed (maxtries
+         increases or is capped */
+      host->moveProbeToBench(probeI);
+      continue;
+    }
+    /* Either it's still to be retransmitted, or the loop above will give up
+       on it next round. */
+    host->scheduleProbeTimer(probeI);
   }
 
   /* In case any hosts were completed during this run */
@@ -2648,6 +3444,215 @@ static void processData(UltraScanInfo *USI) {
   }
 }
 
+/* The port or protocol number a port scan probe is for. */
+static u16 pspec_portno(const probespec *pspec) {
+  switch (pspec->type) {
+  case PS_TCP:
+  case PS_CONNECTTCP:
+    return pspec->pd.tcp.dport;
+  case PS_UDP:
+    return pspec->pd.udp.dport;
+  case PS_SCTP:
+    return pspec->pd.sctp.dport;
+  case PS_PROTO:
+    return pspec->proto;
+  default:
+    return 0;
+  }
+}
+
+/* Notes in each incomplete host's checkpoint state the ports that need no more
+   probes, and writes a checkpoint. Ports with probes outstanding or waiting
+   to be retransmitted are not finished. */
+static void checkpoint_scan_progress(UltraScanInfo *USI) {
+  std::multiset<HostScanStats *, HssPredicate>::iterator hostI;
+  std::list<UltraProbe *>::iterator probeI;
+  std::vector<probespec>::iterator pspecI;
+  const unsigned short *ports;
+  HostScanStats *hss;
+  HostCheckpoint *hc;
+  int nports, i;
+
+  nports = scan_ports(USI, &ports);
+  for (hostI = USI->incompleteHosts.begin(); nports > 0 && hostI != USI->incompleteHosts.end(); hostI++) {
+    hss = *hostI;
+    hc = hss->target->checkpoint;
+    if (hc == NULL)
+      continue;
+    for (i = 0; i < hss->next_portidx && i < nports; i++)
+      hc->setPortDone(ports[i], true);
+    for (probeI = hss->probes_outstanding.begin(); probeI != hss->probes_outstanding.end(); probeI++) {
+      if (!(*probeI)->isPing())
+        hc->setPortDone(pspec_portno((*probeI)->pspec()), false);
+    }
+    for (pspecI = hss->probe_bench.begin(); pspecI != hss->probe_bench.end(); pspecI++)
+      hc->setPortDone(pspec_portno(&*pspecI), false);
+    for (pspecI = hss->retry_stack.begin(); pspecI != hss->retry_stack.end(); pspecI++)
+      hc->setPortDone(pspec_portno(&*pspecI), false);
+    hc->cwnd = hss->timing.cwnd;
+    hc->ssthresh = hss->timing.ssthresh;
+  }
+  checkpoint_write();
+}
+
+/* Runs a scan set up by the UltraScanInfo constructor until every host in it
+   is complete. */
+static void ultra_scan_loop(UltraScanInfo *USI) {
+  while (!USI->incompleteHostsEmpty()) {
+    doAnyPings(USI);
+    doAnyOutstandingRetransmits(USI); // Retransmits from probes_outstanding
+    /* Retransmits from retry_stack -- goes after OutstandingRetransmits for
+       memory consumption reasons */
+    doAnyRetryStackRetransmits(USI);
+    doAnyNewProbes(USI);
+    if (USI->sendq)
+      USI->sendq->flush();
+    gettimeofday(&USI->now, NULL);
+    // printf("TRACE: Finished doAnyNewProbes() at %.4fs\n", o.TimeSinceStartMS(&USI->now) / 1000.0);
+    printAnyStats(USI);
+    waitForResponses(USI);
+    gettimeofday(&USI->now, NULL);
+    // printf("TRACE: Finished waitForResponses() at %.4fs\n", o.TimeSinceStartMS(&USI->now) / 1000.0);
+    processData(USI);
+    if (USI->feed)
+      USI->admitHosts();
+    if (checkpoint_due(&USI->now))
+      checkpoint_scan_progress(USI);
+
+    if (USI->SPM && keyWasPressed()) {
+      // This prints something like
+      // SYN Stealth Scan Timing: About 1.14% done; ETC: 15:01 (0:43:23 remaining);
+      USI->SPM->printStats(USI->getCompletionFraction(), NULL);
+      if (o.debugging) {
+        /* Don't update when getting the current rates, otherwise we can get
+           anomalies (rates are too low) from having just done a potentially
+           long waitForResponses without sending any packets. */
+        USI->log_current_rates(LOG_STDOUT, false);
+      }
+
+      log_flush(LOG_STDOUT);
+    }
+  }
+
+  USI->send_rate_meter.stop(&USI->now);
+}
+
+#if HAVE_PTHREAD
+/* Returns how many threads (--scan-threads) to split this scan of Targets
+   across, or 1 to run it in the calling thread. Only the raw port scans are
+   split: their hosts share nothing but the rate limits and the group
+   congestion window, which the workers keep in a SharedGroupStats. Scans that carry timing between calls (to),
+   print per-packet traces, or are rate limited by --scan-delay stay in one
+   thread. */
+static int ultra_scan_nworkers(std::vector<Target *> &Targets, stype scantype,
+                               struct timeout_info *to, TargetFeed *feed) {
+  if (o.scan_threads <= 1 || to != NULL || feed != NULL || o.packetTrace()
+      || o.debugging > 1 || o.scan_delay)
+    return 1;
+
+  switch (scantype) {
+  case SYN_SCAN:
+  case ACK_SCAN:
+  case WINDOW_SCAN:
+  case FIN_SCAN:
+  case XMAS_SCAN:
+  case NULL_SCAN:
+  case MAIMON_SCAN:
+  case UDP_SCAN:
+  case SCTP_INIT_SCAN:
+  case SCTP_COOKIE_ECHO_SCAN:
+    break;
+  default:
+    return 1;
+  }
+
+  return MIN(o.scan_threads, (int) Targets.size());
+}
+
+static void *ultra_scan_worker(void *arg) {
+  ultra_scan_loop((UltraScanInfo *) arg);
+  return NULL;
+}
+
+/* Scans Targets with nworkers threads, each running its own UltraScanInfo
+   (and so its own raw socket and host congestion control) over a disjoint
+   share of the hosts. They share the rate schedule and group congestion
+   window, and one sniffer, whose thread hands each reply to the worker of
+   its host. */
+static void ultra_scan_threaded(std::vector<Target *> &Targets,
+                                struct scan_lists *ports, stype scantype,
+                                int nworkers) {
+  std::vector<std::vector<Target *> > shards(nworkers);
+  std::vector<UltraScanInfo *> workers;
+  std::vector<pthread_t> threads(nworkers);
+  SharedGroupStats shared;
+  SharedSniffer *sniffer;
+  ScanProgressMeter *SPM;
+  int numprobes, timedout;
+  unsigned int i;
+  int w;
+
+  for (i = 0; i < Targets.size(); i++)
+    shards[i % nworkers].push_back(Targets[i]);
+  for (w = 0; w < nworkers; w++)
+    workers.push_back(new UltraScanInfo(shards[w], ports, scantype, &shared));
+
+  numprobes = workers[0]->gstats->numprobes;
+  if (numprobes <= 0) {
+    if (o.debugging) {
+      log_write(LOG_STDOUT, "Skipping %s: no probes to send\n", scantype2str(scantype));
+    }
+    for (w = 0; w < nworkers; w++)
+      delete workers[w];
+    return;
+  }
+
+  SPM = new ScanProgressMeter(scantype2str(scantype));
+  if (o.verbose) {
+    log_write(LOG_STDOUT, "Scanning %d hosts [%d port%s/host] with %d threads\n",
+              (int) Targets.size(), numprobes, (numprobes != 1) ? "s" : "",
+              nworkers);
+  }
+
+  /* One sniffer, filtered for all of Targets, takes the replies for every
+     worker. begin_sniffer opens it on the first worker, which gives it up. */
+  begin_sniffer(workers[0], Targets);
+  sniffer = new SharedSniffer(workers[0]->pd, workers);
+  workers[0]->pd = NULL;
+  sniffer->start();
+
+  for (w = 0; w < nworkers; w++) {
+    if (pthread_create(&threads[w], NULL, ultra_scan_worker, workers[w]) != 0)
+      fatal("%s: failed to create scan thread", __func__);
+  }
+  timedout = 0;
+  for (w = 0; w < nworkers; w++) {
+    pthread_join(threads[w], NULL);
+    timedout += workers[w]->gstats->num_hosts_timedout;
+  }
+  delete sniffer;
+
+  if (o.verbose) {
+    char additional_info[128];
+    if (timedout == 0)
+      Snprintf(additional_info, sizeof(additional_info), "%lu total ports",
+               (unsigned long) numprobes * Targets.size());
+    else Snprintf(additional_info, sizeof(additional_info), "%d %s timed out",
+                    timedout, (timedout == 1) ? "host" : "hosts");
+    SPM->endTask(NULL, additional_info);
+  }
+  for (w = 0; w < nworkers; w++) {
+    if (o.debugging) {
+      log_write(LOG_STDOUT, "Thread %d of %d:\n", w + 1, nworkers);
+      workers[w]->log_overall_rates(LOG_STDOUT);
+      workers[w]->probePool.log_stats(LOG_STDOUT);
+    }
+    delete workers[w];
+  }
+  delete SPM;
+}
+#endif
+
 /* 3rd generation Nmap scanning function. Handles most Nmap port scan types.
 
    The parameter to gives group timing information, and if it is not NULL,
@@ -2655,7 +3660,7 @@ static void processData(UltraScanInfo *USI) {
    exists so timing can be shared across invocations of this function. If to is
    NULL (its default value), a default timeout_info will be used. */
 void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
-                stype scantype, struct timeout_info *to) {
+                stype scantype, struct timeout_info *to, TargetFeed *feed) {
   o.current_scantype = scantype;
 
   increment_base_port();
@@ -2678,7 +3683,15 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
   // Set the variable for status printing
   o.numhosts_scanning = Targets.size();
 
-  UltraScanInfo USI(Targets, ports, scantype);
+#if HAVE_PTHREAD
+  int nworkers = ultra_scan_nworkers(Targets, scantype, to, feed);
+  if (nworkers > 1) {
+    ultra_scan_threaded(Targets, ports, scantype, nworkers);
+    return;
+  }
+#endif
+
+  UltraScanInfo USI(Targets, ports, scantype, NULL, feed);
 
   if (USI.gstats->numprobes <= 0) {
     if (o.debugging) {
@@ -2704,37 +3717,7 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
     begin_sniffer(&USI, Targets);
   /* Otherwise, no sniffer needed! */
 
-  while (!USI.incompleteHostsEmpty()) {
-    doAnyPings(&USI);
-    doAnyOutstandingRetransmits(&USI); // Retransmits from probes_outstanding
-    /* Retransmits from retry_stack -- goes after OutstandingRetransmits for
-       memory consumption reasons */
-    doAnyRetryStackRetransmits(&USI);
-    doAnyNewProbes(&USI);
-    gettimeofday(&USI.now, NULL);
-    // printf("TRACE: Finished doAnyNewProbes() at %.4fs\n", o.TimeSinceStartMS(&USI.now) / 1000.0);
-    printAnyStats(&USI);
-    waitForResponses(&USI);
-    gettimeofday(&USI.now, NULL);
-    // printf("TRACE: Finished waitForResponses() at %.4fs\n", o.TimeSinceStartMS(&USI.now) / 1000.0);
-    processData(&USI);
-
-    if (keyWasPressed()) {
-      // This prints something like
-      // SYN Stealth Scan Timing: About 1.14% done; ETC: 15:01 (0:43:23 remaining);
-      USI.SPM->printStats(USI.getCompletionFraction(), NULL);
-      if (o.debugging) {
-        /* Don't update when getting the current rates, otherwise we can get
-           anomalies (rates are too low) from having just done a potentially
-           long waitForResponses without sending any packets. */
-        USI.log_current_rates(LOG_STDOUT, false);
-      }
-
-      log_flush(LOG_STDOUT);
-    }
-  }
-
-  USI.send_rate_meter.stop(&USI.now);
+  ultra_scan_loop(&USI);
 
   /* Save the computed timeouts. */
   if (to != NULL)
@@ -2748,15 +3731,17 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
                  (unsigned long) Targets.size());
       } else {
         Snprintf(additional_info, sizeof(additional_info), "%lu total ports",
-                 (unsigned long) USI.gstats->numprobes * Targets.size());
+                 (unsigned long) USI.gstats->numprobes * USI.gstats->numtargets);
       }
     else Snprintf(additional_info, sizeof(additional_info), "%d %s timed out",
                     USI.gstats->num_hosts_timedout,
                     (USI.gstats->num_hosts_timedout == 1) ? "host" : "hosts");
     USI.SPM->endTask(NULL, additional_info);
   }
-  if (o.debugging)
+  if (o.debugging) {
     USI.log_overall_rates(LOG_STDOUT);
+    USI.probePool.log_stats(LOG_STDOUT);
+  }
 
   if (o.debugging > 2 && USI.pd != NULL)
     pcap_print_stats(LOG_PLAIN, USI.pd);
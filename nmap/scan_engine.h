@@ -66,6 +66,7 @@
 #ifndef SCAN_ENGINE_H
 #define SCAN_ENGINE_H
 
+#include "nmap.h"
 #include "scan_lists.h"
 #include "probespec.h"
 
@@ -75,14 +76,43 @@
 
 #include <pcap.h>
 #include <list>
+#include <map>
 #include <vector>
 #include <set>
 #include <algorithm>
+
+#if HAVE_PTHREAD
+#include <deque>
+#include <pthread.h>
+#include "libnetutil/netutil.h" /* struct link_header */
+#endif
+
 class Target;
+class RawSendBatch;
+class PacketTemplate;
 
-/* 3rd generation Nmap scanning function.  Handles most Nmap port scan types */
+/* Hands ultra_scan more targets as hosts finish, so the scan never waits on
+   its slowest hosts with nothing else to do (--rolling-hostgroup). */
+class TargetFeed {
+public:
+  virtual ~TargetFeed() {}
+  /* Returns the next target to scan, or NULL if there are no more for this
+     scan. It must be fit to join the scan's host group (see
+     target_needs_new_hostgroup). This is called from the scan loop, so it
+     must not block. */
+  virtual Target *next() = 0;
+  /* Called with every target of the scan, from the initial Targets or from
+     next(), once the scan is done with it. */
+  virtual void done(Target *target) = 0;
+};
+
+/* 3rd generation Nmap scanning function.  Handles most Nmap port scan types.
+   If feed is not NULL, the scan keeps admitting hosts from it to keep
+   Targets.size() hosts in progress, and hands each one back to it when
+   done. */
 void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
-                stype scantype, struct timeout_info *to = NULL);
+                stype scantype, struct timeout_info *to = NULL,
+                TargetFeed *feed = NULL);
 
 /* Determines an ideal number of hosts to be scanned (port scan, os
    scan, version detection, etc.) in parallel after the ping scan is
@@ -96,6 +126,7 @@ int determineScanGroupSize(int hosts_scanned_so_far,
                            struct scan_lists *ports);
 
 class UltraScanInfo;
+class HostScanStats;
 
 struct ppkt { /* Beginning of ICMP Echo/Timestamp header         */
   u8 type;
@@ -209,6 +240,13 @@ public:
     return pingseq > 0;
   }
 
+  /* Bookkeeping for ProbeTimerWheel, which owns these fields. */
+  UltraProbe *timer_next;
+  UltraProbe **timer_pprev; /* NULL if the probe is not scheduled */
+  unsigned long timer_tick;
+  HostScanStats *timer_hss;
+  std::list<UltraProbe *>::iterator timer_probeI;
+
 private:
   probespec mypspec; /* Filled in by the appropriate set* function */
   union {
@@ -218,22 +256,130 @@ private:
   } probes;
 };
 
+/* Hands out UltraProbes for one ultra_scan. Probes are carved from slabs
+   of PROBE_POOL_SLAB_SIZE and recycled through a free list rather than
+   going back to the heap, since a large scan makes and destroys millions of
+   them. */
+#define PROBE_POOL_SLAB_SIZE 256
+class UltraProbePool {
+public:
+  UltraProbePool();
+  ~UltraProbePool();
+  /* Returns a newly constructed probe. */
+  UltraProbe *get();
+  /* Destroys a probe from get() and keeps its memory for reuse. */
+  void put(UltraProbe *probe);
+  /* Writes slab count and high-water mark to the given log. */
+  void log_stats(int logt) const;
+
+private:
+  std::vector<void *> slabs;
+  std::vector<void *> freelist;
+  unsigned int in_use;
+  unsigned int high_water;
+};
+
+/* A hierarchical timing wheel of the outstanding probes of one scan, keyed
+   on the next time processData needs to look at each of them (its timeout
+   while it is active, then its expiry). Time is counted in millisecond
+   ticks since the wheel was made. The first level holds the next 256
+   ticks one slot per tick; each level above covers 64 times as much with a
+   slot per level below, and its slots are cascaded down as their time
+   comes. So scheduling, cancelling, and handing out a probe are all O(1),
+   and processData only ever sees the probes that are due. */
+#define TIMER_WHEEL_L0_BITS 8
+#define TIMER_WHEEL_LN_BITS 6
+#define TIMER_WHEEL_LEVELS 3
+class ProbeTimerWheel {
+public:
+  ProbeTimerWheel();
+  /* Schedules (or reschedules) the probe at probeI in hss->probes_outstanding
+     for when. A time in the past is due at the next expire(). */
+  void schedule(HostScanStats *hss, std::list<UltraProbe *>::iterator probeI,
+                const struct timeval *when);
+  /* Unschedules a probe, if it is scheduled. */
+  void cancel(UltraProbe *probe);
+  /* Unschedules every probe due at or before now and appends it to due. */
+  void expire(const struct timeval *now, std::vector<UltraProbe *> &due);
+  /* If any probe is scheduled, puts the earliest time one is due in when
+     and returns true. */
+  bool nextDeadline(struct timeval *when) const;
+
+private:
+  unsigned long tickOf(const struct timeval *tv) const;
+  void link(UltraProbe *probe);
+  void cascade(int level, unsigned int slot);
+  UltraProbe *minInSlot(UltraProbe *head) const;
+
+  UltraProbe *l0[1 << TIMER_WHEEL_L0_BITS];
+  UltraProbe *ln[TIMER_WHEEL_LEVELS - 1][1 << TIMER_WHEEL_LN_BITS];
+  struct timeval base;
+  unsigned long cur_tick; /* Every probe due at or before this is handed out */
+  unsigned int count;
+  /* nextDeadline is called for every host that can't send, so its answer
+     is kept until something may have changed it. 0 means unknown. */
+  mutable unsigned long next_tick;
+};
+
+/* A hash table from a probe's (protocol, sport, dport) key to the
+   outstanding probes sent with it, in send order. This is what lets a
+   received reply find its candidate probes in constant time, however many
+   probes are outstanding. */
+class ProbeIndex {
+public:
+  typedef std::vector<std::list<UltraProbe *>::iterator> Bucket;
+  ProbeIndex();
+  static u64 key(u8 proto, u16 sport, u16 dport) {
+    return ((u64) proto << 32) | ((u32) sport << 16) | dport;
+  }
+  /* Appends probeI to the bucket for key. */
+  void insert(u64 key, std::list<UltraProbe *>::iterator probeI);
+  /* Removes probeI from the bucket for key, where it must be. */
+  void erase(u64 key, std::list<UltraProbe *>::iterator probeI);
+  /* Returns the bucket for key, or NULL if it is empty. The pointer is good
+     until the next insert or erase. */
+  const Bucket *find(u64 key) const;
+
+private:
+  unsigned int slotOf(u64 key) const;
+  unsigned int newSlot(u64 key);
+  void rehash(unsigned int capacity);
+  unsigned int capacity; /* Always 0 or a power of two */
+  unsigned int used; /* Occupied slots, including deleted ones */
+  unsigned int live; /* Occupied slots that hold a bucket */
+  std::vector<u8> state;
+  std::vector<u64> keys;
+  std::vector<Bucket> buckets;
+};
+
 /* Global info for the connect scan */
 class ConnectScanInfo {
 public:
   ConnectScanInfo();
   ~ConnectScanInfo();
 
-  /* Watch a socket descriptor (add to fd_sets and maxValidSD).  Returns
-     true if the SD was absent from the list, false if you tried to
-     watch an SD that was already being watched. */
-  bool watchSD(int sd);
+  /* Watch a socket descriptor belonging to the probe at probeI of hss (add
+     to the epoll set or fd_sets, and maxValidSD).  Returns true if the SD
+     was absent from the list, false if you tried to watch an SD that was
+     already being watched. */
+  bool watchSD(int sd, HostScanStats *hss,
+               std::list<UltraProbe *>::iterator probeI);
 
-  /* Clear SD from the fd_sets and maxValidSD.  Returns true if the SD
-   was in the list, false if you tried to clear an sd that wasn't
+  /* Clear SD from the epoll set or fd_sets and maxValidSD.  Returns true if
+   the SD was in the list, false if you tried to clear an sd that wasn't
    there in the first place. */
   bool clearSD(int sd);
   int maxValidSD; /* The maximum socket descriptor in any of the fd_sets */
+  /* An epoll descriptor watching all SDs, or -1 if we use select() and the
+     fd_sets below. With epoll there is no FD_SETSIZE limit, and a wait costs
+     time in the number of ready sockets rather than in maxValidSD. */
+  int epfd;
+  struct SDOwner {
+    HostScanStats *hss; /* NULL if the SD is not watched */
+    std::list<UltraProbe *>::iterator probeI;
+  };
+  /* The probe each watched SD belongs to, indexed by SD (epoll only). */
+  std::vector<SDOwner> owners;
   fd_set fds_read;
   fd_set fds_write;
   fd_set fds_except;
@@ -241,7 +387,24 @@ public:
   int maxSocketsAllowed; /* No more than this many sockets may be created @once */
 };
 
-class HostScanStats;
+/* The group statistics that the workers of a --scan-threads scan have in
+   common, so that --min-rate, --max-rate, --max-parallelism and the group
+   congestion window hold for the scan as a whole and not for each worker.
+   Each GroupScanStats works on a copy between its lock() and unlock(). */
+class SharedGroupStats {
+public:
+  SharedGroupStats();
+  ~SharedGroupStats();
+  bool initialized; /* Set by the first GroupScanStats to use it */
+  int num_probes_active;
+  int num_incomplete_hosts; /* Over all the workers */
+  struct ultra_timing_vals timing;
+  struct timeval send_no_earlier_than;
+  struct timeval send_no_later_than;
+#if HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+};
 
 /* These are ultra_scan() statistics for the whole group of Targets */
 class GroupScanStats {
@@ -249,11 +412,21 @@ public:
   struct timeval timeout; /* The time at which we abort the scan */
   /* Most recent host tested for sendability */
   struct sockaddr_storage latestip;
-  GroupScanStats(UltraScanInfo *UltraSI);
+  /* shared is non-NULL for a worker of a threaded scan. */
+  GroupScanStats(UltraScanInfo *UltraSI, SharedGroupStats *shared = NULL);
   ~GroupScanStats();
   void probeSent(unsigned int nbytes);
   /* Returns true if the GLOBAL system says that sending is OK. */
   bool sendOK(struct timeval *when);
+  /* With a SharedGroupStats, num_probes_active, timing, send_no_earlier_than
+     and send_no_later_than are copies of the shared values. lock() refreshes
+     them and unlock() stores them back, so take these around every use of
+     them that must be current, and around every change. Without one, they
+     do nothing. */
+  void lock();
+  void unlock();
+  /* Called when a host of this group is completed. */
+  void hostCompleted();
   /* Total # of probes outstanding (active) for all Hosts */
   int num_probes_active;
   UltraScanInfo *USI; /* The USI which contains this GSS.  Use for at least
@@ -292,6 +465,10 @@ public:
   // number of hosts that timed out during scan, or were already timedout
   int num_hosts_timedout;
   ConnectScanInfo *CSI;
+
+private:
+  bool sendOKLocked(struct timeval *when);
+  SharedGroupStats *shared;
 };
 
 struct send_delay_nfo {
@@ -321,6 +498,9 @@ public:
   int freshPortsLeft(); /* Returns the number of ports remaining to probe */
   int next_portidx; /* Index of the next port to probe in the relevant
                        ports array in USI.ports */
+  /* With --checkpoint, moves next_portidx past the ports that a resumed scan
+     had finished. */
+  void skipCheckpointedPorts();
   bool sent_arp; /* Has an ARP probe been sent for the target yet? */
 
   /* massping state. */
@@ -371,10 +551,9 @@ public:
      true. */
   bool sendOK(struct timeval *when);
 
-  /* If there are pending probe timeouts, fills in when with the time of
-     the earliest one and returns true.  Otherwise returns false and
-     puts now in when. */
-  bool nextTimeout(struct timeval *when);
+  /* Puts the probe at probeI in USI->timers for the next time processData
+     should look at it. */
+  void scheduleProbeTimer(std::list<UltraProbe *>::iterator probeI);
   UltraScanInfo *USI; /* The USI which contains this HSS */
 
   /* Removes a probe from probes_outstanding, adjusts HSS and USS
@@ -399,6 +578,17 @@ public:
      maximum tryno and expired) are not counted in
      probes_outstanding.  */
   std::list<UltraProbe *> probes_outstanding;
+  /* An index of the UP_IP probes in probes_outstanding, keyed by
+     ProbeIndex::key(protocol, sport, dport). Probes sharing a key are kept
+     in the same order as in probes_outstanding, so walking a bucket
+     backwards visits the most recently sent candidates first, just like
+     walking the whole list does. Always modify probes_outstanding through
+     addOutstandingProbe, destroyOutstandingProbe and moveProbeToBench so
+     that the two stay in sync. */
+  ProbeIndex probes_by_key;
+  /* Appends a newly sent probe to probes_outstanding (and probes_by_key if
+     it is an IP probe). Does not touch any of the active probe counts. */
+  void addOutstandingProbe(UltraProbe *probe);
   /* The number of probes in probes_outstanding, minus the inactive (timed out) ones */
   unsigned int num_probes_active;
   /* Probes timed out but not yet retransmitted because of congestion
@@ -497,6 +687,8 @@ public:
   struct rate_limit_detection_nfo rld;
 
 private:
+  /* Removes the probes_by_key entry for the given probe, if any. */
+  void unindexProbe(std::list<UltraProbe *>::iterator probeI);
   u8 nxtpseq; /* the next scanping sequence number to use */
 };
 
@@ -514,21 +706,138 @@ struct ultra_scan_performance_vars : public scan_performance_vars {
   void init();
 };
 
+/* Orders HostScanStats by target address. This is the order in which
+   incompleteHosts are visited for sending. */
 struct HssPredicate {
 public:
   int operator() (const HostScanStats *lhs, const HostScanStats *rhs) const;
-  static struct sockaddr_storage *ss;
 };
 
+/* An open-addressed hash table from fixed-length addresses to
+   HostScanStats. The keys are stored inline in one flat array, so a lookup
+   usually touches a single cache line and never has to dereference a
+   Target. Duplicate keys are allowed; find returns the one inserted first. */
+class HssAddrTable {
+public:
+  HssAddrTable(size_t keylen);
+  /* Makes room for at least n entries without rehashing. */
+  void reserve(unsigned int n);
+  void insert(const u8 *key, HostScanStats *hss);
+  /* Removes the entry for hss under key. Returns false if there was none. */
+  bool erase(const u8 *key, const HostScanStats *hss);
+  HostScanStats *find(const u8 *key) const;
+  void clear();
+
+private:
+  unsigned int slotFor(const u8 *key) const;
+  void rehash(unsigned int capacity);
+  size_t keylen;
+  unsigned int capacity; /* Always 0 or a power of two */
+  unsigned int used; /* Occupied slots, including deleted ones */
+  unsigned int live; /* Occupied slots that hold an entry */
+  std::vector<u8> keys;
+  std::vector<HostScanStats *> values;
+};
+
+/* Indexes every HostScanStats of a group, complete or not, by target
+   address. This is what findHost uses to match a received packet to a host
+   in constant time. IPv4 and IPv6 addresses are kept in separate tables so
+   that each stays densely packed. */
+class HssIndex {
+public:
+  HssIndex() : v4(4), v6(16) {}
+  void reserve(unsigned int n, int af);
+  void insert(HostScanStats *hss);
+  void erase(const HostScanStats *hss);
+  HostScanStats *find(const struct sockaddr_storage *ss) const;
+  void clear() {
+    v4.clear();
+    v6.clear();
+  }
+
+private:
+  HssAddrTable v4;
+  HssAddrTable v6;
+};
+
+class ReplyQueue;
+
+#if HAVE_PTHREAD
+/* Replies taken by the SharedSniffer of a threaded scan that are waiting
+   for the worker which scans their host. */
+class ReplyQueue {
+public:
+  /* Holds at most max_replies. */
+  ReplyQueue(unsigned int max_replies);
+  ~ReplyQueue();
+  /* Queues a reply. If the queue is full, the oldest reply is dropped to
+     make room, as a full kernel capture ring would. */
+  void push(const u8 *packet, unsigned int len, const struct timeval *rcvdtime,
+            const struct link_header *linkhdr);
+  /* Takes the oldest reply, first waiting up to to_usec for one if there is
+     none, in the manner of readip_pcap. Returns NULL if none came; otherwise
+     the packet is valid until the next call. */
+  const u8 *pop(unsigned int *len, long to_usec, struct timeval *rcvdtime,
+                struct link_header *linkhdr);
+  /* The number of replies dropped because the queue was full */
+  unsigned long dropped;
+
+private:
+  struct Reply {
+    unsigned int len;
+    struct timeval rcvdtime;
+    struct link_header linkhdr;
+    u8 packet[256]; /* The snaplen of begin_sniffer */
+  };
+  std::deque<Reply> replies;
+  unsigned int max_replies;
+  Reply current;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* The one sniffer of a scan split across --scan-threads workers. Its thread
+   reads every reply once and queues it for the worker that scans the host
+   the reply is from, or for ICMP errors, the host of the probe it quotes. */
+class SharedSniffer {
+public:
+  /* Takes over pd, which begin_sniffer has opened for all of the workers'
+     hosts, and gives each worker a ReplyQueue. */
+  SharedSniffer(pcap_t *pd, const std::vector<UltraScanInfo *> &workers);
+  /* Stops the thread, closes pd, and frees the workers' queues. With -d, it
+     reports how many replies were dropped from full queues. */
+  ~SharedSniffer();
+  void start();
+
+private:
+  static void *receive_thread(void *arg);
+  void receive();
+  ReplyQueue *ownerOf(const u8 *packet, unsigned int len) const;
+
+  pcap_t *pd;
+  std::vector<UltraScanInfo *> workers;
+  HssIndex owners;
+  pthread_t thread;
+  bool running;
+  pthread_mutex_t lock;
+  bool stopping;
+};
+#endif /* HAVE_PTHREAD */
+
 class UltraScanInfo {
 public:
   UltraScanInfo();
-  UltraScanInfo(std::vector<Target *> &Targets, struct scan_lists *pts, stype scantype) {
-    Init(Targets, pts, scantype);
+  UltraScanInfo(std::vector<Target *> &Targets, struct scan_lists *pts, stype scantype,
+                SharedGroupStats *shared = NULL, TargetFeed *feed = NULL) {
+    Init(Targets, pts, scantype, shared, feed);
   }
   ~UltraScanInfo();
-  /* Must call Init if you create object with default constructor */
-  void Init(std::vector<Target *> &Targets, struct scan_lists *pts, stype scantp);
+  /* Must call Init if you create object with default constructor. shared is
+     given to each of the --scan-threads workers of a scan, which keep their
+     rate limits and group congestion window there; only a lone scan (NULL)
+     has a progress meter. feed is as for ultra_scan. */
+  void Init(std::vector<Target *> &Targets, struct scan_lists *pts, stype scantp,
+            SharedGroupStats *shared = NULL, TargetFeed *feed = NULL);
 
   unsigned int numProbesPerHost();
 
@@ -578,7 +887,7 @@ public:
   int removeCompletedHosts();
   /* Find a HostScanStats by its IP address in the incomplete and completed
      lists.  Returns NULL if none are found. */
-  HostScanStats *findHost(struct sockaddr_storage *ss);
+  HostScanStats *findHost(const struct sockaddr_storage *ss);
 
   double getCompletionFraction();
 
@@ -600,22 +909,50 @@ public:
   void log_current_rates(int logt, bool update = true);
 
   /* Any function which messes with (removes elements from)
-     incompleteHosts may have to manipulate nextI */
+     incompleteHosts may have to manipulate nextI. This set only determines
+     the order in which hosts are scheduled; use findHost to look a host up
+     by address. */
   std::multiset<HostScanStats *, HssPredicate> incompleteHosts;
   /* Hosts are moved from incompleteHosts to completedHosts as they are
      completed. We keep them around because sometimes responses come back very
      late, after we consider a host completed. */
   std::multiset<HostScanStats *, HssPredicate> completedHosts;
+  /* Every host in incompleteHosts and completedHosts, by address. */
+  HssIndex hostIndex;
   /* How long (in msecs) we keep a host in completedHosts */
   unsigned int completedHostLifetime;
   /* The last time we went through completedHosts to remove hosts */
   struct timeval lastCompletedHostRemoval;
 
-  ScanProgressMeter *SPM;
+  ScanProgressMeter *SPM; /* NULL for a worker of a threaded scan */
   PacketRateMeter send_rate_meter;
   struct scan_lists *ports;
   int rawsd; /* raw socket descriptor */
+  /* Batches raw-socket sends during the send phase of each ultra_scan
+     iteration; flushed before waiting for replies. NULL if not batching. */
+  RawSendBatch *sendq;
+  /* Reusable IPv4 TCP and UDP probe packets, two per decoy. See
+     probeTemplate(). */
+  PacketTemplate *probeTemplates;
+  PacketTemplate *probeTemplate(u8 proto, int decoy);
+  /* Every UltraProbe of this scan comes from here. */
+  UltraProbePool probePool;
+  /* Timeouts and expiries of all outstanding probes. */
+  ProbeTimerWheel timers;
+  /* Source of more targets, and where finished ones go; NULL unless
+     --rolling-hostgroup. */
+  TargetFeed *feed;
+  /* Admits targets from feed until there are as many incomplete hosts as
+     the scan started with, or it runs dry. */
+  void admitHosts();
+  /* The base source port of the probes (see increment_base_port). It is
+     kept here as a nested ultra_scan (host discovery while feeding a
+     rolling scan) moves the global one. */
+  u16 base_port;
   pcap_t *pd;
+  /* Where this scan reads its replies in place of pd when it is one of the
+     workers of a threaded scan (see SharedSniffer); otherwise NULL. */
+  ReplyQueue *replies;
   eth_t *ethsd;
   u32 seqmask; /* This mask value is used to encode values in sequence
                   numbers.  It is set randomly in UltraScanInfo::Init() */
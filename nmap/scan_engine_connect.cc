@@ -71,6 +71,9 @@
 #include "NmapOps.h"
 
 #include <errno.h>
+#if HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 extern NmapOps o;
 
@@ -88,6 +91,7 @@ void UltraProbe::setConnect(u16 portno) {
 ConnectScanInfo::ConnectScanInfo() {
   maxValidSD = -1;
   numSDs = 0;
+  epfd = -1;
   if (o.max_parallelism > 0) {
     maxSocketsAllowed = o.max_parallelism;
   } else {
@@ -106,20 +110,56 @@ ConnectScanInfo::ConnectScanInfo() {
     if (maxSocketsAllowed < 5)
       maxSocketsAllowed = 5;
   }
-  maxSocketsAllowed = MIN(maxSocketsAllowed, FD_SETSIZE - 10);
+#if HAVE_EPOLL_CREATE1
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1 && o.debugging)
+    error("epoll_create1 failed (%s); falling back to select() for connect scan", strerror(errno));
+#endif
+  if (epfd == -1)
+    maxSocketsAllowed = MIN(maxSocketsAllowed, FD_SETSIZE - 10);
+  else
+    maxSocketsAllowed = MIN(maxSocketsAllowed, max_sd() - 10);
+  if (o.pipeline_sockets[PIPELINE_SCAN] > 0)
+    maxSocketsAllowed = MIN(maxSocketsAllowed, o.pipeline_sockets[PIPELINE_SCAN]);
   FD_ZERO(&fds_read);
   FD_ZERO(&fds_write);
   FD_ZERO(&fds_except);
 }
 
-/* Nothing really to do here. */
-ConnectScanInfo::~ConnectScanInfo() {}
+ConnectScanInfo::~ConnectScanInfo() {
+  if (epfd != -1)
+    close(epfd);
+}
 
-/* Watch a socket descriptor (add to fd_sets and maxValidSD).  Returns
-   true if the SD was absent from the list, false if you tried to
-   watch an SD that was already being watched. */
-bool ConnectScanInfo::watchSD(int sd) {
+/* Watch a socket descriptor (add to the epoll set or fd_sets, and
+   maxValidSD).  Returns true if the SD was absent from the list, false if
+   you tried to watch an SD that was already being watched. */
+bool ConnectScanInfo::watchSD(int sd, HostScanStats *hss,
+                              std::list<UltraProbe *>::iterator probeI) {
   assert(sd >= 0);
+#if HAVE_EPOLL_CREATE1
+  if (epfd != -1) {
+    struct epoll_event ev;
+
+    if ((size_t) sd < owners.size() && owners[sd].hss != NULL)
+      return false;
+    if ((size_t) sd >= owners.size()) {
+      SDOwner none;
+      none.hss = NULL;
+      owners.resize(sd + 1, none);
+    }
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = sd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) == -1)
+      pfatal("epoll_ctl(EPOLL_CTL_ADD) in %s", __func__);
+    owners[sd].hss = hss;
+    owners[sd].probeI = probeI;
+    numSDs++;
+    if (sd > maxValidSD)
+      maxValidSD = sd;
+    return true;
+  }
+#endif
   if (!checked_fd_isset(sd, &fds_read)) {
     checked_fd_set(sd, &fds_read);
     checked_fd_set(sd, &fds_write);
@@ -133,11 +173,26 @@ bool ConnectScanInfo::watchSD(int sd) {
   }
 }
 
-/* Clear SD from the fd_sets and maxValidSD.  Returns true if the SD
-   was in the list, false if you tried to clear an sd that wasn't
+/* Clear SD from the epoll set or fd_sets and maxValidSD.  Returns true if
+   the SD was in the list, false if you tried to clear an sd that wasn't
    there in the first place. */
 bool ConnectScanInfo::clearSD(int sd) {
   assert(sd >= 0);
+#if HAVE_EPOLL_CREATE1
+  if (epfd != -1) {
+    if ((size_t) sd >= owners.size() || owners[sd].hss == NULL)
+      return false;
+    /* The socket may stay open for a while (self-connects are retried), so
+       don't rely on close() to take it out of the set. */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sd, NULL);
+    owners[sd].hss = NULL;
+    assert(numSDs > 0);
+    numSDs--;
+    if (sd == maxValidSD)
+      maxValidSD--;
+    return true;
+  }
+#endif
   if (checked_fd_isset(sd, &fds_read)) {
     checked_fd_clr(sd, &fds_read);
     checked_fd_clr(sd, &fds_write);
@@ -359,7 +414,7 @@ static void init_socket(int sd) {
 UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                                  u16 destport, u8 tryno, u8 pingseq) {
 
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probePool.get();
   std::list<UltraProbe *>::iterator probeI;
   int rc;
   int connect_errno = 0;
@@ -401,10 +456,12 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   if (rc == -1)
     connect_errno = socket_errno();
   /* This counts as probe being sent, so update structures */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   probeI = hss->probes_outstanding.end();
   probeI--;
+  USI->gstats->lock();
   USI->gstats->num_probes_active++;
+  USI->gstats->unlock();
   hss->num_probes_active++;
 
   /* It would be convenient if the connect() call would never succeed
@@ -414,7 +471,7 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   if (rc == -1 && (connect_errno == EINPROGRESS || connect_errno == EAGAIN)) {
     PacketTrace::traceConnect(IPPROTO_TCP, (sockaddr *) &sock, socklen, rc,
         connect_errno, &USI->now);
-    USI->gstats->CSI->watchSD(CP->sd);
+    USI->gstats->CSI->watchSD(CP->sd, hss, probeI);
   } else {
     handleConnectResult(USI, hss, probeI, connect_errno, true);
     probe = NULL;
@@ -423,10 +480,55 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   return probe;
 }
 
-/* Does a select() call and handles all of the results. This handles both host
-   discovery (ping) scans and port scans.  Even if stime is now, it tries a very
-   quick select() just in case.  Returns true if at least one good result
-   (generally a port state change) is found, false if it times out instead */
+#if HAVE_EPOLL_CREATE1
+/* The epoll counterpart of do_one_select_round. Only the sockets that are
+   ready are visited, found through CSI->owners. */
+static bool do_one_epoll_round(UltraScanInfo *USI, struct timeval *stime) {
+  struct epoll_event events[256];
+  ConnectScanInfo *CSI = USI->gstats->CSI;
+  int nfds, i, sd;
+  int timeleft;
+  int optval;
+  recvfrom6_t optlen = sizeof(int);
+  int numGoodSD = 0;
+  int err = 0;
+
+  do {
+    timeleft = TIMEVAL_MSEC_SUBTRACT(*stime, USI->now);
+    if (timeleft < 0)
+      timeleft = 0;
+    nfds = epoll_wait(CSI->epfd, events, sizeof(events) / sizeof(*events),
+                      timeleft);
+    err = socket_errno();
+  } while (nfds == -1 && err == EINTR);
+
+  gettimeofday(&USI->now, NULL);
+
+  if (nfds == -1)
+    pfatal("epoll_wait failed in %s()", __func__);
+
+  for (i = 0; i < nfds; i++) {
+    sd = events[i].data.fd;
+    /* Handling an earlier event may have destroyed this probe (for example
+       when a ping scan finds its host up), which clears its owner. */
+    if ((size_t) sd >= CSI->owners.size() || CSI->owners[sd].hss == NULL)
+      continue;
+    numGoodSD++;
+    if (getsockopt(sd, SOL_SOCKET, SO_ERROR, (char *) &optval,
+                   &optlen) != 0)
+      optval = socket_errno();
+
+    handleConnectResult(USI, CSI->owners[sd].hss, CSI->owners[sd].probeI, optval);
+  }
+  return numGoodSD;
+}
+#endif
+
+/* Does a select() call (epoll_wait() where available) and handles all of the
+   results. This handles both host discovery (ping) scans and port scans.
+   Even if stime is now, it tries a very quick select() just in case.
+   Returns true if at least one good result (generally a port state change)
+   is found, false if it times out instead */
 bool do_one_select_round(UltraScanInfo *USI, struct timeval *stime) {
   fd_set fds_rtmp, fds_wtmp, fds_xtmp;
   int selectres;
@@ -442,6 +544,11 @@ bool do_one_select_round(UltraScanInfo *USI, struct timeval *stime) {
   int numGoodSD = 0;
   int err = 0;
 
+#if HAVE_EPOLL_CREATE1
+  if (CSI->epfd != -1)
+    return do_one_epoll_round(USI, stime);
+#endif
+
   do {
     timeleft = TIMEVAL_MSEC_SUBTRACT(*stime, USI->now);
     if (timeleft < 0)
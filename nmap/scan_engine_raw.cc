@@ -239,6 +239,11 @@ void increment_base_port() {
   }
 }
 
+/* Returns the base port chosen by the last increment_base_port. */
+u16 get_base_port() {
+  return base_port;
+}
+
 /* The try number or ping sequence number can be encoded into a TCP SEQ or ACK
    field. This returns a 32-bit number which encodes both of these values along
    with a simple checksum. Decoding is done by seq32_decode. */
@@ -333,6 +338,53 @@ static bool sport_decode(const UltraScanInfo *USI, u16 base_portno, u16 portno,
 
 
 
+/* Visits, newest first, the outstanding probes of a host that could have
+   elicited a response. By default every probe in probes_outstanding is a
+   candidate. After restrict() only the probes indexed under the given
+   protocol and port pair in probes_by_key are, which avoids walking the whole
+   list when thousands of probes are outstanding. Either way the candidates
+   come in the same relative order, so the first match is the same one a full
+   walk would find. */
+class ProbeCandidates {
+public:
+  ProbeCandidates(HostScanStats *hss) : hss(hss), indexed(false) {
+    listI = hss->probes_outstanding.end();
+    bucket = NULL;
+    pos = 0;
+  }
+
+  /* Only visit probes of protocol proto sent from sport to dport. */
+  void restrict(u8 proto, u16 sport, u16 dport) {
+    bucket = hss->probes_by_key.find(ProbeIndex::key(proto, sport, dport));
+    pos = bucket != NULL ? bucket->size() : 0;
+    indexed = true;
+  }
+
+  /* Fills in probeI with the next candidate and returns true, or returns
+     false if there are no more. */
+  bool next(std::list<UltraProbe *>::iterator *probeI) {
+    if (indexed) {
+      if (pos == 0)
+        return false;
+      pos--;
+      *probeI = (*bucket)[pos];
+    } else {
+      if (listI == hss->probes_outstanding.begin())
+        return false;
+      listI--;
+      *probeI = listI;
+    }
+    return true;
+  }
+
+private:
+  HostScanStats *hss;
+  bool indexed;
+  std::list<UltraProbe *>::iterator listI;
+  const ProbeIndex::Bucket *bucket;
+  size_t pos;
+};
+
 static bool icmp_probe_match(const UltraScanInfo *USI, const UltraProbe *probe,
                              const struct ppkt *ping,
                              const struct sockaddr_storage *target_src,
@@ -413,7 +465,7 @@ static bool tcp_probe_match(const UltraScanInfo *USI, const UltraProbe *probe,
               || seq32_decode(USI, ntohl(tcp->th_seq), &tryno, &pingseq);
   } else {
     /* Get the values from the destination port (our source port). */
-    sport_decode(USI, base_port, ntohs(tcp->th_dport), &tryno, &pingseq);
+    sport_decode(USI, USI->base_port, ntohs(tcp->th_dport), &tryno, &pingseq);
     goodseq = true;
   }
 
@@ -782,7 +834,7 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
         if (o.magic_port_set) {
           trynum = probe->tryno;
         } else {
-          sport_decode(USI, base_port, ntohs(udp->uh_dport), &trynum, NULL);
+          sport_decode(USI, USI->base_port, ntohs(udp->uh_dport), &trynum, NULL);
         }
 
         /* Sometimes we get false results when scanning localhost with
@@ -907,6 +959,24 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
   return goodone;
 }
 
+/* Returns the kernel capture buffer size to request for the scan sniffer, or 0
+   for libpcap's default (2MB on Linux). With --min-rate, make room for about
+   half a second of replies at that rate, so that a burst of responses is not
+   dropped by the kernel before we get around to reading it. The rate is the
+   whole scan's, as the workers of a threaded scan share one sniffer. snaplen
+   is the capture length; each frame in the ring also carries about 64 bytes
+   of headers. */
+static int sniffer_bufsize(int snaplen) {
+  double bytes;
+
+  if (o.min_packet_send_rate == 0.0)
+    return 0;
+  bytes = o.min_packet_send_rate / 2 * (snaplen + 64);
+  if (bytes <= 2 * 1024 * 1024)
+    return 0;
+  return (int) MIN(bytes, 64.0 * 1024 * 1024);
+}
+
 /* Initiate libpcap or some other sniffer as appropriate to be able to catch
    responses */
 void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
@@ -915,7 +985,9 @@ void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
   std::string dst_hosts = "";
   unsigned int len = 0;
   unsigned int targetno;
-  bool doIndividual = Targets.size() <= 20; // Don't bother IP limits if scanning huge # of hosts
+  // Don't bother IP limits if scanning huge # of hosts, or if more are to
+  // join the scan later.
+  bool doIndividual = Targets.size() <= 20 && USI->feed == NULL;
 
   if (doIndividual) {
     for (targetno = 0; targetno < Targets.size(); targetno++) {
@@ -925,8 +997,15 @@ void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
     }
   }
 
-  if ((USI->pd = my_pcap_open_live(Targets[0]->deviceName(), 256,  (o.spoofsource) ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2)) == NULL)
+  if ((USI->pd = my_pcap_open_live(Targets[0]->deviceName(), 256,  (o.spoofsource) ? 1 : 0, pcap_selectable_fd_valid() ? 200 : 2, sniffer_bufsize(256))) == NULL)
     fatal("%s", PCAP_OPEN_ERRMSG);
+#ifdef LINUX
+  /* Replies are read from libpcap's memory-mapped ring. In nonblocking mode
+     read_reply_pcap takes every frame already in the ring before it goes back
+     to select(), rather than doing one select() per reply. */
+  if (pcap_setnonblock(USI->pd, 1, NULL) < 0 && o.debugging)
+    error("Could not put pcap handle in nonblocking mode: %s", pcap_geterr(USI->pd));
+#endif
 
   if (USI->ping_scan_arp) {
     /* Some OSs including Windows 7 and Solaris 10 have been seen to send their
@@ -1005,12 +1084,193 @@ void begin_sniffer(UltraScanInfo *USI, std::vector<Target *> &Targets) {
   return;
 }
 
+#if HAVE_PTHREAD
+/* How long the SharedSniffer thread waits for a reply before it looks
+   whether it has been told to stop. */
+#define SHARED_SNIFFER_POLL_USEC 20000
+/* The capture length of begin_sniffer, and the room for a reply in a
+   ReplyQueue */
+#define SHARED_SNIFFER_SNAPLEN 256
+
+ReplyQueue::ReplyQueue(unsigned int max_replies)
+  : dropped(0), max_replies(max_replies) {
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+ReplyQueue::~ReplyQueue() {
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+void ReplyQueue::push(const u8 *packet, unsigned int len,
+                      const struct timeval *rcvdtime,
+                      const struct link_header *linkhdr) {
+  pthread_mutex_lock(&lock);
+  if (replies.size() >= max_replies) {
+    replies.pop_front();
+    dropped++;
+  }
+  replies.push_back(Reply());
+  Reply &reply = replies.back();
+  reply.len = MIN(len, sizeof(reply.packet));
+  reply.rcvdtime = *rcvdtime;
+  reply.linkhdr = *linkhdr;
+  memcpy(reply.packet, packet, reply.len);
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+const u8 *ReplyQueue::pop(unsigned int *len, long to_usec,
+                          struct timeval *rcvdtime,
+                          struct link_header *linkhdr) {
+  pthread_mutex_lock(&lock);
+  if (replies.empty() && to_usec > 0) {
+    struct timeval tv;
+    struct timespec deadline;
+
+    gettimeofday(&tv, NULL);
+    TIMEVAL_ADD(tv, tv, to_usec);
+    deadline.tv_sec = tv.tv_sec;
+    deadline.tv_nsec = tv.tv_usec * 1000;
+    while (replies.empty()) {
+      if (pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT)
+        break;
+    }
+  }
+  if (replies.empty()) {
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+  current = replies.front();
+  replies.pop_front();
+  pthread_mutex_unlock(&lock);
+
+  *len = current.len;
+  if (rcvdtime)
+    *rcvdtime = current.rcvdtime;
+  if (linkhdr)
+    *linkhdr = current.linkhdr;
+  return current.packet;
+}
+
+SharedSniffer::SharedSniffer(pcap_t *pd, const std::vector<UltraScanInfo *> &workers)
+  : pd(pd), workers(workers), running(false), stopping(false) {
+  std::vector<UltraScanInfo *>::const_iterator w;
+  std::multiset<HostScanStats *, HssPredicate>::iterator hostI;
+  unsigned int max_replies;
+  int bufsize;
+
+  pthread_mutex_init(&lock, NULL);
+  /* Let each worker fall as far behind as the kernel capture ring would let
+     an unthreaded scan. */
+  bufsize = sniffer_bufsize(SHARED_SNIFFER_SNAPLEN);
+  if (bufsize == 0)
+    bufsize = 2 * 1024 * 1024;
+  max_replies = bufsize / (SHARED_SNIFFER_SNAPLEN + 64);
+  /* The workers' hosts are all incomplete until they start, and none of
+     them is freed before the workers are. */
+  for (w = workers.begin(); w != workers.end(); w++) {
+    (*w)->replies = new ReplyQueue(max_replies);
+    for (hostI = (*w)->incompleteHosts.begin(); hostI != (*w)->incompleteHosts.end(); hostI++)
+      owners.insert(*hostI);
+  }
+}
+
+SharedSniffer::~SharedSniffer() {
+  std::vector<UltraScanInfo *>::iterator w;
+
+  if (running) {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+  }
+  if (o.debugging > 2)
+    pcap_print_stats(LOG_PLAIN, pd);
+  pcap_close(pd);
+  for (w = workers.begin(); w != workers.end(); w++) {
+    /* The sniffer thread is gone, so the counts are settled. */
+    if (o.debugging)
+      log_write(LOG_PLAIN, "Reply queue of thread %d of %d: %lu replies dropped while full.\n",
+                (int) (w - workers.begin()) + 1, (int) workers.size(), (*w)->replies->dropped);
+    delete (*w)->replies;
+    (*w)->replies = NULL;
+  }
+  pthread_mutex_destroy(&lock);
+}
+
+void SharedSniffer::start() {
+  if (pthread_create(&thread, NULL, receive_thread, this) != 0)
+    fatal("%s: failed to create sniffer thread", __func__);
+  running = true;
+}
+
+void *SharedSniffer::receive_thread(void *arg) {
+  ((SharedSniffer *) arg)->receive();
+  return NULL;
+}
+
+void SharedSniffer::receive() {
+  struct link_header linkhdr;
+  struct timeval rcvdtime;
+  unsigned int len;
+  const u8 *packet;
+  ReplyQueue *queue;
+  bool stop;
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    stop = stopping;
+    pthread_mutex_unlock(&lock);
+    if (stop)
+      break;
+
+    packet = readip_pcap(pd, &len, SHARED_SNIFFER_POLL_USEC, &rcvdtime, &linkhdr, true);
+    if (packet == NULL)
+      continue;
+    queue = ownerOf(packet, len);
+    if (queue != NULL)
+      queue->push(packet, len, &rcvdtime, &linkhdr);
+  }
+}
+
+/* Returns the queue of the worker that get_pcap_result would match this reply
+   to a host of, or NULL if there is none. */
+ReplyQueue *SharedSniffer::ownerOf(const u8 *packet, unsigned int len) const {
+  struct abstract_ip_hdr hdr, encaps_hdr;
+  const struct sockaddr_storage *addr;
+  const u8 *data;
+  unsigned int datalen, encaps_len;
+  HostScanStats *hss;
+
+  datalen = len;
+  data = (const u8 *) ip_get_data(packet, &datalen, &hdr);
+  if (data == NULL)
+    return NULL;
+
+  addr = &hdr.src;
+  if (datalen >= 8 &&
+      ((hdr.proto == IPPROTO_ICMP && (data[0] == 3 || data[0] == 11))
+       || (hdr.proto == IPPROTO_ICMPV6
+           && (data[0] == ICMPV6_UNREACH || data[0] == ICMPV6_PARAMPROBLEM)))) {
+    encaps_len = datalen - 8;
+    if (ip_get_data(data + 8, &encaps_len, &encaps_hdr) == NULL)
+      return NULL;
+    addr = &encaps_hdr.dst;
+  }
+
+  hss = owners.find(addr);
+  return (hss != NULL) ? hss->USI->replies : NULL;
+}
+#endif /* HAVE_PTHREAD */
+
 /* If this is NOT a ping probe, set pingseq to 0.  Otherwise it will be the
    ping sequence number (they start at 1).  The probe sent is returned. */
 UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                              u8 tryno, u8 pingseq) {
   int rc;
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probePool.get();
 
   /* 3 cheers for libdnet header files */
   u8 frame[ETH_HDR_LEN + ARP_HDR_LEN + ARP_ETHIP_LEN];
@@ -1037,8 +1297,10 @@ UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   probe->setARP(frame, sizeof(frame));
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
+  USI->gstats->lock();
   USI->gstats->num_probes_active++;
+  USI->gstats->unlock();
   hss->num_probes_active++;
 
   gettimeofday(&USI->now, NULL);
@@ -1047,7 +1309,7 @@ UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 
 UltraProbe *sendNDScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                             u8 tryno, u8 pingseq) {
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probePool.get();
   struct eth_nfo eth;
   struct eth_nfo *ethptr = NULL;
   u8 *packet = NULL;
@@ -1106,8 +1368,10 @@ UltraProbe *sendNDScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   free(packet);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
+  USI->gstats->lock();
   USI->gstats->num_probes_active++;
+  USI->gstats->unlock();
   hss->num_probes_active++;
 
   gettimeofday(&USI->now, NULL);
@@ -1226,6 +1490,20 @@ static u8 *build_protoscan_packet(const struct sockaddr_storage *src,
   return packet;
 }
 
+/* Sends one packet of an IP probe, or queues it in USI->sendq to go out at
+   the end of the send phase. When queued, *sent (if not NULL) is updated with
+   the time the packet actually leaves. */
+static void sendProbePacket(UltraScanInfo *USI, const struct eth_nfo *eth,
+                            HostScanStats *hss, const u8 *packet,
+                            u32 packetlen, struct timeval *sent) {
+  const struct sockaddr_storage *dst = hss->target->TargetSockAddr();
+
+  if (USI->sendq && USI->sendq->accepts(eth, dst, packet, packetlen))
+    USI->sendq->queue(dst, packet, packetlen, sent);
+  else
+    send_ip_packet(USI->rawsd, eth, dst, packet, packetlen);
+}
+
 /* If this is NOT a ping probe, set pingseq to 0.  Otherwise it will be the
    ping sequence number (they start at 1).  The probe sent is returned.
 
@@ -1237,7 +1515,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
                             const probespec *pspec, u8 tryno, u8 pingseq) {
   u8 *packet = NULL;
   u32 packetlen = 0;
-  UltraProbe *probe = new UltraProbe();
+  UltraProbe *probe = USI->probePool.get();
   int decoy = 0;
   u32 seq = 0;
   u32 ack = 0;
@@ -1264,7 +1542,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   if (o.magic_port_set)
     sport = o.magic_port;
   else
-    sport = sport_encode(USI, base_port, tryno, pingseq);
+    sport = sport_encode(USI, USI->base_port, tryno, pingseq);
 
   probe->tryno = tryno;
   probe->pingseq = pingseq;
@@ -1288,7 +1566,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 
     if (hss->target->af() == AF_INET) {
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        packet = build_tcp_raw(&((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, hss->target->v4hostip(),
+        packet = USI->probeTemplate(IPPROTO_TCP, decoy)->buildTCP(
+                               &((const struct sockaddr_in *) hss->target->DecoySockAddr(decoy))->sin_addr, hss->target->v4hostip(),
                                o.ttl, ipid, IP_TOS_DEFAULT, false,
                                o.ipoptions, o.ipoptionslen,
                                sport, pspec->pd.tcp.dport,
@@ -1301,12 +1580,13 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
-        free(packet);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
+        /* packet belongs to the template; don't free it. */
       }
     } else if (hss->target->af() == AF_INET6) {
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        packet = build_tcp_raw_ipv6(&((struct sockaddr_in6 *)&o.decoys[decoy])->sin6_addr, hss->target->v6hostip(),
+        packet = build_tcp_raw_ipv6(&((const struct sockaddr_in6 *) hss->target->DecoySockAddr(decoy))->sin6_addr, hss->target->v6hostip(),
                                   0, 0, o.ttl, sport, pspec->pd.tcp.dport,
                                   seq, ack, 0, pspec->pd.tcp.flags, 0, 0,
                                   tcpops, tcpopslen,
@@ -1317,7 +1597,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
         free(packet);
       }
     }
@@ -1329,7 +1610,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 
     if (hss->target->af() == AF_INET) {
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        packet = build_udp_raw(&((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, hss->target->v4hostip(),
+        packet = USI->probeTemplate(IPPROTO_UDP, decoy)->buildUDP(
+                               &((const struct sockaddr_in *) hss->target->DecoySockAddr(decoy))->sin_addr, hss->target->v4hostip(),
                                o.ttl, ipid, IP_TOS_DEFAULT, false,
                                o.ipoptions, o.ipoptionslen,
                                sport, pspec->pd.udp.dport,
@@ -1340,12 +1622,13 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
-        free(packet);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
+        /* packet belongs to the template; don't free it. */
       }
     } else if (hss->target->af() == AF_INET6) {
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        packet = build_udp_raw_ipv6(&((struct sockaddr_in6 *)&o.decoys[decoy])->sin6_addr, hss->target->v6hostip(),
+        packet = build_udp_raw_ipv6(&((const struct sockaddr_in6 *) hss->target->DecoySockAddr(decoy))->sin6_addr, hss->target->v6hostip(),
                                   0, 0, o.ttl, sport, pspec->pd.tcp.dport,
                                   (char *) payload, payload_length,
                                   &packetlen);
@@ -1354,7 +1637,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
         free(packet);
       }
     }
@@ -1382,7 +1666,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
     }
     if (hss->target->af() == AF_INET) {
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        packet = build_sctp_raw(&((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, hss->target->v4hostip(),
+        packet = build_sctp_raw(&((const struct sockaddr_in *) hss->target->DecoySockAddr(decoy))->sin_addr, hss->target->v4hostip(),
                                 o.ttl, ipid, IP_TOS_DEFAULT, false,
                                 o.ipoptions, o.ipoptionslen,
                                 sport, pspec->pd.sctp.dport,
@@ -1394,12 +1678,13 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        packet = build_sctp_raw_ipv6(&((struct sockaddr_in6 *)&o.decoys[decoy])->sin6_addr, hss->target->v6hostip(),
+        packet = build_sctp_raw_ipv6(&((const struct sockaddr_in6 *) hss->target->DecoySockAddr(decoy))->sin6_addr, hss->target->v6hostip(),
                                    0, 0, o.ttl, sport, pspec->pd.sctp.dport,
                                    vtag, chunk, chunklen,
                                    o.extra_payload, o.extra_payload_length,
@@ -1409,7 +1694,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
         free(packet);
       }
     }
@@ -1423,7 +1709,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
       sin->sin_family = AF_INET;
 
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        sin->sin_addr = ((struct sockaddr_in *)&o.decoys[decoy])->sin_addr;
+        sin->sin_addr = ((const struct sockaddr_in *) hss->target->DecoySockAddr(decoy))->sin_addr;
         packet = build_protoscan_packet(&ss, hss->target->TargetSockAddr(),
                                         pspec->proto, sport, &packetlen);
         assert(packet != NULL);
@@ -1432,7 +1718,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1443,7 +1730,7 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
       sin6->sin6_family = AF_INET6;
 
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        sin6->sin6_addr = ((struct sockaddr_in6 *)&o.decoys[decoy])->sin6_addr;
+        sin6->sin6_addr = ((const struct sockaddr_in6 *) hss->target->DecoySockAddr(decoy))->sin6_addr;
         packet = build_protoscan_packet(&ss, hss->target->TargetSockAddr(),
                                       pspec->proto, sport, &packetlen);
         assert(packet != NULL);
@@ -1452,13 +1739,14 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                        decoy == o.decoyturn ? &probe->sent : NULL);
         free(packet);
       }
     }
   } else if (pspec->type == PS_ICMP) {
     for (decoy = 0; decoy < o.numdecoys; decoy++) {
-      packet = build_icmp_raw(&((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, hss->target->v4hostip(),
+      packet = build_icmp_raw(&((const struct sockaddr_in *) hss->target->DecoySockAddr(decoy))->sin_addr, hss->target->v4hostip(),
                               o.ttl, ipid, IP_TOS_DEFAULT, false,
                               o.ipoptions, o.ipoptionslen,
                               0, icmp_ident, pspec->pd.icmp.type, pspec->pd.icmp.code,
@@ -1469,12 +1757,13 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
         probe->sent = USI->now;
       }
       hss->probeSent(packetlen);
-      send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                      decoy == o.decoyturn ? &probe->sent : NULL);
       free(packet);
     }
   } else if (pspec->type == PS_ICMPV6) {
     for (decoy =0; decoy < o.numdecoys; decoy++) {
-      packet = build_icmpv6_raw(&((struct sockaddr_in6 *)&o.decoys[decoy])->sin6_addr, hss->target->v6hostip(),
+      packet = build_icmpv6_raw(&((const struct sockaddr_in6 *) hss->target->DecoySockAddr(decoy))->sin6_addr, hss->target->v6hostip(),
                               0, 0, o.ttl, 0, icmp_ident, pspec->pd.icmpv6.type,
                               pspec->pd.icmpv6.code, o.extra_payload,
                               o.extra_payload_length,
@@ -1484,14 +1773,17 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
         probe->sent = USI->now;
       }
       hss->probeSent(packetlen);
-      send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      sendProbePacket(USI, ethptr, hss, packet, packetlen,
+                      decoy == o.decoyturn ? &probe->sent : NULL);
       free(packet);
     }
   } else assert(0);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
+  USI->gstats->lock();
   USI->gstats->num_probes_active++;
+  USI->gstats->unlock();
   hss->num_probes_active++;
 
   gettimeofday(&USI->now, NULL);
@@ -1699,7 +1991,12 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
     to_usec = TIMEVAL_SUBTRACT(*stime, USI->now);
     if (to_usec < 2000)
       to_usec = 2000;
-    ip_tmp = (struct ip *) readip_pcap(USI->pd, &bytes, to_usec, &rcvdtime, &linkhdr, true);
+#if HAVE_PTHREAD
+    if (USI->replies)
+      ip_tmp = (struct ip *) USI->replies->pop(&bytes, to_usec, &rcvdtime, &linkhdr);
+    else
+#endif
+      ip_tmp = (struct ip *) readip_pcap(USI->pd, &bytes, to_usec, &rcvdtime, &linkhdr, true);
     gettimeofday(&USI->now, NULL);
     if (!ip_tmp && TIMEVAL_SUBTRACT(*stime, USI->now) < 0) {
       timedout = true;
@@ -1760,14 +2057,13 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      ProbeCandidates candidates(hss);
+      candidates.restrict(IPPROTO_TCP, ntohs(tcp->th_dport), ntohs(tcp->th_sport));
 
       goodone = false;
 
       /* Find the probe that provoked this response. */
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      while (!goodone && candidates.next(&probeI)) {
         probe = *probeI;
 
         if (!tcp_probe_match(USI, probe, hss, tcp, &hdr.src, &hdr.dst, hdr.ipid))
@@ -1808,8 +2104,8 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      ProbeCandidates candidates(hss);
+      candidates.restrict(IPPROTO_SCTP, ntohs(sctp->sh_dport), ntohs(sctp->sh_sport));
 
       goodone = false;
 
@@ -1817,8 +2113,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       /* Find the probe that provoked this response. */
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      while (!goodone && candidates.next(&probeI)) {
         probe = *probeI;
 
         if (probe->protocol() != IPPROTO_SCTP)
@@ -1908,8 +2203,13 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      ProbeCandidates candidates(hss);
+      if (!USI->prot_scan) {
+        /* The first four bytes of the TCP, UDP, or SCTP header are the source
+           and destination ports of the probe we sent. */
+        const u16 *ports = (const u16 *) encaps_data;
+        candidates.restrict(encaps_hdr.proto, ntohs(ports[0]), ntohs(ports[1]));
+      }
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -1918,8 +2218,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
       goodone = false;
       /* Find the matching probe */
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      while (!goodone && candidates.next(&probeI)) {
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2037,8 +2336,13 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      ProbeCandidates candidates(hss);
+      if (!USI->prot_scan) {
+        /* The first four bytes of the TCP, UDP, or SCTP header are the source
+           and destination ports of the probe we sent. */
+        const u16 *ports = (const u16 *) encaps_data;
+        candidates.restrict(encaps_hdr.proto, ntohs(ports[0]), ntohs(ports[1]));
+      }
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -2047,8 +2351,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
       goodone = false;
       /* Find the matching probe */
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      while (!goodone && candidates.next(&probeI)) {
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2159,15 +2462,14 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      ProbeCandidates candidates(hss);
+      candidates.restrict(IPPROTO_UDP, ntohs(udp->uh_dport), ntohs(udp->uh_sport));
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       goodone = false;
 
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      while (!goodone && candidates.next(&probeI)) {
         probe = *probeI;
         newstate = PORT_UNKNOWN;
 
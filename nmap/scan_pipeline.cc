@@ -0,0 +1,198 @@
+
+/***************************************************************************
+ * scan_pipeline.cc -- runs the later phases of successive host groups     *
+ * concurrently with the port scan of the next group.                      *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "scan_pipeline.h"
+#include "nmap_error.h"
+
+#if HAVE_PTHREAD
+
+/* Set in the threads of the later stages. */
+static pthread_key_t stage_key;
+static pthread_once_t stage_key_once = PTHREAD_ONCE_INIT;
+
+static void make_stage_key() {
+  if (pthread_key_create(&stage_key, NULL) != 0)
+    fatal("%s: failed to create pipeline thread key", __func__);
+}
+
+bool in_pipeline_stage() {
+  pthread_once(&stage_key_once, make_stage_key);
+  return pthread_getspecific(stage_key) != NULL;
+}
+
+ScanPipeline::ScanPipeline(stage_func probe, stage_func script,
+                           const int depth[2]) {
+  int i;
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+  in_flight = 0;
+  closing = false;
+  pthread_once(&stage_key_once, make_stage_key);
+
+  stages[0].func = probe;
+  stages[1].func = script;
+  for (i = 0; i < PIPELINE_NUM_STAGES - 1; i++) {
+    stages[i].pipeline = this;
+    stages[i].index = i;
+    stages[i].depth = MAX(depth[i], 1);
+    if (pthread_create(&stages[i].thread, NULL, stage_thread, &stages[i]) != 0)
+      fatal("%s: failed to create pipeline thread", __func__);
+  }
+}
+
+ScanPipeline::~ScanPipeline() {
+  int i;
+
+  drain();
+  pthread_mutex_lock(&lock);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  for (i = 0; i < PIPELINE_NUM_STAGES - 1; i++)
+    pthread_join(stages[i].thread, NULL);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+void ScanPipeline::push(std::vector<Target *> &Targets) {
+  std::vector<Target *> *group = new std::vector<Target *>;
+
+  group->swap(Targets);
+  pthread_mutex_lock(&lock);
+  while (stages[0].queue.size() >= stages[0].depth)
+    pthread_cond_wait(&cond, &lock);
+  stages[0].queue.push_back(group);
+  in_flight++;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+bool ScanPipeline::drain() {
+  bool any;
+
+  pthread_mutex_lock(&lock);
+  any = in_flight > 0;
+  while (in_flight > 0)
+    pthread_cond_wait(&cond, &lock);
+  pthread_mutex_unlock(&lock);
+
+  return any;
+}
+
+void ScanPipeline::useDevice(const char *device) {
+  if (device == NULL)
+    device = "";
+  if (!this->device.empty() && this->device != device)
+    drain();
+  this->device = device;
+}
+
+void *ScanPipeline::stage_thread(void *arg) {
+  Stage *stage = (Stage *) arg;
+
+  pthread_setspecific(stage_key, stage);
+  stage->pipeline->run(stage);
+  return NULL;
+}
+
+void ScanPipeline::run(Stage *stage) {
+  std::vector<Target *> *group;
+  Stage *next;
+
+  next = stage->index + 1 < PIPELINE_NUM_STAGES - 1 ? &stages[stage->index + 1] : NULL;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (stage->queue.empty() && !closing)
+      pthread_cond_wait(&cond, &lock);
+    if (stage->queue.empty())
+      break;
+    group = stage->queue.front();
+    stage->queue.pop_front();
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    stage->func(*group);
+
+    pthread_mutex_lock(&lock);
+    if (next != NULL) {
+      while (next->queue.size() >= next->depth)
+        pthread_cond_wait(&cond, &lock);
+      next->queue.push_back(group);
+    } else {
+      delete group;
+      in_flight--;
+    }
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+#else
+
+bool in_pipeline_stage() {
+  return false;
+}
+
+#endif /* HAVE_PTHREAD */
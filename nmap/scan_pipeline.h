@@ -0,0 +1,148 @@
+
+/***************************************************************************
+ * scan_pipeline.h -- runs the later phases of successive host groups      *
+ * concurrently with the port scan of the next group.                      *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifndef SCAN_PIPELINE_H
+#define SCAN_PIPELINE_H
+
+#include "nmap.h"
+
+#include <list>
+#include <string>
+#include <vector>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+class Target;
+
+/* The stages of a pipelined scan. The port scan stage (host discovery and
+   port scanning) runs in the main thread; the others each have a thread of
+   their own. */
+enum pipeline_stage {
+  PIPELINE_SCAN,   /* Host discovery and port scans */
+  PIPELINE_PROBE,  /* Version detection, OS detection and traceroute */
+  PIPELINE_SCRIPT, /* Script scan and output */
+  PIPELINE_NUM_STAGES
+};
+
+/* Returns true if called from the thread of a later stage of a pipelined
+   scan. Those leave o.current_scantype to the port scan stage, which owns it
+   (it is what the status line reports). */
+bool in_pipeline_stage();
+
+#if HAVE_PTHREAD
+
+/* Passes host groups from the port scan stage through the later stages, so
+   that group N+1 can be in host discovery while group N is in version
+   detection and group N-1 is in NSE. Each later stage holds at most a set
+   number of groups waiting for it, which bounds how many Targets are alive at
+   once; push() blocks while the first of those queues is full. The last stage
+   owns the groups and is expected to free their Targets. */
+class ScanPipeline {
+public:
+  typedef void (*stage_func)(std::vector<Target *> &Targets);
+
+  /* probe and script are run on each group in turn. depth[i] is the number of
+     groups that may wait for stage PIPELINE_PROBE + i. */
+  ScanPipeline(stage_func probe, stage_func script, const int depth[2]);
+  ~ScanPipeline();
+
+  /* Hands a port-scanned group to the later stages. Targets is left empty. */
+  void push(std::vector<Target *> &Targets);
+
+  /* Waits until every group pushed so far is through the last stage. Returns
+     true if there were any. */
+  bool drain();
+
+  /* Called before the port scan stage (host discovery included) sends from
+     the interface device. If the groups in the later stages were sent from
+     another, waits for them first: every stage shares the cached ethernet
+     handle, which holds one interface at a time. */
+  void useDevice(const char *device);
+
+private:
+  struct Stage {
+    ScanPipeline *pipeline;
+    int index;
+    stage_func func;
+    std::list<std::vector<Target *> *> queue;
+    unsigned int depth;
+    pthread_t thread;
+  };
+
+  static void *stage_thread(void *arg);
+  void run(Stage *stage);
+
+  Stage stages[PIPELINE_NUM_STAGES - 1];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned int in_flight; /* Groups pushed and not yet out of the last stage */
+  bool closing;
+  std::string device; /* The interface of the last useDevice() */
+};
+
+#endif /* HAVE_PTHREAD */
+
+#endif /* SCAN_PIPELINE_H */
@@ -106,6 +106,12 @@
 
 #include <algorithm>
 #include <list>
+#include <map>
+#include <string>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 extern NmapOps o;
 
@@ -204,6 +210,56 @@ private:
   int servicefpalloc;
 };
 
+#if HAVE_PTHREAD
+// With --version-threads, responses are matched against the probes by a pool
+// of worker threads, so that a slow set of regexes doesn't hold up the nsock
+// loop and the other connections in it. A job carries a copy of the response.
+// Finished jobs are queued for the loop, and a byte written to a socket pair
+// that the loop reads from wakes it to handle them. The loop also checks
+// every MATCH_POLL_MS, in case a wakeup could not be sent.
+#define MATCH_POLL_MS 1000
+class MatchWorkers {
+public:
+  struct Job {
+    ServiceNFO *svc;
+    ServiceProbe *probe;
+    nsock_iod nsi;
+    u8 *response;
+    int responselen;
+    // Filled in by the worker. MD is NULL or points into result.
+    const struct MatchDetails *MD;
+    int fallbackDepth;
+    struct MatchResult result;
+  };
+
+  MatchWorkers(nsock_pool nsp, int nthreads);
+  ~MatchWorkers();
+  // Queues job to be matched. Takes ownership of job and job->response.
+  void submit(Job *job);
+  // Returns the next finished job, or NULL if there is none yet. The caller
+  // must delete the job.
+  Job *finished();
+  static void freeJob(Job *job);
+  // If a match thread failed to wake the loop, the errno it got; else 0.
+  int wakeError();
+
+  nsock_iod wake_iod; // Readable when there may be finished jobs
+  unsigned int outstanding; // Submitted and not yet returned by finished()
+
+private:
+  static void *worker_thread(void *arg);
+  void run();
+
+  std::vector<pthread_t> threads;
+  std::list<Job *> pending, done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool closing;
+  int wake_fds[2];
+  int wake_error;
+};
+#endif
+
 // This holds the service information for a group of Targets being service scanned.
 class ServiceGroup {
 public:
@@ -215,8 +271,65 @@ public:
   unsigned int ideal_parallelism; // Max (and desired) number of probes out at once.
   ScanProgressMeter *SPM;
   int num_hosts_timedout; // # of hosts timed out during (or before) scan
+#if HAVE_PTHREAD
+  MatchWorkers *workers; // NULL when matching is done in the nsock loop
+#endif
+};
+
+// Remembers what matching a probe's response found, so that identical
+// responses from many hosts, as are common on large networks of alike
+// machines, only go through the match lines once. Entries are keyed by the
+// probe and a hash of the response, and keep the whole response so that a
+// hash collision is never taken for a hit. When the cache is full, the least
+// recently used entry is dropped.
+class MatchCache {
+public:
+  MatchCache() : hits(0), misses(0) {}
+  // If the result of matching buf against probe and its fallbacks is
+  // cached, sets *MD to it (NULL if nothing matched) and *fallbackDepth to
+  // the fallback that matched, and returns true. *MD is only valid until the
+  // next call to add() or clear().
+  bool lookup(const ServiceProbe *probe, const u8 *buf, int buflen,
+              const struct MatchDetails **MD, int *fallbackDepth);
+  // Records the result of matching buf against probe. MD may be NULL.
+  void add(const ServiceProbe *probe, const u8 *buf, int buflen,
+           const struct MatchDetails *MD, int fallbackDepth);
+  void clear();
+  unsigned long hits, misses;
+
+private:
+  struct Key {
+    const ServiceProbe *probe;
+    u32 hash;
+    int len;
+    bool operator<(const Key &other) const {
+      if (probe != other.probe)
+        return probe < other.probe;
+      if (hash != other.hash)
+        return hash < other.hash;
+      return len < other.len;
+    }
+  };
+  struct Entry {
+    Key key;
+    std::string response;
+    bool matched;
+    int fallbackDepth;
+    // The pointers in MD point into strings.
+    struct MatchDetails MD;
+    std::string strings[9];
+  };
+  static u32 hash(const u8 *buf, int buflen);
+  std::list<Entry> lru; // Most recently used first
+  std::map<Key, std::list<Entry>::iterator> index;
 };
 
+// Responses longer than this aren't cached, to bound the memory used.
+#define MATCH_CACHE_MAX_RESPONSE 8192
+#define MATCH_CACHE_ENTRIES 1024
+
+static MatchCache match_cache;
+
 #define SUBSTARGS_MAX_ARGS 5
 #define SUBSTARGS_STRLEN 128
 #define SUBSTARGS_ARGTYPE_NONE 0
@@ -236,6 +349,9 @@ struct substargs {
 
 /********************   PROTOTYPES *******************/
 static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *mydata);
+#if HAVE_PTHREAD
+static void servicescan_match_handler(nsock_pool nsp, nsock_event nse, void *mydata);
+#endif
 static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *mydata);
 static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *mydata);
 static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, ServiceGroup *SG, ServiceNFO *svc, nsock_iod nsi);
@@ -246,8 +362,11 @@ ServiceProbeMatch::ServiceProbeMatch() {
   matchstr = NULL;
   product_template = version_template = info_template = NULL;
   hostname_template = ostype_template = devicetype_template = NULL;
+  regex_tried = false;
   regex_compiled = NULL;
   regex_extra = NULL;
+  prefix = NULL;
+  prefixlen = 0;
   isInitialized = false;
   matchops_ignorecase = false;
   matchops_dotall = false;
@@ -270,6 +389,7 @@ ServiceProbeMatch::~ServiceProbeMatch() {
   matchstrlen = 0;
   if (regex_compiled) pcre_free(regex_compiled);
   if (regex_extra) pcre_free(regex_extra);
+  if (prefix) free(prefix);
   isInitialized = false;
   matchops_anchor = -1;
 }
@@ -338,6 +458,150 @@ static bool next_template(const char **matchtext, char **modestr, char **tmplt,
   return true;
 }
 
+// Reads one literal byte of a regex at *p into *c and advances *p past it.
+// Returns false, leaving *p alone, if what is at *p is not a plain literal
+// byte, like a metacharacter or a character class escape.
+static bool regex_literal(const char **p, u8 *c) {
+  const char *s = *p;
+  int i, n;
+
+  switch (*s) {
+  case '\0': case '.': case '[': case ']': case '(': case ')': case '|':
+  case '*': case '+': case '?': case '{': case '}': case '^': case '$':
+    return false;
+  case '\\':
+    break;
+  default:
+    *c = *s;
+    *p = s + 1;
+    return true;
+  }
+  s++;
+  switch (*s) {
+  case 'r': *c = '\r'; break;
+  case 'n': *c = '\n'; break;
+  case 't': *c = '\t'; break;
+  case 'f': *c = '\f'; break;
+  case 'a': *c = '\a'; break;
+  case 'e': *c = '\x1b'; break;
+  case 'x':
+    // \xhh, with one or two hex digits. \x{...} is not handled.
+    n = 0;
+    for (i = 1; i <= 2 && isxdigit((int) (unsigned char) s[i]); i++)
+      n = n * 16 + (isdigit((int) (unsigned char) s[i]) ? s[i] - '0' : tolower((int) (unsigned char) s[i]) - 'a' + 10);
+    if (s[1] == '{')
+      return false;
+    *c = n;
+    *p = s + i;
+    return true;
+  case '0':
+    // \0 followed by up to two more octal digits.
+    n = 0;
+    for (i = 1; i <= 2 && s[i] >= '0' && s[i] <= '7'; i++)
+      n = n * 8 + s[i] - '0';
+    *c = n;
+    *p = s + i;
+    return true;
+  default:
+    // Any other escaped non-alphanumeric is that character itself. Escaped
+    // letters and digits are classes, assertions, or back references.
+    if (*s == '\0' || isalnum((int) (unsigned char) *s) || (unsigned char) *s >= 0x80)
+      return false;
+    *c = *s;
+    break;
+  }
+  *p = s + 1;
+
+  return true;
+}
+
+// Finds the literal bytes that any match of regex must begin with, if the
+// regex is anchored with ^. Returns their number, and stores them in a newly
+// allocated *prefix if there are any. Anything not understood ends the prefix
+// early, which is always safe: a shorter prefix only rejects fewer responses.
+static int regex_anchored_prefix(const char *regex, u8 **prefix) {
+  const char *p;
+  int depth, len;
+  u8 c;
+
+  *prefix = NULL;
+  if (regex[0] != '^')
+    return 0;
+
+  // An alternative at the top level would not be anchored. \Q...\E quoting
+  // would hide metacharacters from this scan, so don't try with it.
+  if (strstr(regex, "\\Q") != NULL)
+    return 0;
+  depth = 0;
+  for (p = strchr(regex, '|') != NULL ? regex : ""; *p != '\0'; p++) {
+    if (*p == '\\') {
+      if (p[1] != '\0')
+        p++;
+    } else if (*p == '[') {
+      // Skip the class. A ] right at the start is a literal.
+      p++;
+      if (*p == '^')
+        p++;
+      if (*p == ']')
+        p++;
+      for (; *p != '\0' && *p != ']'; p++) {
+        if (*p == '\\' && p[1] != '\0')
+          p++;
+      }
+      if (*p == '\0')
+        return 0;
+    } else if (*p == '(') {
+      depth++;
+    } else if (*p == ')') {
+      depth--;
+    } else if (*p == '|' && depth == 0) {
+      return 0;
+    }
+  }
+
+  *prefix = (u8 *) safe_malloc(strlen(regex));
+  len = 0;
+  p = regex + 1;
+  while (regex_literal(&p, &c)) {
+    // A quantifier that allows zero repetitions makes the byte optional, and
+    // one that allows more means nothing after it is at a fixed place.
+    if (*p == '*' || *p == '?' || *p == '{')
+      break;
+    (*prefix)[len++] = c;
+    if (*p == '+')
+      break;
+  }
+  if (len == 0) {
+    free(*prefix);
+    *prefix = NULL;
+  }
+
+  return len;
+}
+
+// Compares the start of buf to prefix, ignoring the case of ASCII letters if
+// ignorecase is true, as PCRE_CASELESS does with the default tables.
+static bool prefix_matches(const u8 *buf, int buflen, const u8 *prefix,
+                           int prefixlen, bool ignorecase) {
+  int i;
+
+  if (buflen < prefixlen)
+    return false;
+  if (!ignorecase)
+    return memcmp(buf, prefix, prefixlen) == 0;
+  for (i = 0; i < prefixlen; i++) {
+    u8 a = buf[i], b = prefix[i];
+    if (a >= 'A' && a <= 'Z')
+      a += 'a' - 'A';
+    if (b >= 'A' && b <= 'Z')
+      b += 'a' - 'A';
+    if (a != b)
+      return false;
+  }
+
+  return true;
+}
+
 // match text from the nmap-service-probes file.  This must be called
 // before you try and do anything with this match.  This function
 // should be passed the whole line starting with "match" or
@@ -347,9 +611,6 @@ static bool next_template(const char **matchtext, char **modestr, char **tmplt,
 void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   const char *p;
   char *modestr, *tmptemplate, *flags;
-  int pcre_compile_ops = 0;
-  const char *pcre_errptr = NULL;
-  int pcre_erroffset = 0;
   char **curr_tmp = NULL;
 
   if (isInitialized) fatal("Sorry ... %s does not yet support reinitializion", __func__);
@@ -403,41 +664,10 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
       fatal("%s: illegal regexp option on line %d of nmap-service-probes", __func__, lineno);
   }
 
-  // Next we compile and study the regular expression to match
-  if (matchops_ignorecase)
-    pcre_compile_ops |= PCRE_CASELESS;
-
-  if (matchops_dotall)
-    pcre_compile_ops |= PCRE_DOTALL;
-
-  regex_compiled = pcre_compile(matchstr, pcre_compile_ops, &pcre_errptr,
-                                   &pcre_erroffset, NULL);
-
-  if (regex_compiled == NULL)
-    fatal("%s: illegal regexp on line %d of nmap-service-probes (at regexp offset %d): %s\n", __func__, lineno, pcre_erroffset, pcre_errptr);
-
-  // Now study the regexp for greater efficiency
-  regex_extra = pcre_study(regex_compiled, 0
-#ifdef PCRE_STUDY_EXTRA_NEEDED
-  | PCRE_STUDY_EXTRA_NEEDED
-#endif
-  , &pcre_errptr);
-  if (pcre_errptr != NULL)
-    fatal("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s\n", __func__, lineno, pcre_errptr);
-
-  if (!regex_extra) {
-    regex_extra = (pcre_extra *) pcre_malloc(sizeof(pcre_extra));
-    memset(regex_extra, 0, sizeof(pcre_extra));
-  }
-
-  // Set some limits to avoid evil match cases.
-  // These are flexible; if they cause problems, increase them.
-#ifdef PCRE_ERROR_MATCHLIMIT
-  regex_extra->match_limit = 100000; // 100K
-#endif
-#ifdef PCRE_ERROR_RECURSIONLIMIT
-  regex_extra->match_limit_recursion = 10000; // 10K
-#endif
+  // The regex is compiled by compileRegex() when it is first needed. Most
+  // are never needed in a given scan, because the responses they would be
+  // tested against don't start with their literal prefix.
+  prefixlen = regex_anchored_prefix(matchstr, &prefix);
 
   free(modestr);
   free(flags);
@@ -483,6 +713,72 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   isInitialized = 1;
 }
 
+void ServiceProbeMatch::compileRegex() {
+  int pcre_compile_ops = 0;
+  int pcre_study_ops = 0;
+  const char *pcre_errptr = NULL;
+  int pcre_erroffset = 0;
+
+  if (regex_tried)
+    return;
+  regex_tried = true;
+
+  if (matchops_ignorecase)
+    pcre_compile_ops |= PCRE_CASELESS;
+
+  if (matchops_dotall)
+    pcre_compile_ops |= PCRE_DOTALL;
+
+  regex_compiled = pcre_compile(matchstr, pcre_compile_ops, &pcre_errptr,
+                                   &pcre_erroffset, NULL);
+
+  if (regex_compiled == NULL) {
+    error("%s: illegal regexp on line %d of nmap-service-probes (at regexp offset %d): %s; ignoring that line", __func__, deflineno, pcre_erroffset, pcre_errptr);
+    return;
+  }
+
+  // Now study the regexp for greater efficiency
+#ifdef PCRE_STUDY_EXTRA_NEEDED
+  pcre_study_ops |= PCRE_STUDY_EXTRA_NEEDED;
+#endif
+  regex_extra = pcre_study(regex_compiled, pcre_study_ops, &pcre_errptr);
+  // The regex works unstudied, just more slowly.
+  if (pcre_errptr != NULL)
+    error("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s", __func__, deflineno, pcre_errptr);
+
+  if (!regex_extra) {
+    regex_extra = (pcre_extra *) pcre_malloc(sizeof(pcre_extra));
+    memset(regex_extra, 0, sizeof(pcre_extra));
+  }
+
+  // Set some limits to avoid evil match cases.
+  // These are flexible; if they cause problems, increase them.
+#ifdef PCRE_ERROR_MATCHLIMIT
+  regex_extra->match_limit = 100000; // 100K
+#endif
+#ifdef PCRE_ERROR_RECURSIONLIMIT
+  regex_extra->match_limit_recursion = 10000; // 10K
+#endif
+}
+
+// Reports a warning from matching with error(), or if warnings is not NULL,
+// adds it there for the caller to report.
+static void match_warning(std::vector<std::string> *warnings, const char *fmt, ...)
+     __attribute__ ((format (printf, 2, 3)));
+
+static void match_warning(std::vector<std::string> *warnings, const char *fmt, ...) {
+  char buf[1024];
+  va_list ap;
+
+  va_start(ap, fmt);
+  Vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (warnings != NULL)
+    warnings->push_back(buf);
+  else
+    error("%s", buf);
+}
+
   // If the buf (of length buflen) match the regex in this
   // ServiceProbeMatch, returns the details of the match (service
   // name, version number if applicable, and whether this is a "soft"
@@ -492,63 +788,85 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   // exception is that the serviceName field can be saved throughout
   // program execution.  If no version matched, that field will be
   // NULL.
-const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int buflen) {
+const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int buflen,
+                                                        struct MatchResult *result) {
   int rc;
-  static char product[80];
-  static char version[80];
-  static char info[256];  /* We will truncate with ... later */
-  static char hostname[80];
-  static char ostype[32];
-  static char devicetype[32];
-  static char cpe_a[80], cpe_h[80], cpe_o[80];
+  static struct MatchResult static_result;
+  struct MatchDetails *MD_return;
+  std::vector<std::string> *warnings = NULL;
   char *bufc = (char *) buf;
   int ovector[150]; // allows 50 substring matches (including the overall match)
   assert(isInitialized);
 
   assert (matchtype == SERVICEMATCH_REGEX);
 
+  if (result == NULL)
+    result = &static_result;
+  else
+    warnings = &result->warnings;
+  MD_return = &result->MD;
+
   // Clear out the output struct
-  memset(&MD_return, 0, sizeof(MD_return));
-  MD_return.isSoft = isSoft;
+  memset(MD_return, 0, sizeof(*MD_return));
+  MD_return->isSoft = isSoft;
+  result->rc = PCRE_ERROR_NOMATCH;
+
+  // Most responses can be ruled out without the regex.
+  if (prefixlen > 0 && !prefix_matches(buf, buflen, prefix, prefixlen, matchops_ignorecase))
+    return MD_return;
+
+  if (!regex_tried)
+    compileRegex();
+  if (regex_compiled == NULL)
+    return MD_return; // The regex is invalid; this line never matches.
 
   rc = pcre_exec(regex_compiled, regex_extra, bufc, buflen, 0, 0, ovector, sizeof(ovector) / sizeof(*ovector));
+  result->rc = rc;
   if (rc < 0) {
 #ifdef PCRE_ERROR_MATCHLIMIT  // earlier PCRE versions lack this
     if (rc == PCRE_ERROR_MATCHLIMIT) {
       if (o.debugging || o.verbose > 1)
-        error("Warning: Hit PCRE_ERROR_MATCHLIMIT when probing for service %s with the regex '%s'", servicename, matchstr);
+        match_warning(warnings, "Warning: Hit PCRE_ERROR_MATCHLIMIT when probing for service %s with the regex '%s'", servicename, matchstr);
     } else
 #endif // PCRE_ERROR_MATCHLIMIT
 #ifdef PCRE_ERROR_RECURSIONLIMIT
     if (rc == PCRE_ERROR_RECURSIONLIMIT) {
       if (o.debugging || o.verbose > 1)
-        error("Warning: Hit PCRE_ERROR_RECURSIONLIMIT when probing for service %s with the regex '%s'", servicename, matchstr);
+        match_warning(warnings, "Warning: Hit PCRE_ERROR_RECURSIONLIMIT when probing for service %s with the regex '%s'", servicename, matchstr);
     } else
 #endif // PCRE_ERROR_RECURSIONLIMIT
       if (rc != PCRE_ERROR_NOMATCH) {
-        fatal("Unexpected PCRE error (%d) when probing for service %s with the regex '%s'", rc, servicename, matchstr);
+        char msg[1024];
+
+        Snprintf(msg, sizeof(msg), "Unexpected PCRE error (%d) when probing for service %s with the regex '%s'", rc, servicename, matchstr);
+        if (warnings == NULL)
+          fatal("%s", msg);
+        result->fatalmsg = msg;
       }
   } else {
     // Yeah!  Match apparently succeeded.
     // Now lets get the version number if available
-    getVersionStr(buf, buflen, ovector, rc, product, sizeof(product), version, sizeof(version), info, sizeof(info),
-                  hostname, sizeof(hostname), ostype, sizeof(ostype), devicetype, sizeof(devicetype),
-                  cpe_a, sizeof(cpe_a), cpe_h, sizeof(cpe_h), cpe_o, sizeof(cpe_o));
-    if (*product) MD_return.product = product;
-    if (*version) MD_return.version = version;
-    if (*info) MD_return.info = info;
-    if (*hostname) MD_return.hostname = hostname;
-    if (*ostype) MD_return.ostype = ostype;
-    if (*devicetype) MD_return.devicetype = devicetype;
-    if (*cpe_a) MD_return.cpe_a = cpe_a;
-    if (*cpe_h) MD_return.cpe_h = cpe_h;
-    if (*cpe_o) MD_return.cpe_o = cpe_o;
+    getVersionStr(buf, buflen, ovector, rc, result->product, sizeof(result->product),
+                  result->version, sizeof(result->version), result->info, sizeof(result->info),
+                  result->hostname, sizeof(result->hostname), result->ostype, sizeof(result->ostype),
+                  result->devicetype, sizeof(result->devicetype),
+                  result->cpe_a, sizeof(result->cpe_a), result->cpe_h, sizeof(result->cpe_h),
+                  result->cpe_o, sizeof(result->cpe_o), warnings);
+    if (*result->product) MD_return->product = result->product;
+    if (*result->version) MD_return->version = result->version;
+    if (*result->info) MD_return->info = result->info;
+    if (*result->hostname) MD_return->hostname = result->hostname;
+    if (*result->ostype) MD_return->ostype = result->ostype;
+    if (*result->devicetype) MD_return->devicetype = result->devicetype;
+    if (*result->cpe_a) MD_return->cpe_a = result->cpe_a;
+    if (*result->cpe_h) MD_return->cpe_h = result->cpe_h;
+    if (*result->cpe_o) MD_return->cpe_o = result->cpe_o;
 
-    MD_return.serviceName = servicename;
-    MD_return.lineno = getLineNo();
+    MD_return->serviceName = servicename;
+    MD_return->lineno = getLineNo();
   }
 
-  return &MD_return;
+  return MD_return;
 }
 
 // This simple function parses arguments out of a string.  The string
@@ -939,7 +1257,8 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
                   char *devicetype, int devicetypelen,
                   char *cpe_a, int cpe_alen,
                   char *cpe_h, int cpe_hlen,
-                  char *cpe_o, int cpe_olen) {
+                  char *cpe_o, int cpe_olen,
+                  std::vector<std::string> *warnings) {
 
   int rc;
   assert(productlen >= 0 && versionlen >= 0 && infolen >= 0 &&
@@ -960,10 +1279,10 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
   if (product_template) {
     rc = dotmplsubst(subject, subjectlen, ovector, nummatches, product_template, product, productlen);
     if (rc != 0) {
-      error("Warning: Servicescan failed to fill product_template (subjectlen: %d, productlen: %d). Capture exceeds length? Match string was line %d: p/%s/%s/%s", subjectlen, productlen, deflineno,
-            (product_template)? product_template : "",
-            (version_template)? version_template : "",
-            (info_template)? info_template : "");
+      match_warning(warnings, "Warning: Servicescan failed to fill product_template (subjectlen: %d, productlen: %d). Capture exceeds length? Match string was line %d: p/%s/%s/%s", subjectlen, productlen, deflineno,
+                    (product_template)? product_template : "",
+                    (version_template)? version_template : "",
+                    (info_template)? info_template : "");
       if (productlen > 0) *product = '\0';
       retval = -1;
     }
@@ -972,10 +1291,10 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
   if (version_template) {
     rc = dotmplsubst(subject, subjectlen, ovector, nummatches, version_template, version, versionlen);
     if (rc != 0) {
-      error("Warning: Servicescan failed to fill version_template (subjectlen: %d, versionlen: %d). Capture exceeds length? Match string was line %d: v/%s/%s/%s", subjectlen, versionlen, deflineno,
-            (product_template)? product_template : "",
-            (version_template)? version_template : "",
-            (info_template)? info_template : "");
+      match_warning(warnings, "Warning: Servicescan failed to fill version_template (subjectlen: %d, versionlen: %d). Capture exceeds length? Match string was line %d: v/%s/%s/%s", subjectlen, versionlen, deflineno,
+                    (product_template)? product_template : "",
+                    (version_template)? version_template : "",
+                    (info_template)? info_template : "");
       if (versionlen > 0) *version = '\0';
       retval = -1;
     }
@@ -984,10 +1303,10 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
   if (info_template) {
     rc = dotmplsubst(subject, subjectlen, ovector, nummatches, info_template, info, infolen);
     if (rc != 0) {
-      error("Warning: Servicescan failed to fill info_template (subjectlen: %d, infolen: %d). Capture exceeds length? Match string was line %d: i/%s/%s/%s", subjectlen, infolen, deflineno,
-            (product_template)? product_template : "",
-            (version_template)? version_template : "",
-            (info_template)? info_template : "");
+      match_warning(warnings, "Warning: Servicescan failed to fill info_template (subjectlen: %d, infolen: %d). Capture exceeds length? Match string was line %d: i/%s/%s/%s", subjectlen, infolen, deflineno,
+                    (product_template)? product_template : "",
+                    (version_template)? version_template : "",
+                    (info_template)? info_template : "");
       if (infolen > 0) *info = '\0';
       retval = -1;
     }
@@ -996,8 +1315,8 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
   if (hostname_template) {
     rc = dotmplsubst(subject, subjectlen, ovector, nummatches, hostname_template, hostname, hostnamelen);
     if (rc != 0) {
-      error("Warning: Servicescan failed to fill hostname_template (subjectlen: %d, hostnamelen: %d). Capture exceeds length? Match string was line %d: h/%s/", subjectlen, hostnamelen, deflineno,
-            (hostname_template)? hostname_template : "");
+      match_warning(warnings, "Warning: Servicescan failed to fill hostname_template (subjectlen: %d, hostnamelen: %d). Capture exceeds length? Match string was line %d: h/%s/", subjectlen, hostnamelen, deflineno,
+                    (hostname_template)? hostname_template : "");
       if (hostnamelen > 0) *hostname = '\0';
       retval = -1;
     }
@@ -1006,8 +1325,8 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
   if (ostype_template) {
     rc = dotmplsubst(subject, subjectlen, ovector, nummatches, ostype_template, ostype, ostypelen);
     if (rc != 0) {
-      error("Warning: Servicescan failed to fill ostype_template (subjectlen: %d, ostypelen: %d). Capture exceeds length? Match string was line %d: o/%s/", subjectlen, ostypelen, deflineno,
-            (ostype_template)? ostype_template : "");
+      match_warning(warnings, "Warning: Servicescan failed to fill ostype_template (subjectlen: %d, ostypelen: %d). Capture exceeds length? Match string was line %d: o/%s/", subjectlen, ostypelen, deflineno,
+                    (ostype_template)? ostype_template : "");
       if (ostypelen > 0) *ostype = '\0';
       retval = -1;
     }
@@ -1016,8 +1335,8 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
   if (devicetype_template) {
     rc = dotmplsubst(subject, subjectlen, ovector, nummatches, devicetype_template, devicetype, devicetypelen);
     if (rc != 0) {
-      error("Warning: Servicescan failed to fill devicetype_template (subjectlen: %d, devicetypelen: %d). Too long? Match string was line %d: d/%s/", subjectlen, devicetypelen, deflineno,
-            (devicetype_template)? devicetype_template : "");
+      match_warning(warnings, "Warning: Servicescan failed to fill devicetype_template (subjectlen: %d, devicetypelen: %d). Too long? Match string was line %d: d/%s/", subjectlen, devicetypelen, deflineno,
+                    (devicetype_template)? devicetype_template : "");
       if (devicetypelen > 0) *devicetype = '\0';
       retval = -1;
     }
@@ -1045,15 +1364,15 @@ int ServiceProbeMatch::getVersionStr(const u8 *subject, int subjectlen,
       cpelen = cpe_olen;
       break;
     default:
-      error("Warning: ignoring cpe:// template with unknown part '%c' (0x%02X)",
-        isprint(part) ? part : '.', part);
+      match_warning(warnings, "Warning: ignoring cpe:// template with unknown part '%c' (0x%02X)",
+                    isprint(part) ? part : '.', part);
       continue;
       break;
     }
     rc = dotmplsubst(subject, subjectlen, ovector, nummatches, cpe_templates[i], cpe, cpelen, transform_cpe);
     if (rc != 0) {
-      error("Warning: Servicescan failed to fill cpe_%c (subjectlen: %d, cpelen: %d). Too long? Match string was line %d: %s", part, subjectlen, cpelen, deflineno,
-            (cpe_templates[i])? cpe_templates[i] : "");
+      match_warning(warnings, "Warning: Servicescan failed to fill cpe_%c (subjectlen: %d, cpelen: %d). Too long? Match string was line %d: %s", part, subjectlen, cpelen, deflineno,
+                    (cpe_templates[i])? cpe_templates[i] : "");
       if (cpelen > 0) *cpe = '\0';
       retval = -1;
     }
@@ -1235,13 +1554,7 @@ bool ServiceProbe::portIsProbable(enum service_tunnel_type tunnel, u16 portno) {
  // Returns true if the passed in service name is among those that can
   // be detected by the matches in this probe;
 bool ServiceProbe::serviceIsPossible(const char *sname) {
-  std::vector<const char *>::iterator vi;
-
-  for(vi = detectedServices.begin(); vi != detectedServices.end(); vi++) {
-    if (strcmp(*vi, sname) == 0)
-      return true;
-  }
-  return false;
+  return detectedServices.find(sname) != detectedServices.end();
 }
 
 
@@ -1267,12 +1580,9 @@ void ServiceProbe::setRarity(const char *portstr, int lineno) {
   // function will bail with an error (giving the line number) if it
   // fails to parse the string.
 void ServiceProbe::addMatch(const char *match, int lineno) {
-  const char *sname;
   ServiceProbeMatch *newmatch = new ServiceProbeMatch();
   newmatch->InitMatch(match, lineno);
-  sname = newmatch->getName();
-  if (!serviceIsPossible(sname))
-    detectedServices.push_back(sname);
+  detectedServices.insert(newmatch->getName());
   matches.push_back(newmatch);
 }
 
@@ -1393,6 +1703,8 @@ AllProbes *AllProbes::service_scan_init(void)
 void AllProbes::service_scan_free(void)
 {
   if(global_AP){
+    // The cache refers to the probes.
+    match_cache.clear();
     delete global_AP;
     global_AP = NULL;
   }
@@ -1430,12 +1742,13 @@ int AllProbes::check_excluded_port(unsigned short portno, int proto)
 // serviceName field can be saved throughout program execution.  If
 // no version matched, that field will be NULL. This function may
 // return NULL if there are no match lines at all in this probe.
-const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n = 0) {
+const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n = 0,
+                                                   struct MatchResult *result) {
   std::vector<ServiceProbeMatch *>::iterator vi;
   const struct MatchDetails *MD;
 
   for(vi = matches.begin(); vi != matches.end(); vi++) {
-    MD = (*vi)->testMatch(buf, buflen);
+    MD = (*vi)->testMatch(buf, buflen, result);
     if (MD->serviceName) {
       if (n == 0)
         return MD;
@@ -1491,6 +1804,22 @@ ServiceProbe *AllProbes::getProbeByName(const char *name, int proto) {
 }
 
 
+void AllProbes::compileRegexes() {
+  std::vector<ServiceProbe *>::iterator pi;
+  unsigned int i;
+
+  for (pi = probes.begin(); pi != probes.end(); pi++) {
+    const std::vector<ServiceProbeMatch *> &matches = (*pi)->getMatches();
+    for (i = 0; i < matches.size(); i++)
+      matches[i]->compileRegex();
+  }
+  if (nullProbe != NULL) {
+    const std::vector<ServiceProbeMatch *> &matches = nullProbe->getMatches();
+    for (i = 0; i < matches.size(); i++)
+      matches[i]->compileRegex();
+  }
+}
+
 
 // Returns nonzero if port was specified in the excludeports
 // directive in nmap-service-probes. Zero otherwise.
@@ -1952,6 +2281,9 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   }
 
   SPM = new ScanProgressMeter("Service scan");
+#if HAVE_PTHREAD
+  workers = NULL;
+#endif
   desired_par = 1;
   if (o.timing_level == 3) desired_par = 20;
   if (o.timing_level == 4) desired_par = 30;
@@ -1960,6 +2292,10 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   int min_par, max_par;
   min_par = o.min_parallelism;
   max_par = MAX(min_par, o.max_parallelism ? o.max_parallelism : 100);
+  if (o.pipeline_sockets[PIPELINE_PROBE] > 0) {
+    max_par = MIN(max_par, o.pipeline_sockets[PIPELINE_PROBE]);
+    min_par = MIN(min_par, max_par);
+  }
   ideal_parallelism = box(min_par, max_par, desired_par);
 }
 
@@ -1976,6 +2312,9 @@ ServiceGroup::~ServiceGroup() {
     delete *i;
 
   delete SPM;
+#if HAVE_PTHREAD
+  delete workers;
+#endif
 }
 
 /* Called if data is read for a service or a TCP connection made. Sets the port
@@ -2432,6 +2771,364 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
   return;
 }
 
+// FNV-1a
+u32 MatchCache::hash(const u8 *buf, int buflen) {
+  u32 h = 2166136261U;
+  int i;
+
+  for (i = 0; i < buflen; i++) {
+    h ^= buf[i];
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+bool MatchCache::lookup(const ServiceProbe *probe, const u8 *buf, int buflen,
+                        const struct MatchDetails **MD, int *fallbackDepth) {
+  std::map<Key, std::list<Entry>::iterator>::iterator it;
+  Key key;
+
+  key.probe = probe;
+  key.hash = hash(buf, buflen);
+  key.len = buflen;
+  it = index.find(key);
+  if (it == index.end() || it->second->response.compare(0, std::string::npos, (const char *) buf, buflen) != 0) {
+    misses++;
+    return false;
+  }
+  hits++;
+  lru.splice(lru.begin(), lru, it->second);
+  *MD = it->second->matched ? &it->second->MD : NULL;
+  *fallbackDepth = it->second->fallbackDepth;
+
+  return true;
+}
+
+// Copies src into dst and returns dst's contents, or returns NULL if src is
+// NULL.
+static const char *copy_match_string(std::string &dst, const char *src) {
+  if (src == NULL)
+    return NULL;
+  dst = src;
+  return dst.c_str();
+}
+
+void MatchCache::add(const ServiceProbe *probe, const u8 *buf, int buflen,
+                     const struct MatchDetails *MD, int fallbackDepth) {
+  std::map<Key, std::list<Entry>::iterator>::iterator it;
+  Entry *e;
+  Key key;
+
+  if (buflen > MATCH_CACHE_MAX_RESPONSE)
+    return;
+
+  key.probe = probe;
+  key.hash = hash(buf, buflen);
+  key.len = buflen;
+  // A different response with the same hash replaces the old one.
+  it = index.find(key);
+  if (it != index.end()) {
+    lru.erase(it->second);
+    index.erase(it);
+  }
+  if (lru.size() >= MATCH_CACHE_ENTRIES) {
+    index.erase(lru.back().key);
+    lru.pop_back();
+  }
+
+  // Fill in the entry in place, so that the pointers into its strings stay
+  // valid.
+  lru.push_front(Entry());
+  e = &lru.front();
+  e->key = key;
+  e->response.assign((const char *) buf, buflen);
+  e->matched = MD != NULL && MD->serviceName != NULL;
+  e->fallbackDepth = fallbackDepth;
+  memset(&e->MD, 0, sizeof(e->MD));
+  if (e->matched) {
+    e->MD.isSoft = MD->isSoft;
+    e->MD.serviceName = MD->serviceName;
+    e->MD.lineno = MD->lineno;
+    e->MD.product = copy_match_string(e->strings[0], MD->product);
+    e->MD.version = copy_match_string(e->strings[1], MD->version);
+    e->MD.info = copy_match_string(e->strings[2], MD->info);
+    e->MD.hostname = copy_match_string(e->strings[3], MD->hostname);
+    e->MD.ostype = copy_match_string(e->strings[4], MD->ostype);
+    e->MD.devicetype = copy_match_string(e->strings[5], MD->devicetype);
+    e->MD.cpe_a = copy_match_string(e->strings[6], MD->cpe_a);
+    e->MD.cpe_h = copy_match_string(e->strings[7], MD->cpe_h);
+    e->MD.cpe_o = copy_match_string(e->strings[8], MD->cpe_o);
+  }
+  index[key] = lru.begin();
+}
+
+void MatchCache::clear() {
+  lru.clear();
+  index.clear();
+}
+
+// Tests resp against probe and then its fallbacks, in order, and returns the
+// first match, or NULL if there is none. *fallbackDepth is set to the index of
+// the fallback that matched. result is as for ServiceProbe::testMatch.
+static const struct MatchDetails *match_response(ServiceProbe *probe,
+                                                 const u8 *resp, int resplen,
+                                                 int *fallbackDepth,
+                                                 struct MatchResult *result) {
+  const struct MatchDetails *MD;
+
+  for (*fallbackDepth = 0; probe->fallbacks[*fallbackDepth] != NULL; (*fallbackDepth)++) {
+    MD = (probe->fallbacks[*fallbackDepth])->testMatch(resp, resplen, 0, result);
+    if (MD && MD->serviceName)
+      return MD; // Found one!
+  }
+
+  return NULL;
+}
+
+// Acts on the result of matching svc's response to probe: records a match,
+// or reads more, or moves on to the next probe. MD is the match found (or
+// NULL) and fallbackDepth says which of probe's fallbacks it came from.
+static void handle_match(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
+                         ServiceNFO *svc, ServiceProbe *probe,
+                         const struct MatchDetails *MD, int fallbackDepth) {
+  const u8 *readstr;
+  int readstrlen;
+
+  readstr = svc->getcurrentproberesponse(&readstrlen);
+
+  if (MD && MD->serviceName) {
+    // WOO HOO!!!!!!  MATCHED!  But might be soft
+    if (MD->isSoft && svc->probe_matched) {
+      if (strcmp(svc->probe_matched, MD->serviceName) != 0)
+        error("WARNING: Service %s:%hu had already soft-matched %s, but now soft-matched %s; ignoring second value", svc->target->targetipstr(), svc->portno, svc->probe_matched, MD->serviceName);
+      // No error if its the same - that happens frequently.  For
+      // example, if we read more data for the same probe response
+      // it will probably still match.
+    } else {
+      if (o.debugging > 1 || o.versionTrace()) {
+        if (MD->product || MD->version || MD->info)
+          log_write(LOG_PLAIN, "Service scan match (Probe %s matched with %s line %d): %s:%hu is %s%s.  Version: |%s|%s|%s|\n",
+                    probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
+                    MD->lineno,
+                    svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "",
+                    MD->serviceName, (MD->product)? MD->product : "", (MD->version)? MD->version : "",
+                    (MD->info)? MD->info : "");
+        else
+          log_write(LOG_PLAIN, "Service scan %s match (Probe %s matched with %s line %d): %s:%hu is %s%s\n",
+                    (MD->isSoft)? "soft" : "hard",
+                    probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
+                    MD->lineno,
+                    svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", MD->serviceName);
+      }
+      svc->probe_matched = MD->serviceName;
+      if (MD->product)
+        Strncpy(svc->product_matched, MD->product, sizeof(svc->product_matched));
+      if (MD->version)
+        Strncpy(svc->version_matched, MD->version, sizeof(svc->version_matched));
+      if (MD->info)
+        Strncpy(svc->extrainfo_matched, MD->info, sizeof(svc->extrainfo_matched));
+      if (MD->hostname)
+        Strncpy(svc->hostname_matched, MD->hostname, sizeof(svc->hostname_matched));
+      if (MD->ostype)
+        Strncpy(svc->ostype_matched, MD->ostype, sizeof(svc->ostype_matched));
+      if (MD->devicetype)
+        Strncpy(svc->devicetype_matched, MD->devicetype, sizeof(svc->devicetype_matched));
+      if (MD->cpe_a)
+        Strncpy(svc->cpe_a_matched, MD->cpe_a, sizeof(svc->cpe_a_matched));
+      if (MD->cpe_h)
+        Strncpy(svc->cpe_h_matched, MD->cpe_h, sizeof(svc->cpe_h_matched));
+      if (MD->cpe_o)
+        Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
+      svc->softMatchFound = MD->isSoft;
+      if (!svc->softMatchFound) {
+        // We might be able to continue scan through a tunnel protocol
+        // like SSL
+        if (scanThroughTunnel(nsp, nsi, SG, svc) == 0)
+          end_svcprobe(nsp, PROBESTATE_FINISHED_HARDMATCHED, SG, svc, nsi);
+      }
+    }
+  }
+
+  if (!MD || !MD->serviceName || MD->isSoft) {
+    // Didn't match... maybe reading more until timeout will help
+    // TODO: For efficiency I should be able to test if enough data
+    // has been received rather than always waiting for the reading
+    // to timeout.  For now I'll limit it to 4096 bytes just to
+    // avoid reading megs from services like chargen.  But better
+    // approach is needed.
+    if (svc->probe_timemsleft(probe) > 0 && readstrlen < 4096) {
+      nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe), svc);
+    } else {
+      // Failed -- lets go to the next probe.
+      if (readstrlen > 0)
+        svc->addToServiceFingerprint(probe->getName(), readstr, readstrlen);
+      startNextProbe(nsp, nsi, SG, svc, false);
+    }
+  }
+}
+
+#if HAVE_PTHREAD
+MatchWorkers::MatchWorkers(nsock_pool nsp, int nthreads) {
+  int i;
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+  closing = false;
+  outstanding = 0;
+  wake_error = 0;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, wake_fds) != 0)
+    pfatal("%s: socketpair failed", __func__);
+  unblock_socket(wake_fds[1]);
+  wake_iod = nsock_iod_new2(nsp, wake_fds[0], NULL);
+  if (wake_iod == NULL)
+    fatal("%s: failed to create nsock iod", __func__);
+
+  threads.resize(nthreads);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, worker_thread, this) != 0)
+      fatal("%s: failed to create match thread", __func__);
+  }
+}
+
+MatchWorkers::~MatchWorkers() {
+  unsigned int i;
+
+  pthread_mutex_lock(&lock);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  for (i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  while (!pending.empty()) {
+    freeJob(pending.front());
+    pending.pop_front();
+  }
+  while (!done.empty()) {
+    freeJob(done.front());
+    done.pop_front();
+  }
+  // wake_iod has its own copy of wake_fds[0] and goes with the nsock pool.
+  close(wake_fds[0]);
+  close(wake_fds[1]);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+void MatchWorkers::submit(Job *job) {
+  outstanding++;
+  pthread_mutex_lock(&lock);
+  pending.push_back(job);
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+MatchWorkers::Job *MatchWorkers::finished() {
+  Job *job = NULL;
+
+  pthread_mutex_lock(&lock);
+  if (!done.empty()) {
+    job = done.front();
+    done.pop_front();
+    outstanding--;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return job;
+}
+
+int MatchWorkers::wakeError() {
+  int err;
+
+  pthread_mutex_lock(&lock);
+  err = wake_error;
+  pthread_mutex_unlock(&lock);
+
+  return err;
+}
+
+void MatchWorkers::freeJob(Job *job) {
+  free(job->response);
+  delete job;
+}
+
+void *MatchWorkers::worker_thread(void *arg) {
+  ((MatchWorkers *) arg)->run();
+  return NULL;
+}
+
+void MatchWorkers::run() {
+  Job *job;
+  char c = 0;
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (pending.empty() && !closing)
+      pthread_cond_wait(&cond, &lock);
+    if (closing)
+      break;
+    job = pending.front();
+    pending.pop_front();
+    pthread_mutex_unlock(&lock);
+
+    job->MD = match_response(job->probe, job->response, job->responselen,
+                             &job->fallbackDepth, &job->result);
+
+    pthread_mutex_lock(&lock);
+    done.push_back(job);
+    // If the socket buffer is full, the loop has wakeups waiting already.
+    // Other errors are left for the loop to report, as it polls anyway.
+    if (send(wake_fds[1], &c, 1, 0) < 0 && socket_errno() != EAGAIN && socket_errno() != EWOULDBLOCK)
+      wake_error = socket_errno();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Called when a match thread has finished a job, or after MATCH_POLL_MS
+// without one. Handles all the finished jobs, and waits for more if any are
+// still out. The match threads don't print; their warnings and errors are
+// reported here.
+static void servicescan_match_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
+  ServiceGroup *SG = (ServiceGroup *) nsock_pool_get_udata(nsp);
+  MatchWorkers::Job *job;
+  ServiceNFO *svc;
+  unsigned int i;
+  int err;
+
+  if (nse_status(nse) == NSE_STATUS_KILL)
+    return;
+  if (nse_status(nse) != NSE_STATUS_SUCCESS && nse_status(nse) != NSE_STATUS_TIMEOUT)
+    fatal("%s: unexpected status %s reading from the match threads", __func__,
+          nse_status2str(nse_status(nse)));
+  err = SG->workers->wakeError();
+  if (err != 0)
+    fatal("%s: a match thread failed to wake the service scan loop: %s",
+          __func__, socket_strerror(err));
+
+  while ((job = SG->workers->finished()) != NULL) {
+    for (i = 0; i < job->result.warnings.size(); i++)
+      error("%s", job->result.warnings[i].c_str());
+    if (!job->result.fatalmsg.empty())
+      fatal("%s", job->result.fatalmsg.c_str());
+    svc = job->svc;
+    match_cache.add(job->probe, job->response, job->responselen, job->MD, job->fallbackDepth);
+    if (svc->target->timedOut(nsock_gettimeofday())) {
+      end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, job->nsi);
+    } else {
+      handle_match(nsp, job->nsi, SG, svc, job->probe, job->MD, job->fallbackDepth);
+    }
+    MatchWorkers::freeJob(job);
+  }
+
+  if (SG->workers->outstanding > 0)
+    nsock_read(nsp, SG->workers->wake_iod, servicescan_match_handler, MATCH_POLL_MS, NULL);
+
+  // We may have room for more probes!
+  launchSomeServiceProbes(nsp, SG);
+}
+#endif
+
 static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *mydata) {
   nsock_iod nsi = nse_iod(nse);
   enum nse_status status = nse_status(nse);
@@ -2458,79 +3155,25 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
     // now get the full version
     readstr = svc->getcurrentproberesponse(&readstrlen);
 
-    for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
-      MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen);
-      if (MD && MD->serviceName) break; // Found one!
-    }
-
-    if (MD && MD->serviceName) {
-      // WOO HOO!!!!!!  MATCHED!  But might be soft
-      if (MD->isSoft && svc->probe_matched) {
-        if (strcmp(svc->probe_matched, MD->serviceName) != 0)
-          error("WARNING: Service %s:%hu had already soft-matched %s, but now soft-matched %s; ignoring second value", svc->target->targetipstr(), svc->portno, svc->probe_matched, MD->serviceName);
-        // No error if its the same - that happens frequently.  For
-        // example, if we read more data for the same probe response
-        // it will probably still match.
-      } else {
-        if (o.debugging > 1 || o.versionTrace()) {
-          if (MD->product || MD->version || MD->info)
-            log_write(LOG_PLAIN, "Service scan match (Probe %s matched with %s line %d): %s:%hu is %s%s.  Version: |%s|%s|%s|\n",
-                      probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
-                      MD->lineno,
-                      svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "",
-                      MD->serviceName, (MD->product)? MD->product : "", (MD->version)? MD->version : "",
-                      (MD->info)? MD->info : "");
-          else
-            log_write(LOG_PLAIN, "Service scan %s match (Probe %s matched with %s line %d): %s:%hu is %s%s\n",
-                      (MD->isSoft)? "soft" : "hard",
-                      probe->getName(), (*probe->fallbacks[fallbackDepth]).getName(),
-                      MD->lineno,
-                      svc->target->targetipstr(), svc->portno, (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "", MD->serviceName);
-        }
-        svc->probe_matched = MD->serviceName;
-        if (MD->product)
-          Strncpy(svc->product_matched, MD->product, sizeof(svc->product_matched));
-        if (MD->version)
-          Strncpy(svc->version_matched, MD->version, sizeof(svc->version_matched));
-        if (MD->info)
-          Strncpy(svc->extrainfo_matched, MD->info, sizeof(svc->extrainfo_matched));
-        if (MD->hostname)
-          Strncpy(svc->hostname_matched, MD->hostname, sizeof(svc->hostname_matched));
-        if (MD->ostype)
-          Strncpy(svc->ostype_matched, MD->ostype, sizeof(svc->ostype_matched));
-        if (MD->devicetype)
-          Strncpy(svc->devicetype_matched, MD->devicetype, sizeof(svc->devicetype_matched));
-        if (MD->cpe_a)
-          Strncpy(svc->cpe_a_matched, MD->cpe_a, sizeof(svc->cpe_a_matched));
-        if (MD->cpe_h)
-          Strncpy(svc->cpe_h_matched, MD->cpe_h, sizeof(svc->cpe_h_matched));
-        if (MD->cpe_o)
-          Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
-        svc->softMatchFound = MD->isSoft;
-        if (!svc->softMatchFound) {
-          // We might be able to continue scan through a tunnel protocol
-          // like SSL
-          if (scanThroughTunnel(nsp, nsi, SG, svc) == 0)
-            end_svcprobe(nsp, PROBESTATE_FINISHED_HARDMATCHED, SG, svc, nsi);
-        }
-      }
-    }
-
-    if (!MD || !MD->serviceName || MD->isSoft) {
-      // Didn't match... maybe reading more until timeout will help
-      // TODO: For efficiency I should be able to test if enough data
-      // has been received rather than always waiting for the reading
-      // to timeout.  For now I'll limit it to 4096 bytes just to
-      // avoid reading megs from services like chargen.  But better
-      // approach is needed.
-      if (svc->probe_timemsleft(probe) > 0 && readstrlen < 4096) {
-        nsock_read(nsp, nsi, servicescan_read_handler, svc->probe_timemsleft(probe), svc);
-      } else {
-        // Failed -- lets go to the next probe.
-        if (readstrlen > 0)
-          svc->addToServiceFingerprint(probe->getName(), readstr, readstrlen);
-        startNextProbe(nsp, nsi, SG, svc, false);
-      }
+    if (match_cache.lookup(probe, readstr, readstrlen, &MD, &fallbackDepth)) {
+      handle_match(nsp, nsi, SG, svc, probe, MD, fallbackDepth);
+#if HAVE_PTHREAD
+    } else if (SG->workers != NULL) {
+      MatchWorkers::Job *job = new MatchWorkers::Job;
+      job->svc = svc;
+      job->probe = probe;
+      job->nsi = nsi;
+      job->response = (u8 *) safe_malloc(readstrlen);
+      memcpy(job->response, readstr, readstrlen);
+      job->responselen = readstrlen;
+      if (SG->workers->outstanding == 0)
+        nsock_read(nsp, SG->workers->wake_iod, servicescan_match_handler, MATCH_POLL_MS, NULL);
+      SG->workers->submit(job);
+#endif
+    } else {
+      MD = match_response(probe, readstr, readstrlen, &fallbackDepth, NULL);
+      match_cache.add(probe, readstr, readstrlen, MD, fallbackDepth);
+      handle_match(nsp, nsi, SG, svc, probe, MD, fallbackDepth);
     }
   } else if (status == NSE_STATUS_TIMEOUT) {
     // Failed to read enough to make a match in the given amount of time.  So we
@@ -2792,6 +3435,14 @@ int service_scan(std::vector<Target *> &Targets) {
     nsock_pool_set_proxychain(nsp, o.proxy_chain);
   }
 
+#if HAVE_PTHREAD
+  if (o.version_threads > 1) {
+    // The match threads don't compile regexes, so do them all first.
+    AP->compileRegexes();
+    SG->workers = new MatchWorkers(nsp, o.version_threads);
+  }
+#endif
+
 #if HAVE_OPENSSL
   /* We don't care about connection security in version detection. */
   nsock_pool_ssl_init(nsp, NSOCK_SSL_MAX_SPEED);
@@ -2830,6 +3481,13 @@ int service_scan(std::vector<Target *> &Targets) {
   // else.
   processResults(SG);
 
+  if (o.debugging) {
+    unsigned long lookups = match_cache.hits + match_cache.misses;
+    log_write(LOG_PLAIN, "Service match cache: %lu hits in %lu lookups (%.1f%%)\n",
+              match_cache.hits, lookups,
+              lookups > 0 ? 100.0 * match_cache.hits / lookups : 0.0);
+  }
+
   delete SG;
 
   return 0;
@@ -69,6 +69,8 @@
 #include "portlist.h"
 #include "scan_lists.h"
 
+#include <set>
+#include <string>
 #include <vector>
 
 #ifdef HAVE_CONFIG_H
@@ -126,6 +128,28 @@ struct MatchDetails {
   const char *cpe_h;
 };
 
+// A MatchDetails along with the storage its strings point into.  Each
+// thread that tests matches needs one of its own.
+struct MatchResult {
+  struct MatchDetails MD;
+  char product[80];
+  char version[80];
+  char info[256];  /* We will truncate with ... later */
+  char hostname[80];
+  char ostype[32];
+  char devicetype[32];
+  char cpe_a[80], cpe_h[80], cpe_o[80];
+  // What pcre_exec returned for the last test, or PCRE_ERROR_NOMATCH if
+  // the response was ruled out without running the regex.
+  int rc;
+  // testMatch prints nothing when it is given a MatchResult, since that
+  // may be on a match thread. It adds its warnings here instead, and it
+  // sets fatalmsg rather than exiting. The caller reports them and
+  // clears them.
+  std::vector<std::string> warnings;
+  std::string fatalmsg;
+};
+
 /**********************  CLASSES     ***********************************/
 
 class ServiceProbeMatch {
@@ -138,7 +162,10 @@ class ServiceProbeMatch {
 // should be passed the whole line starting with "match" or
 // "softmatch" in nmap-service-probes.  The line number that the text
 // is provided so that it can be reported in error messages.  This
-// function will abort the program if there is a syntax problem.
+// function will abort the program if there is a syntax problem.  The
+// regular expression itself is not compiled until testMatch() first
+// needs it (or compileRegex() is called), so an invalid regex is only
+// reported then, and the match line never matches.
   void InitMatch(const char *matchtext, int lineno);
 
   // If the buf (of length buflen) match the regex in this
@@ -148,13 +175,22 @@ class ServiceProbeMatch {
   // structure will be NULL.  The MatchDetails returned is only valid
   // until the next time this function is called.  The only exception
   // is that the serviceName field can be saved throughout program
-  // execution.  If no version matched, that field will be NULL.
-  const struct MatchDetails *testMatch(const u8 *buf, int buflen);
+  // execution.  If no version matched, that field will be NULL.  If
+  // result is not NULL, the details are stored there instead, and stay
+  // valid until result is next used; this is safe to call from several
+  // threads at once as long as each passes its own result.  Warnings and
+  // errors are then left in result for the caller to report.
+  const struct MatchDetails *testMatch(const u8 *buf, int buflen,
+                                       struct MatchResult *result = NULL);
 // Returns the service name this matches
   const char *getName() { return servicename; }
   // The Line number where this match string was defined.  Returns
   // -1 if unknown.
   int getLineNo() { return deflineno; }
+  // Compiles and studies matchstr into regex_compiled and regex_extra.
+  // Does nothing if it was already done.  testMatch() calls this itself;
+  // it is only needed before testing from several threads at once.
+  void compileRegex();
  private:
   int deflineno; // The line number where this match is defined.
   bool isInitialized; // Has InitMatch yet been called?
@@ -162,8 +198,14 @@ class ServiceProbeMatch {
   int matchtype; // SERVICEMATCH_REGEX or SERVICESCAN_STATIC
   char *matchstr; // Regular expression text, or static string
   int matchstrlen; // Because static strings may have embedded NULs
+  bool regex_tried; // Has compileRegex run? regex_compiled is NULL if it failed.
   pcre *regex_compiled;
   pcre_extra *regex_extra;
+  // Literal bytes that the regex requires at the very start of a response,
+  // found by InitMatch so that testMatch can reject most responses without
+  // running the regex. prefixlen is 0 if there are none.
+  u8 *prefix;
+  int prefixlen;
   bool matchops_ignorecase;
   bool matchops_dotall;
   bool isSoft; // is this a soft match? ("softmatch" keyword in nmap-service-probes)
@@ -181,8 +223,6 @@ class ServiceProbeMatch {
   // The anchor is for SERVICESCAN_STATIC matches.  If the anchor is not -1, the match must
   // start at that zero-indexed position in the response str.
   int matchops_anchor;
-// Details to fill out and return for testMatch() calls
-  struct MatchDetails MD_return;
 
   // Use the six version templates and the match data included here
   // to put the version info into the given strings, (as long as the sizes
@@ -196,7 +236,8 @@ class ServiceProbeMatch {
                   char *devicetype, int devicetypelen,
                   char *cpe_a, int cpe_alen,
                   char *cpe_h, int cpe_hlen,
-                  char *cpe_o, int cpe_olen);
+                  char *cpe_o, int cpe_olen,
+                  std::vector<std::string> *warnings);
 };
 
 
@@ -280,7 +321,12 @@ class ServiceProbe {
   // serviceName field can be saved throughout program execution.  If
   // no version matched, that field will be NULL. This function may
   // return NULL if there are no match lines at all in this probe.
-  const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n);
+  // result is as for ServiceProbeMatch::testMatch.
+  const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n,
+                                       struct MatchResult *result = NULL);
+
+  // The match lines of this probe, in the order they are tried.
+  const std::vector<ServiceProbeMatch *> &getMatches() { return matches; }
 
   char *fallbackStr;
   ServiceProbe *fallbacks[MAXFALLBACKS+1];
@@ -295,7 +341,7 @@ class ServiceProbe {
   std::vector<u16> probableports;
   std::vector<u16> probablesslports;
   int rarity;
-  std::vector<const char *> detectedServices;
+  std::set<std::string> detectedServices;
   int probeprotocol;
   std::vector<ServiceProbeMatch *> matches; // first-ever use of STL in Nmap!
 };
@@ -321,6 +367,11 @@ public:
   // fallbackStrs.
   void compileFallbacks();
 
+  // Compiles the regexes of all the match lines now rather than on first
+  // use.  Matching from several threads needs this, as compileRegex() is
+  // not locked.
+  void compileRegexes();
+
   int isExcluded(unsigned short port, int proto);
   bool excluded_seen;
   struct scan_lists excludedports;
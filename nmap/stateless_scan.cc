@@ -0,0 +1,491 @@
+
+/***************************************************************************
+ * stateless_scan.cc -- a SYN sweep over all targets and ports that        *
+ * keeps no state per probe, validating replies with a keyed cookie.       *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "stateless_scan.h"
+#include "nmap.h"
+#include "NmapOps.h"
+#include "Target.h"
+#include "TargetGroup.h"
+#include "targets.h"
+#include "nmap_error.h"
+#include "nmap_tty.h"
+#include "portreasons.h"
+#include "scan_lists.h"
+#include "struct_ip.h"
+#include "tcpip.h"
+#include "timing.h"
+#include "utils.h"
+#include "libnetutil/netutil.h"
+
+#include <map>
+
+extern NmapOps o;
+
+/* Probes are sent in batches of this many between looks at the replies. */
+#define SWEEP_BATCH 64
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+  } while (0)
+
+/* SipHash-2-4 of a 12-byte message made of three 32-bit words. */
+static u64 siphash24(const u64 key[2], u32 a, u32 b, u32 c) {
+  u64 v0 = key[0] ^ 0x736f6d6570736575ULL;
+  u64 v1 = key[1] ^ 0x646f72616e646f6dULL;
+  u64 v2 = key[0] ^ 0x6c7967656e657261ULL;
+  u64 v3 = key[1] ^ 0x7465646279746573ULL;
+  u64 m;
+
+  m = (u64) a | (u64) b << 32;
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+  m = (u64) c | (u64) 12 << 56;
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+SweepCookie::SweepCookie() {
+  key[0] = get_random_u64();
+  key[1] = get_random_u64();
+}
+
+SweepCookie::SweepCookie(u64 key0, u64 key1) {
+  key[0] = key0;
+  key[1] = key1;
+}
+
+u32 SweepCookie::cookie(u32 saddr, u16 sport, u32 daddr, u16 dport) const {
+  return (u32) siphash24(key, daddr, saddr, (u32) dport << 16 | sport);
+}
+
+bool SweepCookie::check(const u8 *packet, unsigned int len, u32 saddr,
+                        u16 sport, u16 *dport) const {
+  const struct ip *ip = (const struct ip *) packet;
+  const struct tcp_hdr *tcp;
+
+  if (len < sizeof(struct ip) || ip->ip_v != 4 || ip->ip_p != IPPROTO_TCP)
+    return false;
+  if (len < (unsigned int) ip->ip_hl * 4 + sizeof(struct tcp_hdr))
+    return false;
+  tcp = (const struct tcp_hdr *) (packet + ip->ip_hl * 4);
+  if (ip->ip_dst.s_addr != saddr || ntohs(tcp->th_dport) != sport)
+    return false;
+
+  *dport = ntohs(tcp->th_sport);
+  return ntohl(tcp->th_ack) == cookie(saddr, sport, ip->ip_src.s_addr, *dport) + 1;
+}
+
+class StatelessSweep {
+public:
+  StatelessSweep(struct scan_lists *ports);
+  ~StatelessSweep();
+
+  /* Reads every expression hs has left; returns the number of addresses in
+     this shard. */
+  u64 addTargets(HostGroupState *hs);
+  void run(const struct addrset *exclude_group);
+  u64 hostsSwept() const;
+  void takeResponders(std::vector<Target *> &responders);
+
+private:
+  void getAddress(u64 index, struct sockaddr_storage *ss, size_t *sslen) const;
+  void readReplies(long to_usec);
+  void handleReply(const u8 *packet, unsigned int len,
+                   const struct timeval *rcvdtime);
+
+  TargetSpace space;
+  u64 nhosts;
+  const u16 *portlist;
+  int nports;
+
+  struct sockaddr_in source;
+  u16 sport;
+  SweepCookie cookies;
+  int rawsd;
+  pcap_t *pd;
+
+  u64 probes_sent;
+  u64 nexcluded;
+  /* Hosts that answered, by address in host byte order. */
+  std::map<u32, Target *> responders;
+};
+
+StatelessSweep::StatelessSweep(struct scan_lists *ports) {
+  nhosts = 0;
+  portlist = ports->tcp_ports;
+  nports = ports->tcp_count;
+  memset(&source, 0, sizeof(source));
+  sport = 0;
+  rawsd = -1;
+  pd = NULL;
+  probes_sent = 0;
+  nexcluded = 0;
+}
+
+/* Number of target addresses swept, not counting excluded ones. */
+u64 StatelessSweep::hostsSwept() const {
+  return nhosts - nexcluded;
+}
+
+StatelessSweep::~StatelessSweep() {
+  std::map<u32, Target *>::iterator it;
+
+  for (it = responders.begin(); it != responders.end(); it++)
+    delete it->second;
+  if (pd != NULL)
+    pcap_close(pd);
+  if (rawsd >= 0)
+    close(rawsd);
+}
+
+u64 StatelessSweep::addTargets(HostGroupState *hs) {
+  const char *expr;
+  TargetGroup *tg;
+  u64 n;
+
+  while ((expr = hs->next_expression()) != NULL) {
+    tg = new TargetGroup();
+    if (tg->parse_expr(expr, o.af()) != 0) {
+      log_bogus_target(expr);
+      delete tg;
+      continue;
+    }
+    if (!tg->resolve()) {
+      delete tg;
+      continue;
+    }
+    if (!tg->get_size(&n)) {
+      error("%s: cannot sweep \"%s\"; skipping it", __func__, expr);
+      log_bogus_target(expr);
+      delete tg;
+      continue;
+    }
+    if (n == 0) {
+      delete tg;
+      continue;
+    }
+    space.add(tg, n);
+  }
+  /* With --shard, this process takes every nshards'th address. */
+  if (space.size() > o.shard)
+    nhosts = (space.size() - o.shard - 1) / o.nshards + 1;
+  else
+    nhosts = 0;
+
+  return nhosts;
+}
+
+/* Fills in the address of the index'th host of this shard. */
+void StatelessSweep::getAddress(u64 index, struct sockaddr_storage *ss,
+                                size_t *sslen) const {
+  space.get_host(o.shard + index * o.nshards, ss, sslen);
+}
+
+void StatelessSweep::run(const struct addrset *exclude_group) {
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin;
+  size_t sslen;
+  struct route_nfo rnfo;
+  PacketTemplate tmpl;
+  RawSendBatch *batch = NULL;
+  u64 total, index;
+  u32 packetlen, seq;
+  u16 dport;
+  u8 *packet;
+  struct timeval now;
+  long wait_usec;
+  char info[128];
+
+  if (nhosts == 0 || nports == 0)
+    return;
+  if (nhosts > ((u64) 1 << 62) / nports)
+    fatal("%s: too many targets (%llu) to sweep", __func__, (unsigned long long) nhosts);
+  total = nhosts * nports;
+
+  /* Every probe leaves from the interface and source address of the route to
+     the first target. */
+  getAddress(0, &ss, &sslen);
+  if (ss.ss_family != AF_INET)
+    fatal("%s: only IPv4 targets can be swept", __func__);
+  if (!nmap_route_dst(&ss, &rnfo))
+    fatal("%s: failed to determine route to %s", __func__, inet_ntop_ez(&ss, sslen));
+  memcpy(&source, &rnfo.srcaddr, sizeof(source));
+  if (o.magic_port_set)
+    sport = o.magic_port;
+  else
+    sport = 33000 + get_random_uint() % (65536 - 33000);
+
+  if ((rawsd = nmap_raw_socket()) < 0)
+    pfatal("socket troubles in %s", __func__);
+  if (RawSendBatch::supported())
+    batch = new RawSendBatch(rawsd);
+
+  pd = my_pcap_open_live(rnfo.ii.devname, 100, o.spoofsource ? 1 : 0,
+                         pcap_selectable_fd_valid() ? 200 : 2);
+  if (pd == NULL)
+    fatal("%s", PCAP_OPEN_ERRMSG);
+#ifdef LINUX
+  if (pcap_setnonblock(pd, 1, NULL) < 0 && o.debugging)
+    error("Could not put pcap handle in nonblocking mode: %s", pcap_geterr(pd));
+#endif
+  set_pcap_filter(rnfo.ii.devfullname, pd,
+                  "dst host %s and tcp dst port %hu and tcp[13] & 0x14 != 0",
+                  inet_ntop_ez((struct sockaddr_storage *) &source, sizeof(source)),
+                  sport);
+
+  o.current_scantype = SYN_SCAN;
+  ScanProgressMeter SPM("Stateless SYN Sweep");
+  if (o.verbose) {
+    log_write(LOG_STDOUT, "Sweeping %llu hosts x %d ports from %s port %hu\n",
+              (unsigned long long) nhosts, nports,
+              inet_ntop_ez((struct sockaddr_storage *) &source, sizeof(source)),
+              sport);
+  }
+
+  CyclicPermutation perm(total, get_random_u64());
+  while (perm.next(&index)) {
+    /* Consecutive indexes go to different hosts, so each host sees its ports
+       spread out over the whole sweep. */
+    getAddress(index % nhosts, &ss, &sslen);
+    dport = portlist[index / nhosts];
+    if (exclude_group != NULL && addrset_contains(exclude_group, (struct sockaddr *) &ss)) {
+      /* Count each excluded host once, on its first port. */
+      if (index < nhosts)
+        nexcluded++;
+      continue;
+    }
+
+    sin = (struct sockaddr_in *) &ss;
+    seq = cookies.cookie(source.sin_addr.s_addr, sport, sin->sin_addr.s_addr, dport);
+    packet = tmpl.buildTCP(&source.sin_addr, &sin->sin_addr,
+                           o.ttl, (u16) (seq >> 16), IP_TOS_DEFAULT, false,
+                           o.ipoptions, o.ipoptionslen,
+                           sport, dport, seq, 0, 0, TH_SYN, 0, 0,
+                           (u8 *) TCP_SYN_PROBE_OPTIONS, TCP_SYN_PROBE_OPTIONS_LEN,
+                           o.extra_payload, o.extra_payload_length,
+                           &packetlen);
+    if (batch != NULL) {
+      batch->queue(&ss, packet, packetlen, NULL);
+    } else {
+      send_ip_packet_sd(rawsd, sin, packet, packetlen);
+      PacketTrace::trace(PacketTrace::SENT, packet, packetlen);
+    }
+    probes_sent++;
+
+    if (probes_sent % SWEEP_BATCH != 0)
+      continue;
+    if (batch != NULL)
+      batch->flush();
+    if (o.max_packet_send_rate != 0.0) {
+      /* Spend any time we are ahead of --max-rate reading replies. */
+      gettimeofday(&now, NULL);
+      wait_usec = (long) (probes_sent / o.max_packet_send_rate * 1000000)
+                  - TIMEVAL_SUBTRACT(now, SPM.begin);
+      readReplies(MAX(wait_usec, 0));
+    } else {
+      readReplies(0);
+    }
+    if (probes_sent % (SWEEP_BATCH * 64) == 0 && keyWasPressed())
+      SPM.printStats((double) index / total, NULL);
+  }
+  if (batch != NULL) {
+    batch->flush();
+    delete batch;
+  }
+
+  /* Give the last probes their round trip. */
+  wait_usec = MIN(2 * o.initialRttTimeout(), o.maxRttTimeout()) * 1000;
+  gettimeofday(&now, NULL);
+  for (;;) {
+    struct timeval cur;
+    long left;
+
+    gettimeofday(&cur, NULL);
+    left = wait_usec - TIMEVAL_SUBTRACT(cur, now);
+    if (left <= 0)
+      break;
+    readReplies(left);
+  }
+
+  gettimeofday(&now, NULL);
+  for (std::map<u32, Target *>::iterator it = responders.begin(); it != responders.end(); it++) {
+    it->second->startTimeOutClock(&now);
+    it->second->stopTimeOutClock(&now);
+  }
+
+  Snprintf(info, sizeof(info), "%llu probes, %u hosts answered",
+           (unsigned long long) probes_sent, (unsigned int) responders.size());
+  SPM.endTask(NULL, info);
+}
+
+/* Reads replies until to_usec passes without one. */
+void StatelessSweep::readReplies(long to_usec) {
+  struct timeval rcvdtime;
+  const u8 *packet;
+  unsigned int len;
+
+  for (;;) {
+    packet = readip_pcap(pd, &len, to_usec, &rcvdtime, NULL, true);
+    if (packet == NULL)
+      break;
+    handleReply(packet, len, &rcvdtime);
+  }
+}
+
+void StatelessSweep::handleReply(const u8 *packet, unsigned int len,
+                                 const struct timeval *rcvdtime) {
+  const struct ip *ip = (const struct ip *) packet;
+  const struct tcp_hdr *tcp;
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin;
+  std::map<u32, Target *>::iterator it;
+  Target *t;
+  reason_t reason;
+  int state;
+  u16 dport;
+
+  if (!cookies.check(packet, len, source.sin_addr.s_addr, sport, &dport))
+    return;
+  tcp = (const struct tcp_hdr *) (packet + ip->ip_hl * 4);
+
+  if (o.packetTrace())
+    PacketTrace::trace(PacketTrace::RCVD, packet, len, (struct timeval *) rcvdtime);
+
+  if ((tcp->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+    state = PORT_OPEN;
+    reason = ER_SYNACK;
+  } else if (tcp->th_flags & TH_RST) {
+    state = PORT_CLOSED;
+    reason = ER_RESETPEER;
+  } else {
+    return;
+  }
+
+  it = responders.find(ntohl(ip->ip_src.s_addr));
+  if (it == responders.end()) {
+    t = new Target();
+    memset(&ss, 0, sizeof(ss));
+    sin = (struct sockaddr_in *) &ss;
+    sin->sin_family = AF_INET;
+#if HAVE_SOCKADDR_SA_LEN
+    sin->sin_len = sizeof(*sin);
+#endif
+    sin->sin_addr = ip->ip_src;
+    t->setTargetSockAddr(&ss, sizeof(*sin));
+    if (!set_target_route(t))
+      t->setSourceSockAddr((struct sockaddr_storage *) &source, sizeof(source));
+    /* The host's time is not counted against --host-timeout; the clock
+       runs only to record when it was found. */
+    t->startTimeOutClock(rcvdtime);
+    t->stopTimeOutClock(rcvdtime);
+    /* No round trip is measured, so later phases start from the defaults. */
+    initialize_timeout_info(&t->to);
+    t->flags = HOST_UP;
+    t->reason.reason_id = reason;
+    t->reason.ttl = ip->ip_ttl;
+    t->ports.setDefaultPortState(IPPROTO_TCP, PORT_FILTERED);
+    it = responders.insert(std::make_pair(ntohl(ip->ip_src.s_addr), t)).first;
+  }
+  t = it->second;
+
+  if (!t->ports.portIsDefault(dport, IPPROTO_TCP))
+    return;
+  t->ports.setPortState(dport, IPPROTO_TCP, state);
+  t->ports.setStateReason(dport, IPPROTO_TCP, reason, ip->ip_ttl, NULL);
+}
+
+void StatelessSweep::takeResponders(std::vector<Target *> &out) {
+  std::map<u32, Target *>::iterator it;
+
+  for (it = responders.begin(); it != responders.end(); it++)
+    out.push_back(it->second);
+  responders.clear();
+}
+
+u64 stateless_syn_sweep(HostGroupState *hs, const struct addrset *exclude_group,
+                        struct scan_lists *ports,
+                        std::vector<Target *> &responders) {
+  StatelessSweep sweep(ports);
+
+  sweep.addTargets(hs);
+  sweep.run(exclude_group);
+  sweep.takeResponders(responders);
+
+  return sweep.hostsSwept();
+}
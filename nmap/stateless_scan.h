@@ -0,0 +1,111 @@
+
+/***************************************************************************
+ * stateless_scan.h -- a SYN sweep over all targets and ports that keeps   *
+ * no state per probe, validating replies with a keyed cookie.             *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifndef STATELESS_SCAN_H
+#define STATELESS_SCAN_H
+
+#include "nbase.h"
+
+#include <vector>
+
+class Target;
+class HostGroupState;
+struct addrset;
+struct scan_lists;
+
+/* The keyed hash that a stateless sweep puts in the sequence number of each
+   probe. A reply is accepted only if it acknowledges the cookie of the probe
+   it answers, so nothing needs to be remembered to match it. */
+class SweepCookie {
+public:
+  /* Picks a random key. */
+  SweepCookie();
+  SweepCookie(u64 key0, u64 key1);
+  /* The initial sequence number of the probe from saddr:sport to daddr:dport;
+     a SYN/ACK or RST in answer to it acknowledges this plus one. Addresses
+     are in network byte order and ports in host byte order. */
+  u32 cookie(u32 saddr, u16 sport, u32 daddr, u16 dport) const;
+  /* Returns true if packet is an IPv4 TCP segment to saddr:sport that
+     acknowledges the cookie of a probe from there, and sets *dport to the
+     port that probe went to. */
+  bool check(const u8 *packet, unsigned int len, u32 saddr, u16 sport,
+             u16 *dport) const;
+
+private:
+  u64 key[2];
+};
+
+/* Sends one SYN to every TCP port of every target expression that hs has left
+   to give, in a pseudorandom order over the whole (address, port) space
+   (--stateless). Nothing is remembered about the probes: a reply is accepted
+   if its acknowledgment number matches a keyed hash of the addresses and
+   ports, so memory grows with the hosts that answer rather than with the
+   number of targets. Those hosts are appended to responders in address order,
+   marked up and with their port states set. Returns the number of addresses
+   swept, not counting excluded ones. */
+u64 stateless_syn_sweep(HostGroupState *hs, const struct addrset *exclude_group,
+                        struct scan_lists *ports,
+                        std::vector<Target *> &responders);
+
+#endif /* STATELESS_SCAN_H */
@@ -66,6 +66,7 @@
 
 #include <nbase.h>
 #include "targets.h"
+#include "checkpoint.h"
 #include "timing.h"
 #include "tcpip.h"
 #include "NmapOps.h"
@@ -77,6 +78,8 @@
 #include "nmap_error.h"
 #include "xml.h"
 
+#include <set>
+
 extern NmapOps o;
 #ifdef WIN32
 /* from libdnet's intf-win32.c */
@@ -238,8 +241,11 @@ static void massping(Target *hostbatch[], int num_hosts, struct scan_lists *port
      3. it is directly connected when the other hosts are not, or vice versa, or
      4. it has the same IP address as another target already in the group.
    These restrictions only apply for raw scans, including host discovery. */
-bool target_needs_new_hostgroup(Target **targets, int targets_sz, const Target *target) {
-  int i = 0;
+/* Checks restrictions 1-3 of target_needs_new_hostgroup. *check_address is set
+   to whether restriction 4 applies, which is left to the caller. */
+static bool hostgroup_incompatible(Target **targets, int targets_sz,
+                                   const Target *target, bool *check_address) {
+  *check_address = false;
 
   /* We've just started a new hostgroup, so any target is acceptable. */
   if (targets_sz == 0)
@@ -268,6 +274,19 @@ bool target_needs_new_hostgroup(Target **targets, int targets_sz, const Target *
   if (targets[0]->directlyConnected() != target->directlyConnected())
     return true;
 
+  *check_address = true;
+  return false;
+}
+
+bool target_needs_new_hostgroup(Target **targets, int targets_sz, const Target *target) {
+  bool check_address;
+  int i;
+
+  if (hostgroup_incompatible(targets, targets_sz, target, &check_address))
+    return true;
+  if (!check_address)
+    return false;
+
   /* Is there already a target with this same IP address? ultra_scan doesn't
      cope with that, because it uses IP addresses to look up targets from
      replies. What happens is one target gets the replies for all probes
@@ -281,8 +300,9 @@ bool target_needs_new_hostgroup(Target **targets, int targets_sz, const Target *
 }
 
 /* Lookahead is the number of hosts that can be
-   checked (such as ping scanned) in advance.  Randomize causes each
-   group of up to lookahead hosts to be internally shuffled around.
+   checked (such as ping scanned) in advance.  Randomize causes the hosts
+   of up to SPACE_LIMIT expressions at a time to be given in a random order
+   (or, with -iR, each group of up to lookahead hosts to be shuffled).
    The target_expressions array MUST REMAIN VALID IN MEMORY as long as
    this class instance is used -- the array is NOT copied.
  */
@@ -297,10 +317,18 @@ HostGroupState::HostGroupState(int lookahead, int rnd, int argc, const char **ar
   current_batch_sz = 0;
   next_batch_no = 0;
   randomize = rnd;
+  perm = NULL;
+  unsized = NULL;
+  unsized_index = 0;
+  nspaces = 0;
+  before_discovery = NULL;
+  before_discovery_arg = NULL;
 }
 
 HostGroupState::~HostGroupState() {
   free(hostbatch);
+  delete perm;
+  delete unsized;
 }
 
 /* Returns true iff the defer buffer is not yet full. */
@@ -346,24 +374,162 @@ const char *HostGroupState::next_expression() {
   return NULL;
 }
 
+/* Permutations can't be longer than this. */
+#define SPACE_MAX_HOSTS ((u64) 1 << 62)
+
+/* Reads up to SPACE_LIMIT more expressions into space and starts a new
+   permutation of their addresses. Returns false if there were none left. */
+bool HostGroupState::fill_space() {
+  const char *expr;
+  TargetGroup *tg;
+  unsigned int count;
+  u64 n;
+
+  delete perm;
+  perm = NULL;
+  delete unsized;
+  unsized = NULL;
+  unsized_index = 0;
+  space.clear();
+
+  count = 0;
+  while (count < SPACE_LIMIT && (expr = next_expression()) != NULL) {
+    count++;
+    tg = new TargetGroup();
+    if (tg->parse_expr(expr, o.af()) != 0) {
+      log_bogus_target(expr);
+      delete tg;
+      continue;
+    }
+    if (!tg->resolve()) {
+      delete tg;
+      continue;
+    }
+    if (!tg->get_size(&n) || n >= SPACE_MAX_HOSTS - space.size()) {
+      unsized = tg;
+      break;
+    }
+    space.add(tg, n);
+  }
+  if (count == 0)
+    return false;
+
+  if (space.size() > 0) {
+    perm = new CyclicPermutation(space.size(), o.randomize_seed + nspaces,
+                                 o.shard, o.nshards);
+    nspaces++;
+  }
+
+  return true;
+}
+
+int HostGroupState::get_next_host(struct sockaddr_storage *ss, size_t *sslen,
+                                  const TargetGroup **group) {
+  const char *expr;
+  u64 index;
+
+  /* -iR addresses are random already, and there is no end to them. */
+  if (!randomize || o.generate_random_ips) {
+    while (current_group.get_next_host(ss, sslen) != 0) {
+      /* We are going to have to pop in another expression. */
+      for (;;) {
+        expr = next_expression();
+        if (expr == NULL)
+          /* That's the last of them. */
+          return -1;
+        if (current_group.parse_expr(expr, o.af()) == 0)
+          break;
+        else
+          log_bogus_target(expr);
+      }
+    }
+    *group = &current_group;
+    return 0;
+  }
+
+  for (;;) {
+    if (perm != NULL && perm->next(&index)) {
+      *group = space.get_host(index, ss, sslen);
+      return 0;
+    }
+    while (unsized != NULL && unsized->get_next_host(ss, sslen) == 0) {
+      if (unsized_index++ % o.nshards != o.shard)
+        continue;
+      *group = unsized;
+      return 0;
+    }
+    if (!fill_space())
+      return -1;
+  }
+}
+
+void HostGroupState::skip_past(const TargetGroup *group,
+                               const struct sockaddr_storage *last) {
+  /* Permuted addresses can't be skipped in bulk, nor can those of unsized if
+     they are being counted out to shards. */
+  if (group == &current_group)
+    current_group.skip_past(last);
+  else if (group == unsized && o.nshards == 1)
+    unsized->skip_past(last);
+}
+
 /* Add a <target> element to the XML stating that a target specification was
    ignored. This can be because of, for example, a DNS resolution failure, or a
    syntax error. */
-static void log_bogus_target(const char *expr) {
+void log_bogus_target(const char *expr) {
+  output_lock();
   xml_open_start_tag("target");
   xml_attribute("specification", "%s", expr);
   xml_attribute("status", "skipped");
   xml_attribute("reason", "invalid");
   xml_close_empty_tag();
   xml_newline();
+  output_unlock();
+}
+
+/* Fills in the device, source address, and next hop of a Target, which must
+   already have its address set, from the route to it. Returns false if there
+   is no route. */
+bool set_target_route(Target *t) {
+  struct route_nfo rnfo;
+
+  if (!nmap_route_dst(t->TargetSockAddr(), &rnfo))
+    return false;
+  if (rnfo.direct_connect) {
+    t->setDirectlyConnected(true);
+  } else {
+    t->setDirectlyConnected(false);
+    t->setNextHop(&rnfo.nexthop, sizeof(rnfo.nexthop));
+  }
+  t->setIfType(rnfo.ii.device_type);
+  if (rnfo.ii.device_type == devt_ethernet) {
+    if (o.spoofMACAddress())
+      t->setSrcMACAddress(o.spoofMACAddress());
+    else
+      t->setSrcMACAddress(rnfo.ii.mac);
+  }
+#ifdef WIN32
+  else if (g_has_npcap_loopback && rnfo.ii.device_type == devt_loopback) {
+    if (o.spoofMACAddress())
+      t->setSrcMACAddress(o.spoofMACAddress());
+    else
+      t->setSrcMACAddress(rnfo.ii.mac);
+    t->setNextHopMACAddress(t->SrcMACAddress());
+  }
+#endif
+  t->setSourceSockAddr(&rnfo.srcaddr, sizeof(rnfo.srcaddr));
+  t->setDeviceNames(rnfo.ii.devname, rnfo.ii.devfullname);
+  t->setMTU(rnfo.ii.mtu);
+  // printf("Target %s %s directly connected, goes through local iface %s, which %s ethernet\n", t->NameIP(), t->directlyConnected()? "IS" : "IS NOT", t->deviceName(), (t->ifType() == devt_ethernet)? "IS" : "IS NOT");
+
+  return true;
 }
 
 /* Returns a newly allocated Target with the given address. Handles all the
    details like setting the Target's address and next hop. */
-static Target *setup_target(const HostGroupState *hs,
+static Target *setup_target(const HostGroupState *hs, const TargetGroup *group,
                             const struct sockaddr_storage *ss, size_t sslen,
                             int pingtype) {
-  struct route_nfo rnfo;
   Target *t;
 
   t = new Target();
@@ -372,48 +538,20 @@ static Target *setup_target(const HostGroupState *hs,
 
   /* Special handling for the resolved address (for example whatever
      scanme.nmap.org resolves to in scanme.nmap.org/24). */
-  if (hs->current_group.is_resolved_address(ss)) {
-    if (hs->current_group.get_namedhost())
-      t->setTargetName(hs->current_group.get_resolved_name());
-    t->unscanned_addrs = hs->current_group.get_unscanned_addrs();
+  if (group->is_resolved_address(ss)) {
+    if (group->get_namedhost())
+      t->setTargetName(group->get_resolved_name());
+    t->unscanned_addrs = group->get_unscanned_addrs();
   }
 
   /* We figure out the source IP/device IFF
    * the scan type requires us to */
   if (o.RawScan()) {
-    if (!nmap_route_dst(ss, &rnfo)) {
+    if (!set_target_route(t)) {
       log_bogus_target(inet_ntop_ez(ss, sslen));
       error("%s: failed to determine route to %s", __func__, t->NameIP());
       goto bail;
     }
-    if (rnfo.direct_connect) {
-      t->setDirectlyConnected(true);
-    } else {
-      t->setDirectlyConnected(false);
-      t->setNextHop(&rnfo.nexthop, sizeof(rnfo.nexthop));
-    }
-    t->setIfType(rnfo.ii.device_type);
-    if (rnfo.ii.device_type == devt_ethernet) {
-      if (o.spoofMACAddress())
-        t->setSrcMACAddress(o.spoofMACAddress());
-      else
-        t->setSrcMACAddress(rnfo.ii.mac);
-    }
-#ifdef WIN32
-    else if (g_has_npcap_loopback && rnfo.ii.device_type == devt_loopback) {
-      if (o.spoofMACAddress())
-        t->setSrcMACAddress(o.spoofMACAddress());
-      else
-        t->setSrcMACAddress(rnfo.ii.mac);
-      t->setNextHopMACAddress(t->SrcMACAddress());
-    }
-#endif
-    t->setSourceSockAddr(&rnfo.srcaddr, sizeof(rnfo.srcaddr));
-    if (hs->current_batch_sz == 0) /* Because later ones can have different src addy and be cut off group */
-      o.decoys[o.decoyturn] = t->source();
-    t->setDeviceNames(rnfo.ii.devname, rnfo.ii.devfullname);
-    t->setMTU(rnfo.ii.mtu);
-    // printf("Target %s %s directly connected, goes through local iface %s, which %s ethernet\n", t->NameIP(), t->directlyConnected()? "IS" : "IS NOT", t->deviceName(), (t->ifType() == devt_ethernet)? "IS" : "IS NOT");
   }
 
   return t;
@@ -427,6 +565,8 @@ static Target *next_target(HostGroupState *hs, const struct addrset *exclude_gro
   struct scan_lists *ports, int pingtype) {
   struct sockaddr_storage ss;
   size_t sslen;
+  const TargetGroup *group;
+  HostCheckpoint *hc;
   Target *t;
 
   /* First handle targets deferred in the last batch. */
@@ -438,21 +578,8 @@ static Target *next_target(HostGroupState *hs, const struct addrset *exclude_gro
 
 tryagain:
 
-  if (hs->current_group.get_next_host(&ss, &sslen) != 0) {
-    const char *expr;
-    /* We are going to have to pop in another expression. */
-    for (;;) {
-      expr = hs->next_expression();
-      if (expr == NULL)
-        /* That's the last of them. */
-        return NULL;
-      if (hs->current_group.parse_expr(expr, o.af()) == 0)
-        break;
-      else
-        log_bogus_target(expr);
-    }
-    goto tryagain;
-  }
+  if (hs->get_next_host(&ss, &sslen, &group) != 0)
+    return NULL;
 
   assert(ss.ss_family == o.af());
 
@@ -465,22 +592,45 @@ tryagain:
     goto tryagain;
   }
 
-  /* Check exclude list. */
-  if (hostInExclude((struct sockaddr *) &ss, sslen, exclude_group))
+  /* Check exclude list. The rest of an excluded range is skipped at once,
+     which matters when a large exclude list covers much of the targets. */
+  if (hostInExclude((struct sockaddr *) &ss, sslen, exclude_group)) {
+    struct sockaddr_storage last;
+    if (addrset_range_end(exclude_group, (struct sockaddr *) &ss, &last))
+      hs->skip_past(group, &last);
     goto tryagain;
+  }
 
-  t = setup_target(hs, &ss, sslen, pingtype);
-  if (t == NULL)
+  /* A scan resumed from a checkpoint skips the hosts it had finished. */
+  if (!checkpoint_next_host(&ss, &hc))
     goto tryagain;
 
+  t = setup_target(hs, group, &ss, sslen, pingtype);
+  if (t == NULL) {
+    delete hc;
+    goto tryagain;
+  }
+  if (hc != NULL)
+    checkpoint_attach(t, hc);
+
   return t;
 }
 
+struct lt_sockaddr_storage_ptr {
+  bool operator()(const struct sockaddr_storage *a, const struct sockaddr_storage *b) const {
+    return sockaddr_storage_cmp(a, b) < 0;
+  }
+};
+
 static void refresh_hostbatch(HostGroupState *hs, const struct addrset *exclude_group,
   struct scan_lists *ports, int pingtype) {
   int i;
   bool arpping_done = false;
+  bool check_address;
   struct timeval now;
+  /* The addresses in the batch so far. Host discovery batches are large, so
+     this replaces the linear search of target_needs_new_hostgroup. */
+  std::set<const struct sockaddr_storage *, lt_sockaddr_storage_ptr> batch_addrs;
 
   hs->current_batch_sz = hs->next_batch_no = 0;
   hs->undefer();
@@ -492,15 +642,16 @@ static void refresh_hostbatch(HostGroupState *hs, const struct addrset *exclude_
       break;
 
     /* Does this target need to go in a separate host group? */
-    if (target_needs_new_hostgroup(hs->hostbatch, hs->current_batch_sz, t)) {
+    if (hostgroup_incompatible(hs->hostbatch, hs->current_batch_sz, t, &check_address)
+        || (check_address && batch_addrs.count(t->TargetSockAddr()) > 0)) {
       if (hs->defer(t))
         continue;
       else
         break;
     }
 
-    o.decoys[o.decoyturn] = t->source();
     hs->hostbatch[hs->current_batch_sz++] = t;
+    batch_addrs.insert(t->TargetSockAddr());
   }
 
   if (hs->current_batch_sz == 0)
@@ -508,10 +659,13 @@ static void refresh_hostbatch(HostGroupState *hs, const struct addrset *exclude_
 
   /* OK, now we have our complete batch of entries.  The next step is to
      randomize them (if requested) */
-  if (hs->randomize) {
+  if (hs->randomize && o.generate_random_ips) {
     hoststructfry(hs->hostbatch, hs->current_batch_sz);
   }
 
+  if (hs->before_discovery != NULL)
+    hs->before_discovery(hs->hostbatch[0], hs->before_discovery_arg);
+
   /* First I'll do the ARP ping if all of the machines in the group are
      directly connected over ethernet.  I may need the MAC addresses
      later anyway. */
@@ -566,6 +720,9 @@ static void refresh_hostbatch(HostGroupState *hs, const struct addrset *exclude_
     massping(hs->hostbatch, hs->current_batch_sz, ports);
   }
 
+  for (i = 0; i < hs->current_batch_sz; i++)
+    checkpoint_restore_status(hs->hostbatch[i]);
+
   if (!o.noresolve)
     nmap_mass_rdns(hs->hostbatch, hs->current_batch_sz);
 }
@@ -69,11 +69,14 @@
 #include <list>
 #include <nbase.h>
 class Target;
+class CyclicPermutation;
 
 class HostGroupState {
 public:
   /* The maximum number of entries we want to allow storing in defer_buffer. */
   static const unsigned int DEFER_LIMIT = 64;
+  /* The most expressions whose hosts are permuted together with randomize. */
+  static const unsigned int SPACE_LIMIT = 16384;
 
   HostGroupState(int lookahead, int randomize, int argc, const char *argv[]);
   ~HostGroupState();
@@ -93,16 +96,41 @@ public:
   int current_batch_sz; /* The number of VALID members of hostbatch[] */
   int next_batch_no; /* The index of the next hostbatch[] member to be given
                         back to the user */
-  int randomize; /* Whether each batch should be "shuffled" prior to the ping
-                    scan (they will also be out of order when given back one
-                    at a time to the client program */
+  int randomize; /* Whether to give hosts in a random order. Normally it is a
+                    permutation of the addresses of all the expressions
+                    together; with -iR, each batch is "shuffled" prior to the
+                    ping scan instead. */
   TargetGroup current_group; /* For batch chunking -- targets in queue */
+  /* With randomize, the expressions read so far that are being given in the
+     order of perm, seeded from o.randomize_seed and the number of spaces
+     done. An expression whose addresses can't be counted ends a space and is
+     kept in unsized, to be given in order after it. With --shard, only this
+     shard's part of each is given. */
+  TargetSpace space;
+  CyclicPermutation *perm;
+  TargetGroup *unsized;
+  u64 unsized_index;
+  u64 nspaces;
+  /* If not NULL, called with the first host of each batch, and with
+     before_discovery_arg, before host discovery sends anything for it. */
+  void (*before_discovery)(const Target *first, void *arg);
+  void *before_discovery_arg;
 
   /* Returns true iff the defer buffer is not yet full. */
   bool defer(Target *t);
   void undefer();
   const char *next_expression();
   Target *next_target();
+  /* Fills in the next address to scan and the expression it belongs to.
+     Returns -1 when there are no more. */
+  int get_next_host(struct sockaddr_storage *ss, std::size_t *sslen,
+                    const TargetGroup **group);
+  /* Skips the addresses of group up to and including last, if group is given
+     in address order. */
+  void skip_past(const TargetGroup *group, const struct sockaddr_storage *last);
+
+private:
+  bool fill_space();
 };
 
 /* ports is used to pass information about what ports to use for host discovery */
@@ -119,5 +147,12 @@ void returnhost(HostGroupState *hs);
 
 bool target_needs_new_hostgroup(Target **targets, int targets_sz, const Target *target);
 
+/* Adds a <target> element to the XML saying that a target specification was
+   skipped as invalid. */
+void log_bogus_target(const char *expr);
+/* Fills in the device, source address, and next hop of a Target from the
+   route to its address. Returns false if there is no route. */
+bool set_target_route(Target *t);
+
 #endif /* TARGETS_H */
 
@@ -84,9 +84,40 @@
 #endif /* NETINET_IF_ETHER_H */
 #endif /* HAVE_NETINET_IF_ETHER_H */
 
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 extern NmapOps o;
 
 static PacketCounter PktCt;
+#if HAVE_PTHREAD
+/* Packets are sent and received from the threads of --scan-threads and of a
+   pipelined scan at once. */
+static pthread_mutex_t pktct_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Adds a packet of len bytes to the totals of getFinalPacketStats. */
+static void count_packet(PacketTrace::pdirection pdir, u32 len) {
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&pktct_lock);
+#endif
+  if (pdir == PacketTrace::SENT) {
+    PktCt.sendPackets++;
+    PktCt.sendBytes += len;
+  } else {
+    PktCt.recvPackets++;
+    PktCt.recvBytes += len;
+  }
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&pktct_lock);
+#endif
+}
 
 /* Create a raw socket and do things that always apply to raw sockets:
     * Set SO_BROADCAST.
@@ -147,13 +178,7 @@ void PacketTrace::traceArp(pdirection pdir, const u8 *frame, u32 len,
   char arpdesc[128];
   char who_has[INET_ADDRSTRLEN], tell[INET_ADDRSTRLEN];
 
-  if (pdir == SENT) {
-    PktCt.sendPackets++;
-    PktCt.sendBytes += len;
-  } else {
-    PktCt.recvPackets++;
-    PktCt.recvBytes += len;
-  }
+  count_packet(pdir, len);
 
   if (!o.packetTrace())
     return;
@@ -201,13 +226,7 @@ void PacketTrace::traceND(pdirection pdir, const u8 *frame, u32 len,
   char who_has[INET6_ADDRSTRLEN], tgt_is[INET6_ADDRSTRLEN];
   char desc[128];
 
-  if (pdir == SENT) {
-    PktCt.sendPackets++;
-    PktCt.sendBytes += len;
-  } else {
-    PktCt.recvPackets++;
-    PktCt.recvBytes += len;
-  }
+  count_packet(pdir, len);
 
   if (!o.packetTrace())
     return;
@@ -290,13 +309,7 @@ void PacketTrace::trace(pdirection pdir, const u8 *packet, u32 len,
                         struct timeval *now) {
   struct timeval tv;
 
-  if (pdir == SENT) {
-    PktCt.sendPackets++;
-    PktCt.sendBytes += len;
-  } else {
-    PktCt.recvPackets++;
-    PktCt.recvBytes += len;
-  }
+  count_packet(pdir, len);
 
   if (!o.packetTrace())
     return;
@@ -487,6 +500,114 @@ int send_ip_packet(int sd, const struct eth_nfo *eth,
   fatal("%s only understands IP versions 4 and 6 (got %u)", __func__, ip->ip_v);
 }
 
+/* The most packets handed to one sendmmsg() call. */
+#define RAW_SEND_BATCH_MAX 64
+
+RawSendBatch::RawSendBatch(int sd) {
+  this->sd = sd;
+  pkts.reserve(RAW_SEND_BATCH_MAX);
+}
+
+bool RawSendBatch::supported() {
+#if HAVE_SENDMMSG
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool RawSendBatch::accepts(const struct eth_nfo *eth,
+                           const struct sockaddr_storage *dst,
+                           const u8 *packet, unsigned int packetlen) const {
+  const struct ip *ip = (const struct ip *) packet;
+
+  /* Fragmented sends are left to send_ip_packet; o.fragscan is rare enough
+     that it is not worth checking each packet's size and DF bit. */
+  return sd >= 0 && eth == NULL && !o.fragscan
+    && dst->ss_family == AF_INET
+    && packetlen >= 20 && ip->ip_v == 4;
+}
+
+void RawSendBatch::queue(const struct sockaddr_storage *dst, const u8 *packet,
+                         unsigned int packetlen, struct timeval *sent) {
+  const struct ip *ip = (const struct ip *) packet;
+  QueuedPacket qp;
+
+  assert(dst->ss_family == AF_INET);
+  qp.dst = *(const struct sockaddr_in *) dst;
+  /* Same as send_ip_packet_sd: the port is meaningless for a raw socket, but
+     some systems want it. */
+  if (ip->ip_p == IPPROTO_TCP
+      && packetlen >= (unsigned int) ip->ip_hl * 4 + 20) {
+    qp.dst.sin_port = ((const struct tcp_hdr *) (packet + ip->ip_hl * 4))->th_dport;
+  } else if (ip->ip_p == IPPROTO_UDP
+             && packetlen >= (unsigned int) ip->ip_hl * 4 + 8) {
+    qp.dst.sin_port = ((const struct udp_hdr *) (packet + ip->ip_hl * 4))->uh_dport;
+  }
+  qp.offset = buf.size();
+  qp.len = packetlen;
+  qp.sent = sent;
+  buf.insert(buf.end(), packet, packet + packetlen);
+  pkts.push_back(qp);
+
+  if (pkts.size() >= RAW_SEND_BATCH_MAX)
+    flush();
+}
+
+int RawSendBatch::flush() {
+  struct timeval now;
+  size_t i, j;
+  int res, nsent = 0;
+
+  i = 0;
+  while (i < pkts.size()) {
+    gettimeofday(&now, NULL);
+#if HAVE_SENDMMSG
+    struct mmsghdr msgs[RAW_SEND_BATCH_MAX];
+    struct iovec iovs[RAW_SEND_BATCH_MAX];
+    size_t n = MIN(pkts.size() - i, RAW_SEND_BATCH_MAX);
+
+    memset(msgs, 0, n * sizeof(*msgs));
+    for (j = 0; j < n; j++) {
+      iovs[j].iov_base = &buf[pkts[i + j].offset];
+      iovs[j].iov_len = pkts[i + j].len;
+      msgs[j].msg_hdr.msg_name = &pkts[i + j].dst;
+      msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[j].msg_hdr.msg_iov = &iovs[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    res = sendmmsg(sd, msgs, n, 0);
+    if (res > 0) {
+      for (j = i; j < i + res; j++) {
+        if (pkts[j].sent)
+          *pkts[j].sent = now;
+        PacketTrace::trace(PacketTrace::SENT, &buf[pkts[j].offset], pkts[j].len, &now);
+      }
+      i += res;
+      nsent += res;
+      continue;
+    }
+#endif
+    /* The kernel took none of what was left (or there is no sendmmsg). Send
+       the first packet on its own so that its error is reported and ENOBUFS
+       is waited out, then go back to batching. A probe counts as sent even
+       if this fails, as in send_ip_packet. */
+    res = send_ip_packet_sd(sd, &pkts[i].dst, &buf[pkts[i].offset], pkts[i].len);
+    if (pkts[i].sent)
+      *pkts[i].sent = now;
+    if (res != -1) {
+      PacketTrace::trace(PacketTrace::SENT, &buf[pkts[i].offset], pkts[i].len, &now);
+      nsent++;
+    }
+    i++;
+  }
+
+  pkts.clear();
+  buf.clear();
+
+  return nsent;
+}
+
 
 /* Return an IPv4 pseudoheader checksum for the given protocol and data. Unlike
    ipv4_pseudoheader_cksum, this knows about STUPID_SOLARIS_CHECKSUM_BUG and
@@ -580,7 +701,7 @@ u8 *build_ip_raw(const struct in_addr *source,
   int packetlen = sizeof(struct ip) + ipoptlen + datalen;
   u8 *packet = (u8 *) safe_malloc(packetlen);
   struct ip *ip = (struct ip *) packet;
-  static int myttl = 0;
+  int myttl;
 
   /* check that required fields are there and not too silly */
   assert(source);
@@ -765,7 +886,7 @@ int send_tcp_raw(int sd, const struct eth_nfo *eth,
 }
 
 int send_tcp_raw_decoys(int sd, const struct eth_nfo *eth,
-                        const struct in_addr *victim,
+                        const struct in_addr *source, const struct in_addr *victim,
                         int ttl, bool df,
                         u8 *ipopt, int ipoptlen,
                         u16 sport, u16 dport,
@@ -776,7 +897,7 @@ int send_tcp_raw_decoys(int sd, const struct eth_nfo *eth,
 
   for (decoy = 0; decoy < o.numdecoys; decoy++)
     if (send_tcp_raw(sd, eth,
-                     &((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, victim,
+                     decoy == o.decoyturn ? source : &((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, victim,
                      ttl, df,
                      ipopt, ipoptlen,
                      sport, dport,
@@ -859,8 +980,164 @@ u8 *build_udp_raw_ipv6(const struct in6_addr *source,
   return ipv6;
 }
 
+/* Updates checksum sum for a 16-bit word of the data it covers changing from
+   oldw to neww, following equation 3 of RFC 1624: HC' = ~(~HC + ~m + m'). */
+static inline u16 cksum_adjust(u16 sum, u16 oldw, u16 neww) {
+  u32 x;
+
+  x = (u16) ~sum + (u16) ~oldw + neww;
+  x = (x & 0xffff) + (x >> 16);
+  x = (x & 0xffff) + (x >> 16);
+
+  return ~x;
+}
+
+/* Overwrites len bytes (an even number) at field with val, and adjusts each
+   non-NULL checksum covering the field. */
+static void cksum_patch(void *field, const void *val, size_t len,
+                        u16 *sum1, u16 *sum2) {
+  u16 oldw, neww;
+  size_t i;
+
+  for (i = 0; i < len; i += 2) {
+    memcpy(&oldw, (u8 *) field + i, 2);
+    memcpy(&neww, (const u8 *) val + i, 2);
+    if (oldw == neww)
+      continue;
+    if (sum1)
+      *sum1 = cksum_adjust(*sum1, oldw, neww);
+    if (sum2)
+      *sum2 = cksum_adjust(*sum2, oldw, neww);
+    memcpy((u8 *) field + i, &neww, 2);
+  }
+}
+
+/* Can the packet in buf be patched into one with these IP header fields?
+   Packets with IP options are always built from scratch, because of the
+   source routing hack in fill_ip_raw. So are --badsum packets. */
+bool PacketTemplate::matchesIP(const struct in_addr *source, u8 proto, u8 tos,
+                               bool df, int ipoptlen, u32 packetlen) const {
+  const struct ip *ip;
+
+  if (buf.size() != packetlen || ipoptlen != 0 || o.badsum)
+    return false;
+  ip = (const struct ip *) &buf[0];
+
+  return ip->ip_p == proto && ip->ip_tos == tos
+    && ip->ip_off == htons(df ? IP_DF : 0)
+    && ip->ip_src.s_addr == source->s_addr;
+}
+
+/* Patches the IP header fields that vary from probe to probe. The
+   destination address is part of the transport pseudoheader, so l4sum is
+   adjusted for it too. */
+void PacketTemplate::patchIP(const struct in_addr *victim, int ttl, u16 ipid,
+                             u16 *l4sum) {
+  struct ip *ip = (struct ip *) &buf[0];
+  u8 ttlproto[2];
+  u16 id;
+
+  if (ttl == -1)
+    ttl = (get_random_uint() % 23) + 37;
+  ttlproto[0] = ttl;
+  ttlproto[1] = ip->ip_p;
+  id = htons(ipid);
+
+  cksum_patch(&ip->ip_dst, &victim->s_addr, 4, &ip->ip_sum, l4sum);
+  cksum_patch(&ip->ip_id, &id, 2, &ip->ip_sum, NULL);
+  cksum_patch(&ip->ip_ttl, ttlproto, 2, &ip->ip_sum, NULL);
+}
+
+/* Takes over a packet from one of the build_*_raw functions. */
+void PacketTemplate::assign(u8 *packet, u32 packetlen) {
+  buf.assign(packet, packet + packetlen);
+  free(packet);
+}
+
+u8 *PacketTemplate::buildTCP(const struct in_addr *source,
+                             const struct in_addr *victim, int ttl, u16 ipid,
+                             u8 tos, bool df, const u8 *ipopt, int ipoptlen,
+                             u16 sport, u16 dport, u32 seq, u32 ack,
+                             u8 reserved, u8 flags, u16 window, u16 urp,
+                             const u8 *tcpopt, int tcpoptlen,
+                             const char *data, u16 datalen, u32 *packetlen) {
+  u32 len = sizeof(struct ip) + sizeof(struct tcp_hdr) + tcpoptlen + datalen;
+  struct tcp_hdr *tcp = NULL;
+  u32 seqack[2];
+  u16 ports[2];
+
+  if (matchesIP(source, IPPROTO_TCP, tos, df, ipoptlen, len))
+    tcp = (struct tcp_hdr *) (&buf[0] + sizeof(struct ip));
+  if (tcp == NULL
+      || tcp->th_off != 5 + (tcpoptlen / 4)
+      || tcp->th_x2 != (reserved & 0x0F)
+      || tcp->th_flags != flags
+      || tcp->th_win != htons(window ? window : 1024)
+      || tcp->th_urp != htons(urp)
+      || (tcpoptlen && memcmp(tcp + 1, tcpopt, tcpoptlen) != 0)
+      || (datalen && memcmp((u8 *) (tcp + 1) + tcpoptlen, data, datalen) != 0)) {
+    assign(build_tcp_raw(source, victim, ttl, ipid, tos, df, ipopt, ipoptlen,
+                         sport, dport, seq, ack, reserved, flags, window, urp,
+                         tcpopt, tcpoptlen, data, datalen, &len), len);
+    *packetlen = len;
+    return &buf[0];
+  }
+
+  /* Same rules for seq as build_tcp. */
+  if (seq)
+    seqack[0] = htonl(seq);
+  else if (flags & TH_SYN)
+    get_random_bytes(&seqack[0], 4);
+  else
+    seqack[0] = 0;
+  seqack[1] = htonl(ack);
+  ports[0] = htons(sport);
+  ports[1] = htons(dport);
+
+  patchIP(victim, ttl, ipid, &tcp->th_sum);
+  cksum_patch(&tcp->th_sport, ports, 4, &tcp->th_sum, NULL);
+  cksum_patch(&tcp->th_seq, seqack, 8, &tcp->th_sum, NULL);
+
+  *packetlen = len;
+  return &buf[0];
+}
+
+u8 *PacketTemplate::buildUDP(const struct in_addr *source,
+                             const struct in_addr *victim, int ttl, u16 ipid,
+                             u8 tos, bool df, u8 *ipopt, int ipoptlen,
+                             u16 sport, u16 dport,
+                             const char *data, u16 datalen, u32 *packetlen) {
+  u32 len = sizeof(struct ip) + sizeof(struct udp_hdr) + datalen;
+  struct udp_hdr *udp = NULL;
+  u16 ports[2];
+
+  if (matchesIP(source, IPPROTO_UDP, tos, df, ipoptlen, len))
+    udp = (struct udp_hdr *) (&buf[0] + sizeof(struct ip));
+  /* A zero checksum means "no checksum" and cannot be patched. */
+  if (udp == NULL || udp->uh_sum == 0
+      || (datalen && memcmp(udp + 1, data, datalen) != 0)) {
+    assign(build_udp_raw(source, victim, ttl, ipid, tos, df, ipopt, ipoptlen,
+                         sport, dport, data, datalen, &len), len);
+    *packetlen = len;
+    return &buf[0];
+  }
+
+  ports[0] = htons(sport);
+  ports[1] = htons(dport);
+
+  patchIP(victim, ttl, ipid, &udp->uh_sum);
+  cksum_patch(&udp->uh_sport, ports, 4, &udp->uh_sum, NULL);
+  /* The patched sum can come out as 0x0000, which UDP reads as "no
+     checksum". A full computation sends its equivalent 0xFFFF instead. */
+  if (udp->uh_sum == 0)
+    udp->uh_sum = 0xffff;
+
+  *packetlen = len;
+  return &buf[0];
+}
+
 int send_udp_raw(int sd, const struct eth_nfo *eth,
-                 struct in_addr *source, const struct in_addr *victim,
+                 const struct in_addr *source, const struct in_addr *victim,
                  int ttl, u16 ipid,
                  u8 *ipopt, int ipoptlen,
                  u16 sport, u16 dport, const char *data, u16 datalen) {
@@ -886,14 +1163,14 @@ int send_udp_raw(int sd, const struct eth_nfo *eth,
 }
 
 int send_udp_raw_decoys(int sd, const struct eth_nfo *eth,
-                        const struct in_addr *victim,
+                        const struct in_addr *source, const struct in_addr *victim,
                         int ttl, u16 ipid,
                         u8 *ipops, int ipoptlen,
                         u16 sport, u16 dport, const char *data, u16 datalen) {
   int decoy;
 
   for (decoy = 0; decoy < o.numdecoys; decoy++)
-    if (send_udp_raw(sd, eth, &((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, victim,
+    if (send_udp_raw(sd, eth, decoy == o.decoyturn ? source : &((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, victim,
                      ttl, ipid, ipops, ipoptlen,
                      sport, dport, data, datalen) == -1)
       return -1;
@@ -1715,16 +1992,259 @@ bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_st
 }
 
 
-int nmap_route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo) {
+/* An address prefix, used as a key in the route cache. */
+struct route_prefix {
+  int af;
+  int bits;
+  u8 addr[16];
+
+  bool operator<(const route_prefix &other) const {
+    if (af != other.af)
+      return af < other.af;
+    if (bits != other.bits)
+      return bits < other.bits;
+    return memcmp(addr, other.addr, sizeof(addr)) < 0;
+  }
+};
+
+struct route_cache_entry {
+  int rc;
+  struct route_nfo rnfo;
+};
+
+/* The route cache. Every prefix of the system routing table is in
+   route_prefixes, along with the networks and addresses of the interfaces and
+   the route gateways. All the addresses whose longest matching prefix is the
+   same one match the same set of routes, so they get the same routing
+   decision, and route_dst needs to be asked only once for each such prefix.
+   The answers are kept in route_cache. Like the routes and interfaces from
+   libnetutil that they come from, they are kept for the whole run; only a
+   change of -e or -S (see nmap_route_dst) clears them. */
+static bool route_cache_loaded = false;
+static bool route_cache_usable = false;
+static std::set<route_prefix> route_prefixes;
+/* The prefix lengths present for each address family, longest first. */
+static std::set<int, std::greater<int> > route_prefix_lengths_v4, route_prefix_lengths_v6;
+static std::map<route_prefix, route_cache_entry> route_cache;
+/* The -e and -S settings the cached answers are for. */
+static std::string route_cache_device;
+static struct sockaddr_storage route_cache_spoofss;
+#if HAVE_PTHREAD
+/* In a pipelined scan, target setup and traceroute or OS detection look up
+   routes at the same time. */
+static pthread_mutex_t route_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Fills in p with the first bits bits of the address in ss. Returns false if
+   the address family is not IPv4 or IPv6. */
+static bool make_route_prefix(const struct sockaddr_storage *ss, int bits,
+                              route_prefix *p) {
+  const u8 *addr;
+  int len, i;
+
+  memset(p, 0, sizeof(*p));
+  if (ss->ss_family == AF_INET) {
+    addr = (const u8 *) &((const struct sockaddr_in *) ss)->sin_addr.s_addr;
+    len = 4;
+  } else if (ss->ss_family == AF_INET6) {
+    addr = ((const struct sockaddr_in6 *) ss)->sin6_addr.s6_addr;
+    len = 16;
+  } else {
+    return false;
+  }
+  if (bits < 0 || bits > len * 8)
+    bits = len * 8;
+  p->af = ss->ss_family;
+  p->bits = bits;
+  for (i = 0; i < len && bits > 0; i++, bits -= 8) {
+    if (bits >= 8)
+      p->addr[i] = addr[i];
+    else
+      p->addr[i] = addr[i] & (0xff << (8 - bits));
+  }
+
+  return true;
+}
+
+static void add_route_prefix(const struct sockaddr_storage *ss, int bits) {
+  route_prefix p;
+
+  if (!make_route_prefix(ss, bits, &p))
+    return;
+  route_prefixes.insert(p);
+  if (p.af == AF_INET)
+    route_prefix_lengths_v4.insert(p.bits);
+  else
+    route_prefix_lengths_v6.insert(p.bits);
+}
+
+/* Reads the routing table and interfaces into route_prefixes. If they can't be
+   read, the cache is not used and every lookup goes to route_dst. */
+static void load_route_prefixes() {
+  struct interface_info *ifaces;
+  struct sys_route *routes;
+  int numifaces, numroutes, i;
+  char errstr[256];
+
+  route_cache_loaded = true;
+  route_cache_usable = false;
+
+  routes = getsysroutes(&numroutes, errstr, sizeof(errstr));
+  ifaces = getinterfaces(&numifaces, errstr, sizeof(errstr));
+  if (routes == NULL || ifaces == NULL) {
+    if (o.debugging)
+      log_write(LOG_STDOUT, "Not caching routes: %s\n", errstr);
+    return;
+  }
+
+  for (i = 0; i < numroutes; i++) {
+    add_route_prefix(&routes[i].dest, routes[i].netmask_bits);
+    /* A gateway is directly connected while the rest of its prefix is not. */
+    if (!sockaddr_equal_zero(&routes[i].gw))
+      add_route_prefix(&routes[i].gw, -1);
+  }
+  for (i = 0; i < numifaces; i++) {
+    add_route_prefix(&ifaces[i].addr, ifaces[i].netmask_bits);
+    /* The interface's own address is routed through the loopback. */
+    add_route_prefix(&ifaces[i].addr, -1);
+    /* The kernel also has special routes for the network and broadcast
+       addresses of an IPv4 network. */
+    if (ifaces[i].addr.ss_family == AF_INET && ifaces[i].netmask_bits < 32) {
+      struct sockaddr_storage ss = ifaces[i].addr;
+      struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+      u32 mask = ifaces[i].netmask_bits == 0 ? 0 : htonl(0xffffffff << (32 - ifaces[i].netmask_bits));
+      sin->sin_addr.s_addr &= mask;
+      add_route_prefix(&ss, -1);
+      sin->sin_addr.s_addr |= ~mask;
+      add_route_prefix(&ss, -1);
+    }
+  }
+  /* The limited broadcast address has a kernel route of its own, which may
+     not be in the table. */
+  {
+    struct sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_family = AF_INET;
+    ((struct sockaddr_in *) &ss)->sin_addr.s_addr = htonl(0xffffffff);
+    add_route_prefix(&ss, -1);
+  }
+  /* Addresses matching nothing else share the decision for the whole space. */
+  route_prefix_lengths_v4.insert(0);
+  route_prefix_lengths_v6.insert(0);
+  route_cache_usable = true;
+}
+
+/* Finds the longest prefix in route_prefixes that contains dst, the one whose
+   cached routing decision applies to dst. */
+static bool route_cache_key(const struct sockaddr_storage *dst, route_prefix *key) {
+  const std::set<int, std::greater<int> > *lengths;
+  std::set<int, std::greater<int> >::const_iterator it;
+
+  if (dst->ss_family == AF_INET)
+    lengths = &route_prefix_lengths_v4;
+  else if (dst->ss_family == AF_INET6)
+    lengths = &route_prefix_lengths_v6;
+  else
+    return false;
+
+  for (it = lengths->begin(); it != lengths->end(); it++) {
+    make_route_prefix(dst, *it, key);
+    if (*it == 0 || route_prefixes.find(*key) != route_prefixes.end())
+      return true;
+  }
+
+  return false;
+}
+
+static bool route_cacheable(const struct sockaddr_storage *dst) {
+  if (dst->ss_family == AF_INET) {
+    u32 addr = ntohl(((const struct sockaddr_in *) dst)->sin_addr.s_addr);
+    return addr != 0 && (addr & 0xf0000000) != 0xe0000000;
+  } else if (dst->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) dst;
+    return sin6->sin6_scope_id == 0
+      && !IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr)
+      && !IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr);
+  }
+  return false;
+}
+
+static void route_cache_clear() {
+  route_cache_loaded = false;
+  route_cache_usable = false;
+  route_prefixes.clear();
+  route_prefix_lengths_v4.clear();
+  route_prefix_lengths_v6.clear();
+  route_cache.clear();
+}
+
+void route_cache_free() {
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&route_cache_lock);
+#endif
+  route_cache_clear();
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&route_cache_lock);
+#endif
+}
+
+static int route_dst_cached(const struct sockaddr_storage *dst, struct route_nfo *rnfo) {
   struct sockaddr_storage spoofss;
   size_t spoofsslen;
-
-  if (o.spoofsource) {
+  const char *device;
+  std::map<route_prefix, route_cache_entry>::iterator it;
+  route_cache_entry entry;
+  route_prefix key;
+
+  device = o.device;
+  memset(&spoofss, 0, sizeof(spoofss));
+  if (o.spoofsource)
     o.SourceSockAddr(&spoofss, &spoofsslen);
-    return route_dst(dst, rnfo, o.device, &spoofss);
-  } else {
-    return route_dst(dst, rnfo, o.device, NULL);
+
+  /* An address with an IPv6 scope is routed out of its own interface, and
+     multicast and unspecified addresses are routed by special rules. None of
+     them are cached. */
+  if (!route_cacheable(dst))
+    return route_dst(dst, rnfo, device, o.spoofsource ? &spoofss : NULL);
+
+  if (route_cache_loaded
+      && (route_cache_device != device
+          || memcmp(&route_cache_spoofss, &spoofss, sizeof(spoofss)) != 0)) {
+    route_cache_clear();
+  }
+  if (!route_cache_loaded) {
+    load_route_prefixes();
+    route_cache_device = device;
+    route_cache_spoofss = spoofss;
+  }
+  if (!route_cache_usable || !route_cache_key(dst, &key))
+    return route_dst(dst, rnfo, device, o.spoofsource ? &spoofss : NULL);
+
+  it = route_cache.find(key);
+  if (it == route_cache.end()) {
+    entry.rc = route_dst(dst, rnfo, device, o.spoofsource ? &spoofss : NULL);
+    if (entry.rc)
+      entry.rnfo = *rnfo;
+    it = route_cache.insert(std::make_pair(key, entry)).first;
   }
+  if (it->second.rc)
+    *rnfo = it->second.rnfo;
+
+  return it->second.rc;
+}
+
+int nmap_route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo) {
+  int rc;
+
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&route_cache_lock);
+#endif
+  rc = route_dst_cached(dst, rnfo);
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&route_cache_lock);
+#endif
+
+  return rc;
 }
 
 
@@ -71,6 +71,8 @@
 
 #include <pcap.h>
 
+#include <vector>
+
 class Target;
 
 #ifndef INET_ADDRSTRLEN
@@ -151,12 +153,60 @@ struct addrinfo *resolve_all(const char *hostname, int pf);
    of the routing details.  This function takes into account -S and -e
    options set by user (o.spoofsource, o.device) */
 int nmap_route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo);
+/* Routing decisions are cached by nmap_route_dst for each prefix of the
+   routing table. libnetutil reads the routing table and the interfaces only
+   once per run, so the cache is never stale and lives for the whole run. This
+   frees it. */
+void route_cache_free();
 
 /* Send a pre-built IPv4 or IPv6 packet */
 int send_ip_packet(int sd, const struct eth_nfo *eth,
   const struct sockaddr_storage *dst,
   const u8 *packet, unsigned int packetlen);
 
+/* Collects pre-built IPv4 packets bound for a raw socket and hands them to
+   the kernel a batch at a time with sendmmsg(), rather than with one sendto()
+   per packet. Packets are copied when queued, so the caller may free its
+   buffer right away. Only plain raw-socket IPv4 sends can be batched (not
+   ethernet, IPv6, or fragmented sends); check with accepts() first. */
+class RawSendBatch {
+ public:
+  RawSendBatch(int sd);
+
+  /* Whether sendmmsg() is available on this platform. Without it batching
+     only adds a copy, so callers should not bother. */
+  static bool supported();
+
+  /* Returns true if this packet may be passed to queue(). */
+  bool accepts(const struct eth_nfo *eth, const struct sockaddr_storage *dst,
+               const u8 *packet, unsigned int packetlen) const;
+
+  /* Queues a packet. If sent is not NULL, it is set to the time the packet
+     is handed to the kernel, so it must stay valid until the next flush(). A
+     full batch is flushed right away. */
+  void queue(const struct sockaddr_storage *dst, const u8 *packet,
+             unsigned int packetlen, struct timeval *sent);
+
+  /* Sends everything queued. Packets the kernel refuses are retried one at a
+     time through send_ip_packet_sd(), which reports the error. Returns the
+     number of packets sent successfully. */
+  int flush();
+
+  bool empty() const { return pkts.empty(); }
+
+ private:
+  struct QueuedPacket {
+    struct sockaddr_in dst;
+    size_t offset; /* Into buf */
+    unsigned int len;
+    struct timeval *sent;
+  };
+
+  int sd;
+  std::vector<u8> buf;
+  std::vector<QueuedPacket> pkts;
+};
+
 /* Builds an IP packet (including an IP header) by packing the fields
    with the given information.  It allocates a new buffer to store the
    packet contents, and then returns that buffer.  The packet is not
@@ -208,8 +258,10 @@ int send_tcp_raw(int sd, const struct eth_nfo *eth,
                   u8 *options, int optlen,
                   const char *data, u16 datalen);
 
+/* Like send_tcp_raw, but sends from each decoy in turn, and from source
+   as the real one (o.decoyturn). */
 int send_tcp_raw_decoys(int sd, const struct eth_nfo *eth,
-                         const struct in_addr *victim,
+                         const struct in_addr *source, const struct in_addr *victim,
                          int ttl, bool df,
                          u8* ipopt, int ipoptlen,
                          u16 sport, u16 dport,
@@ -230,20 +282,54 @@ u8 *build_udp_raw(const struct in_addr *source, const struct in_addr *victim,
        const char *data, u16 datalen,
        u32 *packetlen);
 
+/* A reusable buffer for building IPv4 TCP and UDP probes. A packet that
+   differs from the last one built only in its destination, IP ID, TTL, ports,
+   or sequence and acknowledgment numbers is made by patching those fields in
+   place and adjusting the checksums incrementally (RFC 1624). Anything else
+   is built from scratch with build_tcp_raw or build_udp_raw. The returned
+   buffer belongs to the template and is only valid until the next build. */
+class PacketTemplate {
+ public:
+  u8 *buildTCP(const struct in_addr *source, const struct in_addr *victim,
+               int ttl, u16 ipid, u8 tos, bool df,
+               const u8 *ipopt, int ipoptlen,
+               u16 sport, u16 dport,
+               u32 seq, u32 ack, u8 reserved, u8 flags, u16 window, u16 urp,
+               const u8 *options, int optlen,
+               const char *data, u16 datalen,
+               u32 *packetlen);
+  u8 *buildUDP(const struct in_addr *source, const struct in_addr *victim,
+               int ttl, u16 ipid, u8 tos, bool df,
+               u8 *ipopt, int ipoptlen,
+               u16 sport, u16 dport,
+               const char *data, u16 datalen,
+               u32 *packetlen);
+
+ private:
+  bool matchesIP(const struct in_addr *source, u8 proto, u8 tos, bool df,
+                 int ipoptlen, u32 packetlen) const;
+  void patchIP(const struct in_addr *victim, int ttl, u16 ipid, u16 *l4sum);
+  void assign(u8 *packet, u32 packetlen);
+
+  std::vector<u8> buf;
+};
+
 u8 *build_udp_raw_ipv6(const struct in6_addr *source,
                        const struct in6_addr *victim, u8 tc, u32 flowlabel,
                        u8 hoplimit, u16 sport, u16 dport,
                        const char *data, u16 datalen, u32 *packetlen);
 
 int send_udp_raw(int sd, const struct eth_nfo *eth,
-                  struct in_addr *source, const struct in_addr *victim,
+                  const struct in_addr *source, const struct in_addr *victim,
                   int ttl, u16 ipid,
                   u8* ipopt, int ipoptlen,
                   u16 sport, u16 dport,
                   const char *data, u16 datalen);
 
+/* Like send_udp_raw, but sends from each decoy in turn, and from source
+   as the real one (o.decoyturn). */
 int send_udp_raw_decoys(int sd, const struct eth_nfo *eth,
-                         const struct in_addr *victim,
+                         const struct in_addr *source, const struct in_addr *victim,
                          int ttl, u16 ipid,
                          u8* ipops, int ip,
                          u16 sport, u16 dport,
@@ -0,0 +1,244 @@
+/***************************************************************************
+ * capture_bench.cc -- Measures how many replies the scan                  *
+ * sniffer's read loop drops under a burst.                                *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* This tool measures the read loop that ultra_scan uses for its sniffer,
+   read_reply_pcap(), under a burst of traffic.  A child process sends UDP
+   datagrams to the loopback address (or any other) as fast as it can or at
+   a given rate, while the parent captures them through a handle opened the
+   way begin_sniffer() opens one.  It does that twice:
+
+     select: the handle is blocking, so each frame costs a select() first,
+             which is how the sniffer read before it used the ring directly
+     ring:   the handle is nonblocking, so frames already in the ring are
+             taken without a system call, as begin_sniffer() does now
+
+   For each it prints the datagrams captured and lost, and the CPU time the
+   reader used.  -w adds busy work per frame, to stand in
+   for the reply processing of a scan.  Capturing needs the same privileges
+   as a raw scan. */
+
+#include "../nmap.h"
+#include "../nmap_error.h"
+#include "../libnetutil/netutil.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern void set_program_name(const char *name);
+
+#define BENCH_PORT 33999
+
+static void usage(const char *progname) {
+  fprintf(stderr,
+"Usage: %s [-i dev] [-d addr] [-n count] [-r rate] [-b bytes] [-w usec]\n"
+"Sends UDP datagrams and times the scan sniffer's read loop catching them,\n"
+"with and without reading straight from the capture ring.\n"
+"  -i <dev>: Capture on this interface (default lo)\n"
+"  -d <addr>: Send to this IPv4 address (default 127.0.0.1)\n"
+"  -n <count>: Datagrams to send (default 500000)\n"
+"  -r <rate>: Datagrams per second; 0 sends as fast as possible (default 0)\n"
+"  -b <bytes>: Kernel capture buffer size; 0 is libpcap's default (default 0)\n"
+"  -w <usec>: Busy work per captured frame (default 0)\n", progname);
+  exit(2);
+}
+
+static long cpu_usec() {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static long now_usec() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* The filter only lets our datagrams through. */
+static bool accept_any(const unsigned char *p, const struct pcap_pkthdr *head,
+                       int datalink, size_t offset) {
+  return true;
+}
+
+/* Sends count datagrams to dst at rate per second (0 for no limit), then
+   exits. */
+static void send_burst(const struct in_addr *dst, unsigned int count,
+                       unsigned int rate) {
+  struct sockaddr_in sin;
+  char payload[32];
+  unsigned int i;
+  long start;
+  int sd;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sd < 0)
+    pfatal("socket");
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr = *dst;
+  sin.sin_port = htons(BENCH_PORT);
+  memset(payload, 'x', sizeof(payload));
+
+  start = now_usec();
+  for (i = 0; i < count; i++) {
+    if (rate > 0) {
+      while ((now_usec() - start) * (double) rate < i * 1000000.0)
+        ;
+    }
+    /* The port is closed; errors from its ICMP replies don't matter. */
+    sendto(sd, payload, sizeof(payload), 0, (struct sockaddr *) &sin, sizeof(sin));
+  }
+  close(sd);
+  _exit(0);
+}
+
+static void busy(long usec) {
+  long end;
+
+  if (usec <= 0)
+    return;
+  end = now_usec() + usec;
+  while (now_usec() < end)
+    ;
+}
+
+static void run(const char *mode, const char *dev, const struct in_addr *dst,
+                unsigned int count, unsigned int rate, int bufsize, long work) {
+  const unsigned char *p;
+  struct pcap_pkthdr *head;
+  struct timeval rcvdtime;
+  unsigned int captured = 0;
+  int datalink, status;
+  size_t offset;
+  long cpu, wall;
+  pcap_t *pd;
+  pid_t pid;
+
+  pd = my_pcap_open_live(dev, 256, 0, 200, bufsize);
+  if (pd == NULL)
+    fatal("Could not open %s for capture", dev);
+  set_pcap_filter(dev, pd, "udp and dst host %s and dst port %d",
+                  inet_ntoa(*dst), BENCH_PORT);
+  if (strcmp(mode, "ring") == 0 && pcap_setnonblock(pd, 1, NULL) < 0)
+    fatal("Could not put pcap handle in nonblocking mode: %s", pcap_geterr(pd));
+
+  pid = fork();
+  if (pid < 0)
+    pfatal("fork");
+  if (pid == 0)
+    send_burst(dst, count, rate);
+
+  wall = now_usec();
+  cpu = cpu_usec();
+  /* Stop once nothing has come for half a second. */
+  while (read_reply_pcap(pd, 500000, accept_any, &p, &head, &rcvdtime,
+                         &datalink, &offset)) {
+    captured++;
+    busy(work);
+  }
+  cpu = cpu_usec() - cpu;
+  wall = now_usec() - wall - 500000;
+  waitpid(pid, &status, 0);
+
+  printf("%-8s %10u %10u %10u %9.2f s %9.2f s %7.0f ns\n", mode, count,
+         captured, count - captured, wall / 1e6, cpu / 1e6,
+         captured ? cpu * 1000.0 / captured : 0.0);
+  pcap_close(pd);
+}
+
+int main(int argc, char *argv[]) {
+  const char *dev = "lo";
+  struct in_addr dst;
+  unsigned int count = 500000, rate = 0;
+  int bufsize = 0;
+  long work = 0;
+  int c;
+
+  set_program_name(argv[0]);
+  dst.s_addr = htonl(INADDR_LOOPBACK);
+
+  while ((c = getopt(argc, argv, "i:d:n:r:b:w:")) != -1) {
+    switch (c) {
+    case 'i': dev = optarg; break;
+    case 'd':
+      if (inet_pton(AF_INET, optarg, &dst) != 1)
+        fatal("Bad address %s", optarg);
+      break;
+    case 'n': count = atoi(optarg); break;
+    case 'r': rate = atoi(optarg); break;
+    case 'b': bufsize = atoi(optarg); break;
+    case 'w': work = atol(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || count < 1)
+    usage(argv[0]);
+
+  printf("%-8s %10s %10s %10s %11s %11s %10s\n", "read", "sent", "captured",
+         "lost", "wall", "cpu", "cpu/frame");
+  run("select", dev, &dst, count, rate, bufsize, work);
+  run("ring", dev, &dst, count, rate, bufsize, work);
+
+  return 0;
+}
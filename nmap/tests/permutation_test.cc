@@ -0,0 +1,223 @@
+/***************************************************************************
+ * permutation_test.cc -- Checks the random target order                   *
+ * (CyclicPermutation and TargetSpace).                                    *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* This test checks the properties that the randomized, sharded target order
+   relies on.  A CyclicPermutation of n must give every number in [0, n)
+   exactly once, the same way for the same seed, and the nshards walks of
+   one seed must together give every number exactly once between them.  A
+   TargetSpace must number the addresses of its expressions consecutively,
+   in the order that get_next_host gives them. */
+
+#include "../nmap.h"
+#include "../TargetGroup.h"
+#include "../utils.h"
+
+#include <iostream>
+#include <vector>
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+/* Walks shard of nshards of the permutation of n with seed, counting how
+   often each number comes up in seen. Returns the number of steps, or n + 1
+   if a number was out of range. */
+static u64 walk(u64 n, u64 seed, u64 shard, u64 nshards,
+                std::vector<unsigned char> &seen) {
+  CyclicPermutation perm(n, seed, shard, nshards);
+  u64 i, steps = 0;
+
+  while (perm.next(&i)) {
+    if (i >= n)
+      return n + 1;
+    if (seen[i] < 255)
+      seen[i]++;
+    steps++;
+  }
+
+  return steps;
+}
+
+/* Returns true if every number below n was seen exactly once. */
+static bool once_each(const std::vector<unsigned char> &seen, u64 n) {
+  u64 i;
+
+  for (i = 0; i < n; i++) {
+    if (seen[i] != 1)
+      return false;
+  }
+  return true;
+}
+
+static int check_permutation(u64 n, u64 seed) {
+  std::vector<unsigned char> seen(n + 1);
+  std::vector<u64> first, second;
+  static const u64 shard_counts[] = { 2, 3, 7, 16 };
+  u64 i, k, nshards, total;
+  int ret = 0;
+
+  /* The whole walk. */
+  TEST_INCR(walk(n, seed, 0, 1, seen) == n && once_each(seen, n), ret);
+
+  /* The same seed gives the same order. */
+  {
+    CyclicPermutation a(n, seed), b(n, seed);
+    while (a.next(&i))
+      first.push_back(i);
+    while (b.next(&i))
+      second.push_back(i);
+    TEST_INCR(first == second, ret);
+  }
+
+  /* The shards of one seed split the numbers between them. */
+  for (k = 0; k < sizeof(shard_counts) / sizeof(shard_counts[0]); k++) {
+    nshards = shard_counts[k];
+    std::fill(seen.begin(), seen.end(), 0);
+    total = 0;
+    for (i = 0; i < nshards; i++)
+      total += walk(n, seed, i, nshards, seen);
+    TEST_INCR(total == n && once_each(seen, n), ret);
+  }
+
+  if (ret)
+    std::cout << "  permutation of " << n << " with seed " << seed << " failed" << std::endl;
+
+  return ret;
+}
+
+/* Checks that the addresses of exprs are numbered by TargetSpace in the
+   order get_next_host gives them. */
+static int check_space(const char *const exprs[], int nexprs, int af,
+                       u64 expect_size) {
+  std::vector<struct sockaddr_storage> addrs;
+  struct sockaddr_storage ss, ss2;
+  size_t sslen, sslen2;
+  TargetSpace space;
+  TargetGroup *tg;
+  u64 n, i;
+  int ret = 0, e;
+
+  for (e = 0; e < nexprs; e++) {
+    tg = new TargetGroup();
+    TEST_INCR(tg->parse_expr(exprs[e], af) == 0, ret);
+    TEST_INCR(tg->get_size(&n), ret);
+    while (tg->get_next_host(&ss, &sslen) == 0)
+      addrs.push_back(ss);
+    /* get_host does not depend on where get_next_host got to. */
+    space.add(tg, n);
+  }
+  TEST_INCR(space.size() == expect_size && addrs.size() == expect_size, ret);
+  if (ret)
+    return ret;
+
+  for (i = 0; i < space.size(); i++) {
+    memset(&ss2, 0, sizeof(ss2));
+    space.get_host(i, &ss2, &sslen2);
+    TEST_INCR(sockaddr_storage_cmp(&ss2, &addrs[i]) == 0, ret);
+    if (ret) {
+      std::cout << "  address " << i << " is " << inet_ntop_ez(&ss2, sslen2)
+                << std::endl;
+      break;
+    }
+  }
+
+  return ret;
+}
+
+int main()
+{
+  static const u64 sizes[] = { 0, 1, 2, 3, 5, 10, 100, 1000, 4093, 65535, 100003, 1 << 20 };
+  static const char *const v4[] = { "10.0.0.0/30", "192.168.1.1-3", "10.1.0-5.1-254", "10.2.3.4", "172.16.0.0/20" };
+  static const char *const v6[] = { "fe80::1", "2001:db8::/120" };
+  int ret = 0;
+  unsigned int s;
+  u64 seed;
+
+  std::cout << "Testing CyclicPermutation and TargetSpace" << std::endl;
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (seed = 0; seed < 3; seed++)
+      ret += check_permutation(sizes[s], seed * 0x9e3779b97f4a7c15ULL);
+  }
+
+  /* A different seed gives a different order. */
+  {
+    CyclicPermutation a(1000, 1), b(1000, 2);
+    u64 i, j;
+    bool differ = false;
+    while (a.next(&i) && b.next(&j)) {
+      if (i != j)
+        differ = true;
+    }
+    TEST_INCR(differ, ret);
+  }
+
+  ret += check_space(v4, sizeof(v4) / sizeof(v4[0]), AF_INET, 4 + 3 + 6 * 254 + 1 + 4096);
+  ret += check_space(v6, sizeof(v6) / sizeof(v6[0]), AF_INET6, 1 + 256);
+
+  if(ret) std::cout << "Testing CyclicPermutation and TargetSpace finished with errors" << std::endl;
+  else std::cout << "Testing CyclicPermutation and TargetSpace finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
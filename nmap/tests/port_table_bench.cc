@@ -0,0 +1,226 @@
+/***************************************************************************
+ * port_table_bench.cc -- Measures the memory that PortLists take          *
+ * for many hosts scanned over all ports.                                  *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* This tool measures what the port tables of a large scan cost in memory.
+   It makes a PortList for each of a number of hosts, over the same set of
+   TCP ports (all 65535 by default), and records a few open ports in each
+   with the rest left in a filtered default state, as -p- against mostly
+   firewalled hosts leaves them.  It reports how much the resident set and
+   the address space grew, in total and per host.
+
+   For comparison it then builds the layout PortList used before its
+   entries were stored sparsely: one zeroed array with a Port pointer for
+   every port, read in full once (as setDefaultPortState did) and written
+   for the open ports.  That layout takes 512 KB of address space per host
+   for -p-, so by default it is only built for a smaller number of hosts
+   (-l), and the per-host figures are what to compare.  Pages of an array
+   that are never written may be left unbacked by a fresh allocation, so its
+   resident size depends on the allocator; its address space does not.
+
+   Each layout is measured in a child process of its own. */
+
+#include "../nmap.h"
+#include "../nmap_error.h"
+#include "../portlist.h"
+
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern void set_program_name(const char *name);
+
+static void usage(const char *progname) {
+  fprintf(stderr,
+"Usage: %s [-n hosts] [-o open] [-l hosts] [-p ports]\n"
+"Measures the memory of the port tables of a scan of many hosts.\n"
+"  -n <hosts>: Hosts to make PortLists for (default 65536)\n"
+"  -o <open>: Open ports recorded for each host (default 5)\n"
+"  -l <hosts>: Hosts to build the old pointer-array layout for (default\n"
+"              1024; 0 skips it)\n"
+"  -p <ports>: TCP ports scanned on each host (default 65535)\n",
+    progname);
+  exit(2);
+}
+
+/* Resident set and address space of this process, in bytes, from
+   /proc/self/statm. */
+static void memory_use(double *resident, double *size) {
+  unsigned long pages_size, pages_resident;
+  FILE *fp;
+
+  fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL)
+    pfatal("Could not open /proc/self/statm");
+  if (fscanf(fp, "%lu %lu", &pages_size, &pages_resident) != 2)
+    fatal("Could not parse /proc/self/statm");
+  fclose(fp);
+  *size = (double) pages_size * sysconf(_SC_PAGESIZE);
+  *resident = (double) pages_resident * sysconf(_SC_PAGESIZE);
+}
+
+static void report(const char *name, unsigned int hosts,
+                   double resident, double size) {
+  printf("%-8s %8u hosts: resident %9.1f MB (%8.1f KB/host), "
+         "address space %9.1f MB (%8.1f KB/host)\n",
+         name, hosts, resident / 1048576, resident / 1024 / hosts,
+         size / 1048576, size / 1024 / hosts);
+}
+
+/* Makes PortLists for nhosts hosts with nopen open ports each. */
+static void build_sparse(const std::vector<u16> &ports, unsigned int nhosts,
+                         unsigned int nopen) {
+  std::vector<PortList *> lists;
+  double resident0, size0, resident, size;
+  unsigned int i, j;
+
+  memory_use(&resident0, &size0);
+  for (i = 0; i < nhosts; i++) {
+    PortList *pl = new PortList();
+    pl->setDefaultPortState(IPPROTO_TCP, PORT_FILTERED);
+    for (j = 0; j < nopen; j++)
+      pl->setPortState(ports[get_random_u32() % ports.size()], IPPROTO_TCP, PORT_OPEN);
+    lists.push_back(pl);
+  }
+  memory_use(&resident, &size);
+  report("sparse", nhosts, resident - resident0, size - size0);
+}
+
+/* Makes the old pointer arrays for nhosts hosts with nopen open ports
+   each. */
+static void build_array(const std::vector<u16> &ports, unsigned int nhosts,
+                        unsigned int nopen) {
+  std::vector<Port **> arrays;
+  double resident0, size0, resident, size;
+  volatile unsigned long nonnull = 0;
+  unsigned int i, j, index;
+
+  memory_use(&resident0, &size0);
+  for (i = 0; i < nhosts; i++) {
+    Port **array = (Port **) safe_zalloc(sizeof(Port *) * ports.size());
+    for (j = 0; j < ports.size(); j++) {
+      if (array[j] != NULL)
+        nonnull++;
+    }
+    for (j = 0; j < nopen; j++) {
+      index = get_random_u32() % ports.size();
+      if (array[index] == NULL)
+        array[index] = new Port();
+    }
+    arrays.push_back(array);
+  }
+  memory_use(&resident, &size);
+  report("array", nhosts, resident - resident0, size - size0);
+}
+
+/* Runs build in a child process, so that each layout starts from the same
+   heap and none reuses memory another has freed. */
+static void measure(void (*build)(const std::vector<u16> &, unsigned int, unsigned int),
+                    const std::vector<u16> &ports, unsigned int nhosts,
+                    unsigned int nopen) {
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == -1)
+    pfatal("fork");
+  if (pid == 0) {
+    build(ports, nhosts, nopen);
+    fflush(stdout);
+    _exit(0);
+  }
+  if (waitpid(pid, &status, 0) == -1)
+    pfatal("waitpid");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    fatal("Measuring %u hosts failed", nhosts);
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<u16> ports;
+  unsigned int nhosts = 65536, nopen = 5, nold = 1024, nports = 65535;
+  unsigned int i;
+  int c;
+
+  set_program_name(argv[0]);
+
+  while ((c = getopt(argc, argv, "n:o:l:p:")) != -1) {
+    switch (c) {
+    case 'n': nhosts = atoi(optarg); break;
+    case 'o': nopen = atoi(optarg); break;
+    case 'l': nold = atoi(optarg); break;
+    case 'p': nports = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || nhosts < 1 || nports < 1 || nports > 65535 || nopen > nports)
+    usage(argv[0]);
+
+  for (i = 0; i < nports; i++)
+    ports.push_back((u16) (i + 1));
+  PortList::initializePortMap(IPPROTO_TCP, &ports[0], nports);
+
+  measure(build_sparse, ports, nhosts, nopen);
+  if (nold > 0)
+    measure(build_array, ports, nold, nopen);
+
+  return 0;
+}
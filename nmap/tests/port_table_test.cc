@@ -0,0 +1,229 @@
+/***************************************************************************
+ * port_table_test.cc -- Checks the sparse per-protocol port               *
+ * storage of PortList against a std::map.                                 *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* This test runs random sequences of inserts, removals and lookups on
+   SparsePortTable and compares every result with a std::map that is given
+   the same operations.  It covers both of the table's layouts: the hash
+   table it keeps while few ports have entries, and the plain array it
+   switches to once most do, as well as the switch between them.  The
+   sequences are drawn from a fixed seed, or from the seed given as the only
+   argument, so a failure can be repeated. */
+
+#include "../nmap.h"
+#include "../portlist.h"
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+static u32 rng_state;
+
+/* xorshift32, so that a seed gives the same operations everywhere. */
+static u32 rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+/* Compares everything that can be read back from table with model. */
+static int compare_all(const SparsePortTable &table,
+                       const std::map<int, Port *> &model, int nindexes) {
+  std::map<int, Port *>::const_iterator it;
+  int ret = 0, index, i, seen;
+
+  TEST_INCR(table.size() == (int) model.size(), ret);
+
+  /* next() walks the entries in order. */
+  it = model.begin();
+  for (index = table.next(0); index != -1; index = table.next(index + 1)) {
+    TEST_INCR(it != model.end() && it->first == index, ret);
+    if (it == model.end() || it->first != index)
+      break;
+    TEST_INCR(table.find(index) == it->second, ret);
+    TEST_INCR(table.contains(index), ret);
+    it++;
+  }
+  TEST_INCR(it == model.end(), ret);
+
+  /* The slots hold exactly the entries. */
+  seen = 0;
+  for (i = 0; i < table.capacity(); i++) {
+    Port *port = table.slot(i);
+    if (port == NULL)
+      continue;
+    seen++;
+    TEST_INCR(model.count(port->portno) == 1 && model.find(port->portno)->second == port, ret);
+  }
+  TEST_INCR(seen == (int) model.size(), ret);
+
+  TEST_INCR(table.next(nindexes) == -1, ret);
+
+  return ret;
+}
+
+/* Runs nops random operations on a table of nindexes indexes. Indexes are
+   drawn from [base, base + span), and an insert is chosen with probability
+   insert_pct percent, so the table fills up to where the two balance. With
+   drain, the odds are reversed halfway through to empty the table again. */
+static int run(const char *name, int nindexes, int base, int span,
+               int insert_pct, int nops, bool drain) {
+  SparsePortTable table;
+  std::map<int, Port *> model;
+  std::map<int, Port *>::iterator it;
+  std::vector<Port> ports(nindexes);
+  int ret = 0, op, index, expect, max_size = 0;
+  bool was_dense = false;
+
+  for (index = 0; index < nindexes; index++)
+    ports[index].portno = index;
+  table.init(nindexes);
+
+  for (op = 0; op < nops && ret == 0; op++) {
+    if (drain && op == nops / 2)
+      insert_pct = 100 - insert_pct;
+    index = base + rng() % span;
+    it = model.find(index);
+    switch (rng() % 4) {
+    case 0:
+      /* insert or remove */
+      if ((int) (rng() % 100) < insert_pct) {
+        if (it == model.end()) {
+          table.insert(index, &ports[index]);
+          model[index] = &ports[index];
+        }
+      } else {
+        Port *removed = table.remove(index);
+        if (it == model.end()) {
+          TEST_INCR(removed == NULL, ret);
+        } else {
+          TEST_INCR(removed == it->second, ret);
+          model.erase(it);
+        }
+      }
+      break;
+    case 1:
+      TEST_INCR(table.find(index) == (it == model.end() ? NULL : it->second), ret);
+      break;
+    case 2:
+      TEST_INCR(table.contains(index) == (it != model.end()), ret);
+      break;
+    case 3:
+      it = model.lower_bound(index);
+      expect = (it == model.end()) ? -1 : it->first;
+      TEST_INCR(table.next(index) == expect, ret);
+      break;
+    }
+    if ((int) model.size() > max_size)
+      max_size = model.size();
+    /* The array has one slot per index; the hash table never does. */
+    if (table.capacity() == nindexes)
+      was_dense = true;
+    if (op % 1000 == 0)
+      ret += compare_all(table, model, nindexes);
+  }
+  ret += compare_all(table, model, nindexes);
+
+  std::cout << "  " << name << ": " << op << " operations, up to " << max_size
+            << " entries, " << (was_dense ? "array" : "hash table") << std::endl;
+  if (ret)
+    std::cout << "  " << name << " failed" << std::endl;
+
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  u32 seed = 0x5eed;
+  int ret = 0;
+
+  if (argc > 1)
+    seed = strtoul(argv[1], NULL, 0);
+  if (seed == 0)
+    seed = 1;
+  rng_state = seed;
+  std::cout << "Testing SparsePortTable with seed " << seed << std::endl;
+
+  /* -p- with few answering ports: stays a hash table. */
+  ret += run("sparse", 65535, 0, 65535, 5, 200000, false);
+  /* Entries clustered in a run of consecutive indexes, which makes long
+     probe runs for the backward-shift deletion to repair. */
+  ret += run("clustered", 65535, 30000, 600, 60, 200000, true);
+  /* Most ports answered: switches to the array and stays there as entries
+     are removed again. */
+  ret += run("dense", 1000, 0, 1000, 80, 100000, false);
+  ret += run("emptied", 1000, 0, 1000, 80, 100000, true);
+  /* A single index, and the last one. */
+  ret += run("one", 1, 0, 1, 50, 1000, false);
+  ret += run("last", 65535, 65534, 1, 50, 1000, false);
+
+  if(ret) std::cout << "Testing SparsePortTable finished with errors" << std::endl;
+  else std::cout << "Testing SparsePortTable finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
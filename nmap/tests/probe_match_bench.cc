@@ -0,0 +1,273 @@
+/***************************************************************************
+ * probe_match_bench.cc -- Measures the CPU cost of matching               *
+ * received replies to outstanding scan probes.                            *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* This tool measures the receive-path work of ultra_scan's reply matching:
+   finding the outstanding probe a reply belongs to, and the bookkeeping
+   when that probe is replaced by a new one.  It keeps a single host with a
+   fixed number of outstanding SYN probes, each to its own port, and feeds
+   it replies for randomly chosen probes.  Each reply is matched two ways:
+
+     walk:  the newest-first walk over probes_outstanding that
+            get_pcap_result did before probes were indexed, comparing
+            protocol and ports
+     index: a ProbeIndex lookup, as get_pcap_result does now
+
+   The walk only compares protocol and ports, which makes it cheaper than
+   the real per-probe check, so the difference is if anything understated.
+   The replies are chosen before timing starts, and both ways see the same
+   ones. */
+
+#include "../nmap.h"
+#include "../nmap_error.h"
+#include "../scan_engine.h"
+#include "../tcpip.h"
+
+#include <list>
+#include <vector>
+
+#include <sys/resource.h>
+
+extern void set_program_name(const char *name);
+
+#define BENCH_SPORT 45000
+
+static void usage(const char *progname) {
+  fprintf(stderr,
+"Usage: %s [-r replies] [outstanding...]\n"
+"Times the matching of replies to outstanding probes, by walking the probe\n"
+"list and through the probe index.\n"
+"  -r <replies>: Replies to match for each count (default 100000)\n"
+"  outstanding: Numbers of outstanding probes to try (default 100 1000 10000)\n",
+    progname);
+  exit(2);
+}
+
+/* User plus system CPU time used so far, in microseconds. */
+static long cpu_usec() {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Makes a SYN probe to dport, the way sendIPScanProbe does. */
+static UltraProbe *make_probe(u16 dport) {
+  struct in_addr src, dst;
+  probespec pspec;
+  UltraProbe *probe;
+  u8 *packet;
+  u32 packetlen;
+
+  src.s_addr = htonl(0x0a000001);
+  dst.s_addr = htonl(0x0a000002);
+  pspec.type = PS_TCP;
+  pspec.proto = IPPROTO_TCP;
+  pspec.pd.tcp.dport = dport;
+  pspec.pd.tcp.flags = TH_SYN;
+  packet = build_tcp_raw(&src, &dst, 64, dport, 0, false, NULL, 0,
+                         BENCH_SPORT, dport, 0x12345678, 0, 0, TH_SYN, 1024, 0,
+                         NULL, 0, NULL, 0, &packetlen);
+  probe = new UltraProbe();
+  probe->setIP(packet, packetlen, &pspec);
+  free(packet);
+
+  return probe;
+}
+
+/* The probes outstanding to one host, and what a reply needs to be matched
+   against them. */
+struct Host {
+  std::list<UltraProbe *> outstanding;
+  ProbeIndex index;
+  /* The outstanding probes in no particular order, so a random one can
+     be picked. */
+  std::vector<std::list<UltraProbe *>::iterator> slots;
+  /* Probes that are not outstanding, ready to be sent. */
+  std::vector<UltraProbe *> unsent;
+};
+
+static u64 probe_key(const UltraProbe *probe) {
+  return ProbeIndex::key(probe->protocol(), probe->sport(), probe->dport());
+}
+
+static void send_probe(Host *host, unsigned int slot, bool indexed) {
+  std::list<UltraProbe *>::iterator probeI;
+  UltraProbe *probe;
+
+  probe = host->unsent.back();
+  host->unsent.pop_back();
+  probeI = host->outstanding.insert(host->outstanding.end(), probe);
+  if (indexed)
+    host->index.insert(probe_key(probe), probeI);
+  host->slots[slot] = probeI;
+}
+
+/* Matches a reply from dport to BENCH_SPORT and retires the probe it
+   answers. Returns false if no probe matched. */
+static bool receive(Host *host, u16 dport, bool indexed) {
+  std::list<UltraProbe *>::iterator probeI;
+  const ProbeIndex::Bucket *bucket;
+  UltraProbe *probe;
+
+  if (indexed) {
+    bucket = host->index.find(ProbeIndex::key(IPPROTO_TCP, BENCH_SPORT, dport));
+    if (bucket == NULL)
+      return false;
+    probeI = bucket->back();
+    host->index.erase(probe_key(*probeI), probeI);
+  } else {
+    probeI = host->outstanding.end();
+    do {
+      if (probeI == host->outstanding.begin())
+        return false;
+      probeI--;
+      probe = *probeI;
+    } while (probe->protocol() != IPPROTO_TCP || probe->sport() != BENCH_SPORT
+             || probe->dport() != dport);
+  }
+  host->unsent.push_back(*probeI);
+  host->outstanding.erase(probeI);
+
+  return true;
+}
+
+/* Returns the CPU time per reply in nanoseconds. */
+static double run(unsigned int outstanding, const std::vector<u32> &picks,
+                  bool indexed) {
+  std::vector<UltraProbe *>::iterator pi;
+  Host host;
+  unsigned int i, slot;
+  long start;
+  u16 dport;
+
+  for (i = 0; i < 65535; i++)
+    host.unsent.push_back(make_probe((u16) (i + 1)));
+  /* Send in a random order, as a scan does with its randomized ports. */
+  for (i = host.unsent.size() - 1; i > 0; i--)
+    std::swap(host.unsent[i], host.unsent[get_random_u32() % (i + 1)]);
+  host.slots.resize(outstanding);
+  for (i = 0; i < outstanding; i++)
+    send_probe(&host, i, indexed);
+
+  start = cpu_usec();
+  for (i = 0; i < picks.size(); i++) {
+    slot = picks[i] % outstanding;
+    dport = (*host.slots[slot])->dport();
+    if (!receive(&host, dport, indexed))
+      fatal("No probe matched a reply from port %hu", dport);
+    send_probe(&host, slot, indexed);
+  }
+  start = cpu_usec() - start;
+
+  for (pi = host.unsent.begin(); pi != host.unsent.end(); pi++)
+    delete *pi;
+  while (!host.outstanding.empty()) {
+    delete host.outstanding.front();
+    host.outstanding.pop_front();
+  }
+
+  return start * 1000.0 / picks.size();
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<unsigned int> counts;
+  std::vector<u32> picks;
+  unsigned int replies = 100000, i;
+  double walk, index;
+  int c;
+
+  set_program_name(argv[0]);
+
+  while ((c = getopt(argc, argv, "r:")) != -1) {
+    switch (c) {
+    case 'r': replies = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  for (c = optind; c < argc; c++) {
+    i = atoi(argv[c]);
+    if (i < 1 || i > 65535)
+      fatal("Outstanding probe counts must be from 1 to 65535");
+    counts.push_back(i);
+  }
+  if (counts.empty()) {
+    counts.push_back(100);
+    counts.push_back(1000);
+    counts.push_back(10000);
+  }
+  if (replies < 1)
+    usage(argv[0]);
+
+  picks.resize(replies);
+  for (i = 0; i < replies; i++)
+    picks[i] = get_random_u32();
+
+  printf("CPU time per reply, %u replies:\n", replies);
+  printf("%12s %12s %12s\n", "outstanding", "walk", "index");
+  for (i = 0; i < counts.size(); i++) {
+    walk = run(counts[i], picks, false);
+    index = run(counts[i], picks, true);
+    printf("%12u %9.0f ns %9.0f ns\n", counts[i], walk, index);
+  }
+
+  return 0;
+}
@@ -0,0 +1,513 @@
+/***************************************************************************
+ * service_replay.cc -- Replays captured service responses through the     *
+ * nmap-service-probes match lines and reports what each line costs.       *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* This tool runs the service detection match lines over a corpus of
+   probe responses without touching the network, so that changes to
+   the matching code or to nmap-service-probes can be benchmarked
+   reproducibly and so that expensive or pathological regexes can be
+   found.  The corpus is one or more files holding service
+   fingerprints in the form Nmap prints them for unrecognized services:
+
+     SF-Port2400-TCP:V=7.91%I=7%D=10/18%Time=6AD47C23%P=x86_64-unknown-linux-gn
+     SF:u%r(NULL,15,"zzz\x20unknown\x20thing\x206\r\n")%r(GenericLines,15,"zzz\
+     ...
+
+   Other lines, such as the rest of the normal output, are ignored.
+   Each %r() entry is replayed against the match lines of the probe it
+   names and of that probe's fallbacks, just as a scan would try them.
+   Note that Nmap truncates long responses in fingerprints; the
+   truncated response is what gets replayed. */
+
+#include "../nmap.h"
+#include "../nmap_error.h"
+#include "../service_scan.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+extern void set_program_name(const char *name);
+
+struct Response {
+  std::string fpname; // file:line where its fingerprint started
+  ServiceProbe *probe;
+  std::string data;
+};
+
+struct LineStats {
+  ServiceProbe *probe;
+  ServiceProbeMatch *match;
+  unsigned long matched;
+  long total_usec; // over all timed passes
+  long max_usec;   // slowest single test
+  int max_resp;    // the response that took max_usec
+};
+
+struct LimitHit {
+  ServiceProbe *probe;
+  ServiceProbeMatch *match;
+  int resp;
+  int rc;
+};
+
+static bool cost_order(const LineStats *a, const LineStats *b) {
+  return a->total_usec > b->total_usec;
+}
+
+static bool slowest_order(const LineStats *a, const LineStats *b) {
+  return a->max_usec > b->max_usec;
+}
+
+/* testMatch leaves its warnings in the MatchResult it is given. Prints
+   them if print is true, and clears them. */
+static void flush_warnings(struct MatchResult *result, bool print) {
+  unsigned int i;
+
+  if (print) {
+    for (i = 0; i < result->warnings.size(); i++)
+      error("%s", result->warnings[i].c_str());
+  }
+  result->warnings.clear();
+  result->fatalmsg.clear();
+}
+
+static void usage(const char *progname) {
+  fprintf(stderr,
+"Usage: %s [-f nmap-service-probes] [-n passes] [-t lines] [-v] corpus...\n"
+"Replays the service fingerprints in the corpus files through the match\n"
+"lines of nmap-service-probes and reports the time each line takes.\n"
+"  -f <file>: Match lines to use (default: the one Nmap would load)\n"
+"  -n <passes>: Time this many passes over the corpus (default 10)\n"
+"  -t <lines>: List this many of the costliest lines; 0 lists all (default 20)\n"
+"  -v: Print the result for each response\n"
+"Exits with status 1 if any match line hit a PCRE limit.\n", progname);
+  exit(2);
+}
+
+static const char *rc2str(int rc) {
+  switch (rc) {
+#ifdef PCRE_ERROR_MATCHLIMIT
+  case PCRE_ERROR_MATCHLIMIT: return "PCRE_ERROR_MATCHLIMIT";
+#endif
+#ifdef PCRE_ERROR_RECURSIONLIMIT
+  case PCRE_ERROR_RECURSIONLIMIT: return "PCRE_ERROR_RECURSIONLIMIT";
+#endif
+  default: return "PCRE error";
+  }
+}
+
+static int hexval(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* Undoes the escaping done by ServiceNFO::addToServiceFingerprint() on
+   the quoted response starting at *p (just past the opening quote).
+   Leaves *p past the closing quote.  Returns false if the string is
+   unterminated. */
+static bool unescape_response(const char **p, std::string &out) {
+  const char *s = *p;
+
+  while (*s && *s != '"') {
+    if (*s != '\\') {
+      out += *s++;
+      continue;
+    }
+    s++;
+    switch (*s) {
+    case '0': out += '\0'; s++; break;
+    case 'r': out += '\r'; s++; break;
+    case 'n': out += '\n'; s++; break;
+    case 't': out += '\t'; s++; break;
+    case 'x':
+      if (hexval(s[1]) < 0 || hexval(s[2]) < 0)
+        return false;
+      out += (char) (hexval(s[1]) << 4 | hexval(s[2]));
+      s += 3;
+      break;
+    case '\0': return false;
+    default: out += *s++; break;
+    }
+  }
+  if (*s != '"')
+    return false;
+  *p = s + 1;
+  return true;
+}
+
+/* Adds the responses in one unwrapped fingerprint to responses. */
+static void parse_fingerprint(AllProbes *AP, const std::string &fpname,
+                              const std::string &fp,
+                              std::vector<Response> &responses,
+                              int *truncated) {
+  const char *p = fp.c_str();
+  int proto;
+
+  // SF-Port<portno>-<TCP|UDP>:
+  p = strchr(p, '-');
+  if (p == NULL || (p = strchr(p + 1, '-')) == NULL) {
+    error("%s: can't find the protocol in the fingerprint", fpname.c_str());
+    return;
+  }
+  p++;
+  if (strncmp(p, "TCP:", 4) == 0)
+    proto = IPPROTO_TCP;
+  else if (strncmp(p, "UDP:", 4) == 0)
+    proto = IPPROTO_UDP;
+  else {
+    error("%s: unknown protocol in the fingerprint", fpname.c_str());
+    return;
+  }
+
+  while ((p = strstr(p, "%r(")) != NULL) {
+    Response r;
+    char probename[128];
+    const char *comma;
+    unsigned long resplen;
+    char *end;
+
+    p += 3;
+    comma = strchr(p, ',');
+    if (comma == NULL || comma - p >= (int) sizeof(probename))
+      break;
+    memcpy(probename, p, comma - p);
+    probename[comma - p] = '\0';
+    resplen = strtoul(comma + 1, &end, 16);
+    if (end[0] != ',' || end[1] != '"')
+      break;
+    p = end + 2;
+    if (!unescape_response(&p, r.data) || *p != ')')
+      break;
+
+    r.fpname = fpname;
+    r.probe = AP->getProbeByName(probename, proto);
+    if (r.probe == NULL) {
+      error("%s: skipping response to unknown probe %s", fpname.c_str(), probename);
+      continue;
+    }
+    if (r.data.size() < resplen)
+      (*truncated)++;
+    responses.push_back(r);
+  }
+  if (p != NULL)
+    error("%s: can't parse the fingerprint past \"%.20s\"", fpname.c_str(), p);
+}
+
+/* Reads the fingerprints in filename, joining their wrapped lines. */
+static void read_corpus(AllProbes *AP, const char *filename,
+                        std::vector<Response> &responses, int *truncated) {
+  FILE *fp;
+  char line[1024];
+  char fpname[512];
+  std::string cur;
+  int lineno = 0;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL)
+    pfatal("Unable to open %s", filename);
+
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strncmp(line, "SF:", 3) == 0 && !cur.empty()) {
+      cur += line + 3;
+      continue;
+    }
+    if (!cur.empty()) {
+      parse_fingerprint(AP, fpname, cur, responses, truncated);
+      cur.clear();
+    }
+    if (strncmp(line, "SF-Port", 7) == 0) {
+      Snprintf(fpname, sizeof(fpname), "%s:%d", filename, lineno);
+      cur = line;
+    }
+  }
+  if (!cur.empty())
+    parse_fingerprint(AP, fpname, cur, responses, truncated);
+  fclose(fp);
+}
+
+/* Matches a response the way a scan would: the probe's own match lines,
+   then those of its fallbacks.  Returns the first hard match, or failing
+   that the first soft match, or NULL. */
+static const struct MatchDetails *replay(const Response &r,
+                                         struct MatchResult *result) {
+  const u8 *buf = (const u8 *) r.data.data();
+  int buflen = r.data.size();
+  const struct MatchDetails *MD;
+  int fb, n, softfb = -1, softn = 0;
+
+  for (fb = 0; fb <= MAXFALLBACKS && r.probe->fallbacks[fb] != NULL; fb++) {
+    for (n = 0; ; n++) {
+      MD = r.probe->fallbacks[fb]->testMatch(buf, buflen, n, result);
+      if (MD == NULL || MD->serviceName == NULL)
+        break;
+      if (!MD->isSoft)
+        return MD;
+      if (softfb == -1) {
+        softfb = fb;
+        softn = n;
+      }
+    }
+  }
+  if (softfb == -1)
+    return NULL;
+  return r.probe->fallbacks[softfb]->testMatch(buf, buflen, softn, result);
+}
+
+int main(int argc, char *argv[]) {
+  const char *probesfile = NULL;
+  int passes = 10, top = 20;
+  bool verbose = false;
+  AllProbes *AP;
+  std::vector<Response> responses;
+  // For each probe, the responses whose match lines include its own.
+  std::map<ServiceProbe *, std::vector<int> > routed;
+  std::map<ServiceProbe *, std::vector<int> >::iterator ri;
+  std::vector<LineStats> stats;
+  std::vector<LineStats *> order;
+  std::vector<LimitHit> limits;
+  struct MatchResult result;
+  const struct MatchDetails *MD;
+  struct timeval t0, t1;
+  int truncated = 0, hard = 0, soft = 0;
+  long replay_usec;
+  unsigned int i, j, k;
+  int c, pass;
+
+  set_program_name(argv[0]);
+
+  while ((c = getopt(argc, argv, "f:n:t:v")) != -1) {
+    switch (c) {
+    case 'f': probesfile = optarg; break;
+    case 'n': passes = atoi(optarg); break;
+    case 't': top = atoi(optarg); break;
+    case 'v': verbose = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind >= argc || passes < 1 || top < 0)
+    usage(argv[0]);
+
+  if (probesfile != NULL) {
+    AP = new AllProbes();
+    parse_nmap_service_probe_file(AP, (char *) probesfile);
+  } else {
+    AP = AllProbes::service_scan_init();
+  }
+
+  for (c = optind; c < argc; c++)
+    read_corpus(AP, argv[c], responses, &truncated);
+  if (responses.empty())
+    fatal("No service fingerprints found in the corpus");
+
+  for (i = 0; i < responses.size(); i++) {
+    ServiceProbe **fallbacks = responses[i].probe->fallbacks;
+    for (j = 0; j <= MAXFALLBACKS && fallbacks[j] != NULL; j++)
+      routed[fallbacks[j]].push_back(i);
+  }
+
+  /* The first pass gives the scan's answer for each response and
+     compiles the regexes it needs; it isn't timed. */
+  for (i = 0; i < responses.size(); i++) {
+    MD = replay(responses[i], &result);
+    flush_warnings(&result, false);
+    if (MD == NULL) {
+      if (verbose)
+        printf("%s %s: no match\n", responses[i].fpname.c_str(),
+               responses[i].probe->getName());
+      continue;
+    }
+    if (MD->isSoft)
+      soft++;
+    else
+      hard++;
+    if (verbose)
+      printf("%s %s: %s%s line %d%s%s%s%s\n", responses[i].fpname.c_str(),
+             responses[i].probe->getName(), MD->isSoft ? "softmatch " : "",
+             MD->serviceName, MD->lineno,
+             MD->product ? " " : "", MD->product ? MD->product : "",
+             MD->version ? " " : "", MD->version ? MD->version : "");
+  }
+
+  gettimeofday(&t0, NULL);
+  for (pass = 0; pass < passes; pass++) {
+    for (i = 0; i < responses.size(); i++)
+      replay(responses[i], &result);
+    flush_warnings(&result, false);
+  }
+  gettimeofday(&t1, NULL);
+  replay_usec = TIMEVAL_SUBTRACT(t1, t0);
+
+  /* Test each match line on its own.  After an untimed test to compile
+     its regex and print its warnings, a single timed test finds the slowest response for each
+     line, then the line is timed over all of its responses for the
+     requested number of passes. */
+  for (ri = routed.begin(); ri != routed.end(); ri++) {
+    const std::vector<ServiceProbeMatch *> &matches = ri->first->getMatches();
+    const std::vector<int> &resps = ri->second;
+
+    for (j = 0; j < matches.size(); j++) {
+      LineStats ls;
+      ls.probe = ri->first;
+      ls.match = matches[j];
+      ls.matched = 0;
+      ls.max_usec = -1;
+      ls.max_resp = -1;
+
+      for (k = 0; k < resps.size(); k++) {
+        const Response &r = responses[resps[k]];
+        matches[j]->testMatch((const u8 *) r.data.data(), r.data.size(), &result);
+      }
+      flush_warnings(&result, true);
+
+      for (k = 0; k < resps.size(); k++) {
+        const Response &r = responses[resps[k]];
+        long usec;
+
+        gettimeofday(&t0, NULL);
+        MD = matches[j]->testMatch((const u8 *) r.data.data(), r.data.size(), &result);
+        gettimeofday(&t1, NULL);
+        usec = TIMEVAL_SUBTRACT(t1, t0);
+        if (MD->serviceName != NULL)
+          ls.matched++;
+        else if (result.rc != PCRE_ERROR_NOMATCH) {
+          LimitHit hit = { ri->first, matches[j], resps[k], result.rc };
+          limits.push_back(hit);
+        }
+        if (usec > ls.max_usec) {
+          ls.max_usec = usec;
+          ls.max_resp = resps[k];
+        }
+      }
+      flush_warnings(&result, false);
+
+      gettimeofday(&t0, NULL);
+      for (pass = 0; pass < passes; pass++) {
+        for (k = 0; k < resps.size(); k++) {
+          const Response &r = responses[resps[k]];
+          matches[j]->testMatch((const u8 *) r.data.data(), r.data.size(), &result);
+        }
+        flush_warnings(&result, false);
+      }
+      gettimeofday(&t1, NULL);
+      ls.total_usec = TIMEVAL_SUBTRACT(t1, t0);
+      stats.push_back(ls);
+    }
+  }
+  for (i = 0; i < stats.size(); i++)
+    order.push_back(&stats[i]);
+
+  printf("Replayed %u responses (%d truncated in their fingerprints) against %u match lines\n",
+         (unsigned int) responses.size(), truncated, (unsigned int) stats.size());
+  printf("%d hard matches, %d soft matches, %d unmatched\n",
+         hard, soft, (int) responses.size() - hard - soft);
+  printf("Matching took %.3f ms per pass (%d passes)\n",
+         replay_usec / 1000.0 / passes, passes);
+
+  std::sort(order.begin(), order.end(), cost_order);
+  printf("\nCostliest match lines over %d passes:\n", passes);
+  printf("%6s %-22s %-20s %7s %7s %10s %8s\n", "LINE", "PROBE", "SERVICE",
+         "TESTED", "MATCHED", "TOTAL(ms)", "MAX(us)");
+  for (i = 0; i < order.size() && (top == 0 || i < (unsigned int) top); i++) {
+    const LineStats *ls = order[i];
+    printf("%6d %-22s %-20s %7u %7lu %10.3f %8ld\n", ls->match->getLineNo(),
+           ls->probe->getName(), ls->match->getName(),
+           (unsigned int) routed[ls->probe].size(), ls->matched,
+           ls->total_usec / 1000.0, ls->max_usec);
+  }
+
+  std::sort(order.begin(), order.end(), slowest_order);
+  printf("\nSlowest single tests:\n");
+  for (i = 0; i < order.size() && i < 10 && order[i]->max_usec > 0; i++) {
+    printf("  line %d (%s) took %ld us on the %s response from %s\n",
+           order[i]->match->getLineNo(), order[i]->match->getName(),
+           order[i]->max_usec, responses[order[i]->max_resp].probe->getName(),
+           responses[order[i]->max_resp].fpname.c_str());
+  }
+
+  if (!limits.empty()) {
+    printf("\nMatch lines that hit a PCRE limit (likely catastrophic backtracking):\n");
+    for (i = 0; i < limits.size(); i++) {
+      printf("  line %d (%s) on the %s response from %s: %s\n",
+             limits[i].match->getLineNo(), limits[i].match->getName(),
+             responses[limits[i].resp].probe->getName(),
+             responses[limits[i].resp].fpname.c_str(), rc2str(limits[i].rc));
+    }
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,190 @@
+/***************************************************************************
+ * stateless_test.cc -- Checks the cookies with which the                  *
+ * stateless SYN sweep validates replies.                                  *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2020 Insecure.Com LLC ("The Nmap  *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl. This header  *
+ * summarizes some key points from the Nmap license, but is no substitute  *
+ * for the actual license text.                                            *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem                                  *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.org) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/* This test builds the replies a stateless sweep (--stateless) could
+   receive and checks which of them SweepCookie accepts.  A SYN/ACK or RST
+   that acknowledges the cookie of the probe it answers must be accepted and
+   give back the probed port.  A reply must be rejected if its
+   acknowledgment number has been tampered with, if it comes from another
+   address or port than the probe went to, if it is not addressed to the
+   sweep's source, if it was made with another key, or if it is not a whole
+   IPv4 TCP segment.  The keys are fixed, so the results are the same on
+   every run. */
+
+#include "../nmap.h"
+#include "../stateless_scan.h"
+#include "../tcpip.h"
+
+#include <dnet.h>
+#include <iostream>
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+/* The sweep's source, where replies are addressed. */
+#define SRC_ADDR 0x0a000001 /* 10.0.0.1 */
+#define SRC_PORT 40000
+
+static u32 rng_state = 0x5eed;
+
+static u32 rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+/* Builds a reply from from:fromport to to:toport with the given flags and
+   acknowledgment number. Addresses are in host byte order. The caller
+   frees the packet. */
+static u8 *build_reply(u32 from, u16 fromport, u32 to, u16 toport,
+                       u8 flags, u32 ack, u32 *len) {
+  struct in_addr src, dst;
+
+  src.s_addr = htonl(from);
+  dst.s_addr = htonl(to);
+  return build_tcp_raw(&src, &dst, 64, 1, 0, false, NULL, 0,
+                       fromport, toport, rng(), ack, 0, flags, 1024, 0,
+                       NULL, 0, NULL, 0, len);
+}
+
+/* Returns whether cookies accepts the reply, and checks that an accepted
+   one gives back fromport as the probed port. */
+static bool accepts(const SweepCookie &cookies, u32 from, u16 fromport,
+                    u32 to, u16 toport, u8 flags, u32 ack, int *ret) {
+  u32 len;
+  u8 *packet;
+  u16 dport = 0;
+  bool ok;
+
+  packet = build_reply(from, fromport, to, toport, flags, ack, &len);
+  ok = cookies.check(packet, len, htonl(SRC_ADDR), SRC_PORT, &dport);
+  free(packet);
+  if (ok)
+    TEST_INCR(dport == fromport, *ret);
+
+  return ok;
+}
+
+int main()
+{
+  SweepCookie cookies(0x0123456789abcdefULL, 0xfedcba9876543210ULL);
+  SweepCookie other(0x0123456789abcdefULL, 0xfedcba9876543211ULL);
+  u32 target = 0xc0a80105; /* 192.168.1.5 */
+  u16 port = 443;
+  u32 ack, len;
+  u8 *packet;
+  u16 dport;
+  int ret = 0, i, bit, accepted;
+
+  std::cout << "Testing SweepCookie" << std::endl;
+
+  ack = cookies.cookie(htonl(SRC_ADDR), SRC_PORT, htonl(target), port) + 1;
+
+  /* The replies to the probe are accepted. */
+  TEST_INCR(accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack, &ret), ret);
+  TEST_INCR(accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_RST|TH_ACK, ack, &ret), ret);
+
+  /* A tampered acknowledgment number is not. */
+  TEST_INCR(!accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack - 1, &ret), ret);
+  TEST_INCR(!accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack + 1, &ret), ret);
+  TEST_INCR(!accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, 0, &ret), ret);
+  for (bit = 0; bit < 32; bit++)
+    TEST_INCR(!accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack ^ ((u32) 1 << bit), &ret), ret);
+
+  /* Nor is the right number from another host or port, or to another
+     address or port than the sweep's, or under another key. */
+  TEST_INCR(!accepts(cookies, target + 1, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack, &ret), ret);
+  TEST_INCR(!accepts(cookies, target, port + 1, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack, &ret), ret);
+  TEST_INCR(!accepts(cookies, target, port, SRC_ADDR + 1, SRC_PORT, TH_SYN|TH_ACK, ack, &ret), ret);
+  TEST_INCR(!accepts(cookies, target, port, SRC_ADDR, SRC_PORT + 1, TH_SYN|TH_ACK, ack, &ret), ret);
+  TEST_INCR(!accepts(other, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack, &ret), ret);
+
+  /* A truncated segment is not looked at. */
+  packet = build_reply(target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack, &len);
+  TEST_INCR(cookies.check(packet, len, htonl(SRC_ADDR), SRC_PORT, &dport), ret);
+  TEST_INCR(!cookies.check(packet, len - 1, htonl(SRC_ADDR), SRC_PORT, &dport), ret);
+  TEST_INCR(!cookies.check(packet, 19, htonl(SRC_ADDR), SRC_PORT, &dport), ret);
+  free(packet);
+
+  /* Many probes: each reply is accepted with its own cookie, and not with a
+     random other acknowledgment number (which would get through once in
+     2^32 tries). */
+  accepted = 0;
+  for (i = 0; i < 100000; i++) {
+    target = rng();
+    port = (u16) (1 + rng() % 65535);
+    ack = cookies.cookie(htonl(SRC_ADDR), SRC_PORT, htonl(target), port) + 1;
+    if (accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack, &ret))
+      accepted++;
+    TEST_INCR(!accepts(cookies, target, port, SRC_ADDR, SRC_PORT, TH_SYN|TH_ACK, ack ^ (rng() | 1), &ret), ret);
+  }
+  TEST_INCR(accepted == 100000, ret);
+
+  if(ret) std::cout << "Testing SweepCookie finished with errors" << std::endl;
+  else std::cout << "Testing SweepCookie finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
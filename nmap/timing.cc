@@ -634,6 +634,7 @@ bool ScanProgressMeter::printStats(double perc_done,
   // data for decent timing estimates. Also with perc_done == 0
   // these elements will be nonsensical.
   if (perc_done < 0.01) {
+    output_lock();
     log_write(LOG_STDOUT, "%s Timing: About %.2f%% done\n",
         scantypestr, perc_done * 100);
     xml_open_start_tag("taskprogress");
@@ -643,6 +644,7 @@ bool ScanProgressMeter::printStats(double perc_done,
     xml_close_empty_tag();
     xml_newline();
     log_flush(LOG_STDOUT|LOG_XML);
+    output_unlock();
     return true;
   }
 
@@ -656,6 +658,7 @@ bool ScanProgressMeter::printStats(double perc_done,
   timet = last_est.tv_sec;
   err = n_localtime(&timet, &ltime);
 
+  output_lock();
   if (!err) {
     log_write(LOG_STDOUT, "%s Timing: About %.2f%% done; ETC: %02d:%02d (%.f:%02.f:%02.f remaining)\n",
         scantypestr, perc_done * 100, ltime.tm_hour, ltime.tm_min,
@@ -680,6 +683,7 @@ bool ScanProgressMeter::printStats(double perc_done,
   xml_close_empty_tag();
   xml_newline();
   log_flush(LOG_STDOUT|LOG_XML);
+  output_unlock();
 
   return true;
 }
@@ -707,6 +711,7 @@ bool ScanProgressMeter::beginOrEndTask(const struct timeval *now, const char *ad
   err = n_localtime(&tv_sec, &tm);
   if (err)
     log_write(LOG_STDERR, "Timing error: n_localtime(%f): %s\n", (double) tv_sec, strerror(err));
+  output_lock();
   if (beginning) {
     if (!err)
       log_write(LOG_STDOUT, "Initiating %s at %02d:%02d", scantypestr, tm.tm_hour, tm.tm_min);
@@ -739,5 +744,6 @@ bool ScanProgressMeter::beginOrEndTask(const struct timeval *now, const char *ad
     xml_newline();
   }
   log_flush(LOG_STDOUT|LOG_XML);
+  output_unlock();
   return true;
 }
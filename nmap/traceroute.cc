@@ -107,6 +107,7 @@ individually.
 #include "payload.h"
 #include "timing.h"
 #include "NmapOps.h"
+#include "scan_pipeline.h"
 #include "Target.h"
 #include "tcpip.h"
 
@@ -617,7 +618,7 @@ void Probe::send(int rawsd, eth_t *ethsd, struct timeval *now) {
       host->target->SourceSockAddr(&source, &source_len);
       sent_time = get_now(now);
     } else {
-      source = o.decoys[decoy];
+      source = *host->target->DecoySockAddr(decoy);
     }
 
     packet = this->build_packet(&source, &packetlen);
@@ -1513,7 +1514,8 @@ static int traceroute_remote(std::vector<Target *> targets) {
 
   ScanProgressMeter SPM("Traceroute");
 
-  o.current_scantype = TRACEROUTE;
+  if (!in_pipeline_stage())
+    o.current_scantype = TRACEROUTE;
 
   while (!global_state.active_hosts.empty()) {
     struct timeval now;
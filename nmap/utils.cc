@@ -130,6 +130,128 @@ void nmap_hexdump(const unsigned char *cp, unsigned int length) {
 }
 
 
+/* a * b mod m, without overflow for any m < 2^63. */
+static u64 mulmod64(u64 a, u64 b, u64 m) {
+#if defined(__SIZEOF_INT128__)
+  return (u64) ((unsigned __int128) a * b % m);
+#else
+  u64 r;
+
+  if (m <= 0xFFFFFFFFULL)
+    return a * b % m;
+  /* Double and add, since a * b may not fit. */
+  r = 0;
+  a %= m;
+  for (; b > 0; b >>= 1) {
+    if (b & 1)
+      r = (r + a) % m;
+    a = (a << 1) % m;
+  }
+  return r;
+#endif
+}
+
+static u64 powmod64(u64 b, u64 e, u64 m) {
+  u64 r = 1;
+
+  b %= m;
+  for (; e > 0; e >>= 1) {
+    if (e & 1)
+      r = mulmod64(r, b, m);
+    b = mulmod64(b, b, m);
+  }
+  return r;
+}
+
+/* Deterministic Miller-Rabin; these bases are enough for every n < 2^64. */
+static bool is_prime64(u64 n) {
+  static const u64 bases[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+  unsigned int i, r, j;
+  u64 d, x;
+
+  if (n < 2)
+    return false;
+  if (n < 4)
+    return true;
+  if (n % 2 == 0)
+    return false;
+  for (d = n - 1, r = 0; d % 2 == 0; d /= 2)
+    r++;
+  for (i = 0; i < sizeof(bases) / sizeof(*bases); i++) {
+    x = powmod64(bases[i], d, n);
+    if (x == 0 || x == 1 || x == n - 1)
+      continue;
+    for (j = 1; j < r; j++) {
+      x = mulmod64(x, x, n);
+      if (x == n - 1)
+        break;
+    }
+    if (j == r)
+      return false;
+  }
+  return true;
+}
+
+/* The output function of the SplitMix64 generator: a bijection on 64-bit
+   numbers that changes about half the bits for each bit of input. */
+static u64 splitmix64(u64 x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+CyclicPermutation::CyclicPermutation(u64 n, u64 seed, u64 shard, u64 nshards) {
+  u64 q, generator;
+
+  assert(n < ((u64) 1 << 62));
+  assert(nshards > 0 && shard < nshards);
+  this->n = n;
+
+  /* Elements 1 .. p - 1 of the group stand for 0 .. p - 2. p is a safe prime
+     (p = 2q + 1 with q prime), so p - 1 needs no factoring: g generates the
+     group iff neither g^2 nor g^q is 1. */
+  for (q = n / 2 + 1; !is_prime64(q) || !is_prime64(2 * q + 1); q++)
+    ;
+  prime = 2 * q + 1;
+
+  /* Scramble the seed so that nearby seeds (like ones typed by hand) don't
+     give small, similar generators. */
+  seed = splitmix64(seed);
+  generator = 2 + seed % (prime - 3);
+  while (mulmod64(generator, generator, prime) == 1
+         || powmod64(generator, q, prime) == 1) {
+    if (++generator >= prime - 1)
+      generator = 2;
+  }
+
+  /* Another round of it picks where the walk starts. */
+  cur = 1 + splitmix64(seed) % (prime - 1);
+
+  /* The whole walk is prime - 1 steps long. */
+  cur = mulmod64(cur, powmod64(generator, shard, prime), prime);
+  step = powmod64(generator, nshards, prime);
+  if (n == 0 || shard >= prime - 1)
+    remaining = 0;
+  else
+    remaining = (prime - 2 - shard) / nshards + 1;
+}
+
+bool CyclicPermutation::next(u64 *i) {
+  u64 elem;
+
+  while (remaining > 0) {
+    elem = cur;
+    cur = mulmod64(cur, step, prime);
+    remaining--;
+    if (elem <= n) {
+      *i = elem - 1;
+      return true;
+    }
+  }
+  return false;
+}
+
 /* Like the perl equivalent, removes the terminating newline from string IF one
    exists. It then returns the POSSIBLY MODIFIED string. */
 char *chomp(char *string) {
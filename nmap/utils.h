@@ -106,6 +106,30 @@ void nmap_hexdump(const unsigned char *cp, unsigned int length);
 
 void genfry(unsigned char *arr, int elem_sz, int num_elem);
 void shortfry(unsigned short *arr, int num_elem);
+
+/* Visits every number in [0, n) once, in a pseudorandom order that needs no
+   memory proportional to n. The order is the cyclic group of integers modulo
+   a prime p > n, walked from a random element by repeated multiplication
+   with a random generator; elements that don't correspond to a number below
+   n are skipped. The same n and seed always give the same order. n must be
+   less than 2^62.
+
+   With nshards > 1, only every nshards'th step of the walk is taken,
+   starting at step shard, so permutations that differ only in shard split
+   the numbers between them evenly. */
+class CyclicPermutation {
+public:
+  CyclicPermutation(u64 n, u64 seed, u64 shard = 0, u64 nshards = 1);
+  /* Stores the next number in *i. Returns false once all have been given. */
+  bool next(u64 *i);
+
+private:
+  u64 n;
+  u64 prime;
+  u64 step; /* generator^nshards */
+  u64 cur;
+  u64 remaining; /* steps of the walk left to take */
+};
 char *chomp(char *string);
 
 int Send(int sd, const void *msg, size_t len, int flags);